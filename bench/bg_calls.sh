@@ -0,0 +1,29 @@
+#!/bin/sh
+# Calls/sec of a G function versus number of concurrent backends, and
+# context switches per call (host wide, from /proc/stat).
+# Requires plunijava--test.sql to be loaded into $PGDATABASE.
+#
+#   ./bench/bg_calls.sh [duration] [clients...]
+#
+# SCRIPT selects the pgbench script (default g_call.sql, g_call_args.sql
+# passes several small arguments per call).
+
+DIR=$(dirname "$0")
+DURATION=${1:-20}
+shift 2>/dev/null
+CLIENTS=${@:-"1 8 32 64 128 200"}
+SCRIPT=${SCRIPT:-$DIR/g_call.sql}
+
+# Warm up (starts the global workers)
+psql -qAt -c "SELECT g_test_int1(1)" > /dev/null || exit 1
+
+ctxt() { awk '/^ctxt/ { print $2 }' /proc/stat; }
+
+printf "%8s %12s %12s\n" clients calls/sec ctxsw/call
+for c in $CLIENTS; do
+	cs=$(ctxt)
+	tps=$(pgbench -n -M prepared -f "$SCRIPT" -c "$c" -j "$c" -T "$DURATION" 2>/dev/null \
+		| awk '/^tps/ { print int($3) }')
+	cs=$(( $(ctxt) - cs ))
+	printf "%8s %12s %12s\n" "$c" "$tps" "$(awk -v cs="$cs" -v n="$tps" -v t="$DURATION" 'BEGIN { if(n > 0) printf "%.2f", cs / (n * t) }')"
+done
@@ -0,0 +1,2 @@
+\set v random(1, 1000000)
+SELECT g_test_int1(:v);
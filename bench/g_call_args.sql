@@ -0,0 +1,2 @@
+\set v random(1, 1000000)
+SELECT g_test_int2(:v, :v), g_test_double2(:v, 0.5), g_test_null2('row ' || :v);
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Runtime of a Java scalar UDF over a table scan versus
+# max_parallel_workers_per_gather. Each parallel worker starts its own
+# JVM unless DELEGATE=on routes the calls to the global pool.
+#
+#   ROWS=10000000 DELEGATE=off ./bench/parallel_scaling.sh [workers...]
+
+ROWS=${ROWS:-10000000}
+DELEGATE=${DELEGATE:-off}
+WORKERS=${@:-"0 1 2 4 8 16"}
+
+psql -qAt <<SQL || exit 1
+CREATE OR REPLACE FUNCTION bench_double1(float8) RETURNS float8 AS 'F|ai/sedn/plunijava/Tests|test_double1' LANGUAGE UJAVA PARALLEL SAFE;
+DROP TABLE IF EXISTS bench_parallel;
+CREATE TABLE bench_parallel AS SELECT i::float8 AS x FROM generate_series(1,$ROWS) i;
+ANALYZE bench_parallel;
+SQL
+
+printf "%8s %12s %12s\n" workers ms rows/sec
+for w in $WORKERS; do
+	ms=$(psql -qAt <<SQL | awk '/^Time:/ { print int($2) }'
+SET max_parallel_workers_per_gather = $w;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET pluj.parallel_delegate = $DELEGATE;
+\timing on
+SELECT sum(bench_double1(x)) FROM bench_parallel;
+SQL
+)
+	printf "%8s %12s %12s\n" "$w" "$ms" "$(awk -v n="$ROWS" -v ms="$ms" 'BEGIN { if(ms > 0) printf "%d", n * 1000 / ms }')"
+done
+
+psql -qAt -c "DROP TABLE bench_parallel; DROP FUNCTION bench_double1(float8);"
@@ -0,0 +1,51 @@
+package ai.sedn.plunijava;
+
+/**
+ * Array of any rank: data is a flat primitive array (double[], float[], int[],
+ * long[] or short[]) in row-major order, dims the extent of each dimension.
+ * NULL elements are zero in data and have their bit set in nulls (layout of
+ * BitSet.valueOf), which is null if there are none.
+ */
+public class NDArray {
+	public int[] dims;
+	public Object data;
+	public long[] nulls;
+
+	public NDArray() {
+	}
+
+	public NDArray(int[] dims, Object data) {
+		this.dims = dims;
+		this.data = data;
+	}
+
+	public int size() {
+		int n = 1;
+		for(int d : dims) {
+			n *= d;
+		}
+		return n;
+	}
+
+	/**
+	 * Flat position of an element given its (0-based) index per dimension
+	 */
+	public int offset(int... idx) {
+		int off = 0;
+		for(int i = 0; i < dims.length; i++) {
+			off = off * dims[i] + idx[i];
+		}
+		return off;
+	}
+
+	public boolean isNull(int i) {
+		return nulls != null && (i >> 6) < nulls.length && (nulls[i >> 6] & (1L << i)) != 0;
+	}
+
+	public void setNull(int i) {
+		if(nulls == null) {
+			nulls = new long[(size() + 63) >> 6];
+		}
+		nulls[i >> 6] |= 1L << i;
+	}
+}
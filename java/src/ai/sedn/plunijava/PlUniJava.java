@@ -7,6 +7,8 @@ import static java.lang.foreign.ValueLayout.JAVA_DOUBLE;
 import static java.lang.foreign.ValueLayout.JAVA_FLOAT;
 import static java.lang.foreign.ValueLayout.JAVA_BOOLEAN;
 import static java.lang.foreign.ValueLayout.JAVA_LONG;
+import static java.lang.foreign.ValueLayout.JAVA_BYTE;
+import static java.lang.foreign.ValueLayout.JAVA_SHORT;
 
 import java.lang.foreign.Arena;
 import java.lang.foreign.FunctionDescriptor;
@@ -37,6 +39,21 @@ public class PlUniJava {
 	private MethodHandle lib_getlong;
 	private MethodHandle lib_getdoublearray;
 	private MethodHandle lib_getvector;
+	private MethodHandle lib_fetch_batch;
+	private MethodHandle lib_prepare;
+	private MethodHandle lib_execute_prepared;
+	private MethodHandle lib_free_prepared;
+	private MethodHandle lib_insert_batch;
+	private MethodHandle lib_open_cursor;
+	private MethodHandle lib_open_prepared_cursor;
+	private MethodHandle lib_close_cursor;
+	private MethodHandle lib_cursor_next;
+	private MethodHandle lib_cursor_getdouble;
+	private MethodHandle lib_cursor_getfloat;
+	private MethodHandle lib_cursor_getint;
+	private MethodHandle lib_cursor_getlong;
+	private MethodHandle lib_cursor_getdoublearray;
+	private MethodHandle lib_cursor_getvector;
 	
 	private GroupLayout arrayLayout = MemoryLayout.structLayout(
 			ADDRESS.withName("arr"),
@@ -46,6 +63,49 @@ public class PlUniJava {
 	private VarHandle resultSize = arrayLayout.varHandle(MemoryLayout.PathElement.groupElement("size"));
 	private VarHandle resultArr = arrayLayout.varHandle(MemoryLayout.PathElement.groupElement("arr"));
 	
+	private GroupLayout columnLayout = MemoryLayout.structLayout(
+			ADDRESS.withName("values"),
+			ADDRESS.withName("nulls"),
+			JAVA_INT.withName("width"),
+			JAVA_INT.withName("nnulls"),
+			JAVA_LONG.withName("size")
+	);
+	
+	private GroupLayout batchLayout = MemoryLayout.structLayout(
+			JAVA_INT.withName("nrows"),
+			JAVA_INT.withName("ncols"),
+			ADDRESS.withName("cols")
+	);
+	
+	private VarHandle columnValues = columnLayout.varHandle(MemoryLayout.PathElement.groupElement("values"));
+	private VarHandle columnNulls = columnLayout.varHandle(MemoryLayout.PathElement.groupElement("nulls"));
+	private VarHandle columnWidth = columnLayout.varHandle(MemoryLayout.PathElement.groupElement("width"));
+	private VarHandle columnNNulls = columnLayout.varHandle(MemoryLayout.PathElement.groupElement("nnulls"));
+	private VarHandle columnSize = columnLayout.varHandle(MemoryLayout.PathElement.groupElement("size"));
+	private VarHandle batchRows = batchLayout.varHandle(MemoryLayout.PathElement.groupElement("nrows"));
+	private VarHandle batchNCols = batchLayout.varHandle(MemoryLayout.PathElement.groupElement("ncols"));
+	private VarHandle batchCols = batchLayout.varHandle(MemoryLayout.PathElement.groupElement("cols"));
+	
+	private GroupLayout paramLayout = MemoryLayout.structLayout(
+			ADDRESS.withName("data"),
+			JAVA_LONG.withName("size"),
+			JAVA_BYTE.withName("kind"),
+			MemoryLayout.paddingLayout(7)
+	);
+	
+	private VarHandle paramData = paramLayout.varHandle(MemoryLayout.PathElement.groupElement("data"));
+	private VarHandle paramSize = paramLayout.varHandle(MemoryLayout.PathElement.groupElement("size"));
+	private VarHandle paramKind = paramLayout.varHandle(MemoryLayout.PathElement.groupElement("kind"));
+	
+	// Column numbers passed to fetch_batch, reused across calls
+	private MemorySegment batchColumns;
+	
+	// Open cursors per connection (MAX_CURSORS in plunijava_spi.h), cursor 0 is the one of execute
+	public static final int MAX_CURSORS = 32;
+	
+	// Batch of the last fetch_batch call per cursor
+	private MemorySegment[] batches = new MemorySegment[MAX_CURSORS];
+	
 	public PlUniJava() {
 		Linker linker = Linker.nativeLinker();		
 		
@@ -63,7 +123,7 @@ public class PlUniJava {
 		lib_disconnect = linker.downcallHandle(lib_disconnect_addr, lib_disconnect_sig); 
 		
 		MemorySegment lib_execute_addr = lib.find("execute").get();
-		FunctionDescriptor lib_execute_sig = FunctionDescriptor.of(JAVA_INT,ADDRESS,JAVA_BOOLEAN);
+		FunctionDescriptor lib_execute_sig = FunctionDescriptor.of(JAVA_INT,ADDRESS,JAVA_BOOLEAN,JAVA_INT);
 		lib_execute = linker.downcallHandle(lib_execute_addr, lib_execute_sig); 
 		
 		MemorySegment lib_fetch_next_double_array_addr = lib.find("fetch_next_double_array").get();
@@ -97,6 +157,66 @@ public class PlUniJava {
 		MemorySegment lib_getvector_addr = lib.find("getvector").get();
 		FunctionDescriptor lib_getvector_sig = FunctionDescriptor.of(ADDRESS.withTargetLayout(arrayLayout),JAVA_INT);
 		lib_getvector = linker.downcallHandle(lib_getvector_addr, lib_getvector_sig); 	
+		
+		MemorySegment lib_fetch_batch_addr = lib.find("cursor_fetch_batch").get();
+		FunctionDescriptor lib_fetch_batch_sig = FunctionDescriptor.of(ADDRESS.withTargetLayout(batchLayout),JAVA_INT,ADDRESS,JAVA_INT,JAVA_INT);
+		lib_fetch_batch = linker.downcallHandle(lib_fetch_batch_addr, lib_fetch_batch_sig); 
+		
+		MemorySegment lib_prepare_addr = lib.find("prepare").get();
+		FunctionDescriptor lib_prepare_sig = FunctionDescriptor.of(JAVA_INT,ADDRESS,JAVA_INT,ADDRESS);
+		lib_prepare = linker.downcallHandle(lib_prepare_addr, lib_prepare_sig); 
+		
+		MemorySegment lib_execute_prepared_addr = lib.find("execute_prepared").get();
+		FunctionDescriptor lib_execute_prepared_sig = FunctionDescriptor.of(JAVA_INT,JAVA_INT,ADDRESS,JAVA_INT,JAVA_BOOLEAN,JAVA_INT);
+		lib_execute_prepared = linker.downcallHandle(lib_execute_prepared_addr, lib_execute_prepared_sig); 
+		
+		MemorySegment lib_free_prepared_addr = lib.find("free_prepared").get();
+		FunctionDescriptor lib_free_prepared_sig = FunctionDescriptor.ofVoid(JAVA_INT);
+		lib_free_prepared = linker.downcallHandle(lib_free_prepared_addr, lib_free_prepared_sig); 
+		
+		MemorySegment lib_insert_batch_addr = lib.find("insert_batch").get();
+		FunctionDescriptor lib_insert_batch_sig = FunctionDescriptor.of(JAVA_LONG,ADDRESS,JAVA_INT,ADDRESS,ADDRESS,JAVA_INT);
+		lib_insert_batch = linker.downcallHandle(lib_insert_batch_addr, lib_insert_batch_sig); 
+		
+		MemorySegment lib_open_cursor_addr = lib.find("open_cursor").get();
+		FunctionDescriptor lib_open_cursor_sig = FunctionDescriptor.of(JAVA_INT,ADDRESS,JAVA_INT);
+		lib_open_cursor = linker.downcallHandle(lib_open_cursor_addr, lib_open_cursor_sig); 
+		
+		MemorySegment lib_open_prepared_cursor_addr = lib.find("open_prepared_cursor").get();
+		FunctionDescriptor lib_open_prepared_cursor_sig = FunctionDescriptor.of(JAVA_INT,JAVA_INT,ADDRESS,JAVA_INT,JAVA_INT);
+		lib_open_prepared_cursor = linker.downcallHandle(lib_open_prepared_cursor_addr, lib_open_prepared_cursor_sig); 
+		
+		MemorySegment lib_close_cursor_addr = lib.find("close_cursor").get();
+		FunctionDescriptor lib_close_cursor_sig = FunctionDescriptor.ofVoid(JAVA_INT);
+		lib_close_cursor = linker.downcallHandle(lib_close_cursor_addr, lib_close_cursor_sig); 
+		
+		MemorySegment lib_cursor_next_addr = lib.find("cursor_next").get();
+		FunctionDescriptor lib_cursor_next_sig = FunctionDescriptor.of(JAVA_BOOLEAN,JAVA_INT);
+		lib_cursor_next = linker.downcallHandle(lib_cursor_next_addr, lib_cursor_next_sig); 
+		
+		MemorySegment lib_cursor_getdouble_addr = lib.find("cursor_getdouble").get();
+		FunctionDescriptor lib_cursor_getdouble_sig = FunctionDescriptor.of(JAVA_DOUBLE,JAVA_INT,JAVA_INT);
+		lib_cursor_getdouble = linker.downcallHandle(lib_cursor_getdouble_addr, lib_cursor_getdouble_sig); 
+		
+		MemorySegment lib_cursor_getfloat_addr = lib.find("cursor_getfloat").get();
+		FunctionDescriptor lib_cursor_getfloat_sig = FunctionDescriptor.of(JAVA_FLOAT,JAVA_INT,JAVA_INT);
+		lib_cursor_getfloat = linker.downcallHandle(lib_cursor_getfloat_addr, lib_cursor_getfloat_sig); 
+		
+		MemorySegment lib_cursor_getint_addr = lib.find("cursor_getint").get();
+		FunctionDescriptor lib_cursor_getint_sig = FunctionDescriptor.of(JAVA_INT,JAVA_INT,JAVA_INT);
+		lib_cursor_getint = linker.downcallHandle(lib_cursor_getint_addr, lib_cursor_getint_sig); 
+		
+		MemorySegment lib_cursor_getlong_addr = lib.find("cursor_getlong").get();
+		FunctionDescriptor lib_cursor_getlong_sig = FunctionDescriptor.of(JAVA_LONG,JAVA_INT,JAVA_INT);
+		lib_cursor_getlong = linker.downcallHandle(lib_cursor_getlong_addr, lib_cursor_getlong_sig); 
+		
+		MemorySegment lib_cursor_getdoublearray_addr = lib.find("cursor_getdoublearray").get();
+		FunctionDescriptor lib_cursor_getdoublearray_sig = FunctionDescriptor.of(ADDRESS.withTargetLayout(arrayLayout),JAVA_INT,JAVA_INT);
+		lib_cursor_getdoublearray = linker.downcallHandle(lib_cursor_getdoublearray_addr, lib_cursor_getdoublearray_sig); 
+		
+		MemorySegment lib_cursor_getvector_addr = lib.find("cursor_getvector").get();
+		FunctionDescriptor lib_cursor_getvector_sig = FunctionDescriptor.of(ADDRESS.withTargetLayout(arrayLayout),JAVA_INT,JAVA_INT);
+		lib_cursor_getvector = linker.downcallHandle(lib_cursor_getvector_addr, lib_cursor_getvector_sig); 
 	}
 	
 	public void connect() throws Throwable {
@@ -112,10 +232,18 @@ public class PlUniJava {
 	}
 	
 	public void execute(String query) throws Throwable {
+		execute(query, -1);
+	}
+	
+	/*
+	 * Rows are fetched from the cursor fetch_size rows at a time. 0 sizes the fetches 
+	 * adaptively by pluj.fetch_memory, a negative value uses pluj.fetch_size.
+	 */
+	public void execute(String query, int fetch_size) throws Throwable {
 		
 		var cString = arena.allocateUtf8String(query);
 		
-		int ret = (int) lib_execute.invokeExact(cString,true);
+		int ret = (int) lib_execute.invokeExact(cString,true,fetch_size);
 		
 		if(ret != 0) {
 			throw new SQLException("Execution failed! ("+query+")"); 
@@ -126,7 +254,7 @@ public void execute_nc(String query) throws Throwable {
 		
 		var cString = arena.allocateUtf8String(query);
 		
-		int ret = (int) lib_execute.invokeExact(cString,false);
+		int ret = (int) lib_execute.invokeExact(cString,false,-1);
 		
 		if(ret != 0) {
 			throw new SQLException("Execution failed! ("+query+")"); 
@@ -134,6 +262,108 @@ public void execute_nc(String query) throws Throwable {
 	}
 	
 	
+	/*
+	 * Prepares sql with parameters $1..$n of the given PG type names (e.g. "int4", "float8[]") 
+	 * and returns a handle for execute_prepared. The plan is kept for the session, preparing 
+	 * the same statement again returns the same handle.
+	 */
+	public int prepare(String sql, String... argtypes) throws Throwable {
+		
+		try(Arena call = Arena.ofConfined()) {
+			MemorySegment types = call.allocateArray(ADDRESS, argtypes.length);
+			
+			for(int i = 0; i < argtypes.length; i++) {
+				types.setAtIndex(ADDRESS, i, call.allocateUtf8String(argtypes[i]));
+			}
+			
+			int handle = (int) lib_prepare.invokeExact(call.allocateUtf8String(sql), argtypes.length, types);
+			
+			if(handle < 0) {
+				throw new SQLException("Prepare failed! ("+sql+")"); 
+			}
+			
+			return handle;
+		}
+	}
+	
+	/*
+	 * Runs a prepared statement, rows are read as after execute. Parameters are bound in 
+	 * binary form: Java primitives (boxed), byte[] (bytea), primitive arrays and native 
+	 * MemorySegments (dense elements of a 1D array, passed without copy), null (NULL). 
+	 * Other objects are passed as text (toString) to the input function of the parameter type.
+	 * The number of arguments must match the number of prepared parameter types.
+	 */
+	public void execute_prepared(int handle, Object... args) throws Throwable {
+		
+		try(Arena call = Arena.ofConfined()) {
+			MemorySegment params = bind_params(call, args);
+			
+			int ret = (int) lib_execute_prepared.invokeExact(handle, params, args.length, true, -1);
+			
+			if(ret != 0) {
+				throw new SQLException("Execution of prepared statement "+handle+" failed!"); 
+			}
+		}
+	}
+	
+	public void free_prepared(int handle) throws Throwable {
+		lib_free_prepared.invokeExact(handle);
+	}
+	
+	private MemorySegment bind_params(Arena call, Object[] args) {
+		MemorySegment params = call.allocateArray(paramLayout, Math.max(args.length, 1));
+		
+		for(int i = 0; i < args.length; i++) {
+			bind_param(call, params.asSlice(i * paramLayout.byteSize(), paramLayout.byteSize()), args[i]);
+		}
+		
+		return params;
+	}
+	
+	private void set_param(MemorySegment param, char kind, MemorySegment data) {
+		paramKind.set(param, (byte) kind);
+		paramData.set(param, data);
+		paramSize.set(param, data.byteSize());
+	}
+	
+	private void bind_param(Arena call, MemorySegment param, Object arg) {
+		
+		if(arg == null) {
+			set_param(param, 'n', MemorySegment.NULL);
+		} else if(arg instanceof Integer v) {
+			set_param(param, 'i', call.allocate(JAVA_INT, v));
+		} else if(arg instanceof Long v) {
+			set_param(param, 'i', call.allocate(JAVA_LONG, v));
+		} else if(arg instanceof Short v) {
+			set_param(param, 'i', call.allocate(JAVA_SHORT, v));
+		} else if(arg instanceof Byte v) {
+			set_param(param, 'i', call.allocate(JAVA_SHORT, (short) v.byteValue()));
+		} else if(arg instanceof Double v) {
+			set_param(param, 'f', call.allocate(JAVA_DOUBLE, v));
+		} else if(arg instanceof Float v) {
+			set_param(param, 'f', call.allocate(JAVA_FLOAT, v));
+		} else if(arg instanceof Boolean v) {
+			set_param(param, 'b', call.allocate(JAVA_BOOLEAN, v));
+		} else if(arg instanceof byte[] v) {
+			set_param(param, 'y', call.allocateArray(JAVA_BYTE, v));
+		} else if(arg instanceof double[] v) {
+			set_param(param, 'y', call.allocateArray(JAVA_DOUBLE, v));
+		} else if(arg instanceof float[] v) {
+			set_param(param, 'y', call.allocateArray(JAVA_FLOAT, v));
+		} else if(arg instanceof int[] v) {
+			set_param(param, 'y', call.allocateArray(JAVA_INT, v));
+		} else if(arg instanceof long[] v) {
+			set_param(param, 'y', call.allocateArray(JAVA_LONG, v));
+		} else if(arg instanceof short[] v) {
+			set_param(param, 'y', call.allocateArray(JAVA_SHORT, v));
+		} else if(arg instanceof MemorySegment v) {
+			set_param(param, 'y', native_segment(call, v));
+		} else {
+			MemorySegment str = call.allocateUtf8String(arg.toString());
+			set_param(param, 's', str.asSlice(0, str.byteSize() - 1));
+		}
+	}
+	
 	public double[] fetch_next_double_array(int column) throws Throwable{
 		
 		MemorySegment next = (MemorySegment) lib_fetch_next_double_array.invokeExact(column);  
@@ -233,5 +463,290 @@ public void execute_nc(String query) throws Throwable {
 		
 		return null;
 	}
-}
+	
+	/*
+	 * Columnar batch fetch: fetches up to max_rows rows of the given columns (1-based) 
+	 * with one downcall and returns the number of rows fetched (0 at the end of the result). 
+	 * The values of the columns are read with batch_values / batch_nulls, which stay valid 
+	 * until the next fetch_batch, execute or disconnect call.
+	 */
+	public int fetch_batch(int[] columns, int max_rows) throws Throwable {
+		return fetch_batch(0, columns, max_rows);
+	}
+	
+	public int fetch_batch(int cursor, int[] columns, int max_rows) throws Throwable {
+		
+		if(batchColumns == null || batchColumns.byteSize() < columns.length * JAVA_INT.byteSize()) {
+			batchColumns = arena.allocateArray(JAVA_INT, columns.length);
+		}
+		MemorySegment.copy(columns, 0, batchColumns, JAVA_INT, 0, columns.length);
+		
+		MemorySegment batch = (MemorySegment) lib_fetch_batch.invokeExact(cursor, batchColumns, columns.length, max_rows);
+		
+		if(batch.equals(MemorySegment.NULL)) {
+			throw new SQLException("Batch fetch failed! (unsupported column type, invalid column or cursor)"); 
+		}
+		
+		batches[cursor] = batch;
+		
+		return (int) batchRows.get(batch);
+	}
+	
+	private MemorySegment batch_column(int cursor, int index) {
+		MemorySegment batch = cursor >= 0 && cursor < MAX_CURSORS ? batches[cursor] : null;
+		
+		if(batch == null || index < 0 || index >= (int) batchNCols.get(batch)) {
+			throw new IndexOutOfBoundsException("Batch column "+index+" of cursor "+cursor+" out of range");
+		}
+		
+		MemorySegment cols = ((MemorySegment) batchCols.get(batch)).reinterpret(columnLayout.byteSize() * (index + 1));
+		return cols.asSlice(index * columnLayout.byteSize(), columnLayout.byteSize());
+	}
+	
+	/*
+	 * Dense values of the index-th column of the last batch (0 for NULL rows), 
+	 * e.g. read with getAtIndex(JAVA_DOUBLE, row) for float8 columns
+	 */
+	public MemorySegment batch_values(int index) {
+		return batch_values(0, index);
+	}
+	
+	public MemorySegment batch_values(int cursor, int index) {
+		MemorySegment col = batch_column(cursor, index);
+		MemorySegment values = (MemorySegment) columnValues.get(col);
+		
+		return values.reinterpret((long) (int) batchRows.get(batches[cursor]) * (int) columnWidth.get(col)).asReadOnly();
+	}
+	
+	/*
+	 * Null bitmap of the index-th column of the last batch: a set bit per NULL row 
+	 * (long words, java.util.BitSet.valueOf(nulls.toArray(JAVA_LONG)))
+	 */
+	public MemorySegment batch_nulls(int index) {
+		return batch_nulls(0, index);
+	}
+	
+	public MemorySegment batch_nulls(int cursor, int index) {
+		MemorySegment col = batch_column(cursor, index);
+		MemorySegment nulls = (MemorySegment) columnNulls.get(col);
+		
+		return nulls.reinterpret((((int) batchRows.get(batches[cursor]) + 63) / 64) * JAVA_LONG.byteSize()).asReadOnly();
+	}
+	
+	public boolean batch_hasnulls(int index) {
+		return batch_hasnulls(0, index);
+	}
+	
+	public boolean batch_hasnulls(int cursor, int index) {
+		return (int) columnNNulls.get(batch_column(cursor, index)) > 0;
+	}
+	
+	public boolean batch_isnull(int index, int row) {
+		return batch_isnull(0, index, row);
+	}
+	
+	public boolean batch_isnull(int cursor, int index, int row) {
+		MemorySegment nulls = batch_nulls(cursor, index);
+		
+		return (nulls.getAtIndex(JAVA_LONG, row >> 6) & (1L << (row & 63))) != 0;
+	}
+	
+	/*
+	 * Bulk insert of nrows rows into the given columns of table. values holds per column the 
+	 * dense values (nrows values of the column type's width: bool, int2, int4, int8, float4 
+	 * or float8), nulls optionally a bitmap with a set bit per NULL row (long words, as 
+	 * returned by batch_nulls). The rows are inserted by one prepared statement execution, 
+	 * returns the number of inserted rows.
+	 */
+	public long insert_batch(String table, String[] columns, int nrows, MemorySegment[] values, MemorySegment[] nulls) throws Throwable {
+		
+		if(values.length != columns.length || (nulls != null && nulls.length != columns.length)) {
+			throw new IllegalArgumentException("One values (and nulls) segment per column required");
+		}
+		
+		try(Arena call = Arena.ofConfined()) {
+			MemorySegment names = call.allocateArray(ADDRESS, columns.length);
+			MemorySegment data = call.allocateArray(columnLayout, columns.length);
+			
+			for(int i = 0; i < columns.length; i++) {
+				MemorySegment col = data.asSlice(i * columnLayout.byteSize(), columnLayout.byteSize());
+				MemorySegment nullmap = nulls != null && nulls[i] != null ? native_segment(call, nulls[i]) : MemorySegment.NULL;
+				
+				if(!nullmap.equals(MemorySegment.NULL) && nullmap.byteSize() < ((nrows + 63) / 64) * JAVA_LONG.byteSize()) {
+					throw new IllegalArgumentException("Null bitmap of column "+columns[i]+" too small");
+				}
+				
+				names.setAtIndex(ADDRESS, i, call.allocateUtf8String(columns[i]));
+				columnValues.set(col, native_segment(call, values[i]));
+				columnNulls.set(col, nullmap);
+				columnWidth.set(col, 0);
+				columnNNulls.set(col, 0);
+				columnSize.set(col, values[i].byteSize());
+			}
+			
+			long ret = (long) lib_insert_batch.invokeExact(call.allocateUtf8String(table), columns.length, names, data, nrows);
+			
+			if(ret < 0) {
+				throw new SQLException("Insert into "+table+" failed!"); 
+			}
+			
+			return ret;
+		}
+	}
+	
+	/*
+	 * Bulk insert from Java arrays, one double[], float[], long[], int[], short[] or 
+	 * boolean[] of equal length per column (without NULLs)
+	 */
+	public long insert_batch(String table, String[] columns, Object... data) throws Throwable {
+		
+		try(Arena call = Arena.ofConfined()) {
+			MemorySegment[] values = new MemorySegment[data.length];
+			int nrows = -1;
+			
+			for(int i = 0; i < data.length; i++) {
+				int n;
+				
+				if(data[i] instanceof double[] v) {
+					values[i] = call.allocateArray(JAVA_DOUBLE, v);
+					n = v.length;
+				} else if(data[i] instanceof float[] v) {
+					values[i] = call.allocateArray(JAVA_FLOAT, v);
+					n = v.length;
+				} else if(data[i] instanceof long[] v) {
+					values[i] = call.allocateArray(JAVA_LONG, v);
+					n = v.length;
+				} else if(data[i] instanceof int[] v) {
+					values[i] = call.allocateArray(JAVA_INT, v);
+					n = v.length;
+				} else if(data[i] instanceof short[] v) {
+					values[i] = call.allocateArray(JAVA_SHORT, v);
+					n = v.length;
+				} else if(data[i] instanceof boolean[] v) {
+					values[i] = call.allocateArray(JAVA_BYTE, v.length);
+					for(int r = 0; r < v.length; r++) {
+						values[i].set(JAVA_BYTE, r, (byte) (v[r] ? 1 : 0));
+					}
+					n = v.length;
+				} else {
+					throw new IllegalArgumentException("Unsupported column data "+(data[i] == null ? "null" : data[i].getClass().getName()));
+				}
+				
+				if(nrows >= 0 && n != nrows) {
+					throw new IllegalArgumentException("Columns of different length");
+				}
+				nrows = n;
+			}
+			
+			return insert_batch(table, columns, Math.max(nrows, 0), values, null);
+		}
+	}
+	
+	private MemorySegment native_segment(Arena call, MemorySegment segment) {
+		if(segment.isNative()) {
+			return segment;
+		}
+		return call.allocate(segment.byteSize()).copyFrom(segment);
+	}
+	
+	/*
+	 * Cursors: open_cursor runs a query on its own portal and returns a cursor handle, so 
+	 * several results can be read at once (e.g. a merge join of two sorted inputs). The rows 
+	 * are read with fetch_next(cursor), the getters and fetch_batch with the cursor as first 
+	 * argument. Up to MAX_CURSORS - 1 cursors can be open per connection.
+	 */
+	public int open_cursor(String query) throws Throwable {
+		return open_cursor(query, -1);
+	}
+	
+	public int open_cursor(String query, int fetch_size) throws Throwable {
+		
+		try(Arena call = Arena.ofConfined()) {
+			int cursor = (int) lib_open_cursor.invokeExact(call.allocateUtf8String(query), fetch_size);
+			
+			if(cursor < 0) {
+				throw new SQLException("Opening cursor failed! ("+query+")"); 
+			}
+			
+			return cursor;
+		}
+	}
+	
+	public int open_prepared_cursor(int handle, Object... args) throws Throwable {
+		
+		try(Arena call = Arena.ofConfined()) {
+			MemorySegment params = bind_params(call, args);
+			
+			int cursor = (int) lib_open_prepared_cursor.invokeExact(handle, params, args.length, -1);
+			
+			if(cursor < 0) {
+				throw new SQLException("Opening cursor on prepared statement "+handle+" failed!"); 
+			}
+			
+			return cursor;
+		}
+	}
+	
+	public void close_cursor(int cursor) throws Throwable {
+		lib_close_cursor.invokeExact(cursor);
+		if(cursor >= 0 && cursor < MAX_CURSORS) {
+			batches[cursor] = null;
+		}
+	}
+	
+	public boolean fetch_next(int cursor) throws Throwable {
+		return (boolean) lib_cursor_next.invokeExact(cursor);		
+	}
+
+	public double getdouble(int cursor, int column) throws Throwable {
+		return (double) lib_cursor_getdouble.invokeExact(cursor, column);		
+	}
 
+	public float getfloat(int cursor, int column) throws Throwable {
+		return (float) lib_cursor_getfloat.invokeExact(cursor, column);		
+	}
+	
+	public int getint(int cursor, int column) throws Throwable {
+		return (int) lib_cursor_getint.invokeExact(cursor, column);		
+	}
+	
+	public long getlong(int cursor, int column) throws Throwable {
+		return (long) lib_cursor_getlong.invokeExact(cursor, column);		
+	}
+	
+	public double[] getdoublearray(int cursor, int column) throws Throwable {
+		
+		MemorySegment next = (MemorySegment) lib_cursor_getdoublearray.invokeExact(cursor, column);  
+	
+		int size = (int) resultSize.get(next);
+		
+		if(size > 0) {
+			MemorySegment ARR = (MemorySegment) resultArr.get(next);
+			
+			SequenceLayout L = MemoryLayout.sequenceLayout(size,JAVA_DOUBLE);
+			ARR = ARR.reinterpret(L.byteSize());
+			
+			return ARR.toArray(JAVA_DOUBLE);
+		}
+		
+		return null;
+	}
+	
+	public float[] getvector(int cursor, int column) throws Throwable {
+		
+		MemorySegment next = (MemorySegment) lib_cursor_getvector.invokeExact(cursor, column);  
+	
+		int size = (int) resultSize.get(next);
+		
+		if(size > 0) {
+			MemorySegment ARR = (MemorySegment) resultArr.get(next);
+			
+			SequenceLayout L = MemoryLayout.sequenceLayout(size,JAVA_FLOAT);
+			ARR = ARR.reinterpret(L.byteSize());
+			
+			return ARR.toArray(JAVA_FLOAT);
+		}
+		
+		return null;
+	}
+}
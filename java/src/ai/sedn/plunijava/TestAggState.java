@@ -0,0 +1,6 @@
+package ai.sedn.plunijava;
+
+public class TestAggState {
+	public long N;
+	public double Sum;
+}
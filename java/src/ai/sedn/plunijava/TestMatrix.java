@@ -0,0 +1,5 @@
+package ai.sedn.plunijava;
+
+public class TestMatrix {
+	public double[][] M;
+}
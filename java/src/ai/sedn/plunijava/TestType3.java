@@ -0,0 +1,6 @@
+package ai.sedn.plunijava;
+
+public class TestType3 {
+	public Integer A;
+	public String B;
+}
@@ -1,8 +1,15 @@
 package ai.sedn.plunijava;
 
+import java.lang.foreign.Arena;
+import java.lang.foreign.MemorySegment;
+import java.lang.foreign.ValueLayout;
+import java.math.BigDecimal;
+import java.nio.ByteBuffer;
+import java.nio.DoubleBuffer;
 import java.sql.SQLException;
 import java.util.ArrayList;
 import java.util.Iterator;
+import java.util.UUID;
 
 public class Tests {
 
@@ -87,6 +94,118 @@ public class Tests {
 		return ret;
     }
 	
+	public static double[] test_batch1(double[] in) throws SQLException {
+		double[] ret = new double[in.length];
+		for(int i = 0; i < in.length; i++) {
+			ret[i] = 2*in[i];
+		}
+		return ret;
+	}
+
+	public static int[] test_batch2(int[] in1, int[] in2) throws SQLException {
+		int[] ret = new int[in1.length];
+		for(int i = 0; i < in1.length; i++) {
+			ret[i] = in1[i]+in2[i];
+		}
+		return ret;
+	}
+
+	/*
+	 * Aggregate
+	 */
+	public static TestAggState test_agg_trans(TestAggState state, double in) {
+		if(state == null) {
+			state = new TestAggState();
+		}
+		state.N++;
+		state.Sum += in;
+		return state;
+	}
+
+	public static TestAggState test_agg_combine(TestAggState state1, TestAggState state2) {
+		if(state1 == null) {
+			return state2;
+		}
+		state1.N += state2.N;
+		state1.Sum += state2.Sum;
+		return state1;
+	}
+
+	public static byte[] test_agg_serial(TestAggState state) {
+		ByteBuffer buf = ByteBuffer.allocate(16);
+		buf.putLong(state.N);
+		buf.putDouble(state.Sum);
+		return buf.array();
+	}
+
+	public static TestAggState test_agg_deserial(byte[] in) {
+		ByteBuffer buf = ByteBuffer.wrap(in);
+		TestAggState state = new TestAggState();
+		state.N = buf.getLong();
+		state.Sum = buf.getDouble();
+		return state;
+	}
+
+	public static double test_agg_final(TestAggState state) {
+		if(state == null || state.N == 0) {
+			return 0;
+		}
+		return state.Sum/state.N;
+	}
+
+	public static double test_buffer1(ByteBuffer in) throws SQLException {
+		DoubleBuffer d = in.asDoubleBuffer();
+		double ret = 0;
+		while(d.hasRemaining()) {
+			ret += d.get();
+		}
+		return ret;
+	}
+
+	public static TestMatrix test_matrix1(int rows, int cols) throws SQLException {
+		TestMatrix ret = new TestMatrix();
+		ret.M = new double[rows][cols];
+		for(int i = 0; i < rows; i++) {
+			for(int j = 0; j < cols; j++) {
+				ret.M[i][j] = i*cols+j;
+			}
+		}
+		return ret;
+	}
+
+	public static NDArray test_ndarray1(NDArray in, double f) throws SQLException {
+		double[] d = (double[]) in.data;
+		double[] out = new double[d.length];
+		for(int i = 0; i < d.length; i++) {
+			out[i] = d[i] * f;
+		}
+		NDArray ret = new NDArray(in.dims, out);
+		ret.nulls = in.nulls;
+		return ret;
+	}
+
+	public static NDArray test_ndarray3(NDArray in) throws SQLException {
+		// NULL where the input is 0 or NULL
+		int[] d = (int[]) in.data;
+		NDArray ret = new NDArray(in.dims, d.clone());
+		for(int i = 0; i < d.length; i++) {
+			if(d[i] == 0) {
+				ret.setNull(i);
+			}
+		}
+		return ret;
+	}
+
+	public static long test_ndarray2(NDArray in) throws SQLException {
+		int[] d = (int[]) in.data;
+		long ret = 0;
+		// weight with position in last dimension
+		for(int i = 0; i < d.length; i++) {
+			ret += (long) d[i] * (i % in.dims[in.dims.length - 1] + 1);
+		}
+		return ret;
+	}
+
 	public static double test_double4(double[][] in) throws SQLException {
 		double ret = 0;
 		for(int i = 0; i < in.length; i++) {
@@ -136,6 +255,55 @@ public class Tests {
 		return R;
 	}
 
+	public static TestType3 test_complextype4(TestType3 in) {
+		TestType3 R = new TestType3();
+		R.A = (in.A == null) ? null : in.A + 1;
+		R.B = in.B;
+
+		return R;
+	}
+
+	/*
+	 * NULL
+	 */
+	public static Double test_null1(Integer in1, Double in2) {
+		if(in1 == null || in2 == null) {
+			return null;
+		}
+		return in1 * in2;
+	}
+
+	public static String test_null2(String in) {
+		return (in == null) ? "null" : (in.isEmpty() ? null : in);
+	}
+
+	/*
+	 * Converted types
+	 */
+	public static long test_timestamp1(long micros) {
+		return micros + 1000000L;
+	}
+
+	public static int test_date1(int days) {
+		return days + 1;
+	}
+
+	public static String test_uuid1(UUID in) {
+		return in.toString();
+	}
+
+	public static UUID test_uuid2(UUID in) {
+		return new UUID(in.getLeastSignificantBits(), in.getMostSignificantBits());
+	}
+
+	public static BigDecimal test_numeric1(BigDecimal in1, BigDecimal in2) {
+		return in1.add(in2);
+	}
+
+	public static byte[] test_jsonb1(byte[] in) {
+		return in;
+	}
+
 	/*
 	 * Setof return
 	 */
@@ -179,5 +347,153 @@ public class Tests {
 		
 	}
 	
+	public static double test_njdbc2() throws Throwable {
+		
+		PlUniJava unij = new PlUniJava();
+		double sum = 0;
+			
+	    unij.connect();
+	    
+	    unij.execute("select i, case when i % 3 = 0 then null else i * 0.5::float8 end from generate_series(1,25000) i");
+	    
+	    int rows;
+	    while((rows = unij.fetch_batch(new int[] {1,2}, 1000)) > 0) {
+	    	MemorySegment ids = unij.batch_values(0);
+	    	MemorySegment values = unij.batch_values(1);
+	    	
+	    	for(int i = 0; i < rows; i++) {
+	    		if(!unij.batch_isnull(1, i)) {
+	    			sum += values.getAtIndex(ValueLayout.JAVA_DOUBLE, i) / ids.getAtIndex(ValueLayout.JAVA_INT, i);
+	    		}
+	    	}
+	    }
+	    
+	    unij.disconnect();
+	
+		return sum;
+	}
+	
+	public static double test_njdbc3() throws Throwable {
+		
+		PlUniJava unij = new PlUniJava();
+		double sum = 0;
+			
+	    unij.connect();
+	    
+	    // Adaptive fetch size
+	    unij.execute("select i, array_fill(i::float8, ARRAY[2048]) from generate_series(1,3000) i", 0);
+	    
+	    while(unij.fetch_next()) {
+	    	sum += unij.getdoublearray(2)[2047];
+	    }
+	    
+	    unij.disconnect();
+	
+		return sum;
+	}
+	
+	public static long test_njdbc4() throws Throwable {
+		
+		PlUniJava unij = new PlUniJava();
+		long sum = 0;
+			
+	    unij.connect();
+	    
+	    int h = unij.prepare("select $1 + array_length($2, 1) + coalesce($3, 0)", "int4", "float8[]", "int8");
+	    
+	    for(int i = 0; i < 100; i++) {
+	    	// Same statement, same plan
+	    	if(unij.prepare("select $1 + array_length($2, 1) + coalesce($3, 0)", "int4", "float8[]", "int8") != h) {
+	    		throw new SQLException("Statement prepared twice");
+	    	}
+	    	
+	    	unij.execute_prepared(h, i, new double[] {1,2,3}, null);
+	    	while(unij.fetch_next()) {
+	    		sum += unij.getlong(1);
+	    	}
+	    }
+	    
+	    int h2 = unij.prepare("select count(*) from test_table1 where id = any($1)", "int4[]");
+	    unij.execute_prepared(h2, new int[] {1,3});
+	    while(unij.fetch_next()) {
+	    	sum += unij.getlong(1);
+	    }
+	    
+	    unij.free_prepared(h);
+	    unij.free_prepared(h2);
+	    unij.disconnect();
+	
+		return sum;
+	}
+	
+	public static long test_njdbc5() throws Throwable {
+		
+		PlUniJava unij = new PlUniJava();
+		long matches = 0;
+			
+	    unij.connect();
+	    
+	    // Merge join of two sorted inputs, read through two cursors at once
+	    int a = unij.open_cursor("select i from generate_series(1,30000) i", 1000);
+	    int h = unij.prepare("select i * $1 from generate_series(1,10000) i", "int4");
+	    int b = unij.open_prepared_cursor(h, 3);
+	    
+	    boolean hasA = unij.fetch_next(a);
+	    boolean hasB = unij.fetch_next(b);
+	    
+	    while(hasA && hasB) {
+	    	int va = unij.getint(a, 1);
+	    	int vb = unij.getint(b, 1);
+	    	
+	    	if(va < vb) {
+	    		hasA = unij.fetch_next(a);
+	    	} else if(va > vb) {
+	    		hasB = unij.fetch_next(b);
+	    	} else {
+	    		matches++;
+	    		hasA = unij.fetch_next(a);
+	    		hasB = unij.fetch_next(b);
+	    	}
+	    }
+	    
+	    unij.close_cursor(a);
+	    unij.close_cursor(b);
+	    unij.free_prepared(h);
+	    unij.disconnect();
+	
+		return matches;
+	}
+	
+	public static long test_njdbc6() throws Throwable {
+		
+		PlUniJava unij = new PlUniJava();
+		int n = 100000;
+		long[] ids = new long[n];
+		double[] vals = new double[n];
+		boolean[] flags = new boolean[n];
+		
+		for(int i = 0; i < n; i++) {
+			ids[i] = i + 1;
+			vals[i] = i * 0.5;
+			flags[i] = i % 2 == 0;
+		}
+			
+	    unij.connect();
+	    
+	    long inserted = unij.insert_batch("test_table2", new String[] {"id","val","flag"}, ids, vals, flags);
+	    
+	    // NULL values from a bitmap
+	    try(Arena arena = Arena.ofConfined()) {
+	    	MemorySegment id = arena.allocateArray(ValueLayout.JAVA_LONG, -1, -2, -3);
+	    	MemorySegment val = arena.allocateArray(ValueLayout.JAVA_DOUBLE, 0, 0, 0);
+	    	MemorySegment nulls = arena.allocateArray(ValueLayout.JAVA_LONG, 0b111L);
+	    	
+	    	inserted += unij.insert_batch("test_table2", new String[] {"id","val"}, 3, new MemorySegment[] {id,val}, new MemorySegment[] {null,nulls});
+	    }
+	    
+	    unij.disconnect();
+	
+		return inserted;
+	}
+	
 }
-
@@ -58,6 +58,16 @@ CREATE OR REPLACE FUNCTION g_test_double3(float8[]) RETURNS float8 AS 'G|ai/sedn
 SELECT f_test_double3('{1.01,2.23,3.11,4.2,5.433}');
 SELECT b_test_double3('{6.,231.,5.764,4.43,3.665,2.4323,1.34234}');
 SELECT g_test_double3('{1.43,2.,2.3434,1.3}');
+SELECT f_test_double3('{1.43,NULL,2.3434}'), b_test_double3('{1.43,NULL,2.3434}'), g_test_double3('{1.43,NULL,2.3434}');
+-- zero-copy array view
+CREATE OR REPLACE FUNCTION f_test_buffer1(float8[]) RETURNS float8 AS 'F|ai/sedn/plunijava/Tests|test_buffer1|(Ljava/nio/ByteBuffer;)D' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION g_test_buffer1(float8[]) RETURNS float8 AS 'G|ai/sedn/plunijava/Tests|test_buffer1|(Ljava/nio/ByteBuffer;)D' LANGUAGE UJAVA;
+SELECT f_test_buffer1('{1.01,2.23,3.11,4.2,5.433}');
+SELECT g_test_buffer1('{1.43,2.,2.3434,1.3}');
+SELECT f_test_buffer1(array_agg(i::float8)) FROM generate_series(1,10000) i;
+-- payload larger than the former fixed 2 MB slots
+SELECT b_test_double3(array_agg(i::float8)) FROM generate_series(1,500000) i;
+SELECT g_test_double3(array_agg(i::float8)) FROM generate_series(1,500000) i;
 
 CREATE OR REPLACE FUNCTION f_test_double4(float8[]) RETURNS float8 AS 'F|ai/sedn/plunijava/Tests|test_double4|([[D)D' LANGUAGE UJAVA;
 CREATE OR REPLACE FUNCTION b_test_double4(float8[]) RETURNS float8 AS 'B|ai/sedn/plunijava/Tests|test_double4|([[D)D' LANGUAGE UJAVA;
@@ -100,11 +110,124 @@ CREATE OR REPLACE FUNCTION f_test_complextype3(TESTTYPE2) RETURNS TESTTYPE2 AS '
 
 SELECT f_test_complextype3('("HELLO WORLD!")'::TESTTYPE2);
 
+CREATE TYPE TESTTYPE3 as (A int, B text);
+CREATE OR REPLACE FUNCTION f_test_complextype4(TESTTYPE3) RETURNS TESTTYPE3 AS 'F|ai/sedn/plunijava/Tests|test_complextype4|(Lai/sedn/plunijava/TestType3;)Lai/sedn/plunijava/TestType3;' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION g_test_complextype4(TESTTYPE3) RETURNS TESTTYPE3 AS 'G|ai/sedn/plunijava/Tests|test_complextype4|(Lai/sedn/plunijava/TestType3;)Lai/sedn/plunijava/TestType3;' LANGUAGE UJAVA;
+
+SELECT f_test_complextype4('(1,)'::TESTTYPE3), f_test_complextype4('(,"HELLO")'::TESTTYPE3);
+SELECT g_test_complextype4('(1,)'::TESTTYPE3), g_test_complextype4('(,"HELLO")'::TESTTYPE3);
+
+--null
+CREATE OR REPLACE FUNCTION f_test_strict1(float8,float8) RETURNS float8 AS 'F|ai/sedn/plunijava/Tests|test_double2|(DD)D' LANGUAGE UJAVA STRICT;
+CREATE OR REPLACE FUNCTION g_test_strict1(float8,float8) RETURNS float8 AS 'G|ai/sedn/plunijava/Tests|test_double2|(DD)D' LANGUAGE UJAVA STRICT;
+CREATE OR REPLACE FUNCTION f_test_null1(int,float8) RETURNS float8 AS 'F|ai/sedn/plunijava/Tests|test_null1|(Ljava/lang/Integer;Ljava/lang/Double;)Ljava/lang/Double;' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION b_test_null1(int,float8) RETURNS float8 AS 'B|ai/sedn/plunijava/Tests|test_null1|(Ljava/lang/Integer;Ljava/lang/Double;)Ljava/lang/Double;' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION g_test_null1(int,float8) RETURNS float8 AS 'G|ai/sedn/plunijava/Tests|test_null1|(Ljava/lang/Integer;Ljava/lang/Double;)Ljava/lang/Double;' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION f_test_null2(text) RETURNS text AS 'F|ai/sedn/plunijava/Tests|test_null2|(Ljava/lang/String;)Ljava/lang/String;' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION g_test_null2(text) RETURNS text AS 'G|ai/sedn/plunijava/Tests|test_null2|(Ljava/lang/String;)Ljava/lang/String;' LANGUAGE UJAVA;
+
+SELECT f_test_strict1(NULL, 1.0) IS NULL, g_test_strict1(2.0, NULL) IS NULL;
+SELECT f_test_null1(3, 1.5), f_test_null1(NULL, 1.5) IS NULL, f_test_null1(3, NULL) IS NULL;
+SELECT b_test_null1(3, 1.5), b_test_null1(NULL, 1.5) IS NULL;
+SELECT g_test_null1(3, 1.5), g_test_null1(3, NULL) IS NULL;
+SELECT f_test_null2(NULL), f_test_null2('') IS NULL, g_test_null2(NULL), g_test_null2('') IS NULL;
+
+
+--converted types
+CREATE OR REPLACE FUNCTION f_test_timestamp1(timestamptz) RETURNS timestamptz AS 'F|ai/sedn/plunijava/Tests|test_timestamp1' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION g_test_timestamp1(timestamptz) RETURNS timestamptz AS 'G|ai/sedn/plunijava/Tests|test_timestamp1' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION f_test_epoch1(timestamptz) RETURNS bigint AS 'F|ai/sedn/plunijava/Tests|test_timestamp1|(J)J' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION f_test_date1(date) RETURNS date AS 'F|ai/sedn/plunijava/Tests|test_date1' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION f_test_uuid1(uuid) RETURNS text AS 'F|ai/sedn/plunijava/Tests|test_uuid1|(Ljava/util/UUID;)Ljava/lang/String;' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION g_test_uuid1(uuid) RETURNS text AS 'G|ai/sedn/plunijava/Tests|test_uuid1|(Ljava/util/UUID;)Ljava/lang/String;' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION f_test_uuid2(uuid) RETURNS uuid AS 'F|ai/sedn/plunijava/Tests|test_uuid2' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION f_test_numeric1(numeric, numeric) RETURNS numeric AS 'F|ai/sedn/plunijava/Tests|test_numeric1' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION g_test_numeric1(numeric, numeric) RETURNS numeric AS 'G|ai/sedn/plunijava/Tests|test_numeric1' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION f_test_jsonb1(jsonb) RETURNS jsonb AS 'F|ai/sedn/plunijava/Tests|test_jsonb1' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION g_test_jsonb1(jsonb) RETURNS jsonb AS 'G|ai/sedn/plunijava/Tests|test_jsonb1' LANGUAGE UJAVA;
+
+SELECT f_test_timestamp1('2024-01-01 00:00:00+00'), g_test_timestamp1('2024-01-01 00:00:00+00'), f_test_timestamp1('infinity');
+SELECT f_test_epoch1('1970-01-01 00:00:00+00'), f_test_date1('1999-12-31');
+SELECT f_test_uuid1('a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'), g_test_uuid1('a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11');
+SELECT f_test_uuid2('a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11');
+SELECT f_test_numeric1(1.5, 2.25), g_test_numeric1(12345678901234567890.123, 0.877);
+SELECT f_test_jsonb1('{"a": 1, "b": [true, null]}'), g_test_jsonb1('{"a": 1, "b": [true, null]}');
+
+--batched
+CREATE OR REPLACE FUNCTION v_test_batch1(float8) RETURNS float8 WINDOW AS 'V|ai/sedn/plunijava/Tests|test_batch1' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION v_test_batch2(int, int) RETURNS int WINDOW AS 'V|ai/sedn/plunijava/Tests|test_batch2' LANGUAGE UJAVA;
+
+SELECT i, v_test_batch1(i::float8) OVER () FROM generate_series(1,5) i;
+SELECT g, sum(v) FROM (SELECT i % 3 AS g, v_test_batch2(i, 1) OVER (PARTITION BY i % 3) AS v FROM generate_series(1,10000) i) s GROUP BY g ORDER BY g;
+SET pluj.batch_size = 7;
+SELECT sum(v) FROM (SELECT v_test_batch1(i::float8) OVER () AS v FROM generate_series(1,100) i) s;
+RESET pluj.batch_size;
+
+--aggregate
+CREATE OR REPLACE FUNCTION a_test_agg_trans(internal, float8) RETURNS internal AS 'A|ai/sedn/plunijava/Tests|test_agg_trans|(Lai/sedn/plunijava/TestAggState;D)Lai/sedn/plunijava/TestAggState;' LANGUAGE UJAVA PARALLEL SAFE;
+CREATE OR REPLACE FUNCTION a_test_agg_combine(internal, internal) RETURNS internal AS 'A|ai/sedn/plunijava/Tests|test_agg_combine|(Lai/sedn/plunijava/TestAggState;Lai/sedn/plunijava/TestAggState;)Lai/sedn/plunijava/TestAggState;' LANGUAGE UJAVA PARALLEL SAFE;
+CREATE OR REPLACE FUNCTION a_test_agg_serial(internal) RETURNS bytea AS 'A|ai/sedn/plunijava/Tests|test_agg_serial|(Lai/sedn/plunijava/TestAggState;)[B' LANGUAGE UJAVA STRICT PARALLEL SAFE;
+CREATE OR REPLACE FUNCTION a_test_agg_deserial(bytea, internal) RETURNS internal AS 'A|ai/sedn/plunijava/Tests|test_agg_deserial|([B)Lai/sedn/plunijava/TestAggState;' LANGUAGE UJAVA STRICT PARALLEL SAFE;
+CREATE OR REPLACE FUNCTION a_test_agg_final(internal) RETURNS float8 AS 'A|ai/sedn/plunijava/Tests|test_agg_final|(Lai/sedn/plunijava/TestAggState;)D' LANGUAGE UJAVA PARALLEL SAFE;
+CREATE AGGREGATE a_test_avg(float8) (SFUNC = a_test_agg_trans, STYPE = internal, FINALFUNC = a_test_agg_final,
+    COMBINEFUNC = a_test_agg_combine, SERIALFUNC = a_test_agg_serial, DESERIALFUNC = a_test_agg_deserial, PARALLEL = SAFE);
+
+SELECT a_test_avg(i::float8) FROM generate_series(1,10000) i;
+SELECT i % 3, a_test_avg(i::float8) FROM generate_series(1,10000) i GROUP BY 1 ORDER BY 1;
+SELECT a_test_avg(i::float8) FROM generate_series(1,0) i;
+
+--parallel
+CREATE OR REPLACE FUNCTION p_test_double1(float8) RETURNS float8 AS 'F|ai/sedn/plunijava/Tests|test_double1' LANGUAGE UJAVA PARALLEL SAFE;
+CREATE TABLE test_parallel AS SELECT i::float8 AS x FROM generate_series(1,100000) i;
+ANALYZE test_parallel;
+
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+SELECT sum(p_test_double1(x)) FROM test_parallel;
+SELECT a_test_avg(x) FROM test_parallel;
+SET pluj.parallel_delegate = on;
+SELECT sum(p_test_double1(x)) FROM test_parallel;
+RESET pluj.parallel_delegate;
+RESET max_parallel_workers_per_gather;
+RESET min_parallel_table_scan_size;
+RESET parallel_tuple_cost;
+RESET parallel_setup_cost;
+DROP TABLE test_parallel;
+
+--large array returns
+CREATE TYPE TESTMATRIX as (M float8[]);
+CREATE OR REPLACE FUNCTION f_test_matrix1(int, int) RETURNS TESTMATRIX AS 'F|ai/sedn/plunijava/Tests|test_matrix1|(II)Lai/sedn/plunijava/TestMatrix;' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION g_test_matrix1(int, int) RETURNS TESTMATRIX AS 'G|ai/sedn/plunijava/Tests|test_matrix1|(II)Lai/sedn/plunijava/TestMatrix;' LANGUAGE UJAVA;
+
+SELECT (f_test_matrix1(2,3)).M;
+SELECT array_dims((f_test_matrix1(1000,1000)).M), (f_test_matrix1(1000,1000)).M[1000][1000];
+SELECT array_dims((g_test_matrix1(1000,1000)).M), (g_test_matrix1(1000,1000)).M[1000][1000];
+
+--arrays of any rank
+CREATE OR REPLACE FUNCTION f_test_ndarray1(float8[], float8) RETURNS float8[] AS 'F|ai/sedn/plunijava/Tests|test_ndarray1|(Lai/sedn/plunijava/NDArray;D)Lai/sedn/plunijava/NDArray;' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION g_test_ndarray1(float8[], float8) RETURNS float8[] AS 'G|ai/sedn/plunijava/Tests|test_ndarray1|(Lai/sedn/plunijava/NDArray;D)Lai/sedn/plunijava/NDArray;' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION f_test_ndarray2(int[]) RETURNS bigint AS 'F|ai/sedn/plunijava/Tests|test_ndarray2|(Lai/sedn/plunijava/NDArray;)J' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION g_test_ndarray2(int[]) RETURNS bigint AS 'G|ai/sedn/plunijava/Tests|test_ndarray2|(Lai/sedn/plunijava/NDArray;)J' LANGUAGE UJAVA;
+
+SELECT f_test_ndarray1('{{{1,2},{3,4}},{{5,6},{7,8}}}'::float8[], 2.0);
+SELECT g_test_ndarray1('{{{1,2},{3,4}},{{5,6},{7,8}}}'::float8[], 2.0);
+SELECT f_test_ndarray2('{{{1,2,3},{4,5,6}}}'::int[]), g_test_ndarray2('{{{1,2,3},{4,5,6}}}'::int[]);
+CREATE OR REPLACE FUNCTION f_test_ndarray3(int[]) RETURNS int[] AS 'F|ai/sedn/plunijava/Tests|test_ndarray3|(Lai/sedn/plunijava/NDArray;)Lai/sedn/plunijava/NDArray;' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION g_test_ndarray3(int[]) RETURNS int[] AS 'G|ai/sedn/plunijava/Tests|test_ndarray3|(Lai/sedn/plunijava/NDArray;)Lai/sedn/plunijava/NDArray;' LANGUAGE UJAVA;
+
+SELECT f_test_ndarray1('{{1,NULL},{3,4}}'::float8[], 2.0), g_test_ndarray1('{{1,NULL},{3,4}}'::float8[], 2.0);
+SELECT f_test_ndarray3('{{1,0,3},{NULL,5,0}}'::int[]), g_test_ndarray3('{{1,0,3},{NULL,5,0}}'::int[]);
 
 --setof
 CREATE OR REPLACE FUNCTION f_test_setof1(TESTTYPE1[]) RETURNS SETOF TESTTYPE1 AS 'F|ai/sedn/plunijava/Tests|test_setof1|([Lai/sedn/plunijava/TestType1;)Ljava/util/Iterator;' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION b_test_setof1(TESTTYPE1[]) RETURNS SETOF TESTTYPE1 AS 'B|ai/sedn/plunijava/Tests|test_setof1|([Lai/sedn/plunijava/TestType1;)Ljava/util/Iterator;' LANGUAGE UJAVA;
+CREATE OR REPLACE FUNCTION g_test_setof1(TESTTYPE1[]) RETURNS SETOF TESTTYPE1 AS 'G|ai/sedn/plunijava/Tests|test_setof1|([Lai/sedn/plunijava/TestType1;)Ljava/util/Iterator;' LANGUAGE UJAVA;
 
 SELECT f_test_setof1(ARRAY[(1,0.1)::TESTTYPE1,(2,0.2)::TESTTYPE1,(3,0.3)::TESTTYPE1]);
+SELECT * FROM b_test_setof1(ARRAY[(1,0.1)::TESTTYPE1,(2,0.2)::TESTTYPE1,(3,0.3)::TESTTYPE1]);
+SELECT * FROM g_test_setof1(ARRAY[(1,0.1)::TESTTYPE1,(2,0.2)::TESTTYPE1,(3,0.3)::TESTTYPE1]);
 
 --Non-JDBC
 CREATE TABLE test_table1(id int, data float8[]);
@@ -114,8 +237,40 @@ CREATE OR REPLACE FUNCTION f_test_njdbc1() RETURNS SETOF TESTTYPE1 AS 'S|ai/sedn
 
 SELECT f_test_njdbc1();
 
+-- columnar batches, 16667 non-null rows of 0.5 -> 8333.5
+CREATE OR REPLACE FUNCTION f_test_njdbc2() RETURNS float8 AS 'S|ai/sedn/plunijava/Tests|test_njdbc2|()D' LANGUAGE UJAVA;
+
+SELECT f_test_njdbc2();
+
+-- adaptive fetch size, 16kB rows in fetches of 1MB -> 4501500
+CREATE OR REPLACE FUNCTION f_test_njdbc3() RETURNS float8 AS 'S|ai/sedn/plunijava/Tests|test_njdbc3|()D' LANGUAGE UJAVA;
+
+SET pluj.fetch_memory = '1MB';
+SELECT f_test_njdbc3();
+RESET pluj.fetch_memory;
+
+-- prepared statements, 100 calls of i + 3 and a count of 2 -> 5252
+CREATE OR REPLACE FUNCTION f_test_njdbc4() RETURNS int8 AS 'S|ai/sedn/plunijava/Tests|test_njdbc4|()J' LANGUAGE UJAVA;
+
+SELECT f_test_njdbc4();
+
+-- two cursors, merge join of 1..30000 and the multiples of 3 -> 10000
+CREATE OR REPLACE FUNCTION f_test_njdbc5() RETURNS int8 AS 'S|ai/sedn/plunijava/Tests|test_njdbc5|()J' LANGUAGE UJAVA;
+
+SELECT f_test_njdbc5();
+
+-- bulk insert, 100000 rows from arrays and 3 with NULL values -> 100003
+CREATE TABLE test_table2(id int8, val float8, flag bool);
+CREATE OR REPLACE FUNCTION f_test_njdbc6() RETURNS int8 AS 'S|ai/sedn/plunijava/Tests|test_njdbc6|()J' LANGUAGE UJAVA;
+
+SELECT f_test_njdbc6();
+SELECT count(*), count(val), count(flag), sum(id) FROM test_table2;
+DROP TABLE test_table2;
+
 --Cleanup
 DROP TABLE test_table1;
 DROP TYPE TESTTYPE1 CASCADE;
 DROP TYPE TESTTYPE2 CASCADE;
+DROP TYPE TESTTYPE3 CASCADE;
+DROP TYPE TESTMATRIX CASCADE;
 DROP EXTENSION PLUNIJAVA CASCADE;
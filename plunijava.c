@@ -10,6 +10,7 @@
 #include <jni.h>
 #include <dlfcn.h>
 #include <time.h>
+#include <math.h>
 #include "catalog/pg_type.h"
 #include "utils/memutils.h"
 #include "utils/snapmgr.h"
@@ -38,24 +39,39 @@
 #include "utils/syscache.h"
 #include "utils/hsearch.h"
 #include "utils/datum.h"
+#include "utils/inval.h"
+#include "access/detoast.h"
+#include "windowapi.h"
+#include "access/parallel.h"
 
 #include "storage/proc.h"
+#include "access/transam.h"
+#include "common/int.h"
+#include "utils/date.h"
+#include "utils/timestamp.h"
+#include "utils/uuid.h"
+#include "utils/numeric.h"
+#include "libpq/pqformat.h"
 
 PG_MODULE_MAGIC;
 
 worker_data_head *worker_head_user = NULL;
 worker_data_head *worker_head_global = NULL;
+dsa_area *worker_area_user = NULL;
+dsa_area *worker_area_global = NULL;
 
 HTAB *function_hash = NULL;
 
 void GetNAttributes(HeapTupleHeader tuple,
                 int16 N, 
                 Datum* datum, bool *isNull, bool *passbyval);
-int argToJava(jvalue* target, char* signature, FunctionCallInfo fcinfo, short* argprim);
+int argToJava(jvalue* target, char* signature, FunctionCallInfo fcinfo, short* argprim, java_function_cache* jcache);
 #ifdef PGXC
-int argSerializer(char* target, char* signature, Datum* args);
+int argSerializer(char* target, arg_schema* schema, int nargs, Datum* args);
+Size argSerializedSize(arg_schema* schema, int nargs, Datum* args);
 #else
-int argSerializer(char* target, char* signature, NullableDatum* args);
+int argSerializer(char* target, arg_schema* schema, int nargs, NullableDatum* args);
+Size argSerializedSize(arg_schema* schema, int nargs, NullableDatum* args);
 #endif
 
 jvalue PG_text_to_jvalue(text* txt);
@@ -80,6 +96,353 @@ void sub_timespec(struct timespec t1, struct timespec t2, struct timespec *td)
     }
 }
 */
+/*
+    Converters of PG types without a native Java counterpart. Arguments are
+    replaced by a carrier datum of the Java type before the call, results
+    are converted back after it. Both run on the backend, so background 
+    workers only see carriers.
+*/
+typedef struct {
+    const char* type_name;
+    Oid type;
+    const char* sig;
+    Datum (*to_java)(Datum dat);
+    Datum (*from_java)(Datum dat);
+} type_converter;
+
+// Offsets between the PG (2000-01-01) and the Unix epoch
+#define UNIX_EPOCH_DAYS (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE)
+#define UNIX_EPOCH_USECS ((int64) UNIX_EPOCH_DAYS * USECS_PER_DAY)
+
+// Microseconds since the Unix epoch (infinity as Long.MIN/MAX_VALUE)
+static Datum timestamp_to_java(Datum dat) {
+    Timestamp ts = DatumGetTimestamp(dat);
+
+    if(TIMESTAMP_NOT_FINITE(ts))
+        return Int64GetDatum(ts);
+    return Int64GetDatum(ts + UNIX_EPOCH_USECS);
+}
+
+static Datum timestamp_from_java(Datum dat) {
+    int64 us = DatumGetInt64(dat);
+    Timestamp ts;
+
+    if(TIMESTAMP_NOT_FINITE(us))
+        return TimestampGetDatum(us);
+    if(pg_sub_s64_overflow(us, UNIX_EPOCH_USECS, &ts) || !IS_VALID_TIMESTAMP(ts))
+        ereport(ERROR,
+            (errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+            errmsg("timestamp out of range")));
+    return TimestampGetDatum(ts);
+}
+
+// Days since the Unix epoch
+static Datum date_to_java(Datum dat) {
+    DateADT d = DatumGetDateADT(dat);
+
+    if(DATE_NOT_FINITE(d))
+        return Int32GetDatum(d);
+    return Int32GetDatum(d + UNIX_EPOCH_DAYS);
+}
+
+static Datum date_from_java(Datum dat) {
+    int32 days = DatumGetInt32(dat);
+    DateADT d;
+
+    if(DATE_NOT_FINITE(days))
+        return DateADTGetDatum(days);
+    if(pg_sub_s32_overflow(days, UNIX_EPOCH_DAYS, &d) || !IS_VALID_DATE(d))
+        ereport(ERROR,
+            (errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+            errmsg("date out of range")));
+    return DateADTGetDatum(d);
+}
+
+// 16 bytes, read as the two longs of java.util.UUID
+static Datum uuid_to_java(Datum dat) {
+    bytea* b = (bytea*) palloc(UUID_LEN + VARHDRSZ);
+
+    SET_VARSIZE(b, UUID_LEN + VARHDRSZ);
+    memcpy(VARDATA(b), DatumGetUUIDP(dat)->data, UUID_LEN);
+    return PointerGetDatum(b);
+}
+
+static Datum uuid_from_java(Datum dat) {
+    bytea* b = DatumGetByteaPP(dat);
+    pg_uuid_t* u = (pg_uuid_t*) palloc(sizeof(pg_uuid_t));
+
+    if(VARSIZE_ANY_EXHDR(b) != UUID_LEN)
+        elog(ERROR,"Java UUID result has %d bytes", (int) VARSIZE_ANY_EXHDR(b));
+    memcpy(u->data, VARDATA_ANY(b), UUID_LEN);
+    return UUIDPGetDatum(u);
+}
+
+/*
+    numeric as unscaled two's complement bytes (java.math.BigInteger) plus
+    scale, in a bytea: 4 byte big endian scale, then the unscaled value. The
+    base 10000 digits come from the binary send/recv format of numeric.
+*/
+#define NUMERIC_WIRE_POS 0x0000
+#define NUMERIC_WIRE_NEG 0x4000
+
+// Magnitude as little endian 32 bit limbs
+static void limbs_mul_add(uint32* limbs, int nlimbs, uint32 mul, uint32 add) {
+    uint64 carry = add;
+
+    for(int i = 0; i < nlimbs; i++) {
+        carry += (uint64) limbs[i] * mul;
+        limbs[i] = (uint32) carry;
+        carry >>= 32;
+    }
+}
+
+static uint32 limbs_div(uint32* limbs, int nlimbs, uint32 div) {
+    uint64 rem = 0;
+
+    for(int i = nlimbs - 1; i >= 0; i--) {
+        rem = (rem << 32) | limbs[i];
+        limbs[i] = (uint32) (rem / div);
+        rem %= div;
+    }
+    return (uint32) rem;
+}
+
+static bool limbs_zero(uint32* limbs, int nlimbs) {
+    for(int i = 0; i < nlimbs; i++) {
+        if(limbs[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+static Datum numeric_to_java(Datum dat) {
+    bytea* wire = DatumGetByteaPP( DirectFunctionCall1(numeric_send, dat) );
+    StringInfoData buf;
+    int ndigits, weight, sign, dscale, exp, nlimbs, nbytes, len;
+    uint32* limbs;
+    unsigned char* mag;
+    bytea* b;
+    unsigned char* d;
+
+    buf.data = VARDATA_ANY(wire);
+    buf.len = VARSIZE_ANY_EXHDR(wire);
+    buf.cursor = 0;
+
+    ndigits = (uint16) pq_getmsgint(&buf, sizeof(int16));
+    weight = (int16) pq_getmsgint(&buf, sizeof(int16));
+    sign = (uint16) pq_getmsgint(&buf, sizeof(int16));
+    dscale = (uint16) pq_getmsgint(&buf, sizeof(int16));
+
+    // NaN and infinity have no BigDecimal
+    if(sign != NUMERIC_WIRE_POS && sign != NUMERIC_WIRE_NEG)
+        elog(ERROR,"numeric value can not be passed as BigDecimal");
+
+    // Room for all integer and fraction digits (9 decimal digits per limb)
+    nlimbs = (4 * Max(weight + 1, 0) + dscale + 4) / 9 + 2;
+    limbs = (uint32*) palloc0(nlimbs * sizeof(uint32));
+    for(int i = 0; i < ndigits; i++) {
+        limbs_mul_add(limbs, nlimbs, 10000, (uint16) pq_getmsgint(&buf, sizeof(int16)));
+    }
+
+    // Value is limbs * 10^-exp, shift it to the display scale
+    exp = 4 * (ndigits - 1 - weight);
+    if(ndigits == 0)
+        exp = dscale;
+    for(; exp < dscale; exp++)
+        limbs_mul_add(limbs, nlimbs, 10, 0);
+    for(; exp > dscale; exp--)
+        limbs_div(limbs, nlimbs, 10);
+
+    // Big endian magnitude with a leading sign byte
+    nbytes = nlimbs * 4 + 1;
+    mag = (unsigned char*) palloc0(nbytes);
+    for(int i = 0; i < nlimbs; i++) {
+        for(int k = 0; k < 4; k++)
+            mag[nbytes - 1 - (i * 4 + k)] = (unsigned char) (limbs[i] >> (8 * k));
+    }
+    if(sign == NUMERIC_WIRE_NEG) {
+        int carry = 1;
+
+        for(int i = nbytes - 1; i >= 0; i--) {
+            int v = (unsigned char) ~mag[i] + carry;
+
+            mag[i] = (unsigned char) v;
+            carry = v >> 8;
+        }
+    }
+
+    // Minimal two's complement, as BigInteger.toByteArray()
+    len = nbytes;
+    while(len > 1 && ((mag[nbytes - len] == 0x00 && !(mag[nbytes - len + 1] & 0x80)) ||
+                      (mag[nbytes - len] == 0xFF && (mag[nbytes - len + 1] & 0x80))))
+        len--;
+
+    b = (bytea*) palloc(VARHDRSZ + 4 + len);
+    SET_VARSIZE(b, VARHDRSZ + 4 + len);
+    d = (unsigned char*) VARDATA(b);
+    d[0] = (unsigned char) (dscale >> 24);
+    d[1] = (unsigned char) (dscale >> 16);
+    d[2] = (unsigned char) (dscale >> 8);
+    d[3] = (unsigned char) dscale;
+    memcpy(d + 4, mag + nbytes - len, len);
+
+    pfree(limbs);
+    pfree(mag);
+    return PointerGetDatum(b);
+}
+
+static Datum numeric_from_java(Datum dat) {
+    bytea* b = DatumGetByteaPP(dat);
+    unsigned char* d = (unsigned char*) VARDATA_ANY(b);
+    int len = VARSIZE_ANY_EXHDR(b) - 4;
+    int32 scale;
+    bool negative;
+    int pad, nlimbs, ndigits, fdigits;
+    uint32* limbs;
+    int16* digits;
+    StringInfoData buf;
+
+    if(len < 1)
+        elog(ERROR,"Java BigDecimal result has no unscaled value");
+
+    scale = (int32) (((uint32) d[0] << 24) | ((uint32) d[1] << 16) | ((uint32) d[2] << 8) | d[3]);
+    d += 4;
+    negative = (d[0] & 0x80) != 0;
+
+    if(scale < -NUMERIC_MAX_PRECISION || scale > NUMERIC_MAX_DISPLAY_SCALE)
+        elog(ERROR,"Java BigDecimal result with scale %d is out of the numeric range", scale);
+
+    // Align the decimal point to a base 10000 digit
+    pad = (scale < 0) ? -scale : (4 - scale % 4) % 4;
+
+    nlimbs = len / 4 + 2 + pad / 9 + 1;
+    limbs = (uint32*) palloc0(nlimbs * sizeof(uint32));
+    for(int i = 0; i < len; i++) {
+        unsigned char c = negative ? (unsigned char) ~d[i] : d[i];
+
+        limbs_mul_add(limbs, nlimbs, 256, c);
+    }
+    // One's complement plus one is the magnitude
+    if(negative)
+        limbs_mul_add(limbs, nlimbs, 1, 1);
+    for(int i = 0; i < pad; i++)
+        limbs_mul_add(limbs, nlimbs, 10, 0);
+    if(scale < 0)
+        scale = 0;
+
+    // Base 10000 digits, least significant first
+    digits = (int16*) palloc(nlimbs * 3 * sizeof(int16));
+    ndigits = 0;
+    while(!limbs_zero(limbs, nlimbs))
+        digits[ndigits++] = (int16) limbs_div(limbs, nlimbs, 10000);
+    fdigits = (scale + 3) / 4;
+
+    initStringInfo(&buf);
+    pq_sendint16(&buf, ndigits);
+    pq_sendint16(&buf, (ndigits > 0) ? ndigits - 1 - fdigits : 0);
+    pq_sendint16(&buf, negative ? NUMERIC_WIRE_NEG : NUMERIC_WIRE_POS);
+    pq_sendint16(&buf, scale);
+    for(int i = ndigits - 1; i >= 0; i--)
+        pq_sendint16(&buf, digits[i]);
+
+    pfree(limbs);
+    pfree(digits);
+
+    return DirectFunctionCall3(numeric_recv, PointerGetDatum(&buf), ObjectIdGetDatum(InvalidOid), Int32GetDatum(-1));
+}
+
+// JSON text as UTF-8 bytes (no java.lang.String round trip)
+static Datum jsonb_to_java(Datum dat) {
+    char* json = DatumGetCString( DirectFunctionCall1(jsonb_out, dat) );
+    int len = strlen(json);
+    bytea* b = (bytea*) palloc(len + VARHDRSZ);
+
+    SET_VARSIZE(b, len + VARHDRSZ);
+    memcpy(VARDATA(b), json, len);
+    pfree(json);
+    return PointerGetDatum(b);
+}
+
+static Datum jsonb_from_java(Datum dat) {
+    bytea* b = DatumGetByteaPP(dat);
+    int len = VARSIZE_ANY_EXHDR(b);
+    char* json = (char*) palloc(len + 1);
+
+    memcpy(json, VARDATA_ANY(b), len);
+    json[len] = '\0';
+    return DirectFunctionCall1(jsonb_in, CStringGetDatum(json));
+}
+
+// pgvector as float[]
+static Datum vector_to_java(Datum dat) {
+    Vector* vec = (Vector*) PG_DETOAST_DATUM(dat);
+    ArrayType* v = createArray(vec->dim, sizeof(float), FLOAT4OID, false);
+
+    memcpy(ARR_DATA_PTR(v), vec->x, vec->dim * sizeof(float));
+    return PointerGetDatum(v);
+}
+
+static Datum vector_from_java(Datum dat) {
+    ArrayType* v = DatumGetArrayTypeP(dat);
+    int dim = ArrayGetNItems(ARR_NDIM(v), ARR_DIMS(v));
+    float* x = (float*) ARR_DATA_PTR(v);
+    Vector* vec;
+
+    if(ARR_HASNULL(v) || dim < 1 || dim > PG_INT16_MAX)
+        elog(ERROR,"Java float[] result of %d elements is not a valid vector", dim);
+
+    vec = (Vector*) palloc0(offsetof(Vector, x) + dim * sizeof(float));
+    SET_VARSIZE(vec, offsetof(Vector, x) + dim * sizeof(float));
+    vec->dim = dim;
+    for(int i = 0; i < dim; i++) {
+        if(isnan(x[i]) || isinf(x[i]))
+            elog(ERROR,"NaN and infinity are not allowed in vector");
+        vec->x[i] = x[i];
+    }
+    return PointerGetDatum(vec);
+}
+
+static type_converter type_converters[] = {
+    {"timestamptz", TIMESTAMPTZOID, "J", timestamp_to_java, timestamp_from_java},
+    {"timestamp", TIMESTAMPOID, "J", timestamp_to_java, timestamp_from_java},
+    {"date", DATEOID, "I", date_to_java, date_from_java},
+    {"uuid", UUIDOID, UUID_SIG, uuid_to_java, uuid_from_java},
+    {"numeric", NUMERICOID, BIGDECIMAL_SIG, numeric_to_java, numeric_from_java},
+    {"jsonb", JSONBOID, "[B", jsonb_to_java, jsonb_from_java},
+    // Extension types are matched by name
+    {"vector", InvalidOid, "[F", vector_to_java, vector_from_java},
+};
+
+/*
+    Index of the converter of a PG type (-1 if there is none)
+*/
+static int converter_for_type(Oid type) {
+    HeapTuple tuple;
+    int conv = -1;
+
+    for(int i = 0; i < lengthof(type_converters); i++) {
+        if(type_converters[i].type == type)
+            return i;
+    }
+
+    if(type < FirstNormalObjectId)
+        return -1;
+
+    tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(type));
+    if(!HeapTupleIsValid(tuple))
+        return -1;
+
+    for(int i = 0; i < lengthof(type_converters); i++) {
+        if(type_converters[i].type == InvalidOid && strcmp(NameStr(((Form_pg_type) GETSTRUCT(tuple))->typname), type_converters[i].type_name) == 0) {
+            conv = i;
+            break;
+        }
+    }
+    ReleaseSysCache(tuple);
+
+    return conv;
+}
+
 static char* pgtype_to_java(Oid type) {
     switch(type) {
         case VOIDOID:
@@ -100,9 +463,177 @@ static char* pgtype_to_java(Oid type) {
             return "D";
         case TEXTOID:
             return "Ljava/lang/String;";
-        default:
-            return "O";
+        default: {
+            int conv = converter_for_type(type);
+
+            return (conv >= 0) ? (char*) type_converters[conv].sig : "O";
+        }
+    }
+}
+
+/*
+    End of the signature token starting at p
+*/
+static const char* signature_token_end(const char* p) {
+    while(*p == '[')
+        p++;
+    if(*p == 'L') {
+        const char* end = strchr(p, ';');
+        return (end != NULL) ? end + 1 : p + strlen(p);
     }
+    return (*p != '\0') ? p + 1 : p;
+}
+
+/*
+    Converter of a PG type, if the signature token p..end uses its Java type
+    (batched functions take arrays of it)
+*/
+static short converter_for_token(Oid type, const char* p, const char* end, bool batched) {
+    int conv = converter_for_type(type);
+
+    if(conv < 0)
+        return -1;
+    if(batched && *p == '[')
+        p++;
+    if(strlen(type_converters[conv].sig) != end - p || strncmp(p, type_converters[conv].sig, end - p) != 0)
+        return -1;
+    return conv;
+}
+
+/*
+    Resolve the converters of arguments and return of a function entry
+*/
+static void setup_type_converters(control_entry* centry, Form_pg_proc fstruct) {
+    bool batched = (centry->mode[0] == 'V');
+    const char* p = strchr(centry->signature, '(');
+    const char* rsig = strrchr(centry->signature, ')');
+    int nargs = fstruct->pronargs;
+
+    centry->has_arg_conv = false;
+    centry->arg_conv = (short*) malloc(Max(nargs, 1) * sizeof(short));
+    for(int i = 0; i < nargs; i++) {
+        const char* end;
+
+        centry->arg_conv[i] = -1;
+        if(p == NULL || *(++p) == ')' || *p == '\0') {
+            p = NULL;
+            continue;
+        }
+
+        end = signature_token_end(p);
+        centry->arg_conv[i] = converter_for_token(fstruct->proargtypes.values[i], p, end, batched);
+        if(centry->arg_conv[i] >= 0)
+            centry->has_arg_conv = true;
+        p = end - 1;
+    }
+
+    centry->ret_conv = -1;
+    if(rsig != NULL) {
+        rsig++;
+        centry->ret_conv = converter_for_token(fstruct->prorettype, rsig, rsig + strlen(rsig), batched);
+        if(centry->ret_conv < 0 && converter_for_type(fstruct->prorettype) >= 0) {
+            // Other Java type in a manual signature: not converted
+            centry->return_type = "O";
+        }
+    }
+}
+
+/*
+    Replace arguments of converted PG types by their carrier datums
+*/
+static void convert_arg_values(FunctionCallInfo fcinfo, short* conv) {
+    for(int i = 0; i < fcinfo->nargs; i++) {
+        if(conv[i] < 0 || PG_ARGISNULL(i))
+            continue;
+#ifdef PGXC
+        fcinfo->arg[i] = type_converters[conv[i]].to_java(fcinfo->arg[i]);
+#else
+        fcinfo->args[i].value = type_converters[conv[i]].to_java(fcinfo->args[i].value);
+#endif
+    }
+}
+
+/*
+    Arguments for the Java call: fcinfo itself, or a copy in cargs with
+    carriers of converted PG types (fcinfo is left to the executor)
+*/
+static FunctionCallInfo carrier_args(FunctionCallInfo fcinfo, FunctionCallInfo cargs, control_entry* centry) {
+    if(!centry->has_arg_conv)
+        return fcinfo;
+
+#ifdef PGXC
+    *cargs = *fcinfo;
+#else
+    memcpy(cargs, fcinfo, SizeForFunctionCallInfo(fcinfo->nargs));
+#endif
+    convert_arg_values(cargs, centry->arg_conv);
+
+    return cargs;
+}
+
+/*
+    Role of an aggregate support function, derived from its internal 
+    arguments and return
+*/
+static char agg_function_kind(Form_pg_proc fstruct) {
+    Oid* argtypes = fstruct->proargtypes.values;
+    int nargs = fstruct->pronargs;
+
+    if(fstruct->prorettype == INTERNALOID) {
+        if(nargs == 2 && argtypes[0] == BYTEAOID && argtypes[1] == INTERNALOID)
+            return AGG_DESERIAL;
+        if(nargs == 2 && argtypes[0] == INTERNALOID && argtypes[1] == INTERNALOID)
+            return AGG_COMBINE;
+        if(nargs >= 1 && argtypes[0] == INTERNALOID)
+            return AGG_TRANS;
+    } else if(nargs >= 1 && argtypes[0] == INTERNALOID) {
+        if(nargs == 1 && fstruct->prorettype == BYTEAOID)
+            return AGG_SERIAL;
+        return AGG_FINAL;
+    }
+
+    elog(ERROR,"Aggregate (A) Java functions require an internal state argument");
+    return 0;
+}
+
+/*
+    Invalidate cached function entries on pg_proc changes
+*/
+static void function_cache_invalidate(Datum arg, int cacheid, uint32 hashvalue)
+{
+    HASH_SEQ_STATUS status;
+    control_entry* centry;
+
+    if(function_hash == NULL)
+        return;
+
+    hash_seq_init(&status, function_hash);
+    while((centry = (control_entry *) hash_seq_search(&status)) != NULL) {
+        if(hashvalue == 0 || centry->fn_hashvalue == hashvalue)
+            centry->valid = false;
+    }
+}
+
+/*
+    Release data held by a cached function entry
+*/
+static void function_cache_release(control_entry* centry)
+{
+    release_java_function_cache(&centry->jcache);
+
+    free(centry->mode);
+    free(centry->class_name);
+    free(centry->method_name);
+    free(centry->signature);
+    free(centry->arg_conv);
+    free(centry->payload_schema);
+
+    centry->mode = NULL;
+    centry->class_name = NULL;
+    centry->method_name = NULL;
+    centry->signature = NULL;
+    centry->arg_conv = NULL;
+    centry->payload_schema = NULL;
 }
 
 static Datum java_func_handler(PG_FUNCTION_ARGS)
@@ -134,12 +665,24 @@ static Datum java_func_handler(PG_FUNCTION_ARGS)
         oldctx = MemoryContextSwitchTo(TopMemoryContext);
         function_hash = hash_create("function control cache", 128, &ctl, HASH_ELEM | HASH_CONTEXT | HASH_BLOBS);
         MemoryContextSwitchTo(oldctx);
+
+        // Drop cached entries if function definitions change
+        CacheRegisterSyscacheCallback(PROCOID, function_cache_invalidate, (Datum) 0);
     }
 
     // Lookup in cache
     oldctx = MemoryContextSwitchTo(TopMemoryContext);
     centry = (control_entry *) hash_search(function_hash, (void *) &fid, HASH_ENTER, &found);
     
+    if (!found) {
+        // Clear all but key
+        memset(((char*) centry) + sizeof(Oid), 0, sizeof(control_entry) - sizeof(Oid));
+    } else if(!centry->valid) {
+        // Function was replaced or setup failed before: rebuild entry
+        function_cache_release(centry);
+        found = false;
+    }
+
     if (!found) {
         //elog(WARNING,"CENTRY NOT FOUND: %d",fid);
         char* token;
@@ -151,6 +694,8 @@ static Datum java_func_handler(PG_FUNCTION_ARGS)
         if (!HeapTupleIsValid(tuple))
                 elog(ERROR, "cache lookup failed for function %u",fid);
 
+        centry->fn_hashvalue = GetSysCacheHashValue1(PROCOID, ObjectIdGetDatum(fid));
+
         fstruct = (Form_pg_proc) GETSTRUCT(tuple);
         ret = SysCacheGetAttr(PROCOID, tuple, Anum_pg_proc_prosrc, &isnull);
         
@@ -163,11 +708,14 @@ static Datum java_func_handler(PG_FUNCTION_ARGS)
 
         // Infer return type
         centry->return_type = pgtype_to_java(fstruct->prorettype);
+        centry->agg_kind = 0;
 
         token = strtok(source, "|");
         
         if(token != NULL) {
             centry->mode = (char*) strdup(token);
+            if(centry->mode[0] == 'A')
+                centry->agg_kind = agg_function_kind(fstruct);
             
             // ToDo: Re-order
             token = strtok(0,"|");
@@ -199,7 +747,7 @@ static Datum java_func_handler(PG_FUNCTION_ARGS)
                         
                         numargs = get_func_arg_info(tuple, &argtypes, &argnames, &argmodes);
                         
-                        centry->signature = palloc(512);
+                        centry->signature = malloc(512);
                         centry->signature[0] = '(';
                         pos = 1;
                         for (int i = 0; i < numargs; i++)
@@ -212,17 +760,37 @@ static Datum java_func_handler(PG_FUNCTION_ARGS)
                                 elog(ERROR,"Argument type requires manual specification of Java signature");
                             }
                             
-                            // Build signature
+                            // Build signature (batched functions take arrays)
+                            if(centry->mode[0] == 'V') {
+                                centry->signature[pos] = '[';
+                                pos++;
+                            }
                             len = strlen(type);
-                            memcpy(&centry->signature[pos],type,strlen(centry->return_type));
+                            memcpy(&centry->signature[pos],type,len);
                             pos += len;
                         }
                         
                         centry->signature[pos] = ')';
                         pos++;
                         // Return type
+                        if(centry->mode[0] == 'V') {
+                            centry->signature[pos] = '[';
+                            pos++;
+                        }
                         memcpy(&centry->signature[pos],centry->return_type,strlen(centry->return_type)+1);
                     }
+
+                    // Boxed return (Java null is SQL NULL), NDArray for arrays of any rank
+                    {
+                        char* rsig = strrchr(centry->signature, ')');
+                        if(rsig != NULL && boxed_signature(rsig + 1) != NULL)
+                            centry->return_type = (char*) boxed_signature(rsig + 1);
+                        else if(rsig != NULL && strcmp(rsig + 1, NDARRAY_SIG) == 0)
+                            centry->return_type = NDARRAY_SIG;
+                    }
+
+                    // Converters apply where the signature uses their Java type
+                    setup_type_converters(centry, fstruct);
                 
                 } else {
                     elog(ERROR,"No method name supplied");
@@ -237,29 +805,46 @@ static Datum java_func_handler(PG_FUNCTION_ARGS)
         }
         
         ReleaseSysCache(tuple);
+        pfree(source);
+
+        centry->valid = true;
     }
 
+    // Results are allocated in the caller's context
+    MemoryContextSwitchTo(oldctx);
+
     //elog(WARNING,"mode: %s",centry->mode);
     //elog(WARNING,"class: %s",centry->class_name);
     //elog(WARNING,"sig: %s",centry->signature);
     //elog(WARNING,"ret: %s",centry->return_type);
     
-    if(centry->mode[0] == 'F') {
+    if(centry->mode[0] == 'F' && IsParallelWorker() && pluj_parallel_delegate) {
+        // Parallel query worker: use the shared JVM of the global pool
+        ret = control_bgworkers(fcinfo, pluj_max_workers, false, true, centry);
+    } else if(centry->mode[0] == 'F') {
         // Foreground without SPI
-        ret = control_fgworker(fcinfo, false, centry->class_name, centry->method_name, centry->signature, centry->return_type);
+        ret = control_fgworker(fcinfo, false, centry);
     } else if(centry->mode[0] == 'S') {
         // Foreground with SPI
-        ret = control_fgworker(fcinfo, true, centry->class_name, centry->method_name, centry->signature, centry->return_type);   
+        ret = control_fgworker(fcinfo, true, centry);   
     } else if(centry->mode[0] == 'G') {
         // Background global (NO SPI)
-        ret = control_bgworkers(fcinfo, MAX_WORKERS, false, true, centry->class_name, centry->method_name, centry->signature, centry->return_type);
+        ret = control_bgworkers(fcinfo, pluj_max_workers, false, true, centry);
     } else if(centry->mode[0] == 'B') {
         // Background with SPI
-        ret = control_bgworkers(fcinfo, MAX_WORKERS, true, false, centry->class_name, centry->method_name, centry->signature, centry->return_type);
+        ret = control_bgworkers(fcinfo, pluj_max_workers, true, false, centry);
+    } else if(centry->mode[0] == 'A') {
+        // Foreground aggregate support function
+        ret = control_fgworker_agg(fcinfo, centry);
+    } else if(centry->mode[0] == 'V') {
+        // Foreground batched over a window partition
+        ret = control_fgworker_batch(fcinfo, centry);
     } else 
         elog(ERROR,"Not supported worker type: %s",centry->mode);
-    
-    MemoryContextSwitchTo(oldctx);
+
+    // Results of converted PG types arrive as carriers
+    if(centry->ret_conv >= 0 && !fcinfo->isnull)
+        ret = type_converters[centry->ret_conv].from_java(ret);
 
     PG_RETURN_DATUM( ret );   
 }
@@ -287,39 +872,190 @@ Datum java_call_handler(PG_FUNCTION_ARGS)
     return ret;
 }
 
+/*
+    Materialize the rows a bg worker streams for a SETOF function. The two
+    chunk buffers are consumed in turn, each one is handed back to the 
+    worker right after its rows went to the tuplestore.
+*/
+static void collect_bgworker_setof(worker_data_head* worker_head, dsa_area* area, worker_exec_entry* entry, ReturnSetInfo* rsinfo, TupleDesc tupdesc) {
+    MemoryContext per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+    MemoryContext oldcontext;
+    MemoryContext chunkctx;
+    Tuplestorestate *tupstore;
+    int natts = tupdesc->natts;
+    Datum values[natts];
+    bool nulls[natts];
+    volatile bool finished = false;
+    int chunk = 0;
+
+    oldcontext = MemoryContextSwitchTo(per_query_ctx);
+    tupstore = tuplestore_begin_heap(false, false, work_mem);
+    rsinfo->setResult = tupstore;
+    rsinfo->returnMode = SFRM_Materialize;
+    MemoryContextSwitchTo(oldcontext);
+
+    chunkctx = AllocSetContextCreate(CurrentMemoryContext, "plunijava setof chunk", ALLOCSET_DEFAULT_SIZES);
+
+    PG_TRY();
+    {
+        while(!finished) {
+            bool full;
+            bool last;
+            bool error;
+            int rows;
+            char* data;
+            Latch* worker_latch;
+
+            SpinLockAcquire(&worker_head->lock);
+            full = entry->chunk_state[chunk] == CHUNK_FULL;
+            rows = entry->chunk_rows[chunk];
+            last = entry->chunk_last[chunk];
+            error = entry->chunk_error[chunk];
+            SpinLockRelease(&worker_head->lock);
+
+            if(!full) {
+                int ev = WaitLatch(MyLatch,
+                                WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+                                1 * 1000L,
+                                PG_WAIT_EXTENSION);
+                ResetLatch(MyLatch);
+                if (ev & WL_POSTMASTER_DEATH)
+                    elog(FATAL, "unexpected postmaster dead");
+                
+                CHECK_FOR_INTERRUPTS();
+                continue;
+            }
+
+            data = (char*) dsa_get_address(area, entry->chunk_data[chunk]);
+
+            // Process error message
+            if(error) {
+                char* msg = pstrdup( (data != NULL) ? data : "Unknown error occured in bg worker" );
+
+                // Put to free list
+                finished = true;
+                release_exec_entry(worker_head, area, entry);
+
+                elog(ERROR,"%s",msg);
+            }
+
+            oldcontext = MemoryContextSwitchTo(chunkctx);
+            for(int r = 0; r < rows; r++) {
+                for(int i = 0; i < natts; i++) {
+                    values[i] = datumDeSerialize(&data, &nulls[i]);
+                }
+                tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+            }
+            MemoryContextSwitchTo(oldcontext);
+            MemoryContextReset(chunkctx);
+
+            if(last) {
+                finished = true;
+                release_exec_entry(worker_head, area, entry);
+            } else {
+                SpinLockAcquire(&worker_head->lock);
+                entry->chunk_state[chunk] = CHUNK_EMPTY;
+                worker_latch = entry->worker_latch;
+                SpinLockRelease(&worker_head->lock);
+                
+                SetLatch(worker_latch);
+            }
+
+            chunk = 1 - chunk;
+        }
+    }
+    PG_CATCH();
+    {
+        // Cancelled query: let the worker stop streaming and release the entry
+        if(!finished) {
+            Latch* worker_latch;
+            bool worker_done;
+
+            SpinLockAcquire(&worker_head->lock);
+            worker_done = entry->worker_done;
+            if(!worker_done)
+                entry->cancelled = true;
+            worker_latch = entry->worker_latch;
+            SpinLockRelease(&worker_head->lock);
+
+            if(worker_done)
+                release_exec_entry(worker_head, area, entry);
+            else if(worker_latch != NULL)
+                SetLatch(worker_latch);
+        }
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    MemoryContextDelete(chunkctx);
+}
+
 /*
     Main function to deliver tasks to bg workers and collect results
 */
-Datum control_bgworkers(FunctionCallInfo fcinfo, int n_workers, bool need_SPI, bool globalWorker, char* class_name, char* method_name, char* signature, char* return_type) {
+Datum control_bgworkers(FunctionCallInfo fcinfo, int n_workers, bool need_SPI, bool globalWorker, control_entry* centry) {
+    char* class_name = centry->class_name;
+    char* method_name = centry->method_name;
+    char* signature = centry->signature;
+    char* return_type = centry->return_type;
     ReturnSetInfo   *rsinfo       = (ReturnSetInfo *) fcinfo->resultinfo;
     TupleDesc tupdesc; 
     int rtype = get_call_result_type(fcinfo, NULL, &tupdesc);
     int natts;
     bool* nulls;
+    int slot;
 
     worker_data_head *worker_head;
+    dsa_area *area;
+
+    // Payload schema, parsed once per function
+    if(centry->payload_schema == NULL) {
+        char error_msg[128];
+        int n = build_arg_schema(signature, &centry->payload_schema, error_msg);
+
+        if(n < 0)
+            elog(ERROR,"%s",error_msg);
+        centry->n_payload_args = n;
+    }
 
     // Start workers if not started yet
     if(globalWorker) {
         if(worker_head_global == NULL || worker_head_global->n_workers == 0) {
-            worker_head_global = launch_dynamic_workers(n_workers, need_SPI, globalWorker);
+            worker_head_global = launch_dynamic_workers(n_workers, need_SPI, globalWorker, &worker_area_global);
             pg_usleep(5000L);		/* 5msec */
         }
         worker_head = worker_head_global;
+        area = worker_area_global;
     } else {
+        // Slot of the pool was given to another role/database
+        if(worker_head_user != NULL && (worker_head_user->roleid != GetUserId() || worker_head_user->dbid != MyDatabaseId)) {
+            worker_head_user = NULL;
+            if(worker_area_user != NULL) {
+                dsa_detach(worker_area_user);
+                worker_area_user = NULL;
+            }
+        }
         if(worker_head_user == NULL || worker_head_user->n_workers == 0) {
-            worker_head_user = launch_dynamic_workers(n_workers, need_SPI, globalWorker);
+            worker_head_user = launch_dynamic_workers(n_workers, need_SPI, globalWorker, &worker_area_user);
             pg_usleep(5000L);		/* 5msec */
         }
         worker_head = worker_head_user; 
+        area = worker_area_user;
     }
 
     // Prepare return tuple
-    if(rsinfo != NULL)
+    if(rsinfo != NULL) {
+        if(!IsA(rsinfo, ReturnSetInfo) || !(rsinfo->allowedModes & SFRM_Materialize))
             ereport(ERROR,
                 (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
                 errmsg("function returning set called in context "
                         "that cannot accept type set")));
+        
+        if(rtype != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                errmsg("function returning set of non-composite type not supported")));
+    }
     
     if(rtype == TYPEFUNC_COMPOSITE) {
         tupdesc = BlessTupleDesc(tupdesc);
@@ -331,341 +1067,827 @@ Datum control_bgworkers(FunctionCallInfo fcinfo, int n_workers, bool need_SPI, b
 
     nulls = palloc0( natts * sizeof( bool ) );
     
-    SpinLockAcquire(&worker_head->lock);
-    /*
-        Lock acquired
-    */      
-    if(!dlist_is_empty(&worker_head->free_list)) {
-        dlist_iter    iter;
-        bool got_signal = false;
-     
-        dlist_node* dnode = dlist_pop_head_node(&worker_head->free_list);
-        worker_exec_entry* entry = dlist_container(worker_exec_entry, node, dnode);
+    slot = task_ring_pop(FREE_RING(worker_head));
+    if(slot >= 0) {
+        // Entry is owned until pushed to the exec ring
+        worker_exec_entry* entry = &worker_head->list_data[slot];
 
         strncpy(entry->class_name, class_name, strlen(class_name)+1);
         strncpy(entry->method_name, method_name, strlen(method_name)+1);
         strncpy(entry->signature, signature, strlen(signature)+1);
-        strncpy(entry->return_type, return_type, 1);
+        strlcpy(entry->return_type, return_type, sizeof(entry->return_type));
         
+        entry->fn_oid = centry->fn_oid;
         entry->n_return = natts;
         entry->notify_latch = MyLatch;
-
+        entry->error = false;
+        entry->setof = (rsinfo != NULL);
+        entry->cancelled = false;
+        entry->worker_done = false;
+        entry->worker_latch = NULL;
+        pg_atomic_write_u32(&entry->state, TASK_PENDING);
+        entry->chunk_state[0] = entry->chunk_state[1] = CHUNK_EMPTY;
+        entry->chunk_last[0] = entry->chunk_last[1] = false;
+        entry->chunk_error[0] = entry->chunk_error[1] = false;
+
+        // Serialize arguments into a payload of matching size
+        PG_TRY();
+        {
+#ifdef PGXC
+            FunctionCallInfoData cargsdata;
+            FunctionCallInfo cargs = &cargsdata;
+#else
+            LOCAL_FCINFO(cargs, FUNC_MAX_ARGS);
+#endif
+            FunctionCallInfo afcinfo = carrier_args(fcinfo, cargs, centry);
 #ifdef PGXC        
-        entry->n_args = argSerializer(entry->data, signature, &fcinfo->arg[0] );
+            Datum* args = &afcinfo->arg[0];
 #else
-        entry->n_args = argSerializer(entry->data, signature, &fcinfo->args[0] );
+            NullableDatum* args = &afcinfo->args[0];
 #endif
+            Size size;
+            char* data;
 
-        // Push
-        dlist_push_tail(&worker_head->exec_list,&entry->node);
-    
-        for(int w = 0; w < worker_head->n_workers; w++) {
-            SetLatch( worker_head->latch[w] );
+            if(afcinfo->nargs != centry->n_payload_args)
+                elog(ERROR,"Java function signature has %d arguments, the function %d", centry->n_payload_args, afcinfo->nargs);
+
+            size = argSerializedSize(centry->payload_schema, afcinfo->nargs, args);
+            data = alloc_entry_data(area, entry, size);
+
+            if(data == NULL)
+                ereport(ERROR,
+                    (errcode(ERRCODE_OUT_OF_MEMORY),
+                    errmsg("could not allocate %zu bytes for bg worker arguments", size)));
+
+            entry->n_args = argSerializer(data, centry->payload_schema, afcinfo->nargs, args);
+        }
+        PG_CATCH();
+        {
+            release_exec_entry(worker_head, area, entry);
+            PG_RE_THROW();
         }
+        PG_END_TRY();
 
-        SpinLockRelease(&worker_head->lock);
-        /*
-            Lock released
-        */    
+        // Push (cannot fail, the ring holds every slot)
+        task_ring_push(EXEC_RING(worker_head), entry->taskid);
+    
+        wake_idle_worker(worker_head);
 
-        // Wait for return
-        while(!got_signal)
-	    {
-            worker_exec_entry* ret;
-           
-            SpinLockAcquire(&worker_head->lock);
-        
-            if (dlist_is_empty(&worker_head->return_list))
+        // Rows arrive in chunks
+        if(rsinfo != NULL) {
+            pfree(nulls);
+            collect_bgworker_setof(worker_head, area, entry, rsinfo, tupdesc);
+            PG_RETURN_NULL();
+        }
+
+        // Wait for the worker to mark the task done
+        PG_TRY();
+        {
+            while(pg_atomic_read_u32(&entry->state) != TASK_DONE)
             {
-                int ev;
-                SpinLockRelease(&worker_head->lock);
-                ev = WaitLatch(MyLatch,
-                                WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-                                1 * 1000L,
+                int ev = WaitLatch(MyLatch,
+                                WL_LATCH_SET | WL_POSTMASTER_DEATH,
+                                -1L,
                                 PG_WAIT_EXTENSION);
                 ResetLatch(MyLatch);
                 if (ev & WL_POSTMASTER_DEATH)
                     elog(FATAL, "unexpected postmaster dead");
                 
                 CHECK_FOR_INTERRUPTS();
-                continue;
             }
+        }
+        PG_CATCH();
+        {
+            // Cancelled query: the worker releases the entry once done
+            if(pg_atomic_exchange_u32(&entry->state, TASK_ABANDONED) == TASK_DONE)
+                release_exec_entry(worker_head, area, entry);
+            PG_RE_THROW();
+        }
+        PG_END_TRY();
+
+        // Results were written before the state flipped
+        pg_read_barrier();
+
+        {
+            char* data = (char*) dsa_get_address(area, entry->data);
+            Datum values[entry->n_return];
+            bool ret_null = entry->ret_null;
+            
+            // Process error message
+            if(entry->error) {
+                // Copy message
+                char* buf = pstrdup( (data != NULL) ? data : "Unknown error occured in bg worker" );
+
+                pfree(nulls);
+                
+                // Put to free ring 
+                release_exec_entry(worker_head, area, entry);
+
+                // Throw
+                elog(ERROR,"%s",buf);
+            }
+
+            // Prep return
+            for(int i = 0; i < entry->n_return; i++) {
+                values[i] = datumDeSerialize(&data, &nulls[i]);
+            }
+            
+            // Cleanup
+            release_exec_entry(worker_head, area, entry);
+
+            // Java null (scalar or whole composite) is SQL NULL
+            if(ret_null) {
+                pfree(nulls);
+                PG_RETURN_NULL();
+            } else if(tupdesc != NULL) {
+                HeapTuple tuple = heap_form_tuple(tupdesc, values, nulls);             
+                pfree(nulls);
+                PG_RETURN_DATUM( HeapTupleGetDatum(tuple ));    
+            } else {
+                pfree(nulls);
+                PG_RETURN_DATUM( values[0] );
+            }
+        }
+
+    } else {
+        pfree(nulls);
+        elog(ERROR,"BG worker task queue is full");
+    }
+
+    PG_RETURN_NULL();
+}
+
+/*
+    Upper bound of the bytes argSerializer writes for the given arguments
+*/
+#ifdef PGXC
+Size argSerializedSize(arg_schema* schema, int nargs, Datum* args) {
+#else
+Size argSerializedSize(arg_schema* schema, int nargs, NullableDatum* args) {
+#endif
+    Size size = ARG_NULLMAP_SIZE(nargs);
+
+    for(int ac = 0; ac < nargs; ac++) {
+        Datum argu = args[ac].value;
+
+        // Only the null bit is sent
+        if(args[ac].isnull)
+            continue;
+
+        switch(schema[ac].kind) {
+            case ARG_PRIMITIVE:
+            case ARG_BOXED:
+                size += sizeof(Datum);
+                break;
+            case ARG_COMPOSITE: {
+                HeapTupleHeader t = DatumGetHeapTupleHeader(argu);
+                size += MAXALIGN(HeapTupleHeaderGetDatumLength(t) + HeapTupleHeaderGetNatts(t) * (sizeof(int) + sizeof(Datum)));
+                break;
+            }
+            case ARG_COMPOSITE_ARRAY: {
+                ArrayType* v = DatumGetArrayTypeP(argu);
+                TupleDesc td = lookup_rowtype_tupdesc(ARR_ELEMTYPE(v), -1);
+                size += MAXALIGN(sizeof(int) + ARR_SIZE(v) + (Size) ArrayGetNItems(ARR_NDIM(v), ARR_DIMS(v)) * td->natts * (sizeof(int) + sizeof(Datum)));
+                ReleaseTupleDesc(td);
+                break;
+            }
+            default:
+                // Detoasted varlena
+                size += MAXALIGN(toast_raw_datum_size(argu));
+        }
+    }
+
+    return size;
+}
+
+/*
+    Serialize the attributes of a composite datum
+*/
+static char* composite_serialize(Datum dat, char* target) {
+    HeapTupleHeader t = DatumGetHeapTupleHeader(dat);
+    int16 Na = (int16) HeapTupleHeaderGetNatts( t );
+    Datum attr[Na];
+    bool isnull[Na];
+    bool passbyval[Na];
+
+    GetNAttributes(t, Na, attr, isnull, passbyval);
+    for(int a = 0; a < Na; a++) {  
+        datumSerialize(attr[a], isnull[a], passbyval[a], -1, &target); // getTupleBassBy slow !
+    }
+
+    return target;
+}
+
+/*
+    Serialize function arguments into the binary payload of a background 
+    task (layout in plunijava_worker.h)
+*/
+#ifdef PGXC
+int argSerializer(char* target, arg_schema* schema, int nargs, Datum* args) {
+#else
+int argSerializer(char* target, arg_schema* schema, int nargs, NullableDatum* args) {
+#endif
+    bits8* nullmap = (bits8*) target;
+
+    memset(target, 0, ARG_NULLMAP_SIZE(nargs));
+    target += ARG_NULLMAP_SIZE(nargs);
+
+    for(int ac = 0; ac < nargs; ac++) {
+        Datum argu = args[ac].value;
+
+        if(args[ac].isnull) {
+            if(schema[ac].kind == ARG_PRIMITIVE)
+                elog(ERROR,"NULL passed for primitive Java argument %d (declare the function STRICT or use a boxed type)", ac+1);
+
+            nullmap[ac / 8] |= 1 << (ac % 8);
+            continue;
+        }
+
+        switch(schema[ac].kind) {
+            case ARG_PRIMITIVE:
+            case ARG_BOXED:
+                // Boxed primitives are boxed by the worker
+                *((Datum*) target) = argu;
+                target += sizeof(Datum);
+                break;
+            case ARG_COMPOSITE:
+                target = (char*) MAXALIGN( composite_serialize(argu, target) );
+                break;
+            case ARG_COMPOSITE_ARRAY: {
+                ArrayType *v = DatumGetArrayTypeP( argu );
+                Oid elemType = ARR_ELEMTYPE(v);
+                Datum  *datums;
+                bool   *nulls;
+                int     N;
+                int16   elemWidth;
+                bool    elemTypeByVal;
+                char    elemAlignmentCode;
+                                            
+                get_typlenbyvalalign(elemType, &elemWidth, &elemTypeByVal, &elemAlignmentCode);
+                deconstruct_array(v, elemType, elemWidth, elemTypeByVal, elemAlignmentCode, &datums, &nulls, &N);
+
+                // Array size, then all elements
+                memcpy(target, &N, sizeof(int));
+                target += sizeof(int);
+                for(int n = 0; n < N; n++) {
+                    target = composite_serialize(datums[n], target);
+                }
+                target = (char*) MAXALIGN(target);
+                break;
+            }
+            default: {
+                // Strings, carriers and arrays, read in place by the worker
+                struct varlena* v = PG_DETOAST_DATUM( argu );
+
+                memcpy(target, v, VARSIZE(v));
+                target += MAXALIGN(VARSIZE(v));
+            }
+        }
+    }
+
+    return nargs;
+}
+
+/*
+    Raise PG error for failed java function call
+*/
+static void report_java_error(int jfr, char* error_msg) {
+    if( jfr > 0 ) {
+        jthrowable exh = (*jenv)->ExceptionOccurred(jenv);
+			
+        // Clear exception
+        (*jenv)->ExceptionClear(jenv);
+			
+        if(exh !=0) {
+            char msg[2048];
+            prepareErrorMsg(exh, msg, 2048);
+            elog(ERROR,"Java exception: %s",msg);
+
+        } else {
+            elog(ERROR,"Unknown Java exception occured (%d)",jfr);
+        }	
+    } else if(jfr < 0) {
+        elog(ERROR,"%s",error_msg);
+    }
+}
+
+/*
+    State of a value-per-call SETOF function
+*/
+typedef struct {
+    java_iterator it;
+    Datum* values;
+    bool* nulls;
+    bool* primitive;
+    ExprContext* econtext;
+    MemoryContextCallback reset_cb;
+} java_srf_state;
+
+/*
+    Release iterator if the executor stops early (e.g. LIMIT)
+*/
+static void java_srf_shutdown(Datum arg) {
+    java_srf_state* state = (java_srf_state*) DatumGetPointer(arg);
     
-            dlist_foreach(iter, &worker_head->return_list) {
-                ret = dlist_container(worker_exec_entry, node, iter.cur);
-
-                if(ret->taskid == entry->taskid) {
-                    got_signal = true;
-                    dlist_delete(iter.cur);
-                    break;
-               }
+    close_iter_java_function(&state->it);
+}
+
+/*
+    Release iterator with the SRF memory, also on error (no econtext callbacks)
+*/
+static void java_srf_reset(void* arg) {
+    java_srf_state* state = (java_srf_state*) arg;
+
+    close_iter_java_function(&state->it);
+}
+
+/*
+    Foreground SETOF function returning one row per call
+*/
+static Datum control_fgworker_srf(FunctionCallInfo fcinfo, control_entry* centry) {
+    char error_msg[128];  
+    FuncCallContext* funcctx;
+    java_srf_state* state;
+    HeapTuple tuple;
+    bool done;
+    int jfr;
+
+    if(SRF_IS_FIRSTCALL()) {
+        ReturnSetInfo* rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+        MemoryContext oldcontext;
+        TupleDesc tupdesc;
+        int natts;
+
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                errmsg("function returning set of non-composite type not supported")));
+
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        natts = funcctx->tuple_desc->natts;
+
+        state = (java_srf_state*) palloc0(sizeof(java_srf_state));
+        state->values = (Datum*) palloc0(natts * sizeof(Datum));
+        state->nulls = (bool*) palloc0(natts * sizeof(bool));
+        state->primitive = (bool*) palloc0(natts * sizeof(bool));
+        state->econtext = rsinfo->econtext;
+        state->reset_cb.func = java_srf_reset;
+        state->reset_cb.arg = state;
+        MemoryContextRegisterResetCallback(funcctx->multi_call_memory_ctx, &state->reset_cb);
+        funcctx->user_fctx = state;
+
+        MemoryContextSwitchTo(oldcontext);
+
+        // Start JVM
+        if(jenv == NULL) {
+            int jc = startJVM(error_msg);
+            if(jc < 0 ) {
+                elog(ERROR,"%s",error_msg);
             }
-            SpinLockRelease(&worker_head->lock);           
+        }
+
+        // Prep arguments
+        jvalue args[fcinfo->nargs];
+        short argprim[fcinfo->nargs];
         
-            if(got_signal) {
-                char* data = entry->data;
-                Datum values[ret->n_return];
-                
-                // Process error message
-                if(entry->error) {
-                    char buf[ strlen(entry->data) ];
+#ifdef PGXC
+        FunctionCallInfoData cargsdata;
+        FunctionCallInfo cargs = &cargsdata;
+#else
+        LOCAL_FCINFO(cargs, FUNC_MAX_ARGS);
+#endif
+        
+        memset(argprim, 0, sizeof(argprim));
+        argToJava(args, centry->signature, carrier_args(fcinfo, cargs, centry), argprim, &centry->jcache);
 
-                    pfree(nulls);
-                    
-                    // Copy message
-                    strcpy(buf, entry->data);
-                    
-                    // Put to free list 
-                    SpinLockAcquire(&worker_head->lock);
-                    dlist_push_tail(&worker_head->free_list,&entry->node);           
-                    SpinLockRelease(&worker_head->lock);              
+        activeSPI = false;
+        PushActiveSnapshot(GetTransactionSnapshot());
+        jfr = open_iter_java_function(&state->it, &centry->jcache, centry->class_name, centry->method_name, centry->signature, &args[0], error_msg);
+        PopActiveSnapshot();
 
-                    // Throw
-                    elog(ERROR,"%s",buf);
-                }
+        freejvalues(args, argprim, fcinfo->nargs);
+        report_java_error(jfr, error_msg);
+
+        RegisterExprContextCallback(state->econtext, java_srf_shutdown, PointerGetDatum(state));
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    state = (java_srf_state*) funcctx->user_fctx;
+
+    // Pull next row
+    jfr = next_iter_java_function(state->values, state->primitive, state->nulls, funcctx->tuple_desc->natts, &done, &state->it, funcctx->tuple_desc, &centry->jcache, error_msg);
+
+    if(jfr != 0 || done) {
+        UnregisterExprContextCallback(state->econtext, java_srf_shutdown, PointerGetDatum(state));
+        close_iter_java_function(&state->it);
+        report_java_error(jfr, error_msg);
+        
+        SRF_RETURN_DONE(funcctx);
+    }
+
+    tuple = heap_form_tuple(funcctx->tuple_desc, state->values, state->nulls);
+
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+}
+
+/*
+    Partition state of a batched (V) function
+*/
+typedef struct {
+    int64 start;
+    int n;
+    Datum* values;
+    MemoryContext batchctx;
+} java_batch_state;
+
+/*
+    Call the java method once for the rows [pos, pos + batch size) of the 
+    partition. Each argument column is passed as a java array, the method
+    returns an array with one result per row.
+*/
+static void load_java_batch(WindowObject winobj, java_batch_state* state, int64 pos, FunctionCallInfo fcinfo, control_entry* centry) {
+    char error_msg[128];
+    int nargs = fcinfo->nargs;
+    char ret_type[130];
+    jvalue args[nargs];
+    short argprim[nargs];
+    Datum* cols[nargs];
+    jvalue ret;
+    int n = 0;
+    int jfr;
+    MemoryContext oldcontext;
+
+    MemoryContextReset(state->batchctx);
+    oldcontext = MemoryContextSwitchTo(state->batchctx);
+
+    for(int a = 0; a < nargs; a++)
+        cols[a] = (Datum*) palloc(pluj_batch_size * sizeof(Datum));
+
+    // Fetch argument rows of the batch
+    while(n < pluj_batch_size) {
+        bool isout = false;
+
+        for(int a = 0; a < nargs && !isout; a++) {
+            bool isnull;
+
+            cols[a][n] = WinGetFuncArgInPartition(winobj, a, pos + n, WINDOW_SEEK_HEAD, false, &isnull, &isout);
+            if(!isout && isnull)
+                ereport(ERROR,
+                    (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                    errmsg("NULL arguments are not supported in batched Java functions")));
+        }
+
+        if(isout)
+            break;
+        n++;
+    }
+
+    // Rows before the batch are not needed anymore
+    WinSetMarkPosition(winobj, pos);
+
+    // Converted PG types are passed as carriers
+    for(int a = 0; a < nargs; a++) {
+        if(centry->arg_conv[a] < 0)
+            continue;
+        for(int r = 0; r < n; r++)
+            cols[a][r] = type_converters[centry->arg_conv[a]].to_java(cols[a][r]);
+    }
+
+    memset(argprim, 0, sizeof(argprim));
+    for(int a = 0; a < nargs; a++) {
+        char* type = pgtype_to_java(get_fn_expr_argtype(fcinfo->flinfo, a));
+
+        args[a].l = datums_to_java_batch(type, cols[a], n, error_msg);
+        if(args[a].l == NULL) {
+            freejvalues(args, argprim, a);
+            elog(ERROR,"%s",error_msg);
+        }
+        argprim[a] = 1;
+    }
+
+    jfr = resolve_java_method(&centry->jcache.clazz, &centry->jcache.methodID, centry->class_name, centry->method_name, centry->signature, error_msg);
+    if(jfr == 0) {
+        snprintf(ret_type, sizeof(ret_type), "[%s", centry->return_type);
+        jfr = invoke_java_method(jenv, centry->jcache.clazz, centry->jcache.methodID, ret_type, &args[0], &ret);
+    }
+    freejvalues(args, argprim, nargs);
+    report_java_error(jfr, error_msg);
+
+    state->values = (Datum*) palloc(n * sizeof(Datum));
+    jfr = java_batch_to_datums(ret.l, centry->return_type, state->values, n, error_msg);
+    if(ret.l != NULL)
+        (*jenv)->DeleteLocalRef(jenv, ret.l);
+    report_java_error(jfr, error_msg);
+
+    MemoryContextSwitchTo(oldcontext);
+
+    state->start = pos;
+    state->n = n;
+}
+
+/*
+    Batched (V) function: called as window function, rows of the partition
+    are buffered and passed to java in batches of pluj.batch_size, so that
+    one JNI call serves many rows.
+*/
+static Datum control_fgworker_batch(FunctionCallInfo fcinfo, control_entry* centry) {
+    char error_msg[128];
+    WindowObject winobj = PG_WINDOW_OBJECT();
+    java_batch_state* state;
+    int64 pos;
+
+    if(!WindowObjectIsValid(winobj))
+        ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+            errmsg("batched (V) Java functions have to be created as WINDOW and called with OVER")));
+
+    if(centry->return_type[0] == 'V' || centry->return_type[0] == 'O' || centry->return_type[0] == '[' ||
+       strcmp(centry->return_type, NDARRAY_SIG) == 0)
+        ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+            errmsg("batched (V) Java functions have to return a scalar type")));
+
+    // Start JVM
+    if(jenv == NULL) {
+        int jc = startJVM(error_msg);
+        if(jc < 0 ) {
+            elog(ERROR,"%s",error_msg);
+        }
+    }
+
+    state = (java_batch_state*) WinGetPartitionLocalMemory(winobj, sizeof(java_batch_state));
+    if(state->batchctx == NULL) {
+        // Lives as long as the partition
+        state->batchctx = AllocSetContextCreate(GetMemoryChunkContext(state), "plunijava batch", ALLOCSET_DEFAULT_SIZES);
+    }
+
+    pos = WinGetCurrentPosition(winobj);
+    if(state->values == NULL || pos < state->start || pos >= state->start + state->n) {
+        load_java_batch(winobj, state, pos, fcinfo, centry);
+    }
+
+    PG_RETURN_DATUM( state->values[pos - state->start] );
+}
+
+/*
+    Transition state of a Java aggregate. The state object lives in the JVM
+    and is only referenced from the aggregate context.
+*/
+typedef struct {
+    jobject state;
+} java_agg_state;
+
+/*
+    Drop the global reference once the aggregate context goes away (after
+    the final function ran, which may be called more than once)
+*/
+static void java_agg_state_release(void* arg) {
+    java_agg_state* astate = (java_agg_state*) arg;
+
+    if(astate->state != NULL && jenv != NULL)
+        (*jenv)->DeleteGlobalRef(jenv, astate->state);
+    astate->state = NULL;
+}
+
+static java_agg_state* new_java_agg_state(MemoryContext aggcontext) {
+    java_agg_state* astate = (java_agg_state*) MemoryContextAllocZero(aggcontext, sizeof(java_agg_state));
+    MemoryContextCallback* cb = (MemoryContextCallback*) MemoryContextAllocZero(aggcontext, sizeof(MemoryContextCallback));
+
+    cb->func = java_agg_state_release;
+    cb->arg = astate;
+    MemoryContextRegisterResetCallback(aggcontext, cb);
+
+    return astate;
+}
+
+/*
+    Keep the state object returned by java (local reference) in astate
+*/
+static void set_java_agg_state(java_agg_state* astate, jobject obj) {
+    if(obj != NULL && astate->state != NULL && (*jenv)->IsSameObject(jenv, obj, astate->state)) {
+        (*jenv)->DeleteLocalRef(jenv, obj);
+        return;
+    }
 
-                // Prep return
-                for(int i = 0; i < ret->n_return; i++) {
-                    bool null;
-                    values[i] = datumDeSerialize(&data, &null);
-                }
-                
-                // Cleanup
-                SpinLockAcquire(&worker_head->lock);
-                dlist_push_tail(&worker_head->free_list,&entry->node);           
-                SpinLockRelease(&worker_head->lock);              
+    if(astate->state != NULL)
+        (*jenv)->DeleteGlobalRef(jenv, astate->state);
+    astate->state = (obj != NULL) ? (*jenv)->NewGlobalRef(jenv, obj) : NULL;
 
-                if(tupdesc != NULL) {
-                    HeapTuple tuple = heap_form_tuple(tupdesc, values, nulls);             
-                    pfree(nulls);
-                    PG_RETURN_DATUM( HeapTupleGetDatum(tuple ));    
-                } else {
-                    pfree(nulls);
-                    PG_RETURN_DATUM( values[0] );
-                }
-            }
-        }
+    if(obj != NULL)
+        (*jenv)->DeleteLocalRef(jenv, obj);
+}
 
-    } else {
-        SpinLockRelease(&worker_head->lock);
-        pfree(nulls);
-        elog(ERROR,"BG worker task queue is full");
+/*
+    Signature of the arguments following the state object, e.g. 
+    (Lmy/State;DI)Lmy/State; -> (DI)Lmy/State;
+*/
+static void skip_state_signature(const char* signature, char* buf, Size len) {
+    const char* p = signature + 1;
+
+    while(*p == '[')
+        p++;
+    if(*p == 'L') {
+        while(*p != ';' && *p != '\0')
+            p++;
     }
+    if(*p != '\0')
+        p++;
 
-    PG_RETURN_NULL();
+    snprintf(buf, len, "(%s", p);
 }
 
 /*
-    Helper function to serialize function arguments for sending to background worker
+    Aggregate support function (A mode). The transition state is a java 
+    object passed to and returned by the transition function, so it is never
+    marshaled per row. Combine, serial and deserial functions allow partial
+    (parallel) aggregation, the final function converts the state to the
+    result.
 */
+static Datum control_fgworker_agg(FunctionCallInfo fcinfo, control_entry* centry) {
+    char error_msg[128];
+    MemoryContext aggcontext;
+    java_agg_state* astate = PG_ARGISNULL(0) ? NULL : (java_agg_state*) PG_GETARG_POINTER(0);
+    jvalue ret;
+    int jfr;
+
+    if(!AggCheckCallContext(fcinfo, &aggcontext))
+        ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+            errmsg("aggregate (A) Java function called in non-aggregate context")));
+
+    // Start JVM
+    if(jenv == NULL) {
+        int jc = startJVM(error_msg);
+        if(jc < 0 ) {
+            elog(ERROR,"%s",error_msg);
+        }
+    }
+
+    jfr = resolve_java_method(&centry->jcache.clazz, &centry->jcache.methodID, centry->class_name, centry->method_name, centry->signature, error_msg);
+    report_java_error(jfr, error_msg);
+
+    switch(centry->agg_kind) {
+        case AGG_TRANS: {
+            char signature[strlen(centry->signature) + 2];
+            int nargs = fcinfo->nargs - 1;
+            jvalue args[nargs + 1];
+            short argprim[nargs + 1];
 #ifdef PGXC
-int argSerializer(char* target, char* signature, Datum* args) {
+            FunctionCallInfoData targsdata;
+            FunctionCallInfo targs = &targsdata;
 #else
-int argSerializer(char* target, char* signature,  NullableDatum* args) {
+            LOCAL_FCINFO(targs, FUNC_MAX_ARGS);
 #endif
-    bool openrb = false;
-    bool openo = false;
-    bool opensb = false;
 
-    int ac = 0;
-    char* spos;
-    // Loop over signature and detect arguments
-    for(int i = 0; i < strlen(signature); i++) {
-        if(signature[i] == '(') {
-            openrb = true;
-            continue;
-        }
-        
-        if(signature[i] == ')') {
-            // Done
-            break;
+            // Arguments without the state
+            InitFunctionCallInfoData(*targs, fcinfo->flinfo, nargs, fcinfo->fncollation, NULL, NULL);
+            for(int i = 0; i < nargs; i++) {
+#ifdef PGXC
+                targs->arg[i] = fcinfo->arg[i+1];
+                targs->argnull[i] = fcinfo->argnull[i+1];
+#else
+                targs->args[i] = fcinfo->args[i+1];
+#endif
+            }
+            convert_arg_values(targs, centry->arg_conv + 1);
+            skip_state_signature(centry->signature, signature, sizeof(signature));
+
+            memset(argprim, 0, sizeof(argprim));
+            argToJava(&args[1], signature, targs, &argprim[1], &centry->jcache);
+
+            if(astate == NULL)
+                astate = new_java_agg_state(aggcontext);
+            args[0].l = astate->state;
+
+            jfr = invoke_java_method(jenv, centry->jcache.clazz, centry->jcache.methodID, "O", &args[0], &ret);
+            freejvalues(&args[1], &argprim[1], nargs);
+            report_java_error(jfr, error_msg);
+
+            set_java_agg_state(astate, ret.l);
+            PG_RETURN_POINTER(astate);
         }
-    
-        if(openrb) {
-            // Ready to read arguments
-            if( ( (!openo && !opensb) && (signature[i] == '[' || signature[i] == 'L'))   ) {
-                // Buffer 
-                *target = signature[i];
-                target++;
+        case AGG_COMBINE: {
+            java_agg_state* other = PG_ARGISNULL(1) ? NULL : (java_agg_state*) PG_GETARG_POINTER(1);
+            jvalue args[2];
+
+            if(other == NULL || other->state == NULL) {
+                if(astate == NULL)
+                    PG_RETURN_NULL();
+                PG_RETURN_POINTER(astate);
+            }
 
-                if(signature[i]=='[') {
-                    opensb = true;
-                } else {
-                    openo = true;
-                    spos = target-1;
-                }
+            if(astate == NULL)
+                astate = new_java_agg_state(aggcontext);
+            args[0].l = astate->state;
+            args[1].l = other->state;
 
-                continue;
-            }     
-            
-            if ( openo ) {
-                
-                if(signature[i] != ';') {
-                    // Buffer
-                    *target = signature[i];
-                    target++;
-                } else {
-                    // Serialize object argument
-                    Datum argu = args[ac].value;
-                    target[0] = signature[i];
-                    target[1] = '\0';
-                    target+=2;
-                    
-                    if(strcmp("Ljava/lang/String;",spos) == 0) {
-                        // String
-                        datumSerialize(argu, false, false, -1, &target);
-                    } else {
-                        // Composite type  
-                        HeapTupleHeader t = DatumGetHeapTupleHeader(argu);
+            jfr = invoke_java_method(jenv, centry->jcache.clazz, centry->jcache.methodID, "O", &args[0], &ret);
+            report_java_error(jfr, error_msg);
 
-                        // Serialize each composite object one-by-one
-                        int16 Na = (int16) HeapTupleHeaderGetNatts( t );
-                        
-                        Datum attr[Na];
-                        bool isnull[Na];
-                        bool passbyval[Na];
-                        GetNAttributes(t, Na, attr, isnull, passbyval) ;
-
-                        for(int a = 0; a < Na; a++) {  
-                            if(isnull[a]) {
-                                elog(ERROR,"Attribute %d of composite type is null",a); 
-                            } else {
-                                datumSerialize(attr[a], false, passbyval[a], -1, &target); // getTupleBassBy slow !
-                            } 
-                        }
-        
-                    }
-                    ac++;
-                    openo = false;
-                }
-            } else if ( opensb ) {
-                
-                if(signature[i] == '[') {
-                    // Buffer 
-                    *target = signature[i];
-                    target++;
-                } else {
-                    // ToDo: Check if supported
-                    Datum argu = args[ac].value;
-                    if(signature[i] != 'L') {
-                        // Serialize native array
-                        target[0] = signature[i];
-                        target[1] = '\0';
-                        target+=2;
-                        datumSerialize( PointerGetDatum( PG_DETOAST_DATUM( argu ) ), false, false, -1, &target);
-                    } else {
-                        if(signature[i] == '[') {
-                            elog(ERROR,"2d arrays as input to bg worker not supported yet");
-                        } else if(signature[i] == 'L') {
+            set_java_agg_state(astate, ret.l);
+            PG_RETURN_POINTER(astate);
+        }
+        case AGG_SERIAL: {
+            jvalue args[1];
+            bytea* result;
+            jsize len;
 
+            args[0].l = (astate != NULL) ? astate->state : NULL;
+            jfr = invoke_java_method(jenv, centry->jcache.clazz, centry->jcache.methodID, "[B", &args[0], &ret);
+            report_java_error(jfr, error_msg);
 
-                            if(strcmp("Ljava/lang/String;",signature+i) == 0) {
-                                // compare is broken: Fix as above
-                                elog(ERROR,"Array of strings as input to bg worker not supported yet");
-                            } else {
-                                // Array of Composite
-
-                                // ToDo: Move up full signature read ...
-
-                                // Read full signature
-                                target[0] = signature[i];
-                                target++;
-                               
-                                while(signature[i] != ';' && i < strlen(signature)) {
-                                    i++;
-                                    target[0] = signature[i];
-                                    target++;
-                                }  
-                                target[0] = '\0';
-                                target++;
-                                
-                                // Get array
-                                ArrayType *v = DatumGetArrayTypeP( argu );
-                                Oid elemType = ARR_ELEMTYPE(v);
-                                Datum  *datums;
-                                bool   *nulls;
-                                int     N;
-                                int16   elemWidth;
-                                bool    elemTypeByVal;
-                                char    elemAlignmentCode;
-                                                            
-                                get_typlenbyvalalign(elemType, &elemWidth, &elemTypeByVal, &elemAlignmentCode);
-                                deconstruct_array(v, elemType, elemWidth, elemTypeByVal, elemAlignmentCode, &datums, &nulls, &N);
-
-                                // Serialize array size (4 byte)
-                                int* tmp = (int*)(target);
-                                tmp[0] = N;
-                                target+=4;
-    
-                                // Serialize all array elements
-                                for(int n = 0; n < N; n++) {
-                                    // Prepare elements
-    
-                                    HeapTupleHeader t = DatumGetHeapTupleHeader(datums[n]);
-                                  
-                                  /*
-                                     // TEST
-                                    TupleDesc td = lookup_rowtype_tupdesc( HeapTupleHeaderGetTypeId(t), -1);
-                                    elog(WARNING, "A");
-                                    td = CreateTupleDescCopyConstr(td);
-                                    elog(WARNING, "B");
-                                    
-                                    elog(WARNING, "N: %d",td->natts);
+            if(ret.l == NULL)
+                elog(ERROR,"Null pointer returned from java function call");
 
-                                    ReleaseTupleDesc(td);                                  
-                                    */
+            len = (*jenv)->GetArrayLength(jenv, ret.l);
+            result = (bytea*) palloc(len + VARHDRSZ);
+            SET_VARSIZE(result, len + VARHDRSZ);
+            (*jenv)->GetByteArrayRegion(jenv, ret.l, 0, len, (jbyte*) VARDATA(result));
+            (*jenv)->DeleteLocalRef(jenv, ret.l);
 
-                                    // Serialize each composite object one-by-one
-                                    int16 Na = (int16) HeapTupleHeaderGetNatts( t );
-                                    
-                                    Datum attr[Na];
-                                    bool isnull[Na];
-                                    bool passbyval[Na];
-                                    GetNAttributes(t, Na, attr, isnull, passbyval);
-
-                                    for(int a = 0; a < Na; a++) {  
-                                        if(isnull[a]) {
-                                            elog(ERROR,"Attribute %d of composite type is null",a); 
-                                        } else {
-                                            datumSerialize(attr[a], false, passbyval[a], -1, &target); // getTupleBassBy slow !
-                                        } 
-                                    }
-                                }
-                            }
-                        } else {
-                            elog(ERROR,"Unknown array signature");
-                        }
-                    }
-                    
-                    ac++;
-                    opensb = false;
-                }
-            } else {
-                // ToDo: Check if supported
-                Datum argu = args[ac].value;
-                // Serialize native argument
-                target[0] = signature[i];
-                target[1] = '\0';
-                target+=2;
-                datumSerialize(argu, false, true, -1, &target);
-                ac++;
+            PG_RETURN_BYTEA_P(result);
+        }
+        case AGG_DESERIAL: {
+            bytea* bytes = PG_GETARG_BYTEA_PP(0);
+            jsize len = VARSIZE_ANY_EXHDR(bytes);
+            jvalue args[1];
+
+            args[0].l = (*jenv)->NewByteArray(jenv, len);
+            if(args[0].l == NULL) {
+                (*jenv)->ExceptionClear(jenv);
+                elog(ERROR,"Could not allocate %d bytes for the aggregate state", (int) len);
             }
+            (*jenv)->SetByteArrayRegion(jenv, args[0].l, 0, len, (jbyte*) VARDATA_ANY(bytes));
+
+            jfr = invoke_java_method(jenv, centry->jcache.clazz, centry->jcache.methodID, "O", &args[0], &ret);
+            (*jenv)->DeleteLocalRef(jenv, args[0].l);
+            report_java_error(jfr, error_msg);
+
+            astate = new_java_agg_state(aggcontext);
+            set_java_agg_state(astate, ret.l);
+            PG_RETURN_POINTER(astate);
         }
-    }
+        default: {
+            // Final function, state is kept (may be called again)
+            TupleDesc tupdesc;
+            int natts;
+            // FINALFUNC_EXTRA arguments are always NULL
+            jvalue args[Max(fcinfo->nargs, 1)];
+
+            memset(args, 0, sizeof(args));
+
+            if(get_call_result_type(fcinfo, NULL, &tupdesc) == TYPEFUNC_COMPOSITE) {
+                tupdesc = BlessTupleDesc(tupdesc);
+                natts = tupdesc->natts;
+            } else {
+                tupdesc = NULL;
+                natts = 1;
+            }
 
-    // Consistency check
-    if(!openrb || openo || opensb) elog(ERROR,"Inconsistent Java function signature");        
+            // Result arrays are sized by the return type
+            {
+                Datum values[natts];
+                bool nulls[natts];
+                bool primitive[natts];
+                bool ret_null;
 
-    return ac;
+                memset(nulls, 0, sizeof(nulls));
+                memset(primitive, 0, sizeof(primitive));
+
+                args[0].l = (astate != NULL) ? astate->state : NULL;
+                jfr = call_java_function(values, primitive, nulls, &ret_null, natts, tupdesc, &centry->jcache, centry->class_name, centry->method_name, centry->signature, centry->return_type, &args[0], error_msg);
+                report_java_error(jfr, error_msg);
+
+                if(ret_null)
+                    PG_RETURN_NULL();
+                if(tupdesc != NULL)
+                    PG_RETURN_DATUM( HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)) );
+
+                PG_RETURN_DATUM( values[0] );
+            }
+        }
+    }
 }
 
 /*
     Main function to start fg worker and collect results
 */
-Datum control_fgworker(FunctionCallInfo fcinfo, bool need_SPI, char* class_name, char* method_name, char* signature, char* return_type) {
+Datum control_fgworker(FunctionCallInfo fcinfo, bool need_SPI, control_entry* centry) {
     char error_msg[128];  
+    char* class_name = centry->class_name;
+    char* method_name = centry->method_name;
+    char* signature = centry->signature;
+    char* return_type = centry->return_type;
   
     ReturnSetInfo   *rsinfo       = (ReturnSetInfo *) fcinfo->resultinfo;
+
+    // Stream rows if executor allows (SPI state can not be kept across calls)
+    if(rsinfo != NULL && IsA(rsinfo, ReturnSetInfo) && !need_SPI && (rsinfo->allowedModes & SFRM_ValuePerCall)) {
+        return control_fgworker_srf(fcinfo, centry);
+    }
     
     TupleDesc tupdesc; 
     int rtype = get_call_result_type(fcinfo, NULL, &tupdesc);
@@ -696,8 +1918,16 @@ Datum control_fgworker(FunctionCallInfo fcinfo, bool need_SPI, char* class_name,
     // Prep arguments
     jvalue args[fcinfo->nargs];
     short argprim[fcinfo->nargs];
+    
+#ifdef PGXC
+    FunctionCallInfoData cargsdata;
+    FunctionCallInfo cargs = &cargsdata;
+#else
+    LOCAL_FCINFO(cargs, FUNC_MAX_ARGS);
+#endif
+    
     memset(argprim, 0, sizeof(argprim));
-    argToJava(args, signature, fcinfo, argprim);
+    argToJava(args, signature, carrier_args(fcinfo, cargs, centry), argprim, &centry->jcache);
     
     // Call java function
     activeSPI = need_SPI;
@@ -716,14 +1946,19 @@ Datum control_fgworker(FunctionCallInfo fcinfo, bool need_SPI, char* class_name,
         Datum values[natts];
         bool* nulls = palloc0( natts * sizeof( bool ) );
         bool primitive[natts];
+        bool ret_null;
         memset(primitive, 0, sizeof(primitive));
         //elog(WARNING,"[DEBUG] %s",return_type);
-        jfr = call_java_function(values, primitive, class_name, method_name, signature, return_type, &args[0], error_msg);
+        jfr = call_java_function(values, primitive, nulls, &ret_null, natts, tupdesc, &centry->jcache, class_name, method_name, signature, return_type, &args[0], error_msg);
     
         if(jfr == 0) {     
             if(need_SPI) disconnect_SPI();
             PopActiveSnapshot();
-            if(tupdesc != NULL && natts > 0) {
+            if(ret_null) {
+                pfree(nulls);
+                freejvalues(args, argprim, fcinfo->nargs);
+                PG_RETURN_NULL();
+            } else if(tupdesc != NULL && natts > 0) {
                 HeapTuple tuple = heap_form_tuple(tupdesc, values, nulls);
                 pfree(nulls);
                 freejvalues(args, argprim, fcinfo->nargs);
@@ -749,7 +1984,7 @@ Datum control_fgworker(FunctionCallInfo fcinfo, bool need_SPI, char* class_name,
         rsinfo->setResult             = tupstore;
         rsinfo->returnMode            = SFRM_Materialize;
 
-        jfr = call_iter_java_function(tupstore,tupdesc,class_name, method_name, signature, &args[0], error_msg);
+        jfr = call_iter_java_function(tupstore,tupdesc,&centry->jcache, class_name, method_name, signature, &args[0], error_msg);
 
         MemoryContextSwitchTo(oldcontext);
     }
@@ -757,23 +1992,7 @@ Datum control_fgworker(FunctionCallInfo fcinfo, bool need_SPI, char* class_name,
     if(need_SPI) disconnect_SPI();
     PopActiveSnapshot();
 
-    if( jfr > 0 ) {
-        jthrowable exh = (*jenv)->ExceptionOccurred(jenv);
-			
-        // Clear exception
-        (*jenv)->ExceptionClear(jenv);
-			
-        if(exh !=0) {
-            char msg[2048];
-            prepareErrorMsg(exh, msg, 2048);
-            elog(ERROR,"Java exception: %s",msg);
-
-        } else {
-            elog(ERROR,"Unknown Java exception occured (%d)",jfr);
-        }	
-    } else if(jfr < 0) {
-        elog(ERROR,"%s",error_msg);
-    }
+    report_java_error(jfr, error_msg);
 
     // Final cleanup
     freejvalues(args, argprim, fcinfo->nargs);
@@ -801,7 +2020,7 @@ jvalue PG_text_to_jvalue(text* txt) {
 /*
     Helper function to convert arguments to jvalues for foreground worker
 */
-int argToJava(jvalue* target, char* signature, FunctionCallInfo fcinfo, short* argprim) {
+int argToJava(jvalue* target, char* signature, FunctionCallInfo fcinfo, short* argprim, java_function_cache* jcache) {
     bool openrb = false;
     bool openo = false;
     bool opensb = false;
@@ -809,6 +2028,7 @@ int argToJava(jvalue* target, char* signature, FunctionCallInfo fcinfo, short* a
     int ac = 0;
     char buf[256];
     int pos = 0;
+    char arr_error[128];
    
     // Loop over signature and detect arguments
     for(int i = 0; i < strlen(signature); i++) {
@@ -824,6 +2044,23 @@ int argToJava(jvalue* target, char* signature, FunctionCallInfo fcinfo, short* a
         }
     
         if(openrb) {
+            // NULL argument: Java null for objects
+            if(!openo && !opensb && PG_ARGISNULL(ac)) {
+                if(signature[i] != '[' && signature[i] != 'L')
+                    elog(ERROR,"NULL passed for primitive Java argument %d (declare the function STRICT or use a boxed type)", ac+1);
+
+                while(signature[i] == '[')
+                    i++;
+                if(signature[i] == 'L')
+                    while(signature[i] != ';' && signature[i] != '\0')
+                        i++;
+
+                target[ac].l = NULL;
+                argprim[ac] = 0;
+                ac++;
+                continue;
+            }
+
             // Ready to read arguments
             if( ( !openo && !opensb && (signature[i] == '[' || signature[i] == 'L'))   ) {
                 buf[pos] = signature[i];
@@ -850,88 +2087,69 @@ int argToJava(jvalue* target, char* signature, FunctionCallInfo fcinfo, short* a
                     if(strcmp("Ljava/lang/String;",buf) == 0) {
                         target[ac] = (jvalue) PG_text_to_jvalue( DatumGetTextP( PG_GETARG_DATUM(ac) ));
                         argprim[ac] = 2;
+                    } else if(strcmp(JAVA_BUFFER_SIG,buf) == 0) {
+                        // Array data without copy (detoasted array lives until the call returned)
+                        target[ac].l = wrap_array_buffer( DatumGetArrayTypeP( PG_GETARG_DATUM(ac) ));
+                        if(target[ac].l == NULL)
+                            elog(ERROR,"Array with NULLs can not be passed as ByteBuffer");
+                        argprim[ac] = 1;
+                    } else if(boxed_primitive(buf) != 0) {
+                        // Nullable primitive
+                        target[ac].l = box_datum( buf, PG_GETARG_DATUM(ac) );
+                        argprim[ac] = 1;
+                    } else if(is_value_class(buf)) {
+                        // UUID or BigDecimal from the carrier of the converter
+                        target[ac].l = value_to_jobject( buf, PG_GETARG_DATUM(ac), arr_error );
+                        if(target[ac].l == NULL)
+                            elog(ERROR,"%s",arr_error);
+                        argprim[ac] = 1;
+                    } else if(strcmp(NDARRAY_SIG,buf) == 0) {
+                        // Array of any rank as flat data plus dims
+                        char error_msg[128];
+
+                        target[ac].l = datum_to_ndarray( PG_GETARG_DATUM(ac), error_msg );
+                        if(target[ac].l == NULL)
+                            elog(ERROR,"%s",error_msg);
+                        argprim[ac] = 1;
                     } else {
                         // Map to composite type
-                        // ToDo: Move to helper function ?
-                        jclass cls = (*jenv)->FindClass(jenv, buf);
-                        if(cls == NULL) {
-                            elog(ERROR,"Java class %s not known",buf);
+                        char error_msg[128];
+                        HeapTupleHeader t = DatumGetHeapTupleHeader(PG_GETARG_DATUM(ac) );
+                        TupleDesc tupdesc = lookup_rowtype_tupdesc(HeapTupleHeaderGetTypeId(t), HeapTupleHeaderGetTypMod(t));
+                        HeapTupleData tmptup;
+                        Datum values[tupdesc->natts];
+                        bool nulls[tupdesc->natts];
+                        jobject cobj;
+
+                        field_plan* plan = lookup_arg_field_plan(jcache, fcinfo->nargs, ac, buf, tupdesc, error_msg);
+                        if(plan == NULL) {
+                            ReleaseTupleDesc(tupdesc);
+                            elog(ERROR,"%s",error_msg);
                         }
-                    
-                        // Get field info
-                        jmethodID getFields = (*jenv)->GetMethodID(jenv, (*jenv)->GetObjectClass(jenv,cls), "getFields", "()[Ljava/lang/reflect/Field;");
-                        jobjectArray fieldsList = (jobjectArray)  (*jenv)->CallObjectMethod(jenv, cls, getFields);    
-                        jsize len =  (*jenv)->GetArrayLength(jenv,fieldsList);
-                                  
-                        if(len == 0) {
-                            elog(ERROR,"Java class %s has no fields",buf);
-                        } else {
-                            // Construct new instance
-                            jmethodID constructor = (*jenv)->GetMethodID(jenv, cls, "<init>", "()V");
-                            jobject cobj = (*jenv)->NewObject(jenv, cls, constructor);
-                                 
-                            //TupleTableSlot  *t = (TupleTableSlot *) PG_GETARG_POINTER(ac);
-                            HeapTupleHeader t = DatumGetHeapTupleHeader(PG_GETARG_DATUM(ac) );
-                            bool isnull;
-
-                            // Loop over class fields                            
-                            for(int i = 0; i < len; i++) {
-                                char error_msg[128];
-                                const char* sig;
-
-                                // ToDo: Move to helper function ?
-
-                                // Detect field
-                                jobject field = (*jenv)->GetObjectArrayElement(jenv, fieldsList, i);
-                                jclass fieldClass = (*jenv)->GetObjectClass(jenv, field);
-                                    
-                                // Obtain signature
-                                jmethodID m =  (*jenv)->GetMethodID(jenv, fieldClass, "getName", "()Ljava/lang/String;");   
-                                jstring jstr = (jstring)(*jenv)->CallObjectMethod(jenv, field, m);
-                            
-                                char* fieldname =  (*jenv)->GetStringUTFChars(jenv, jstr, false);
-                            
-                                m =  (*jenv)->GetMethodID(jenv, fieldClass, "getType", "()Ljava/lang/Class;");   
-                                jobject value = (*jenv)->CallObjectMethod(jenv, field, m);
-                                jclass  valueClass = (*jenv)->GetObjectClass(jenv, value);
-
-                                m =  (*jenv)->GetMethodID(jenv, valueClass, "getName", "()Ljava/lang/String;");   
-                                jstring jstr2 = (jstring)(*jenv)->CallObjectMethod(jenv, value, m);
-                                const char* typename =  (*jenv)->GetStringUTFChars(jenv, jstr2, false);
 
-                                sig = convert_name_to_JNI_signature(typename, error_msg);
-                                
-                                if(sig == NULL) {
-                                    elog(ERROR,"%s",error_msg);   
-                                }
-                               
-                                jfieldID fid = (*jenv)->GetFieldID(jenv, cls, fieldname, sig);
+                        if(plan->constructor == NULL) {
+                            ReleaseTupleDesc(tupdesc);
+                            elog(ERROR,"Java class %s has no default constructor",buf);
+                        }
 
-                                // Convert fieldname to lower case for PG lookup
-                                for(int k = 0; k < strlen(fieldname); k++) {
-                                    fieldname[k] = tolower(fieldname[k]);
-                                } 
+                        // Deform composite once
+                        tmptup.t_len = HeapTupleHeaderGetDatumLength(t);
+                        ItemPointerSetInvalid(&(tmptup.t_self));
+                        tmptup.t_tableOid = InvalidOid;
+                        tmptup.t_data = t;
+#ifdef PGXC
+                        tmptup.t_xc_node_id = InvalidOid;
+#endif
+                        heap_deform_tuple(&tmptup, tupdesc, values, nulls);
 
-                                Datum attr = GetAttributeByName(t, fieldname, &isnull); // Note: By num should be faster
-                                if(isnull) {
-                                    elog(ERROR,"No attribute %s in supplied composite argument",fieldname);
-                                }
+                        // Construct new instance
+                        cobj = (*jenv)->NewObject(jenv, plan->cls, plan->constructor);
+                        fill_jobject_from_datums(plan, cobj, values, nulls, tupdesc->natts);
 
-                                int res = set_jobject_field_from_datum(&cobj, &fid, &attr, sig); 
+                        ReleaseTupleDesc(tupdesc);
 
-                                (*jenv)->ReleaseStringUTFChars(jenv, jstr2, typename);
-                                (*jenv)->ReleaseStringUTFChars(jenv, jstr, fieldname);
-                                
-                                if(res == 0) {                                
-                                    target[ac].l = cobj;
-                                    argprim[ac] = 1;
-                                } else {
-                                    elog(ERROR,"Unknown error in setting composite type");
-                                }
-                                
-                            }
-                                                       
-                        }
+                        target[ac].l = cobj;
+                        argprim[ac] = 1;
                     }        
                     
                     ac++;       
@@ -964,34 +2182,32 @@ int argToJava(jvalue* target, char* signature, FunctionCallInfo fcinfo, short* a
                             v = DatumGetArrayTypeP( PG_GETARG_DATUM(ac) ); 
                             switch(pos) {
                                 case 1:
-                                    if(!ARR_HASNULL(v)) {
-                                        jsize      nElems = (jsize)ArrayGetNItems(ARR_NDIM(v), ARR_DIMS(v));
-                                        jintArray intArray = (*jenv)->NewIntArray(jenv,nElems);
-                                        (*jenv)->SetIntArrayRegion(jenv, intArray, 0, nElems, (jint*)ARR_DATA_PTR(v));
-                                        target[ac].l = intArray;
-                                        argprim[ac] = 1;
-                                    } else {
-                                        elog(ERROR,"Array with NULLs not implemented yet for foreground Java worker");     
-                                    }
+                                    target[ac].l = array_to_java(v, 'I', arr_error);
+                                    if(target[ac].l == NULL)
+                                        elog(ERROR,"%s",arr_error);
+                                    argprim[ac] = 1;
                                     break;
                                 case 2:
                                     int nc = 0;
-                                    if(!ARR_HASNULL(v)) {
+                                    char* values = dense_array_values(v, 'I', arr_error);
+                                    if(values != NULL) {
                                         jclass cls = (*jenv)->FindClass(jenv,"[I");
                                         jobjectArray objectArray = (*jenv)->NewObjectArray(jenv, ARR_DIMS(v)[0], cls, 0);
                                         
                                         for (int idx = 0; idx < ARR_DIMS(v)[0]; ++idx) {
                                             // Create inner
                                             jintArray innerArray = (*jenv)->NewIntArray(jenv,ARR_DIMS(v)[1]);
-                                            (*jenv)->SetIntArrayRegion(jenv, innerArray, 0, ARR_DIMS(v)[1], (jint *) (ARR_DATA_PTR(v) + nc*sizeof(int) ));
+                                            (*jenv)->SetIntArrayRegion(jenv, innerArray, 0, ARR_DIMS(v)[1], (jint *) (values + nc*sizeof(int) ));
                                             nc += ARR_DIMS(v)[1];
                                             (*jenv)->SetObjectArrayElement(jenv, objectArray, idx, innerArray);
                                             (*jenv)->DeleteLocalRef(jenv,innerArray);
                                         }    
                                         target[ac].l = objectArray;
+                                        if(values != ARR_DATA_PTR(v))
+                                            pfree(values);
                                         argprim[ac] = 1;
                                     } else {
-                                        elog(ERROR,"Array with NULLs not implemented yet for foreground Java worker");     
+                                        elog(ERROR,"%s",arr_error);
                                     }
                                     break;
                                 elog(ERROR,"Higher dimensional array as argument not implemented yet for foreground Java worker");   
@@ -1001,34 +2217,32 @@ int argToJava(jvalue* target, char* signature, FunctionCallInfo fcinfo, short* a
                             v = DatumGetArrayTypeP( PG_GETARG_DATUM(ac) );          
                             switch(pos) {
                                 case 1:
-                                    if(!ARR_HASNULL(v)) {
-                                        jsize      nElems = (jsize)ArrayGetNItems(ARR_NDIM(v), ARR_DIMS(v));
-                                        jlongArray longArray = (*jenv)->NewLongArray(jenv,nElems);
-                                        (*jenv)->SetLongArrayRegion(jenv,longArray, 0, nElems, (jlong*)ARR_DATA_PTR(v));
-                                        target[ac].l = longArray;
-                                        argprim[ac] = 1;
-                                    } else {
-                                        elog(ERROR,"Array with NULLs not implemented yet for foreground Java worker");     
-                                    }
+                                    target[ac].l = array_to_java(v, 'J', arr_error);
+                                    if(target[ac].l == NULL)
+                                        elog(ERROR,"%s",arr_error);
+                                    argprim[ac] = 1;
                                     break;
                                 case 2:
                                     int nc = 0;
-                                    if(!ARR_HASNULL(v)) {
+                                    char* values = dense_array_values(v, 'J', arr_error);
+                                    if(values != NULL) {
                                         jclass cls = (*jenv)->FindClass(jenv,"[J");
                                         jobjectArray objectArray = (*jenv)->NewObjectArray(jenv, ARR_DIMS(v)[0], cls, 0);
                                         
                                         for (int idx = 0; idx < ARR_DIMS(v)[0]; ++idx) {
                                             // Create inner
                                             jlongArray innerArray = (*jenv)->NewLongArray(jenv,ARR_DIMS(v)[1]);
-                                            (*jenv)->SetLongArrayRegion(jenv, innerArray, 0, ARR_DIMS(v)[1], (jlong *) (ARR_DATA_PTR(v) + nc*sizeof(long) ));
+                                            (*jenv)->SetLongArrayRegion(jenv, innerArray, 0, ARR_DIMS(v)[1], (jlong *) (values + nc*sizeof(long) ));
                                             nc += ARR_DIMS(v)[1];
                                             (*jenv)->SetObjectArrayElement(jenv, objectArray, idx, innerArray);
                                             (*jenv)->DeleteLocalRef(jenv,innerArray);
                                         }    
                                         target[ac].l = objectArray;
+                                        if(values != ARR_DATA_PTR(v))
+                                            pfree(values);
                                         argprim[ac] = 1;
                                     } else {
-                                        elog(ERROR,"Array with NULLs not implemented yet for foreground Java worker");     
+                                        elog(ERROR,"%s",arr_error);
                                     }
                                     break;
                                 
@@ -1039,34 +2253,32 @@ int argToJava(jvalue* target, char* signature, FunctionCallInfo fcinfo, short* a
                             v = DatumGetArrayTypeP( PG_GETARG_DATUM(ac) );       
                             switch(pos) {
                                 case 1:
-                                    if(!ARR_HASNULL(v)) {
-                                        jsize      nElems = (jsize)ArrayGetNItems(ARR_NDIM(v), ARR_DIMS(v));
-                                        jfloatArray floatArray = (*jenv)->NewFloatArray(jenv,nElems);
-                                        (*jenv)->SetFloatArrayRegion(jenv,floatArray, 0, nElems, (jfloat *)ARR_DATA_PTR(v));
-                                        target[ac].l = floatArray;
-                                        argprim[ac] = 1;
-                                    } else {
-                                        elog(ERROR,"Array with NULLs not implemented yet for foreground Java worker");     
-                                    }
+                                    target[ac].l = array_to_java(v, 'F', arr_error);
+                                    if(target[ac].l == NULL)
+                                        elog(ERROR,"%s",arr_error);
+                                    argprim[ac] = 1;
                                     break;
                                 case 2:
                                     int nc = 0;
-                                    if(!ARR_HASNULL(v)) {
+                                    char* values = dense_array_values(v, 'F', arr_error);
+                                    if(values != NULL) {
                                         jclass cls = (*jenv)->FindClass(jenv,"[F");
                                         jobjectArray objectArray = (*jenv)->NewObjectArray(jenv, ARR_DIMS(v)[0], cls, 0);
                                         
                                         for (int idx = 0; idx < ARR_DIMS(v)[0]; ++idx) {
                                             // Create inner
                                             jfloatArray innerArray = (*jenv)->NewFloatArray(jenv,ARR_DIMS(v)[1]);
-                                            (*jenv)->SetFloatArrayRegion(jenv, innerArray, 0, ARR_DIMS(v)[1], (jfloat *) (ARR_DATA_PTR(v) + nc*sizeof(float) ));
+                                            (*jenv)->SetFloatArrayRegion(jenv, innerArray, 0, ARR_DIMS(v)[1], (jfloat *) (values + nc*sizeof(float) ));
                                             nc += ARR_DIMS(v)[1];
                                             (*jenv)->SetObjectArrayElement(jenv, objectArray, idx, innerArray);
                                             (*jenv)->DeleteLocalRef(jenv,innerArray);
                                         }    
                                         target[ac].l = objectArray;
+                                        if(values != ARR_DATA_PTR(v))
+                                            pfree(values);
                                         argprim[ac] = 1;
                                     } else {
-                                        elog(ERROR,"Array with NULLs not implemented yet for foreground Java worker");     
+                                        elog(ERROR,"%s",arr_error);
                                     }
                                     break;
                                 elog(ERROR,"Higher dimensional array as argument not implemented yet for foreground Java worker");   
@@ -1076,34 +2288,32 @@ int argToJava(jvalue* target, char* signature, FunctionCallInfo fcinfo, short* a
                             v = DatumGetArrayTypeP( PG_GETARG_DATUM(ac) );       
                             switch(pos) {
                                 case 1:
-                                    if(!ARR_HASNULL(v)) {
-                                        jsize      nElems = (jsize)ArrayGetNItems(ARR_NDIM(v), ARR_DIMS(v));
-                                        jdoubleArray doubleArray = (*jenv)->NewDoubleArray(jenv,nElems);
-                                        (*jenv)->SetDoubleArrayRegion(jenv,doubleArray, 0, nElems, (jdouble *)ARR_DATA_PTR(v));
-                                        target[ac].l = doubleArray;
-                                        argprim[ac] = 1;
-                                    } else {
-                                        elog(ERROR,"Array with NULLs not implemented yet for foreground Java worker");     
-                                    }
+                                    target[ac].l = array_to_java(v, 'D', arr_error);
+                                    if(target[ac].l == NULL)
+                                        elog(ERROR,"%s",arr_error);
+                                    argprim[ac] = 1;
                                     break;
                                 case 2:
                                     int nc = 0;
-                                    if(!ARR_HASNULL(v)) {
+                                    char* values = dense_array_values(v, 'D', arr_error);
+                                    if(values != NULL) {
                                         jclass cls = (*jenv)->FindClass(jenv,"[D");
                                         jobjectArray objectArray = (*jenv)->NewObjectArray(jenv, ARR_DIMS(v)[0], cls, 0);
                                         
                                         for (int idx = 0; idx < ARR_DIMS(v)[0]; ++idx) {
                                             // Create inner
                                             jdoubleArray innerArray = (*jenv)->NewDoubleArray(jenv,ARR_DIMS(v)[1]);
-                                            (*jenv)->SetDoubleArrayRegion(jenv, innerArray, 0, ARR_DIMS(v)[1], (jdouble *) (ARR_DATA_PTR(v) + nc*sizeof(double) ));
+                                            (*jenv)->SetDoubleArrayRegion(jenv, innerArray, 0, ARR_DIMS(v)[1], (jdouble *) (values + nc*sizeof(double) ));
                                             nc += ARR_DIMS(v)[1];
                                             (*jenv)->SetObjectArrayElement(jenv, objectArray, idx, innerArray);
                                             (*jenv)->DeleteLocalRef(jenv,innerArray);
                                         }    
                                         target[ac].l = objectArray;
+                                        if(values != ARR_DATA_PTR(v))
+                                            pfree(values);
                                         argprim[ac] = 1;
                                     } else {
-                                        elog(ERROR,"Array with NULLs not implemented yet for foreground Java worker");     
+                                        elog(ERROR,"%s",arr_error);
                                     }
                                     break;
                                 elog(ERROR,"Higher dimensional array as argument not implemented yet for foreground Java worker");   
@@ -1165,62 +2375,9 @@ int argToJava(jvalue* target, char* signature, FunctionCallInfo fcinfo, short* a
 
                                 } else {
                                     // Build composite type                              
-                                    jclass cls = (*jenv)->FindClass(jenv, cbuf);
-                                    if(cls == NULL) {
-                                        elog(ERROR,"Java class %s not known",cbuf);
-                                    }
-                                
-                                    // Get field info
-                                    jmethodID getFields = (*jenv)->GetMethodID(jenv, (*jenv)->GetObjectClass(jenv,cls), "getFields", "()[Ljava/lang/reflect/Field;");
-                                    jobjectArray fieldsList = (jobjectArray)  (*jenv)->CallObjectMethod(jenv, cls, getFields);    
-                                    jsize len =  (*jenv)->GetArrayLength(jenv,fieldsList);
-                                
-                                    if(len == 0) {
-                                        elog(ERROR,"Java class %s has no fields",cbuf);
-                                    }
-                                    
-                                    char* sig[len];
-                                    char* fieldname[len];
-                                    char* typename[len];
-                                    jstring jstr[len];
-                                    jstring jstr2[len];
-                                    jfieldID fid[len];
-
-                                    // Loop over class fields to prepare                             
-                                    for(int j = 0; j < len; j++) {
-                                    
-                                        // Detect field
-                                        jobject field = (*jenv)->GetObjectArrayElement(jenv, fieldsList, j);
-                                        jclass fieldClass = (*jenv)->GetObjectClass(jenv, field);
-                                            
-                                        // Obtain signature
-                                        jmethodID m =  (*jenv)->GetMethodID(jenv, fieldClass, "getName", "()Ljava/lang/String;");   
-                                        jstr[j] = (jstring)(*jenv)->CallObjectMethod(jenv, field, m);
-                                    
-                                        fieldname[j] =  (*jenv)->GetStringUTFChars(jenv, jstr[j], false);
-                                    
-                                        m =  (*jenv)->GetMethodID(jenv, fieldClass, "getType", "()Ljava/lang/Class;");   
-                                        jobject value = (*jenv)->CallObjectMethod(jenv, field, m);
-                                        jclass  valueClass = (*jenv)->GetObjectClass(jenv, value);
-
-                                        m =  (*jenv)->GetMethodID(jenv, valueClass, "getName", "()Ljava/lang/String;");   
-                                        jstr2[j] = (jstring)(*jenv)->CallObjectMethod(jenv, value, m);
-                                        typename[j] =  (*jenv)->GetStringUTFChars(jenv, jstr2[j], false);
-
-                                        char error_msg[128];
-                                        sig[j] = convert_name_to_JNI_signature(typename[j], error_msg);
-                                        
-                                        if(sig[j] == NULL) {
-                                            elog(ERROR,"%s",error_msg);   
-                                        }
-                                    
-                                        fid[j] = (*jenv)->GetFieldID(jenv, cls, fieldname[j], sig[j]);
-
-                                        // Convert fieldname to lower case for PG lookup
-                                        for(int k = 0; k < strlen(fieldname[j]); k++) {
-                                            fieldname[j][k] = tolower(fieldname[j][k]);
-                                        } 
-                                    }
+                                    char error_msg[128];
+                                    TupleDesc tupdesc;
+                                    field_plan* plan;
 
                                     // Get array
                                     v = PG_GETARG_ARRAYTYPE_P(ac);
@@ -1235,52 +2392,57 @@ int argToJava(jvalue* target, char* signature, FunctionCallInfo fcinfo, short* a
                                     get_typlenbyvalalign(elemType, &elemWidth, &elemTypeByVal, &elemAlignmentCode);
                                     deconstruct_array(v, elemType, elemWidth, elemTypeByVal, elemAlignmentCode, &datums, &nulls, &N);
                                     
+                                    // All elements share the row type of the array
+                                    tupdesc = lookup_rowtype_tupdesc(elemType, -1);
+
+                                    plan = lookup_arg_field_plan(jcache, fcinfo->nargs, ac, cbuf, tupdesc, error_msg);
+                                    if(plan == NULL) {
+                                        ReleaseTupleDesc(tupdesc);
+                                        elog(ERROR,"%s",error_msg);
+                                    }
+
+                                    if(plan->constructor == NULL) {
+                                        ReleaseTupleDesc(tupdesc);
+                                        elog(ERROR,"Java class %s has no default constructor",cbuf);
+                                    }
+
+                                    Datum values[tupdesc->natts];
+                                    bool attnulls[tupdesc->natts];
+
                                     // Create array
-                                    jobjectArray array = (*jenv)->NewObjectArray(jenv,N,cls,0);
-                                    
-                                    jmethodID constructor = (*jenv)->GetMethodID(jenv, cls, "<init>", "()V");
+                                    jobjectArray array = (*jenv)->NewObjectArray(jenv,N,plan->cls,0);
                                         
                                     // Loop over array elements
                                     for (int n = 0; n < N; n++)
                                     {
                                         if (!nulls[n]) {
+                                            HeapTupleData tmptup;
+                                            HeapTupleHeader t = DatumGetHeapTupleHeader(datums[n]);
+
                                             // Construct new instance
-                                            jobject cobj = (*jenv)->NewObject(jenv, cls, constructor);
+                                            jobject cobj = (*jenv)->NewObject(jenv, plan->cls, plan->constructor);
                             
-                                            // Prepare elements
-                                            HeapTupleHeader t = DatumGetHeapTupleHeader(datums[n]);
-                                            
-                                            // Loop over class fields                            
-                                            for(int j = 0; j < len; j++) {
-                                                bool isnull;
-                                                Datum attr = GetAttributeByName(t, fieldname[j], &isnull); // Note: By num should be faster
-                                                if(isnull) {
-                                                    elog(ERROR,"No attribute %s in supplied composite argument",fieldname[j]);
-                                                }
-                                                
-                                                //elog(WARNING,"-> %s (%s)", fieldname[j], sig[j]);
-                                            
-                                                int res = set_jobject_field_from_datum(&cobj, &fid[j], &attr, sig[j]); 
-                                                
-                                                if(res != 0) {                                
-                                                    elog(ERROR,"Unknown error in setting composite type");
-                                                }
-                                            }
+                                            // Deform element
+                                            tmptup.t_len = HeapTupleHeaderGetDatumLength(t);
+                                            ItemPointerSetInvalid(&(tmptup.t_self));
+                                            tmptup.t_tableOid = InvalidOid;
+                                            tmptup.t_data = t;
+#ifdef PGXC
+                                            tmptup.t_xc_node_id = InvalidOid;
+#endif
+                                            heap_deform_tuple(&tmptup, tupdesc, values, attnulls);
+
+                                            fill_jobject_from_datums(plan, cobj, values, attnulls, tupdesc->natts);
                                         
                                             (*jenv)->SetObjectArrayElement(jenv, array, n, cobj);
                                             (*jenv)->DeleteLocalRef(jenv,cobj);
                                         } 
                                     }
+
+                                    ReleaseTupleDesc(tupdesc);
                                             
                                     target[ac].l = array;
                                     argprim[ac] = 1;
-                                    
-                                    // Cleanup
-                                    for(int j = 0; i < len; j++) {
-                                        (*jenv)->ReleaseStringUTFChars(jenv, jstr2[j], typename[j]);
-                                        (*jenv)->ReleaseStringUTFChars(jenv, jstr[j], fieldname[j]);
-                                    }
-
                                 }
 
                             } else {
@@ -1334,43 +2496,25 @@ PG_FUNCTION_INFO_V1(pluj_clear_user_queue);
 Datum
 pluj_clear_user_queue(PG_FUNCTION_ARGS) {
     int c;
+    int slot;
 
-    if(worker_head_user == NULL) {
-        bool found;
-        worker_data_head* worker_head_user;
-
-        Oid			roleid = GetUserId();
-	    Oid			dbid = MyDatabaseId;
-	
-        char buf[12];
-        snprintf(buf, 12, "UJ_%d_%d", roleid, dbid); 
-        
-        LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
-       
-        worker_head_user = (worker_data_head*) ShmemInitStruct(buf,
-                                    sizeof(worker_data_head),
-                                    &found);
-        LWLockRelease(AddinShmemInitLock);
-        
-        if(!found) {
-            worker_head_user->n_workers = 0;
-        }
-    }
+    if(worker_head_user == NULL)
+        worker_head_user = find_user_pool(GetUserId(), MyDatabaseId);
 
-    if(worker_head_user->n_workers == 0) {
+    if(worker_head_user == NULL || worker_head_user->n_workers == 0) {
         elog(ERROR,"No workers started yet");
     }
 
-    SpinLockAcquire(&worker_head_user->lock);
-   
+    // Payloads of the dropped tasks live in the pool's area
+    if(worker_area_user == NULL)
+        worker_area_user = attach_worker_area(worker_head_user);
+
+    // Dropped tasks fail, their backends are waiting for them
     c = 0;
-    while(!dlist_is_empty(&worker_head_user->exec_list)) {
-        dlist_node* dnode = dlist_pop_head_node(&worker_head_user->exec_list);
-        dlist_push_tail(&worker_head_user->free_list,dnode);
+    while((slot = task_ring_pop(EXEC_RING(worker_head_user))) >= 0) {
+        fail_exec_entry(worker_head_user, worker_area_user, &worker_head_user->list_data[slot], "Task was removed from the queue by pluj_clear_user_queue");
         c++;
     }
-    
-    SpinLockRelease(&worker_head_user->lock);   
 
     PG_RETURN_INT32(c);
 }
@@ -1379,42 +2523,15 @@ PG_FUNCTION_INFO_V1(pluj_show_user_queue);
 Datum
 pluj_show_user_queue(PG_FUNCTION_ARGS) {
     int c;
-    dlist_iter iter;
     
-    if(worker_head_user == NULL) {
-        bool found;
-        worker_data_head* worker_head_user;
-
-        Oid			roleid = GetUserId();
-	    Oid			dbid = MyDatabaseId;
-	
-        char buf[12];
-        snprintf(buf, 12, "UJ_%d_%d", roleid, dbid); 
-        
-        LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
-       
-        worker_head_user = (worker_data_head*) ShmemInitStruct(buf,
-                                    sizeof(worker_data_head),
-                                    &found);
-        LWLockRelease(AddinShmemInitLock);
-
-        if(!found) {
-            worker_head_user->n_workers = 0;
-        }
-    } 
+    if(worker_head_user == NULL)
+        worker_head_user = find_user_pool(GetUserId(), MyDatabaseId);
 
-    if(worker_head_user->n_workers == 0) {
+    if(worker_head_user == NULL || worker_head_user->n_workers == 0) {
         elog(ERROR,"No workers started yet");
     }
 
-    SpinLockAcquire(&worker_head_user->lock);
-    
-    c = 0;
-    dlist_foreach(iter, &worker_head_user->exec_list) {
-        c++;
-    }
-    
-    SpinLockRelease(&worker_head_user->lock);   
+    c = (int) task_ring_count(EXEC_RING(worker_head_user));
 
     PG_RETURN_INT32(c);
 }
@@ -1423,25 +2540,12 @@ PG_FUNCTION_INFO_V1(pluj_kill_user_workers);
 Datum
 pluj_kill_user_workers(PG_FUNCTION_ARGS) {
     worker_data_head* worker_head_user;
-    bool found;
     int n_workers;
     int ret;
 
-    Oid			roleid = GetUserId();
-    Oid			dbid = MyDatabaseId;
-
-    char buf[BGW_MAXLEN];
-    snprintf(buf, BGW_MAXLEN, "UJ_%d_%d", roleid, dbid); 
-    
-    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
-   
-    worker_head_user = (worker_data_head*) ShmemInitStruct(buf,
-                                sizeof(worker_data_head),
-                                &found);
-    LWLockRelease(AddinShmemInitLock);
-
-    if(!found) {
-        worker_head_user->n_workers = 0;
+    // Slot is given back when the last worker exits
+    worker_head_user = find_user_pool(GetUserId(), MyDatabaseId);
+    if(worker_head_user == NULL) {
         elog(ERROR,"Can not kill workers if not started yet");
     }
 
@@ -1478,7 +2582,7 @@ pluj_kill_global_workers(PG_FUNCTION_ARGS) {
         
     LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
     worker_head_global = (worker_data_head*) ShmemInitStruct(buf,
-                                sizeof(worker_data_head),
+                                worker_head_size(),
                                 &found);
     LWLockRelease(AddinShmemInitLock);
 	
@@ -1,14 +1,35 @@
 #include "plunijava_worker.h"
+#include "plunijava_jvm.h"
 
 typedef struct {
-    bool global;    
+    Oid fn_oid;
+    bool valid;
+    uint32 fn_hashvalue;
+    bool global;
     bool need_SPI;
     char* mode;
     char* class_name;
     char* method_name;
     char* return_type;
     char* signature;
+    // Type converter per argument and of the return (-1 for none)
+    short* arg_conv;
+    bool has_arg_conv;
+    short ret_conv;
+    // Background task payload layout (built on first background call)
+    arg_schema* payload_schema;
+    int n_payload_args;
+    // Role of an aggregate support function (A mode)
+    char agg_kind;
+    // Resolved on first call (foreground only)
+    java_function_cache jcache;
 } control_entry;
 
-Datum control_bgworkers(FunctionCallInfo fcinfo, int n_workers, bool need_SPI, bool globalWorker, char* class_name, char* method_name, char* signature, char* return_type);
-Datum control_fgworker(FunctionCallInfo fcinfo, bool need_SPI, char* class_name, char* method_name, char* signature, char* return_type);
+#define AGG_TRANS 't'
+#define AGG_COMBINE 'c'
+#define AGG_SERIAL 's'
+#define AGG_DESERIAL 'd'
+#define AGG_FINAL 'f'
+
+Datum control_bgworkers(FunctionCallInfo fcinfo, int n_workers, bool need_SPI, bool globalWorker, control_entry* centry);
+Datum control_fgworker(FunctionCallInfo fcinfo, bool need_SPI, control_entry* centry);
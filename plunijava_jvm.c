@@ -6,19 +6,23 @@
 #include "utils/array.h"
 #include "catalog/pg_type.h"
 #include <dlfcn.h>
+#include <ctype.h>
 #include "plunijava_jvm.h"
 #include "utils/guc.h"
+#include "access/parallel.h"
 
 #include "utils/tuplestore.h"
 #include "utils/builtins.h"
+#include "utils/float.h"
 
 JNIEnv *jenv;
 JavaVM *jvm;
 
 ArrayType* createArray(jsize nElems, size_t elemSize, Oid elemType, bool withNulls);
 ArrayType* create2dArray(jsize dim1, jsize dim2, size_t elemSize, Oid elemType, bool withNulls);
+ArrayType* createNdArray(int ndim, int* dims, size_t elemSize, Oid elemType, int nNulls);
 
-Datum build_datum_from_return_field(bool* primitive, jobject data, jclass cls, const char* fieldname, const char* sig, char* error_msg);
+Datum build_datum_from_return_field(bool* primitive, bool* isnull, jobject data, jfieldID fid, const char* sig, char* error_msg);
 
 JavaVMOption* setJVMoptions(int* numOptions);
 char** readOptions(char* filename, int* N);
@@ -61,6 +65,22 @@ const char* convert_name_to_JNI_signature(const char* name, char* error_msg) {
         // Objects
         } else if (strcmp(name, "java.lang.String") == 0 ) {
             return "Ljava/lang/String;";
+        } else if (strcmp(name, "java.nio.ByteBuffer") == 0 ) {
+            return JAVA_BUFFER_SIG;
+        } else if (strcmp(name, "ai.sedn.plunijava.NDArray") == 0 ) {
+            return NDARRAY_SIG;
+        } else if (strcmp(name, "java.lang.Integer") == 0 ) {
+            return "Ljava/lang/Integer;";
+        } else if (strcmp(name, "java.lang.Long") == 0 ) {
+            return "Ljava/lang/Long;";
+        } else if (strcmp(name, "java.lang.Short") == 0 ) {
+            return "Ljava/lang/Short;";
+        } else if (strcmp(name, "java.lang.Float") == 0 ) {
+            return "Ljava/lang/Float;";
+        } else if (strcmp(name, "java.lang.Double") == 0 ) {
+            return "Ljava/lang/Double;";
+        } else if (strcmp(name, "java.lang.Boolean") == 0 ) {
+            return "Ljava/lang/Boolean;";
         }
     }
     
@@ -133,98 +153,1049 @@ ArrayType* create2dArray(jsize dim1, jsize dim2, size_t elemSize, Oid elemType,
 	return v;
 }
 
-int set_jobject_field_from_datum(jobject* obj, jfieldID* fid, Datum* dat, const char* sig) {
+ArrayType* createNdArray(int ndim, int* dims, size_t elemSize, Oid elemType, int nNulls)
+{
+	ArrayType* v;
+	int nElems = ArrayGetNItems(ndim, dims);
+	Size nBytes;
+
+	Size dataoffset;
+	if(nNulls > 0)
+	{
+		dataoffset = ARR_OVERHEAD_WITHNULLS(ndim, nElems);
+		nBytes = dataoffset + (nElems - nNulls) * elemSize;
+	}
+	else
+	{
+		dataoffset = 0;			/* marker for no null bitmap */
+		nBytes = nElems * elemSize + ARR_OVERHEAD_NONULLS(ndim);
+	}
+
+	v = (ArrayType*)palloc0(nBytes);
+	v->dataoffset = (int32)dataoffset;
+
+	SET_VARSIZE(v, nBytes);
+
+	ARR_NDIM(v) = ndim;
+	ARR_ELEMTYPE(v) = elemType;
+	for(int i = 0; i < ndim; i++) {
+		ARR_DIMS(v)[i] = dims[i];
+		ARR_LBOUND(v)[i] = 1;
+	}
+
+	return v;
+}
+
+/*
+    Boxed primitives: nullable arguments, returns and composite fields
+*/
+typedef struct {
+    const char* sig;
+    char prim;
+    const char* value_name;
+    jclass cls;
+    jmethodID valueOf;
+    jmethodID value;
+} boxed_type;
+
+static boxed_type boxed_types[] = {
+    {"Ljava/lang/Integer;", 'I', "intValue"},
+    {"Ljava/lang/Long;", 'J', "longValue"},
+    {"Ljava/lang/Short;", 'S', "shortValue"},
+    {"Ljava/lang/Float;", 'F', "floatValue"},
+    {"Ljava/lang/Double;", 'D', "doubleValue"},
+    {"Ljava/lang/Boolean;", 'Z', "booleanValue"},
+};
+
+static boxed_type* lookup_boxed_type(const char* sig) {
+    if(sig[0] != 'L')
+        return NULL;
+
+    for(int i = 0; i < lengthof(boxed_types); i++) {
+        if(strcmp(sig, boxed_types[i].sig) == 0)
+            return &boxed_types[i];
+    }
+    return NULL;
+}
+
+/*
+    Primitive JNI type of a boxed signature (0 if sig is not boxed)
+*/
+char boxed_primitive(const char* sig) {
+    boxed_type* b = lookup_boxed_type(sig);
+
+    return (b != NULL) ? b->prim : 0;
+}
+
+/*
+    Constant copy of a boxed signature (NULL if sig is not boxed)
+*/
+const char* boxed_signature(const char* sig) {
+    boxed_type* b = lookup_boxed_type(sig);
+
+    return (b != NULL) ? b->sig : NULL;
+}
+
+static boxed_type* init_boxed_type(const char* sig) {
+    boxed_type* b = lookup_boxed_type(sig);
+
+    if(b != NULL && b->cls == NULL) {
+        char name[64];
+        char msig[64];
+        size_t len = strlen(b->sig);
+        jclass cls;
+
+        // Ljava/lang/Integer; -> java/lang/Integer
+        memcpy(name, b->sig + 1, len - 2);
+        name[len - 2] = '\0';
+
+        cls = (*jenv)->FindClass(jenv, name);
+        snprintf(msig, sizeof(msig), "(%c)%s", b->prim, b->sig);
+        b->valueOf = (*jenv)->GetStaticMethodID(jenv, cls, "valueOf", msig);
+        snprintf(msig, sizeof(msig), "()%c", b->prim);
+        b->value = (*jenv)->GetMethodID(jenv, cls, b->value_name, msig);
+        b->cls = (jclass) (*jenv)->NewGlobalRef(jenv, cls);
+        (*jenv)->DeleteLocalRef(jenv, cls);
+    }
+
+    return b;
+}
+
+/*
+    Box a datum of the primitive type of sig (local reference)
+*/
+jobject box_datum(const char* sig, Datum dat) {
+    boxed_type* b = init_boxed_type(sig);
+    jvalue v;
+
+    switch(b->prim) {
+        case 'I':
+            v.i = DatumGetInt32(dat);
+            break;
+        case 'J':
+            v.j = DatumGetInt64(dat);
+            break;
+        case 'S':
+            v.s = DatumGetInt16(dat);
+            break;
+        case 'F':
+            v.f = DatumGetFloat4(dat);
+            break;
+        case 'D':
+            v.d = DatumGetFloat8(dat);
+            break;
+        case 'Z':
+            v.z = DatumGetBool(dat);
+            break;
+    }
+
+    return (*jenv)->CallStaticObjectMethodA(jenv, b->cls, b->valueOf, &v);
+}
+
+/*
+    Datum of a (non-null) boxed primitive
+*/
+Datum unbox_jobject(const char* sig, jobject obj) {
+    boxed_type* b = init_boxed_type(sig);
+
+    switch(b->prim) {
+        case 'I':
+            return Int32GetDatum( (*jenv)->CallIntMethod(jenv, obj, b->value) );
+        case 'J':
+            return Int64GetDatum( (*jenv)->CallLongMethod(jenv, obj, b->value) );
+        case 'S':
+            return Int16GetDatum( (*jenv)->CallShortMethod(jenv, obj, b->value) );
+        case 'F':
+            return Float4GetDatum( (*jenv)->CallFloatMethod(jenv, obj, b->value) );
+        case 'D':
+            return Float8GetDatum( (*jenv)->CallDoubleMethod(jenv, obj, b->value) );
+        case 'Z':
+            return BoolGetDatum( (*jenv)->CallBooleanMethod(jenv, obj, b->value) );
+    }
+
+    return (Datum) 0;
+}
+
+/*
+    Value classes of converted PG types, built from carrier datums: uuid
+    as 16 byte bytea (two longs), numeric as bytea of the scale (4 bytes, big
+    endian) followed by the unscaled value (BigInteger.toByteArray())
+*/
+static struct {
+    jclass uuid;
+    jmethodID uuid_init;
+    jmethodID uuid_msb;
+    jmethodID uuid_lsb;
+    jclass decimal;
+    jmethodID decimal_init;
+    jmethodID decimal_unscaled;
+    jmethodID decimal_scale;
+    jclass bigint;
+    jmethodID bigint_init;
+    jmethodID bigint_bytes;
+} value_classes;
+
+bool is_value_class(const char* sig) {
+    return strcmp(sig, UUID_SIG) == 0 || strcmp(sig, BIGDECIMAL_SIG) == 0;
+}
+
+static void init_value_classes(void) {
+    jclass cls;
+
+    if(value_classes.uuid != NULL)
+        return;
+
+    cls = (*jenv)->FindClass(jenv, "java/util/UUID");
+    value_classes.uuid_init = (*jenv)->GetMethodID(jenv, cls, "<init>", "(JJ)V");
+    value_classes.uuid_msb = (*jenv)->GetMethodID(jenv, cls, "getMostSignificantBits", "()J");
+    value_classes.uuid_lsb = (*jenv)->GetMethodID(jenv, cls, "getLeastSignificantBits", "()J");
+    value_classes.uuid = (jclass) (*jenv)->NewGlobalRef(jenv, cls);
+    (*jenv)->DeleteLocalRef(jenv, cls);
+
+    cls = (*jenv)->FindClass(jenv, "java/math/BigDecimal");
+    value_classes.decimal_init = (*jenv)->GetMethodID(jenv, cls, "<init>", "(Ljava/math/BigInteger;I)V");
+    value_classes.decimal_unscaled = (*jenv)->GetMethodID(jenv, cls, "unscaledValue", "()Ljava/math/BigInteger;");
+    value_classes.decimal_scale = (*jenv)->GetMethodID(jenv, cls, "scale", "()I");
+    value_classes.decimal = (jclass) (*jenv)->NewGlobalRef(jenv, cls);
+    (*jenv)->DeleteLocalRef(jenv, cls);
+
+    cls = (*jenv)->FindClass(jenv, "java/math/BigInteger");
+    value_classes.bigint_init = (*jenv)->GetMethodID(jenv, cls, "<init>", "([B)V");
+    value_classes.bigint_bytes = (*jenv)->GetMethodID(jenv, cls, "toByteArray", "()[B");
+    value_classes.bigint = (jclass) (*jenv)->NewGlobalRef(jenv, cls);
+    (*jenv)->DeleteLocalRef(jenv, cls);
+}
+
+/*
+    Value object of a carrier datum (local reference, NULL on error)
+*/
+jobject value_to_jobject(const char* sig, Datum dat, char* error_msg) {
+    jobject obj;
+
+    init_value_classes();
+
+    if(strcmp(sig, UUID_SIG) == 0) {
+        bytea* b = DatumGetByteaPP(dat);
+        unsigned char* d = (unsigned char*) VARDATA_ANY(b);
+        uint64 msb = 0;
+        uint64 lsb = 0;
+
+        if(VARSIZE_ANY_EXHDR(b) != 16) {
+            snprintf(error_msg, 128, "UUID requires 16 bytes");
+            return NULL;
+        }
+
+        // Big endian, as in the PG representation
+        for(int i = 0; i < 8; i++) {
+            msb = (msb << 8) | d[i];
+            lsb = (lsb << 8) | d[i + 8];
+        }
+        return (*jenv)->NewObject(jenv, value_classes.uuid, value_classes.uuid_init, (jlong) msb, (jlong) lsb);
+    } else {
+        bytea* b = DatumGetByteaPP(dat);
+        unsigned char* d = (unsigned char*) VARDATA_ANY(b);
+        jsize len = VARSIZE_ANY_EXHDR(b) - 4;
+        jint scale;
+        jbyteArray bytes;
+        jobject unscaled;
+
+        if(len < 1) {
+            snprintf(error_msg, 128, "numeric value can not be passed as BigDecimal");
+            return NULL;
+        }
+        scale = (jint) (((uint32) d[0] << 24) | ((uint32) d[1] << 16) | ((uint32) d[2] << 8) | d[3]);
+
+        bytes = (*jenv)->NewByteArray(jenv, len);
+        if(bytes == NULL) {
+            (*jenv)->ExceptionClear(jenv);
+            snprintf(error_msg, 128, "Could not allocate BigDecimal digits");
+            return NULL;
+        }
+        (*jenv)->SetByteArrayRegion(jenv, bytes, 0, len, (jbyte*) (d + 4));
+
+        unscaled = (*jenv)->NewObject(jenv, value_classes.bigint, value_classes.bigint_init, bytes);
+        (*jenv)->DeleteLocalRef(jenv, bytes);
+        if(unscaled == NULL) {
+            (*jenv)->ExceptionClear(jenv);
+            snprintf(error_msg, 128, "Could not convert numeric to BigDecimal");
+            return NULL;
+        }
+
+        obj = (*jenv)->NewObject(jenv, value_classes.decimal, value_classes.decimal_init, unscaled, scale);
+        (*jenv)->DeleteLocalRef(jenv, unscaled);
+        if(obj == NULL) {
+            (*jenv)->ExceptionClear(jenv);
+            snprintf(error_msg, 128, "Could not convert numeric to BigDecimal");
+            return NULL;
+        }
+        return obj;
+    }
+}
+
+/*
+    Carrier datum of a (non-null) value object
+*/
+Datum jobject_to_value(const char* sig, jobject obj, char* error_msg) {
+    init_value_classes();
+
+    if(strcmp(sig, UUID_SIG) == 0) {
+        uint64 msb = (uint64) (*jenv)->CallLongMethod(jenv, obj, value_classes.uuid_msb);
+        uint64 lsb = (uint64) (*jenv)->CallLongMethod(jenv, obj, value_classes.uuid_lsb);
+        bytea* b = (bytea*) palloc(16 + VARHDRSZ);
+        unsigned char* d = (unsigned char*) VARDATA(b);
+
+        SET_VARSIZE(b, 16 + VARHDRSZ);
+        for(int i = 7; i >= 0; i--) {
+            d[i] = (unsigned char) (msb & 0xFF);
+            d[i + 8] = (unsigned char) (lsb & 0xFF);
+            msb >>= 8;
+            lsb >>= 8;
+        }
+        return PointerGetDatum(b);
+    } else {
+        jobject unscaled = (*jenv)->CallObjectMethod(jenv, obj, value_classes.decimal_unscaled);
+        jint scale = (*jenv)->CallIntMethod(jenv, obj, value_classes.decimal_scale);
+        jbyteArray bytes;
+        jsize len;
+        bytea* result;
+        unsigned char* d;
+
+        if(unscaled == NULL) {
+            snprintf(error_msg, 128, "Could not convert BigDecimal");
+            return (Datum) 0;
+        }
+
+        bytes = (jbyteArray) (*jenv)->CallObjectMethod(jenv, unscaled, value_classes.bigint_bytes);
+        (*jenv)->DeleteLocalRef(jenv, unscaled);
+        if(bytes == NULL) {
+            snprintf(error_msg, 128, "Could not convert BigDecimal");
+            return (Datum) 0;
+        }
+
+        len = (*jenv)->GetArrayLength(jenv, bytes);
+        result = (bytea*) palloc(VARHDRSZ + 4 + len);
+        SET_VARSIZE(result, VARHDRSZ + 4 + len);
+        d = (unsigned char*) VARDATA(result);
+        d[0] = (unsigned char) ((uint32) scale >> 24);
+        d[1] = (unsigned char) ((uint32) scale >> 16);
+        d[2] = (unsigned char) ((uint32) scale >> 8);
+        d[3] = (unsigned char) scale;
+        (*jenv)->GetByteArrayRegion(jenv, bytes, 0, len, (jbyte*) (d + 4));
+        (*jenv)->DeleteLocalRef(jenv, bytes);
+
+        return PointerGetDatum(result);
+    }
+}
+
+/*
+    Null bitmaps: PG arrays store only the present elements plus a bitmap 
+    with a set bit per present element. Java gets dense values (NULL 
+    positions filled) and, for NDArray, a long[] with a set bit per NULL 
+    element (layout of java.util.BitSet.valueOf).
+*/
+#define ELEM_PRESENT(bitmap, i) (((bitmap)[(i) >> 3] & (1 << ((i) & 7))) != 0)
+#define ELEM_NULL(nullmap, i) (((nullmap)[(i) >> 6] & (UINT64CONST(1) << ((i) & 63))) != 0)
+
+/*
+    Copy the elements of a PG array with NULLs to dense memory. NULL positions
+    get fill and are marked in nullmap (if given). Runs of present elements
+    are copied at once.
+*/
+static void expand_array_nulls(ArrayType* v, int n, Size elem_size, char* dst, const void* fill, uint64* nullmap) {
+    bits8* bitmap = ARR_NULLBITMAP(v);
+    char* src = ARR_DATA_PTR(v);
+    int i = 0;
+
+    while(i < n) {
+        int run = i;
+
+        while(run < n && ELEM_PRESENT(bitmap, run))
+            run++;
+        memcpy(dst + i * elem_size, src, (run - i) * elem_size);
+        src += (run - i) * elem_size;
+
+        for(i = run; i < n && !ELEM_PRESENT(bitmap, i); i++) {
+            memcpy(dst + i * elem_size, fill, elem_size);
+            if(nullmap != NULL)
+                nullmap[i >> 6] |= UINT64CONST(1) << (i & 63);
+        }
+    }
+}
+
+/*
+    Inverse of expand_array_nulls: copy the dense values not marked in 
+    nullmap to v (created with room for them) and set its null bitmap
+*/
+void compact_array_nulls(const char* src, int n, Size elem_size, ArrayType* v, const uint64* nullmap) {
+    bits8* bitmap = ARR_NULLBITMAP(v);
+    char* dst = ARR_DATA_PTR(v);
+    int i = 0;
+
+    while(i < n) {
+        int run = i;
+
+        while(run < n && !ELEM_NULL(nullmap, run)) {
+            bitmap[run >> 3] |= 1 << (run & 7);
+            run++;
+        }
+        memcpy(dst, src + i * elem_size, (run - i) * elem_size);
+        dst += (run - i) * elem_size;
+
+        for(i = run; i < n && ELEM_NULL(nullmap, i); i++)
+            ;
+    }
+}
+
+/*
+    Element data of a numeric PG array as dense C array. Without NULLs this 
+    is the array data itself, otherwise a palloc'd copy with NaN for NULL 
+    (floating point only; integer arrays have no free sentinel and need an 
+    NDArray, NULL is returned with error_msg set).
+*/
+void* dense_array_values(ArrayType* v, char type, char* error_msg) {
+    int n;
+    char fill[8];
+    Size elem_size;
+    char* dst;
+
+    if(!ARR_HASNULL(v))
+        return ARR_DATA_PTR(v);
+
+    if(type == 'D') {
+        float8 nan = get_float8_nan();
+        elem_size = sizeof(float8);
+        memcpy(fill, &nan, elem_size);
+    } else if(type == 'F') {
+        float4 nan = get_float4_nan();
+        elem_size = sizeof(float4);
+        memcpy(fill, &nan, elem_size);
+    } else {
+        snprintf(error_msg, 128, "Integer array with NULLs has to be passed as NDArray");
+        return NULL;
+    }
+
+    n = ArrayGetNItems(ARR_NDIM(v), ARR_DIMS(v));
+    dst = palloc(n * elem_size);
+    expand_array_nulls(v, n, elem_size, dst, fill, NULL);
+
+    return dst;
+}
+
+/*
+    Setters of Java object fields from datums
+*/
+static void set_bool_field(jobject obj, jfieldID fid, Datum dat) {
+    (*jenv)->SetBooleanField(jenv, obj, fid, DatumGetBool( dat ) );
+}
+
+static void set_int_field(jobject obj, jfieldID fid, Datum dat) {
+    (*jenv)->SetIntField(jenv, obj, fid, DatumGetInt32( dat ) );
+}
+
+static void set_long_field(jobject obj, jfieldID fid, Datum dat) {
+    (*jenv)->SetLongField(jenv, obj, fid, DatumGetInt64( dat ) );
+}
+
+static void set_short_field(jobject obj, jfieldID fid, Datum dat) {
+    (*jenv)->SetShortField(jenv, obj, fid, DatumGetInt16( dat ) );
+}
+
+static void set_double_field(jobject obj, jfieldID fid, Datum dat) {
+    (*jenv)->SetDoubleField(jenv, obj, fid, DatumGetFloat8( dat ) );
+}
+
+static void set_float_field(jobject obj, jfieldID fid, Datum dat) {
+    (*jenv)->SetFloatField(jenv, obj, fid, DatumGetFloat4( dat ) );
+}
+
+static void set_string_field(jobject obj, jfieldID fid, Datum dat) {
+    text* txt = DatumGetTextP( dat );                            
+    int len = VARSIZE_ANY_EXHDR(txt)+1;
+    char t[len];
+
+    text_to_cstring_buffer(txt, &t[0], len);
+    
+    jstring string = (*jenv)->NewStringUTF(jenv, t);
+    (*jenv)->SetObjectField(jenv, obj, fid, string);
+    (*jenv)->DeleteLocalRef(jenv, string);
+}
+
+static void set_bytea_field(jobject obj, jfieldID fid, Datum dat) {
+    bytea* bytes  = DatumGetByteaP( dat );
+    jsize  nElems = VARSIZE(bytes) - sizeof(int32);
+    jbyteArray byteArray  =(*jenv)->NewByteArray(jenv,nElems);
+    (*jenv)->SetByteArrayRegion(jenv, byteArray, 0, nElems, (jbyte*)VARDATA(bytes));
+    (*jenv)->SetObjectField(jenv, obj, fid, byteArray );
+    (*jenv)->DeleteLocalRef(jenv, byteArray);
+}
+
+static void set_double_array_field(jobject obj, jfieldID fid, Datum dat) {
+    char error_msg[128];
+    jarray arr = array_to_java(DatumGetArrayTypeP( dat ), 'D', error_msg);
+
+    if(arr == NULL)
+        elog(ERROR,"%s",error_msg);
+
+    (*jenv)->SetObjectField(jenv, obj, fid, arr );
+    (*jenv)->DeleteLocalRef(jenv, arr);
+}
+
+static void set_float_array_field(jobject obj, jfieldID fid, Datum dat) {
+    char error_msg[128];
+    jarray arr = array_to_java(DatumGetArrayTypeP( dat ), 'F', error_msg);
+
+    if(arr == NULL)
+        elog(ERROR,"%s",error_msg);
+
+    (*jenv)->SetObjectField(jenv, obj, fid, arr );
+    (*jenv)->DeleteLocalRef(jenv, arr);
+}
+
+static jmethodID buffer_read_only = NULL;
+static jmethodID buffer_order = NULL;
+static jobject native_order = NULL;
+
+/*
+    Wrap PG memory as read-only direct ByteBuffer in native byte order, no
+    copy is made. The buffer is only valid while the memory is, i.e. for 
+    the duration of the call.
+*/
+jobject wrap_direct_buffer(void* data, jlong size) {
+    jobject buf;
+    jobject ro;
+    jobject ordered;
+
+    if(native_order == NULL) {
+        jclass bcls = (*jenv)->FindClass(jenv, "java/nio/ByteBuffer");
+        jclass ocls = (*jenv)->FindClass(jenv, "java/nio/ByteOrder");
+        jmethodID native_m = (*jenv)->GetStaticMethodID(jenv, ocls, "nativeOrder", "()Ljava/nio/ByteOrder;");
+        jobject order = (*jenv)->CallStaticObjectMethod(jenv, ocls, native_m);
+
+        buffer_read_only = (*jenv)->GetMethodID(jenv, bcls, "asReadOnlyBuffer", "()Ljava/nio/ByteBuffer;");
+        buffer_order = (*jenv)->GetMethodID(jenv, bcls, "order", "(Ljava/nio/ByteOrder;)Ljava/nio/ByteBuffer;");
+        native_order = (*jenv)->NewGlobalRef(jenv, order);
+
+        (*jenv)->DeleteLocalRef(jenv, order);
+        (*jenv)->DeleteLocalRef(jenv, ocls);
+        (*jenv)->DeleteLocalRef(jenv, bcls);
+    }
+
+    buf = (*jenv)->NewDirectByteBuffer(jenv, data, size);
+    if(buf == NULL) {
+        (*jenv)->ExceptionClear(jenv);
+        return NULL;
+    }
+
+    // Read-only view, its order is reset to big endian
+    ro = (*jenv)->CallObjectMethod(jenv, buf, buffer_read_only);
+    ordered = (*jenv)->CallObjectMethod(jenv, ro, buffer_order, native_order);
+
+    (*jenv)->DeleteLocalRef(jenv, ro);
+    (*jenv)->DeleteLocalRef(jenv, buf);
+
+    return ordered;
+}
+
+/*
+    Wrap the data of a PG array without NULLs (NULL if not possible)
+*/
+jobject wrap_array_buffer(ArrayType* v) {
+    if(ARR_HASNULL(v))
+        return NULL;
+
+    return wrap_direct_buffer(ARR_DATA_PTR(v), (jlong) (ARR_SIZE(v) - ARR_DATA_OFFSET(v)));
+}
+
+static void set_boxed_field(jobject obj, jfieldID fid, Datum dat, const char* sig) {
+    jobject box = box_datum(sig, dat);
+
+    (*jenv)->SetObjectField(jenv, obj, fid, box);
+    (*jenv)->DeleteLocalRef(jenv, box);
+}
+
+#define BOXED_SETTER(name, sig) \
+    static void name(jobject obj, jfieldID fid, Datum dat) { set_boxed_field(obj, fid, dat, sig); }
+
+BOXED_SETTER(set_boxed_int_field, "Ljava/lang/Integer;")
+BOXED_SETTER(set_boxed_long_field, "Ljava/lang/Long;")
+BOXED_SETTER(set_boxed_short_field, "Ljava/lang/Short;")
+BOXED_SETTER(set_boxed_float_field, "Ljava/lang/Float;")
+BOXED_SETTER(set_boxed_double_field, "Ljava/lang/Double;")
+BOXED_SETTER(set_boxed_bool_field, "Ljava/lang/Boolean;")
+
+static void set_ndarray_field(jobject obj, jfieldID fid, Datum dat) {
+    char error_msg[128];
+    jobject arr = datum_to_ndarray(dat, error_msg);
+
+    if(arr == NULL)
+        elog(ERROR,"%s",error_msg);
+
+    (*jenv)->SetObjectField(jenv, obj, fid, arr);
+    (*jenv)->DeleteLocalRef(jenv, arr);
+}
+
+static void set_buffer_field(jobject obj, jfieldID fid, Datum dat) {
+    jobject buf = wrap_array_buffer(DatumGetArrayTypeP( dat ));
+
+    if(buf == NULL)
+        elog(ERROR,"Array has NULLs");
+
+    (*jenv)->SetObjectField(jenv, obj, fid, buf);
+    (*jenv)->DeleteLocalRef(jenv, buf);
+}
+
+/*
+    Select setter for JNI signature (NULL if not supported)
+*/
+static field_setter setter_for_signature(const char* sig) {
     if(sig[0] != '[') {
-        
         switch(sig[0]) {
             // Natives
-            case 'Z':       
-               (*jenv)->SetBooleanField(jenv, *obj , *fid, DatumGetBool( *dat ) );
-                return 0;
-            case 'I':       
-               (*jenv)->SetIntField(jenv, *obj , *fid, DatumGetInt32( *dat ) );
-                return 0;
-            case 'J':       
-                (*jenv)->SetLongField(jenv, *obj , *fid, DatumGetInt64( *dat ) );
-                return 0;
-            case 'S':       
-               (*jenv)->SetShortField(jenv, *obj , *fid, DatumGetInt16( *dat ) );
-                return 0;
-            case 'D':       
-               (*jenv)->SetDoubleField(jenv, *obj , *fid, DatumGetFloat8( *dat ) );
-                return 0;
-            case 'F':       
-               (*jenv)->SetFloatField(jenv, *obj , *fid, DatumGetFloat4( *dat ) );
-                return 0;
+            case 'Z':
+                return set_bool_field;
+            case 'I':
+                return set_int_field;
+            case 'J':
+                return set_long_field;
+            case 'S':
+                return set_short_field;
+            case 'D':
+                return set_double_field;
+            case 'F':
+                return set_float_field;
             // String
             case 'L':
-                if(strcmp(sig,"Ljava/lang/String;") == 0) {
-                    
-                    text* txt = DatumGetTextP( *dat );                            
-                    int len = VARSIZE_ANY_EXHDR(txt)+1;
-                    char t[len];
-                
-                    text_to_cstring_buffer(txt, &t[0], len);
-                    
-                    jstring string = (*jenv)->NewStringUTF(jenv, t);
-                    
-                    (*jenv)->SetObjectField(jenv, *obj , *fid, string);
-                    
-                    // Memory leak ?
-                    
-                    return 0;
-                }          
+                if(strcmp(sig,"Ljava/lang/String;") == 0) 
+                    return set_string_field;
+                if(strcmp(sig,JAVA_BUFFER_SIG) == 0) 
+                    return set_buffer_field;
+                if(strcmp(sig,NDARRAY_SIG) == 0) 
+                    return set_ndarray_field;
+                switch(boxed_primitive(sig)) {
+                    case 'I':
+                        return set_boxed_int_field;
+                    case 'J':
+                        return set_boxed_long_field;
+                    case 'S':
+                        return set_boxed_short_field;
+                    case 'F':
+                        return set_boxed_float_field;
+                    case 'D':
+                        return set_boxed_double_field;
+                    case 'Z':
+                        return set_boxed_bool_field;
+                }
         }
-    } else {
-        if(sig[1] != '[') {
-            // 1D arrays
-            ArrayType* v;
-            switch(sig[1]) {
-                case 'B':
-                    bytea* bytes  = DatumGetByteaP( *dat );
-                    jsize  nElems = VARSIZE(bytes) - sizeof(int32);
-                    jbyteArray byteArray  =(*jenv)->NewByteArray(jenv,nElems);
-                    (*jenv)->SetByteArrayRegion(jenv, byteArray, 0, nElems, (jbyte*)VARDATA(bytes));
-                    (*jenv)->SetObjectField(jenv, *obj , *fid, byteArray );
-                    return 0;                              
-                case 'D':
-                    v = DatumGetArrayTypeP( *dat );
-                    if(!ARR_HASNULL(v)) {
-                        jsize      nElems = (jsize)ArrayGetNItems(ARR_NDIM(v), ARR_DIMS(v));
-                        jdoubleArray doubleArray = (*jenv)->NewDoubleArray(jenv,nElems);
-                        (*jenv)->SetDoubleArrayRegion(jenv, doubleArray, 0, nElems, (jdouble *)ARR_DATA_PTR(v));
-                        (*jenv)->SetObjectField(jenv, *obj , *fid, doubleArray );
-                        return 0;
-                    } else {
-                        // Copy element by element 
-                        //...
-                        elog(ERROR,"Array has NULLs");
-                    }
-                    break;
-                case 'F':
-                    v = DatumGetArrayTypeP( *dat );
-                    if(!ARR_HASNULL(v)) {
-                        jsize      nElems = (jsize)ArrayGetNItems(ARR_NDIM(v), ARR_DIMS(v));
-                        jfloatArray floatArray = (*jenv)->NewFloatArray(jenv,nElems);
-                        (*jenv)->SetFloatArrayRegion(jenv, floatArray, 0, nElems, (jfloat *)ARR_DATA_PTR(v));
-                        (*jenv)->SetObjectField(jenv, *obj , *fid, floatArray );
-                        return 0;
-                    } else {
-                        // Copy element by element 
-                        //...
-                        elog(ERROR,"Array has NULLs");
-                    }
-                    break;
-            }
+    } else if(sig[1] != '[') {
+        // 1D arrays
+        switch(sig[1]) {
+            case 'B':
+                return set_bytea_field;
+            case 'D':
+                return set_double_array_field;
+            case 'F':
+                return set_float_array_field;
         }
     }
 
+    return NULL;
+}
+
+int set_jobject_field_from_datum(jobject* obj, jfieldID* fid, Datum* dat, const char* sig) {
+    field_setter set = setter_for_signature(sig);
+
+    if(set != NULL) {
+        set(*obj, *fid, *dat);
+        return 0;
+    }
+
     elog(ERROR,"Datum can not be converted to Java object (%s)",sig);
     return -1;
 }
 
-Datum build_datum_from_return_field(bool* primitive, jobject data, jclass cls, const char* fieldname, const char* sig, char* error_msg) {
-    jfieldID fid = (*jenv)->GetFieldID(jenv,cls,fieldname,sig);       
+// Arrays of at least this size are copied through pinned (critical) access
+#define CRITICAL_COPY_MIN 4096
+
+/*
+    Element size and PG type of a primitive java array element
+*/
+static bool java_array_elem_info(char type, Size* elem_size, Oid* elem_type) {
+    switch(type) {
+        case 'I':
+            *elem_size = sizeof(jint);
+            *elem_type = INT4OID;
+            return true;
+        case 'J':
+            *elem_size = sizeof(jlong);
+            *elem_type = INT8OID;
+            return true;
+        case 'S':
+            *elem_size = sizeof(jshort);
+            *elem_type = INT2OID;
+            return true;
+        case 'F':
+            *elem_size = sizeof(jfloat);
+            *elem_type = FLOAT4OID;
+            return true;
+        case 'D':
+            *elem_size = sizeof(jdouble);
+            *elem_type = FLOAT8OID;
+            return true;
+    }
+    return false;
+}
+
+/*
+    Copy the elements of a primitive java array to PG memory. Large arrays
+    are pinned and copied with a single memcpy (no JNI or PG calls may
+    happen while pinned), small ones through the region functions.
+*/
+static void copy_java_array(jarray arr, char type, void* dst, jsize n, Size elem_size) {
+    Size nbytes = (Size) n * elem_size;
+
+    if(nbytes >= CRITICAL_COPY_MIN) {
+        void* src = (*jenv)->GetPrimitiveArrayCritical(jenv, arr, NULL);
+
+        if(src != NULL) {
+            memcpy(dst, src, nbytes);
+            (*jenv)->ReleasePrimitiveArrayCritical(jenv, arr, src, JNI_ABORT);
+            return;
+        }
+        (*jenv)->ExceptionClear(jenv);
+    }
+
+    switch(type) {
+        case 'B':
+            (*jenv)->GetByteArrayRegion(jenv, arr, 0, n, (jbyte*) dst);
+            break;
+        case 'I':
+            (*jenv)->GetIntArrayRegion(jenv, arr, 0, n, (jint*) dst);
+            break;
+        case 'J':
+            (*jenv)->GetLongArrayRegion(jenv, arr, 0, n, (jlong*) dst);
+            break;
+        case 'S':
+            (*jenv)->GetShortArrayRegion(jenv, arr, 0, n, (jshort*) dst);
+            break;
+        case 'F':
+            (*jenv)->GetFloatArrayRegion(jenv, arr, 0, n, (jfloat*) dst);
+            break;
+        case 'D':
+            (*jenv)->GetDoubleArrayRegion(jenv, arr, 0, n, (jdouble*) dst);
+            break;
+    }
+}
+
+/*
+    JNI handles of ai.sedn.plunijava.NDArray (dense array of any rank: flat 
+    row-major primitive data plus dims)
+*/
+static struct {
+    jclass cls;
+    jmethodID constructor;
+    jfieldID dims;
+    jfieldID data;
+    jfieldID nulls;
+    // Element array classes, in order of ndarray_types
+    jclass data_cls[5];
+} ndarray = {NULL};
+
+static const char ndarray_types[] = "DFIJS";
+
+static bool ndarray_init(char* error_msg) {
+    jclass cls;
+
+    if(ndarray.cls != NULL)
+        return true;
+
+    cls = (*jenv)->FindClass(jenv, "ai/sedn/plunijava/NDArray");
+    if(cls == NULL) {
+        (*jenv)->ExceptionClear(jenv);
+        snprintf(error_msg, 128, "Java class ai/sedn/plunijava/NDArray not found");
+        return false;
+    }
+
+    ndarray.constructor = (*jenv)->GetMethodID(jenv, cls, "<init>", "()V");
+    ndarray.dims = (*jenv)->GetFieldID(jenv, cls, "dims", "[I");
+    ndarray.data = (*jenv)->GetFieldID(jenv, cls, "data", "Ljava/lang/Object;");
+    ndarray.nulls = (*jenv)->GetFieldID(jenv, cls, "nulls", "[J");
+
+    for(int i = 0; i < 5; i++) {
+        char name[3] = {'[', ndarray_types[i], '\0'};
+        jclass acls = (*jenv)->FindClass(jenv, name);
+        ndarray.data_cls[i] = (jclass) (*jenv)->NewGlobalRef(jenv, acls);
+        (*jenv)->DeleteLocalRef(jenv, acls);
+    }
+
+    ndarray.cls = (jclass) (*jenv)->NewGlobalRef(jenv, cls);
+    (*jenv)->DeleteLocalRef(jenv, cls);
+
+    return true;
+}
+
+/*
+    Java element type of a PG array element type (0 if not supported)
+*/
+static char java_elem_of_pgtype(Oid type) {
+    switch(type) {
+        case FLOAT8OID:
+            return 'D';
+        case FLOAT4OID:
+            return 'F';
+        case INT4OID:
+            return 'I';
+        case INT8OID:
+            return 'J';
+        case INT2OID:
+            return 'S';
+    }
+    return 0;
+}
+
+/*
+    New primitive java array initialized from PG memory
+*/
+static jarray new_java_array(char type, jsize n, void* src) {
+    jarray arr = NULL;
+
+    switch(type) {
+        case 'D':
+            arr = (*jenv)->NewDoubleArray(jenv, n);
+            if(arr != NULL) (*jenv)->SetDoubleArrayRegion(jenv, arr, 0, n, (jdouble*) src);
+            break;
+        case 'F':
+            arr = (*jenv)->NewFloatArray(jenv, n);
+            if(arr != NULL) (*jenv)->SetFloatArrayRegion(jenv, arr, 0, n, (jfloat*) src);
+            break;
+        case 'I':
+            arr = (*jenv)->NewIntArray(jenv, n);
+            if(arr != NULL) (*jenv)->SetIntArrayRegion(jenv, arr, 0, n, (jint*) src);
+            break;
+        case 'J':
+            arr = (*jenv)->NewLongArray(jenv, n);
+            if(arr != NULL) (*jenv)->SetLongArrayRegion(jenv, arr, 0, n, (jlong*) src);
+            break;
+        case 'S':
+            arr = (*jenv)->NewShortArray(jenv, n);
+            if(arr != NULL) (*jenv)->SetShortArrayRegion(jenv, arr, 0, n, (jshort*) src);
+            break;
+    }
+
+    return arr;
+}
+
+/*
+    Flat primitive java array of the elements of a PG array (NULL with 
+    error_msg set if not possible)
+*/
+jarray array_to_java(ArrayType* v, char type, char* error_msg) {
+    void* values = dense_array_values(v, type, error_msg);
+    jarray arr;
+
+    if(values == NULL)
+        return NULL;
+
+    arr = new_java_array(type, (jsize) ArrayGetNItems(ARR_NDIM(v), ARR_DIMS(v)), values);
+    if(values != ARR_DATA_PTR(v))
+        pfree(values);
+
+    return arr;
+}
+
+/*
+    Wrap a PG array of any rank as NDArray (one flat copy of the data, 
+    NULLs are zero in data and marked in nulls)
+*/
+jobject datum_to_ndarray(Datum dat, char* error_msg) {
+    ArrayType* v = DatumGetArrayTypeP(dat);
+    int ndim = ARR_NDIM(v);
+    jsize nElems = (jsize) ArrayGetNItems(ndim, ARR_DIMS(v));
+    char type = java_elem_of_pgtype(ARR_ELEMTYPE(v));
+    jobject obj;
+    jarray data;
+    jintArray dims;
+    jlongArray nulls = NULL;
+
+    if(type == 0) {
+        snprintf(error_msg, 128, "Array element type %u not supported for NDArray", ARR_ELEMTYPE(v));
+        return NULL;
+    }
+    if(!ndarray_init(error_msg))
+        return NULL;
+
+    if(ARR_HASNULL(v)) {
+        Size elemSize;
+        Oid elemType;
+        char zero[8] = {0};
+        jsize nWords = (nElems + 63) / 64;
+        uint64* nullmap = palloc0(nWords * sizeof(uint64));
+        char* values;
+
+        java_array_elem_info(type, &elemSize, &elemType);
+        values = palloc(nElems * elemSize);
+        expand_array_nulls(v, nElems, elemSize, values, zero, nullmap);
+
+        data = new_java_array(type, nElems, values);
+        nulls = (*jenv)->NewLongArray(jenv, nWords);
+        if(nulls != NULL)
+            (*jenv)->SetLongArrayRegion(jenv, nulls, 0, nWords, (jlong*) nullmap);
+
+        pfree(values);
+        pfree(nullmap);
+    } else {
+        data = new_java_array(type, nElems, ARR_DATA_PTR(v));
+    }
+    dims = (*jenv)->NewIntArray(jenv, ndim);
+    if(data == NULL || dims == NULL) {
+        (*jenv)->ExceptionClear(jenv);
+        snprintf(error_msg, 128, "Could not allocate NDArray of %d elements", (int) nElems);
+        return NULL;
+    }
+    (*jenv)->SetIntArrayRegion(jenv, dims, 0, ndim, (jint*) ARR_DIMS(v));
+
+    obj = (*jenv)->NewObject(jenv, ndarray.cls, ndarray.constructor);
+    (*jenv)->SetObjectField(jenv, obj, ndarray.dims, dims);
+    (*jenv)->SetObjectField(jenv, obj, ndarray.data, data);
+    if(nulls != NULL) {
+        (*jenv)->SetObjectField(jenv, obj, ndarray.nulls, nulls);
+        (*jenv)->DeleteLocalRef(jenv, nulls);
+    }
+
+    (*jenv)->DeleteLocalRef(jenv, dims);
+    (*jenv)->DeleteLocalRef(jenv, data);
+
+    return obj;
+}
+
+/*
+    Build a PG array from an NDArray. On failure error_msg is set.
+*/
+Datum ndarray_to_datum(jobject obj, char* error_msg) {
+    jintArray dims;
+    jarray data;
+    int ndim;
+    char type = 0;
+    Size elemSize;
+    Oid elemType;
+    jsize nElems;
+    ArrayType* v;
+
+    if(!ndarray_init(error_msg))
+        return (Datum) 0;
+
+    dims = (jintArray) (*jenv)->GetObjectField(jenv, obj, ndarray.dims);
+    data = (jarray) (*jenv)->GetObjectField(jenv, obj, ndarray.data);
+
+    if(dims == NULL || data == NULL) {
+        snprintf(error_msg, 128, "NDArray without dims or data returned");
+        (*jenv)->DeleteLocalRef(jenv, dims);
+        (*jenv)->DeleteLocalRef(jenv, data);
+        return (Datum) 0;
+    }
+
+    for(int i = 0; i < 5; i++) {
+        if((*jenv)->IsInstanceOf(jenv, data, ndarray.data_cls[i])) {
+            type = ndarray_types[i];
+            break;
+        }
+    }
+
+    // GetArrayLength is only defined for arrays
+    if(type == 0 || !java_array_elem_info(type, &elemSize, &elemType)) {
+        snprintf(error_msg, 128, "NDArray data has to be a primitive numeric array");
+        (*jenv)->DeleteLocalRef(jenv, dims);
+        (*jenv)->DeleteLocalRef(jenv, data);
+        return (Datum) 0;
+    }
+
+    ndim = (*jenv)->GetArrayLength(jenv, dims);
+    nElems = (*jenv)->GetArrayLength(jenv, data);
+
+    // Rank 0 is the empty PG array
+    if(ndim == 0 && nElems == 0) {
+        (*jenv)->DeleteLocalRef(jenv, dims);
+        (*jenv)->DeleteLocalRef(jenv, data);
+        return PointerGetDatum(construct_empty_array(elemType));
+    }
+
+    if(ndim < 1 || ndim > MAXDIM) {
+        snprintf(error_msg, 128, "NDArray rank %d out of range", ndim);
+    } else {
+        int pdims[MAXDIM];
+
+        (*jenv)->GetIntArrayRegion(jenv, dims, 0, ndim, (jint*) pdims);
+        if(ArrayGetNItems(ndim, pdims) != nElems) {
+            snprintf(error_msg, 128, "NDArray dims do not match the %d data elements", (int) nElems);
+        } else {
+            jlongArray nulls = (jlongArray) (*jenv)->GetObjectField(jenv, obj, ndarray.nulls);
+            uint64* nullmap = NULL;
+            int nNulls = 0;
+
+            if(nulls != NULL) {
+                // Bits beyond the java array are not NULL
+                jsize nWords = (nElems + 63) / 64;
+                jsize nGiven = Min((*jenv)->GetArrayLength(jenv, nulls), nWords);
+
+                nullmap = palloc0(nWords * sizeof(uint64));
+                (*jenv)->GetLongArrayRegion(jenv, nulls, 0, nGiven, (jlong*) nullmap);
+                (*jenv)->DeleteLocalRef(jenv, nulls);
+
+                for(int i = 0; i < nElems; i++)
+                    nNulls += ELEM_NULL(nullmap, i);
+            }
+
+            v = createNdArray(ndim, pdims, elemSize, elemType, nNulls);
+            if(nNulls > 0) {
+                char* values = palloc(nElems * elemSize);
+
+                copy_java_array(data, type, values, nElems, elemSize);
+                compact_array_nulls(values, nElems, elemSize, v, nullmap);
+                pfree(values);
+            } else if(nElems > 0) {
+                copy_java_array(data, type, ARR_DATA_PTR(v), nElems, elemSize);
+            }
+            if(nullmap != NULL)
+                pfree(nullmap);
+
+            (*jenv)->DeleteLocalRef(jenv, dims);
+            (*jenv)->DeleteLocalRef(jenv, data);
+            return PointerGetDatum(v);
+        }
+    }
+
+    (*jenv)->DeleteLocalRef(jenv, dims);
+    (*jenv)->DeleteLocalRef(jenv, data);
+    return (Datum) 0;
+}
+
+/*
+    PG array (bytea for byte[]) of a 1D Java array of primitives
+*/
+static Datum java_array_to_datum(jarray arr, char type, char* error_msg) {
+    jsize nElems = (*jenv)->GetArrayLength(jenv, arr);
+    Size elemSize;
+    Oid elemType;
+
+    if(type == 'B') {
+        bytea* b = (bytea*)palloc(nElems + sizeof(int32));
+        SET_VARSIZE(b, nElems + sizeof(int32));
+        if(nElems > 0)
+            copy_java_array(arr, 'B', VARDATA(b), nElems, 1);
+        return PointerGetDatum(b); 
+    }
+
+    if(java_array_elem_info(type, &elemSize, &elemType)) {
+        ArrayType* v = createArray(nElems, elemSize, elemType, false);
+        if(nElems > 0)
+            copy_java_array(arr, type, ARR_DATA_PTR(v), nElems, elemSize);
+        return PointerGetDatum(v);
+    }
+
+    snprintf(error_msg, 128, "Unsupported Java array type [%c", type);
+    return (Datum) 0;
+}
+
+Datum build_datum_from_return_field(bool* primitive, bool* isnull, jobject data, jfieldID fid, const char* sig, char* error_msg) {
     if(sig[0] != '[') {
         // Natives
         *primitive = true;
@@ -242,6 +1213,10 @@ Datum build_datum_from_return_field(bool* primitive, jobject data, jclass cls, c
             case 'L':
                 *primitive = false;
                 jstring string = (*jenv)->GetObjectField(jenv,data,fid);
+                if(string == NULL) {
+                    *isnull = true;
+                    return (Datum) 0;
+                }
                 const char *nativeString = (*jenv)->GetStringUTFChars(jenv, string, 0);
                 
                 int len = strlen(nativeString);
@@ -250,6 +1225,7 @@ Datum build_datum_from_return_field(bool* primitive, jobject data, jclass cls, c
                 memcpy(VARDATA(result), nativeString, len);
 
                 (*jenv)->ReleaseStringUTFChars(jenv, string, nativeString);
+                (*jenv)->DeleteLocalRef(jenv, string);
 
                 return PointerGetDatum( result );
         }
@@ -258,75 +1234,37 @@ Datum build_datum_from_return_field(bool* primitive, jobject data, jclass cls, c
         *primitive = false;
         if(sig[1] != '[') {
             jarray arr;
-            int nElems;
-            ArrayType* v;
+            Datum dat;
             arr = (jarray) (*jenv)->GetObjectField(jenv,data,fid);
-            if(arr != 0) {
-                nElems = (*jenv)->GetArrayLength(jenv, arr) ; 
-            } else {
-                nElems = 0;
+            if(arr == 0) {
+                *isnull = true;
+                return (Datum) 0;
             }
 
-            switch(sig[1]) {
-                case 'B':
-                    bytea* b = (bytea*)palloc(nElems + sizeof(int32));
-                    SET_VARSIZE(b, nElems + sizeof(int32));
-                    if(nElems > 0) {
-                        (*jenv)->GetByteArrayRegion(jenv,arr, 0, nElems, (jbyte*)VARDATA(b));
-                        (*jenv)->DeleteLocalRef(jenv,arr);
-                    }
-                    return PointerGetDatum(b); 
-                case 'I':
-                    v = createArray(nElems, sizeof(jint), INT4OID, false);
-                    if(nElems > 0) {
-                        (*jenv)->GetIntArrayRegion(jenv,arr, 0, nElems, (jint*)ARR_DATA_PTR(v));
-                        (*jenv)->DeleteLocalRef(jenv,arr);
-                    }
-                    return PointerGetDatum(v);
-                case 'J':
-                    v = createArray(nElems, sizeof(jlong), INT8OID, false);
-                    if(nElems > 0) {
-                        (*jenv)->GetLongArrayRegion(jenv,arr, 0, nElems, (jlong*)ARR_DATA_PTR(v));
-                        (*jenv)->DeleteLocalRef(jenv,arr);
-                    }
-                    return PointerGetDatum(v);
-                case 'S':
-                    v = createArray(nElems, sizeof(jshort), INT2OID, false);
-                    if(nElems > 0) {
-                        (*jenv)->GetShortArrayRegion(jenv,arr, 0, nElems, (jshort*)ARR_DATA_PTR(v));
-                        (*jenv)->DeleteLocalRef(jenv,arr);
-                    }
-                    return PointerGetDatum(v);
-                case 'F':
-                    v = createArray(nElems, sizeof(jfloat), FLOAT4OID, false);
-                    if(nElems > 0) {
-                        (*jenv)->GetFloatArrayRegion(jenv,arr, 0, nElems, (jfloat*)ARR_DATA_PTR(v));
-                        (*jenv)->DeleteLocalRef(jenv,arr);
-                    }
-                    return PointerGetDatum(v); 
-                case 'D': 
-                    v = createArray(nElems, sizeof(jdouble), FLOAT8OID, false);
-                    if(nElems > 0) {
-                        (*jenv)->GetDoubleArrayRegion(jenv,arr, 0, nElems, (jdouble*)ARR_DATA_PTR(v));
-                        (*jenv)->DeleteLocalRef(jenv,arr);
-                    }
-                    return PointerGetDatum(v); 
-            }
+            dat = java_array_to_datum(arr, sig[1], error_msg);
+            (*jenv)->DeleteLocalRef(jenv,arr);
+            return dat;
         } else {
             jarray arr;
             int nElems;
             jarray arr0;
             jsize dim2;
             ArrayType* v;
+            Size elemSize;
+            Oid elemType;
            
+            if(!java_array_elem_info(sig[2], &elemSize, &elemType)) {
+                snprintf(error_msg, 128, "Unsupported Java signature %s in composite return",sig);
+                return (Datum) 0;
+            }
+
             arr = (jarray) (*jenv)->GetObjectField(jenv,data,fid);
-            if(arr != 0) { 
-                nElems = (*jenv)->GetArrayLength(jenv, arr); 
-                arr0 = (jarray) (*jenv)->GetObjectArrayElement(jenv,arr,0); 
-            } else {
-                nElems = 1;
-                arr0 = 0;
+            if(arr == 0) {
+                *isnull = true;
+                return (Datum) 0;
             }
+            nElems = (*jenv)->GetArrayLength(jenv, arr); 
+            arr0 = (nElems > 0) ? (jarray) (*jenv)->GetObjectArrayElement(jenv,arr,0) : 0; 
 
             if(arr0 == 0) {
                 dim2 = 0;
@@ -334,475 +1272,930 @@ Datum build_datum_from_return_field(bool* primitive, jobject data, jclass cls, c
             } else
                 dim2 =  (*jenv)->GetArrayLength(jenv, arr0); 
             
-            switch(sig[2]) {
-                case 'F':
-            
-                    v = create2dArray(nElems, dim2, sizeof(jfloat), FLOAT4OID, false);
-
-                    if(dim2 > 0) {
-                        // Copy first dim
-                        (*jenv)->GetFloatArrayRegion(jenv, arr0, 0, dim2, (jfloat*)ARR_DATA_PTR(v));
-                        (*jenv)->DeleteLocalRef(jenv,arr0);
-                        
-                        // Copy remaining
-                        for(int i = 1; i < nElems; i++) {
-                            jfloatArray els =  (jfloatArray) (*jenv)->GetObjectArrayElement(jenv,arr,i); 
-                            (*jenv)->GetFloatArrayRegion(jenv, els, 0, dim2,  (jfloat*) (ARR_DATA_PTR(v)+i*dim2*sizeof(jfloat)) );
-                            (*jenv)->DeleteLocalRef(jenv,els);                  
-                        }
-                       
-                    }
-                    (*jenv)->DeleteLocalRef(jenv,arr);
-                    return PointerGetDatum(v);
-                case 'D':
-            
-                    v = create2dArray(nElems, dim2, sizeof(jdouble), FLOAT8OID, false);
-
-                    if(dim2 > 0) {
-                        // Copy first dim
-                        (*jenv)->GetDoubleArrayRegion(jenv, arr0, 0, dim2, (jdouble*)ARR_DATA_PTR(v));
-                        (*jenv)->DeleteLocalRef(jenv,arr0);
-                        // Copy remaining
-                        for(int i = 1; i < nElems; i++) {
-                            jdoubleArray els =  (jdoubleArray) (*jenv)->GetObjectArrayElement(jenv,arr,i); 
-                            (*jenv)->GetDoubleArrayRegion(jenv, els, 0, dim2,  (jdouble*) (ARR_DATA_PTR(v)+i*dim2*sizeof(jdouble)) );
-                            (*jenv)->DeleteLocalRef(jenv,els);
-                        }
+            v = create2dArray(nElems, dim2, elemSize, elemType, false);
+
+            if(dim2 > 0) {
+                // Java 2D arrays are arrays of rows, each row is copied at once
+                char* dst = ARR_DATA_PTR(v);
+                Size rowSize = dim2 * elemSize;
+
+                copy_java_array(arr0, sig[2], dst, dim2, elemSize);
+                (*jenv)->DeleteLocalRef(jenv,arr0);
+
+                for(int i = 1; i < nElems; i++) {
+                    jarray els = (jarray) (*jenv)->GetObjectArrayElement(jenv,arr,i); 
+
+                    if(els == 0 || (*jenv)->GetArrayLength(jenv, els) != dim2) {
+                        (*jenv)->DeleteLocalRef(jenv,els);
+                        (*jenv)->DeleteLocalRef(jenv,arr);
+                        snprintf(error_msg, 128, "Rows of returned 2D array differ in length");
+                        return (Datum) 0;
                     }
-                    (*jenv)->DeleteLocalRef(jenv,arr);
-                    return PointerGetDatum(v);
 
-                case 'I':
-                 
-                    v = create2dArray(nElems, dim2, sizeof(jint), INT4OID, false);
-
-                    if(dim2 > 0) {
-                        // Copy first dim
-                        (*jenv)->GetIntArrayRegion(jenv, arr0, 0, dim2, (jint*)ARR_DATA_PTR(v));
-                        (*jenv)->DeleteLocalRef(jenv,arr0);
-                        // Copy remaining
-                        for(int i = 1; i < nElems; i++) {
-                            jintArray els =  (jintArray) (*jenv)->GetObjectArrayElement(jenv,arr,i); 
-                            (*jenv)->GetIntArrayRegion(jenv, els, 0, dim2,  (jint*) (ARR_DATA_PTR(v)+i*dim2*sizeof(jint)) );
-                            (*jenv)->DeleteLocalRef(jenv,els);
-                        }
-                    }
-                    (*jenv)->DeleteLocalRef(jenv,arr);
-                    return PointerGetDatum(v);
+                    copy_java_array(els, sig[2], dst + i*rowSize, dim2, elemSize);
+                    (*jenv)->DeleteLocalRef(jenv,els);
+                }
+            }
+            if(arr != 0)
+                (*jenv)->DeleteLocalRef(jenv,arr);
+            return PointerGetDatum(v);
+        }
+
+    }
+
+    snprintf(error_msg, 128, "Unsupported Java signature %s in composite return",sig);
+    return (Datum) 0;
+}
+
+/*
+    Getters of datums from Java object fields
+*/
+static Datum get_int_field(jobject obj, field_plan_entry* field, bool* primitive, bool* isnull, char* error_msg) {
+    *primitive = true;
+    return Int32GetDatum( (*jenv)->GetIntField(jenv, obj, field->fid) );
+}
+
+static Datum get_long_field(jobject obj, field_plan_entry* field, bool* primitive, bool* isnull, char* error_msg) {
+    *primitive = true;
+    return Int64GetDatum( (*jenv)->GetLongField(jenv, obj, field->fid) );
+}
+
+static Datum get_short_field(jobject obj, field_plan_entry* field, bool* primitive, bool* isnull, char* error_msg) {
+    *primitive = true;
+    return Int16GetDatum( (*jenv)->GetShortField(jenv, obj, field->fid) );
+}
+
+static Datum get_float_field(jobject obj, field_plan_entry* field, bool* primitive, bool* isnull, char* error_msg) {
+    *primitive = true;
+    return Float4GetDatum( (*jenv)->GetFloatField(jenv, obj, field->fid) );
+}
+
+static Datum get_double_field(jobject obj, field_plan_entry* field, bool* primitive, bool* isnull, char* error_msg) {
+    *primitive = true;
+    return Float8GetDatum( (*jenv)->GetDoubleField(jenv, obj, field->fid) );
+}
+
+static Datum get_bool_field(jobject obj, field_plan_entry* field, bool* primitive, bool* isnull, char* error_msg) {
+    *primitive = true;
+    return BoolGetDatum( (*jenv)->GetBooleanField(jenv, obj, field->fid) );
+}
+
+static Datum get_ndarray_field(jobject obj, field_plan_entry* field, bool* primitive, bool* isnull, char* error_msg) {
+    jobject arr = (*jenv)->GetObjectField(jenv, obj, field->fid);
+    Datum dat;
+
+    *primitive = false;
+    if(arr == NULL) {
+        *isnull = true;
+        return (Datum) 0;
+    }
+
+    dat = ndarray_to_datum(arr, error_msg);
+    (*jenv)->DeleteLocalRef(jenv, arr);
+
+    return dat;
+}
+
+static Datum get_object_field(jobject obj, field_plan_entry* field, bool* primitive, bool* isnull, char* error_msg) {
+    return build_datum_from_return_field(primitive, isnull, obj, field->fid, field->sig, error_msg);
+}
+
+static Datum get_boxed_field(jobject obj, field_plan_entry* field, bool* primitive, bool* isnull, char* error_msg) {
+    jobject box = (*jenv)->GetObjectField(jenv, obj, field->fid);
+    Datum dat;
+
+    *primitive = true;
+    if(box == NULL) {
+        *isnull = true;
+        return (Datum) 0;
+    }
+
+    dat = unbox_jobject(field->sig, box);
+    (*jenv)->DeleteLocalRef(jenv, box);
+
+    return dat;
+}
+
+/*
+    Select getter for JNI signature (NULL if not supported)
+*/
+static field_getter getter_for_signature(const char* sig) {
+    if(sig[0] != '[') {
+        switch(sig[0]) {
+            case 'I':
+                return get_int_field;
+            case 'J':
+                return get_long_field;
+            case 'S':
+                return get_short_field;
+            case 'F':
+                return get_float_field;
+            case 'D':
+                return get_double_field;
+            case 'Z':
+                return get_bool_field;
+            case 'L':
+                if(strcmp(sig,"Ljava/lang/String;") == 0)
+                    return get_object_field;
+                if(strcmp(sig,NDARRAY_SIG) == 0)
+                    return get_ndarray_field;
+                if(boxed_primitive(sig) != 0)
+                    return get_boxed_field;
+        }
+    } else if(sig[1] != '[') {
+        switch(sig[1]) {
+            case 'B':
+            case 'I':
+            case 'J':
+            case 'S':
+            case 'F':
+            case 'D':
+                return get_object_field;
+        }
+    } else {
+        switch(sig[2]) {
+            case 'I':
+            case 'J':
+            case 'S':
+            case 'F':
+            case 'D':
+                return get_object_field;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Build marshaling plan for the public fields of a Java class. Fields are
+    mapped by position to the attributes of tupdesc, or (by_name) only by their
+    lower case name as for composite arguments. The plan is malloc'ed and pins
+    the class by a global reference.
+*/
+field_plan* build_field_plan(jclass cls, TupleDesc tupdesc, bool by_name, char* error_msg) {
+    field_plan* plan;
+    jmethodID getFields;
+    jobjectArray fieldsList;
+    jsize len;
+
+    getFields = (*jenv)->GetMethodID(jenv, (*jenv)->GetObjectClass(jenv,cls), "getFields", "()[Ljava/lang/reflect/Field;");
+    fieldsList = (jobjectArray) (*jenv)->CallObjectMethod(jenv, cls, getFields); 
+    len = (*jenv)->GetArrayLength(jenv,fieldsList);
+
+    if(len == 0) {
+        strcpy(error_msg,"Java class has no public fields");
+        return NULL;
+    }
+
+    plan = (field_plan*) malloc(offsetof(field_plan, fields) + len * sizeof(field_plan_entry));
+    if(plan == NULL) {
+        strcpy(error_msg,"Out of memory for field plan");
+        return NULL;
+    }
+
+    plan->cls = (jclass) (*jenv)->NewGlobalRef(jenv, cls);
+    plan->constructor = (*jenv)->GetMethodID(jenv, cls, "<init>", "()V");
+    if(plan->constructor == NULL) {
+        // Only needed for arguments
+        (*jenv)->ExceptionClear(jenv);
+    }
+    plan->typid = (tupdesc != NULL) ? tupdesc->tdtypeid : InvalidOid;
+    plan->natts = (tupdesc != NULL) ? tupdesc->natts : len;
+    plan->nfields = len;
+
+    for(int i = 0; i < len; i++) {
+        field_plan_entry* f = &plan->fields[i];
+        const char* sig;
+
+        // Detect field
+        jobject field = (*jenv)->GetObjectArrayElement(jenv, fieldsList, i);
+        jclass fieldClass = (*jenv)->GetObjectClass(jenv, field);
+    
+        // Obtain signature
+        jmethodID m =  (*jenv)->GetMethodID(jenv, fieldClass, "getName", "()Ljava/lang/String;");   
+        jstring jstr = (jstring)(*jenv)->CallObjectMethod(jenv, field, m);
+        const char* fieldname =  (*jenv)->GetStringUTFChars(jenv, jstr, false);
+    
+        m =  (*jenv)->GetMethodID(jenv, fieldClass, "getType", "()Ljava/lang/Class;");   
+        jobject value = (*jenv)->CallObjectMethod(jenv, field, m);
+        jclass  valueClass = (*jenv)->GetObjectClass(jenv, value);
+
+        m =  (*jenv)->GetMethodID(jenv, valueClass, "getName", "()Ljava/lang/String;");   
+        jstring jstr2 = (jstring)(*jenv)->CallObjectMethod(jenv, value, m);
+        const char* typename =  (*jenv)->GetStringUTFChars(jenv, jstr2, false);
+    
+        sig = convert_name_to_JNI_signature(typename, error_msg);
+        if(sig == NULL) {
+            (*jenv)->ReleaseStringUTFChars(jenv, jstr, fieldname);
+            (*jenv)->ReleaseStringUTFChars(jenv, jstr2, typename);
+            free_field_plan(plan);
+            return NULL;
+        }
+
+        strlcpy(f->sig, sig, sizeof(f->sig));
+        strlcpy(f->name, fieldname, sizeof(f->name));
+        f->fid = (*jenv)->GetFieldID(jenv, cls, fieldname, f->sig);
+        f->set = setter_for_signature(f->sig);
+        f->get = getter_for_signature(f->sig);
+
+        (*jenv)->ReleaseStringUTFChars(jenv, jstr, fieldname);
+        (*jenv)->ReleaseStringUTFChars(jenv, jstr2, typename);
+        (*jenv)->DeleteLocalRef(jenv, jstr);
+        (*jenv)->DeleteLocalRef(jenv, jstr2);
+        (*jenv)->DeleteLocalRef(jenv, valueClass);
+        (*jenv)->DeleteLocalRef(jenv, value);
+        (*jenv)->DeleteLocalRef(jenv, fieldClass);
+        (*jenv)->DeleteLocalRef(jenv, field);
+
+        // Convert fieldname to lower case for PG lookup
+        for(int k = 0; k < strlen(f->name); k++) {
+            f->name[k] = tolower(f->name[k]);
+        } 
+
+        // Map to attribute
+        f->attnum = (i < plan->natts) ? i+1 : 0;
+        f->byval = false;
+        if(tupdesc != NULL && by_name) {
+            f->attnum = 0;
+            for(int a = 0; a < tupdesc->natts; a++) {
+                Form_pg_attribute att = TupleDescAttr(tupdesc, a);
+                if(!att->attisdropped && strcmp(NameStr(att->attname), f->name) == 0) {
+                    f->attnum = a+1;
+                    break;
+                }
+            }
+        }
+        if(tupdesc != NULL && f->attnum > 0) {
+            f->byval = TupleDescAttr(tupdesc, f->attnum-1)->attbyval;
+        }
+    }
+
+    (*jenv)->DeleteLocalRef(jenv, fieldsList);
+
+    return plan;
+}
+
+void free_field_plan(field_plan* plan) {
+    if(plan == NULL)
+        return;
+
+    if(plan->cls != NULL && jenv != NULL)
+        (*jenv)->DeleteGlobalRef(jenv, plan->cls);
+
+    free(plan);
+}
+
+/*
+    Release all JNI state of a java function
+*/
+void release_java_function_cache(java_function_cache* jcache) {
+    release_java_method(&jcache->clazz, &jcache->methodID);
+
+    free_field_plan(jcache->ret_plan);
+    jcache->ret_plan = NULL;
+
+    for(int i = 0; i < jcache->n_arg_plans; i++) {
+        free_field_plan(jcache->arg_plans[i]);
+    }
+    free(jcache->arg_plans);
+    jcache->arg_plans = NULL;
+    jcache->n_arg_plans = 0;
+}
+
+static bool field_plan_matches(field_plan* plan, TupleDesc tupdesc) {
+    if(tupdesc == NULL)
+        return true;
+
+    return plan->typid == tupdesc->tdtypeid && plan->natts == tupdesc->natts;
+}
+
+/*
+    Get (or build) plan for the class of a returned object
+*/
+field_plan* lookup_return_field_plan(java_function_cache* jcache, jobject obj, TupleDesc tupdesc, char* error_msg) {
+    field_plan* plan = jcache->ret_plan;
+    jclass cls = (*jenv)->GetObjectClass(jenv, obj);
+
+    if(plan == NULL || !field_plan_matches(plan, tupdesc) || !(*jenv)->IsSameObject(jenv, plan->cls, cls)) {
+        free_field_plan(plan);
+        plan = build_field_plan(cls, tupdesc, false, error_msg);
+        jcache->ret_plan = plan;
+    }
+
+    (*jenv)->DeleteLocalRef(jenv, cls);
+
+    return plan;
+}
+
+/*
+    Get (or build) plan for the class of argument arg given by its signature
+*/
+field_plan* lookup_arg_field_plan(java_function_cache* jcache, int nargs, int arg, const char* class_sig, TupleDesc tupdesc, char* error_msg) {
+    field_plan* plan;
+
+    if(jcache->arg_plans == NULL) {
+        jcache->arg_plans = (field_plan**) calloc(nargs, sizeof(field_plan*));
+        jcache->n_arg_plans = nargs;
+    }
+
+    plan = jcache->arg_plans[arg];
+
+    if(plan == NULL || !field_plan_matches(plan, tupdesc)) {
+        char buf[256];
+        int len = strlen(class_sig);
+        jclass cls;
+
+        // Strip L...; of signature
+        if(class_sig[0] == 'L' && class_sig[len-1] == ';') {
+            strlcpy(buf, class_sig+1, Min(len-1, sizeof(buf)));
+        } else {
+            strlcpy(buf, class_sig, sizeof(buf));
+        }
+
+        cls = (*jenv)->FindClass(jenv, buf);
+        if(cls == NULL) {
+            (*jenv)->ExceptionClear(jenv);
+            snprintf(error_msg, 128, "Java class %s not known", buf);
+            return NULL;
+        }
 
-                case 'J':
-              
-                    v = create2dArray(nElems, dim2, sizeof(jlong), INT8OID, false);
-
-                    if(dim2 > 0) {
-                        // Copy first dim
-                        (*jenv)->GetLongArrayRegion(jenv, arr0, 0, dim2, (jlong*)ARR_DATA_PTR(v));
-                        (*jenv)->DeleteLocalRef(jenv,arr0);
-                        // Copy remaining
-                        for(int i = 1; i < nElems; i++) {
-                            jlongArray els =  (jlongArray) (*jenv)->GetObjectArrayElement(jenv,arr,i); 
-                            (*jenv)->GetLongArrayRegion(jenv, els, 0, dim2,  (jlong*) (ARR_DATA_PTR(v)+i*dim2*sizeof(jlong)) );
-                            (*jenv)->DeleteLocalRef(jenv,els);
-                        }
-                    }
-                    (*jenv)->DeleteLocalRef(jenv,arr);
-                    return PointerGetDatum(v);
+        free_field_plan(plan);
+        plan = build_field_plan(cls, tupdesc, true, error_msg);
+        jcache->arg_plans[arg] = plan;
 
-                case 'S':
-                    
-                    v = create2dArray(nElems, dim2, sizeof(jshort), INT2OID, false);
-
-                    if(dim2 > 0) {
-                        // Copy first dim
-                        (*jenv)->GetShortArrayRegion(jenv, arr0, 0, dim2, (jshort*)ARR_DATA_PTR(v));
-                        (*jenv)->DeleteLocalRef(jenv,arr0);
-                        // Copy remaining
-                        for(int i = 1; i < nElems; i++) {
-                            jshortArray els =  (jshortArray) (*jenv)->GetObjectArrayElement(jenv,arr,i); 
-                            (*jenv)->GetShortArrayRegion(jenv, els, 0, dim2,  (jshort*) (ARR_DATA_PTR(v)+i*dim2*sizeof(jshort)) );
-                            (*jenv)->DeleteLocalRef(jenv,els);
-                        }
-                    }
-                    (*jenv)->DeleteLocalRef(jenv,arr);
-                    return PointerGetDatum(v);
-            }
+        (*jenv)->DeleteLocalRef(jenv, cls);
+    }
+
+    return plan;
+}
+
+/*
+    Read all fields of a Java object into datums according to plan
+*/
+int fill_datums_from_jobject(field_plan* plan, jobject obj, Datum* values, bool* primitive, bool* nulls, int nvalues, char* error_msg) {
+    for(int i = 0; i < plan->nfields; i++) {
+        field_plan_entry* f = &plan->fields[i];
+
+        if(f->attnum < 1 || f->attnum > nvalues) {
+            snprintf(error_msg, 128, "Field %s of Java class has no corresponding attribute", f->name);
+            return -5;
+        }
+
+        if(f->get == NULL) {
+            snprintf(error_msg, 128, "Unsupported Java signature %s in composite return", f->sig);
+            return -5;
         }
 
+        error_msg[0] = '\0';
+        nulls[f->attnum-1] = false;
+        values[f->attnum-1] = f->get(obj, f, &primitive[f->attnum-1], &nulls[f->attnum-1], error_msg);
+        if(error_msg[0] != '\0')
+            return -5;
     }
 
-    snprintf(error_msg, 256, "Unsupported Java signature %s in composite return",sig);
-    return (Datum) 0;
+    return 0;
+}
+
+/*
+    Set all fields of a Java object from deformed tuple according to plan
+*/
+void fill_jobject_from_datums(field_plan* plan, jobject obj, Datum* values, bool* nulls, int nvalues) {
+    for(int i = 0; i < plan->nfields; i++) {
+        field_plan_entry* f = &plan->fields[i];
+
+        if(f->attnum < 1 || f->attnum > nvalues) {
+            elog(ERROR,"No attribute %s in supplied composite argument",f->name);
+        }
+
+        if(nulls[f->attnum-1]) {
+            // Object fields stay null
+            if(f->sig[0] != 'L' && f->sig[0] != '[')
+                elog(ERROR,"Attribute %s of composite type is null, but the Java field is primitive",f->name);
+            continue;
+        }
+
+        if(f->set == NULL) {
+            elog(ERROR,"Datum can not be converted to Java object (%s)",f->sig);
+        }
+
+        f->set(obj, f->fid, values[f->attnum-1]);
+    }
 }
 
-// ToDo: Iterator / setof multi-row return
-int call_java_function(Datum* values, bool* primitive, char* class_name, char* method_name, char* signature, char* return_type, jvalue* args, char* error_msg) {
-    jmethodID methodID;
+/*
+    Resolve class and static method of a java function. The class is pinned
+    by a global reference, so that the result can be cached across calls.
+    Nothing is done if clazz and methodID are already set.
+*/
+int resolve_java_method(jclass* clazz, jmethodID* methodID, char* class_name, char* method_name, char* signature, char* error_msg) {
+    jclass cls;
+    jmethodID mid;
+
+    if(*clazz != NULL && *methodID != NULL)
+        return 0;
 
-    // Prep and call function
-    jclass clazz = (*jenv)->FindClass(jenv, class_name);
+    cls = (*jenv)->FindClass(jenv, class_name);
 
-    if(clazz == NULL) {
+    if(cls == NULL) {
+        (*jenv)->ExceptionClear(jenv);
         elog(WARNING,"Java class %s not found !",class_name);
         snprintf(error_msg, 128, "Java class %s not found", class_name);
         return -1;
     }
 
-    methodID = (*jenv)->GetStaticMethodID(jenv, clazz, method_name, signature);
+    mid = (*jenv)->GetStaticMethodID(jenv, cls, method_name, signature);
 
-    if(methodID == NULL) {
+    if(mid == NULL) {
+        (*jenv)->ExceptionClear(jenv);
+        (*jenv)->DeleteLocalRef(jenv, cls);
         elog(WARNING,"Java method %s with signature %s not found",method_name, signature);
         snprintf(error_msg, 128, "Java method %s with signature %s not found",method_name, signature);
         return -2;
     }
-       
+
+    *clazz = (jclass) (*jenv)->NewGlobalRef(jenv, cls);
+    *methodID = mid;
+    (*jenv)->DeleteLocalRef(jenv, cls);
+
+    return 0;
+}
+
+/*
+    Release a class and method resolved by resolve_java_method
+*/
+void release_java_method(jclass* clazz, jmethodID* methodID) {
+    if(*clazz != NULL && jenv != NULL) {
+        (*jenv)->DeleteGlobalRef(jenv, *clazz);
+    }
+    *clazz = NULL;
+    *methodID = NULL;
+}
+
+/*
+    True if the java method returns an object (reference in jvalue.l)
+*/
+bool java_return_is_object(const char* return_type) {
+    return !(strcmp(return_type, "J") == 0 || strcmp(return_type, "I") == 0 ||
+             strcmp(return_type, "D") == 0 || strcmp(return_type, "F") == 0 ||
+             strcmp(return_type, "Z") == 0 || strcmp(return_type, "V") == 0);
+}
+
+/*
+    Invoke a resolved static java method. Only JNI calls on env are made, so
+    this can run on any thread attached to the JVM. Object results are local
+    references of env, exceptions are left pending (return 1).
+*/
+int invoke_java_method(JNIEnv* env, jclass clazz, jmethodID methodID, const char* return_type, jvalue* args, jvalue* ret) {
     // Note: Keep non-switch for now for future extension to arrays
 
     if(strcmp(return_type, "J") == 0) {
-    
-        jlong ret = (*jenv)->CallStaticLongMethodA(jenv, clazz, methodID, args);
-        
-        // Catch exception
-        if( (*jenv)->ExceptionCheck(jenv) ) {
-            return 1;
-        }
-        
-        primitive[0] = true;
-        values[0] = Int64GetDatum( ret );
-    
-        return 0;
+        ret->j = (*env)->CallStaticLongMethodA(env, clazz, methodID, args);
+    } else if(strcmp(return_type, "I") == 0) {
+        ret->i = (*env)->CallStaticIntMethodA(env, clazz, methodID, args);
+    } else if(strcmp(return_type, "D") == 0) {
+        ret->d = (*env)->CallStaticDoubleMethodA(env, clazz, methodID, args);
+    } else if(strcmp(return_type, "F") == 0) {
+        ret->f = (*env)->CallStaticFloatMethodA(env, clazz, methodID, args);
+    } else if(strcmp(return_type, "Z") == 0) {
+        ret->z = (*env)->CallStaticBooleanMethodA(env, clazz, methodID, args);
+    } else if(strcmp(return_type, "V") == 0) {
+        (*env)->CallStaticVoidMethodA(env, clazz, methodID, args);
+    } else {
+        ret->l = (*env)->CallStaticObjectMethodA(env, clazz, methodID, args);
+    }
+
+    // Catch exception
+    if( (*env)->ExceptionCheck(env) ) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+    Convert the result of invoke_java_method to datums (PG memory, so only
+    on the backend or worker main thread). Object references are not released.
+    ret_null is set if Java returned null, the whole result is SQL NULL then.
+*/
+int convert_java_result(Datum* values, bool* primitive, bool* nulls, bool* ret_null, int nvalues, TupleDesc tupdesc, java_function_cache* jcache, const char* return_type, jvalue* ret, char* error_msg) {
+    memset(nulls, 0, nvalues * sizeof(bool));
+    *ret_null = java_return_is_object(return_type) && ret->l == NULL;
 
+    if(strcmp(return_type, "J") == 0) {
+        primitive[0] = true;
+        values[0] = Int64GetDatum( ret->j );
     } else if(strcmp(return_type, "I") == 0) {
-        jint ret = (*jenv)->CallStaticIntMethodA(jenv, clazz, methodID, args);
-      
-        // Catch exception
-        if( (*jenv)->ExceptionCheck(jenv) ) {
-            return 1;
-        }
-        
         primitive[0] = true;
-        values[0] = Int32GetDatum( ret );
-    
-        return 0;
-    
+        values[0] = Int32GetDatum( ret->i );
     } else if(strcmp(return_type, "D") == 0) {
-    
-        jdouble ret = (*jenv)->CallStaticDoubleMethodA(jenv, clazz, methodID, args);
-        
-        // Catch exception
-        if( (*jenv)->ExceptionCheck(jenv) ) {
-            return 1;
-        }
-        
         primitive[0] = true;
-        values[0] = Float8GetDatum( ret );
-    
-        return 0;
-    
+        values[0] = Float8GetDatum( ret->d );
     } else if(strcmp(return_type, "F") == 0) {
-    
-        jfloat ret = (*jenv)->CallStaticFloatMethodA(jenv, clazz, methodID, args);
-        
-        // Catch exception
-        if( (*jenv)->ExceptionCheck(jenv) ) {
-            return 1;
-        }
-        
         primitive[0] = true;
-        values[0] = Float4GetDatum( ret );
-    
-        return 0;
-    
+        values[0] = Float4GetDatum( ret->f );
     } else if(strcmp(return_type, "Z") == 0) {
-    
-        jboolean ret = (*jenv)->CallStaticBooleanMethodA(jenv, clazz, methodID, args);
-        
-        // Catch exception
-        if( (*jenv)->ExceptionCheck(jenv) ) {
-            return 1;
-        }
-        
         primitive[0] = true;
-        values[0] = BoolGetDatum( ret );
-    
-        return 0;
-
+        values[0] = BoolGetDatum( ret->z );
     } else if(strcmp(return_type, "V") == 0) {
-        (*jenv)->CallStaticVoidMethodA(jenv, clazz, methodID, args);
-        
-        // Catch exception
-        if( (*jenv)->ExceptionCheck(jenv) ) {
-            return 1;
-        }
-
-        return 0;
-
+        // Nothing to return
+        primitive[0] = true;
+        values[0] = (Datum) 0;
     } else if(strcmp(return_type, "Ljava/lang/String;") == 0) {
         const char* str;
         int len;
         text *result;
 
-        jobject ret = (*jenv)->CallStaticObjectMethodA(jenv, clazz, methodID, args);
-     
-        // Catch exception
-        if( (*jenv)->ExceptionCheck(jenv) ) {
-            return 1;
-        }
-        
-        if(ret == NULL) {
-            strcpy(error_msg,"Null pointer returned from java function call");
-            return -3;
+        if(ret->l == NULL) {
+            nulls[0] = true;
+            values[0] = (Datum) 0;
+            return 0;
         }
         
-        str =  (*jenv)->GetStringUTFChars(jenv, ret, false);
+        str =  (*jenv)->GetStringUTFChars(jenv, ret->l, false);
         
         len = strlen(str);
         result = (text *) palloc(len + VARHDRSZ);
         SET_VARSIZE(result, len + VARHDRSZ);
         memcpy(VARDATA(result), str, len);
 
-        (*jenv)->ReleaseStringUTFChars(jenv, ret, str);
+        (*jenv)->ReleaseStringUTFChars(jenv, ret->l, str);
 
         values[0] = (Datum) result; 
-        
-        return 0;
-
-    /*} 
-        // TO BE DONE ...
-        // Problem for BG worker: limited space in queue package -> Distribute over several
-
-        else if(strcmp(return_type,"ITER") == 0) {
-        
-        jobject ret = (*jenv)->CallStaticObjectMethodA(jenv, clazz, methodID, args);
-
-        // Catch exception
-        if( (*jenv)->ExceptionCheck(jenv) ) {
-            return 1;
+    } else if(boxed_primitive(return_type) != 0) {
+        primitive[0] = true;
+        if(ret->l == NULL) {
+            nulls[0] = true;
+            values[0] = (Datum) 0;
+        } else {
+            values[0] = unbox_jobject(return_type, ret->l);
+        }
+    } else if(is_value_class(return_type) || (return_type[0] == '[' && return_type[1] != '[' && return_type[1] != 'L')) {
+        // Value object or 1D array
+        primitive[0] = false;
+        if(ret->l == NULL) {
+            nulls[0] = true;
+            values[0] = (Datum) 0;
+            return 0;
         }
 
-        // Analyis return
-        jclass cls = (*jenv)->GetObjectClass(jenv, ret);
-        
-        // Iterator
-        jmethodID hasNext = (*jenv)->GetMethodID(jenv, cls, "hasNext", "()Z");
-	    jmethodID next = (*jenv)->GetMethodID(jenv, cls, "next", "()Ljava/lang/Object;");
+        error_msg[0] = '\0';
+        if(return_type[0] == '[')
+            values[0] = java_array_to_datum((jarray) ret->l, return_type[1], error_msg);
+        else
+            values[0] = jobject_to_value(return_type, ret->l, error_msg);
+        return (error_msg[0] != '\0') ? -4 : 0;
+    } else {
+        field_plan* plan;
 
-        if(hasNext == NULL || next == NULL) {
-            // ToDo: CLEAN RETURN WITH ERROR MSG !
-            elog(ERROR,"Object returned is not iterator");
+        // SQL NULL (all attributes of a composite)
+        if(ret->l == NULL) {
+            for(int i = 0; i < nvalues; i++) {
+                nulls[i] = true;
+                values[i] = (Datum) 0;
+            }
+            return 0;
         }
 
-        bool hasNext = (bool) (*jenv)->CallBooleanMethod(jenv, cls, hasNext);
- 
-        if(hasNext) {
-            // ToDo: Set function to return one item per call ?        
-        
+        // Array of any rank, known from the signature
+        if(strcmp(return_type, NDARRAY_SIG) == 0) {
+            primitive[0] = false;
+            error_msg[0] = '\0';
+            values[0] = ndarray_to_datum(ret->l, error_msg);
+            return (error_msg[0] != '\0') ? -4 : 0;
         }
-    */    
-    }  else {
-        jclass cls;
-        jmethodID getFields;
-        jobjectArray fieldsList;
-        jsize len;
 
-        jobject ret = (*jenv)->CallStaticObjectMethodA(jenv, clazz, methodID, args);
-     
-        // Catch exception
-        if( (*jenv)->ExceptionCheck(jenv) ) {
-            return 1;
-        }
-        
-        if(ret == NULL) {
-            strcpy(error_msg,"Null pointer returned from java function call");
-            return -3;
+        // Composite return
+        plan = lookup_return_field_plan(jcache, ret->l, tupdesc, error_msg);
+        if(plan == NULL) {
+            return -4;
         }
 
-        // Analyis return
-        // ToDo: Move into helper function
-        cls = (*jenv)->GetObjectClass(jenv, ret);
-
-        getFields = (*jenv)->GetMethodID(jenv, (*jenv)->GetObjectClass(jenv,cls), "getFields", "()[Ljava/lang/reflect/Field;");
+        return fill_datums_from_jobject(plan, ret->l, values, primitive, nulls, nvalues, error_msg);
+    }
 
-        fieldsList = (jobjectArray)  (*jenv)->CallObjectMethod(jenv, cls, getFields); 
-        
-        len =  (*jenv)->GetArrayLength(jenv,fieldsList);
+    return 0;
+}
 
-        if(len == 0) {
-                strcpy(error_msg,"Empty composite return");
-                return -4;
-        } else {
-            // Composite return
-            for(int i = 0; i < len; i++) {
-                
-                // ToDo: Move into helper function ?
+int call_java_function(Datum* values, bool* primitive, bool* nulls, bool* ret_null, int nvalues, TupleDesc tupdesc, java_function_cache* jcache, char* class_name, char* method_name, char* signature, char* return_type, jvalue* args, char* error_msg) {
+    jvalue ret;
 
-                // Detect field
-                jobject field = (*jenv)->GetObjectArrayElement(jenv, fieldsList, i);
-                jclass fieldClass = (*jenv)->GetObjectClass(jenv, field);
-            
-                // Obtain signature
-                jmethodID m =  (*jenv)->GetMethodID(jenv, fieldClass, "getName", "()Ljava/lang/String;");   
-                jstring jstr = (jstring)(*jenv)->CallObjectMethod(jenv, field, m);
-            
-                const char* fieldname =  (*jenv)->GetStringUTFChars(jenv, jstr, false);
-            
-                m =  (*jenv)->GetMethodID(jenv, fieldClass, "getType", "()Ljava/lang/Class;");   
-                jobject value = (*jenv)->CallObjectMethod(jenv, field, m);
-                jclass  valueClass = (*jenv)->GetObjectClass(jenv, value);
+    // Resolve function (cached by caller)
+    int rc = resolve_java_method(&jcache->clazz, &jcache->methodID, class_name, method_name, signature, error_msg);
+    if(rc != 0) {
+        return rc;
+    }
 
-                m =  (*jenv)->GetMethodID(jenv, valueClass, "getName", "()Ljava/lang/String;");   
-                jstring jstr2 = (jstring)(*jenv)->CallObjectMethod(jenv, value, m);
-                const char* typename =  (*jenv)->GetStringUTFChars(jenv, jstr2, false);
-            
-                const char* sig = convert_name_to_JNI_signature(typename, error_msg);
-                if(sig == NULL) {
-                    // Cleanup
-                    (*jenv)->ReleaseStringUTFChars(jenv, jstr, fieldname);
-                    (*jenv)->ReleaseStringUTFChars(jenv, jstr2, typename);
-                    return -4;
-                }
+    rc = invoke_java_method(jenv, jcache->clazz, jcache->methodID, return_type, args, &ret);
+    if(rc != 0) {
+        return rc;
+    }
 
-                values[i] = build_datum_from_return_field(&primitive[i], ret, cls, fieldname, sig, error_msg);
-                if(values == NULL) {
-                    // Cleanup
-                    (*jenv)->ReleaseStringUTFChars(jenv, jstr, fieldname);
-                    (*jenv)->ReleaseStringUTFChars(jenv, jstr2, typename);
-                    return -5;
-                }
+    rc = convert_java_result(values, primitive, nulls, ret_null, nvalues, tupdesc, jcache, return_type, &ret, error_msg);
 
-                // Cleanup
-                (*jenv)->ReleaseStringUTFChars(jenv, jstr, fieldname);
-                (*jenv)->ReleaseStringUTFChars(jenv, jstr2, typename);
-            }
-        }
+    if(java_return_is_object(return_type) && ret.l != NULL) {
+        (*jenv)->DeleteLocalRef(jenv, ret.l);
     }
 
-    return 0;
+    return rc;
 }
 
 /*
-    Call java function with iterator return (ONLY FOR FG WORKER !)
+    Call java function returning an iterator. The iterator is kept as global 
+    reference, so that rows can be pulled across executor calls.
 */
-int call_iter_java_function(Tuplestorestate* tupstore, TupleDesc tupdesc, char* class_name, char* method_name, char* signature, jvalue* args, char* error_msg) {
-    jclass clazz;
-    jmethodID methodID;
+int open_iter_java_function(java_iterator* it, java_function_cache* jcache, char* class_name, char* method_name, char* signature, jvalue* args, char* error_msg) {
     jobject ret;
     jclass cls;
-    
-    jmethodID hasNextF;
-    jmethodID nextF;
-    
-    bool hasNext;
-
-    // Prep and call function
-    clazz = (*jenv)->FindClass(jenv, class_name);
-
-    if(clazz == NULL) {
-        elog(WARNING,"Java class %s not found !",class_name);
-        snprintf(error_msg, 128, "Java class %s not found", class_name);
-        return -1;
-    }
 
-    methodID = (*jenv)->GetStaticMethodID(jenv, clazz, method_name, signature);
+    it->iter = NULL;
 
-    if(methodID == NULL) {
-        elog(WARNING,"Java method %s with signature %s not found !",method_name, signature);
-        snprintf(error_msg, 128, "Java method %s with signature %s not found",method_name, signature);
-        return -2;
+    // Resolve function (cached by caller)
+    int rc = resolve_java_method(&jcache->clazz, &jcache->methodID, class_name, method_name, signature, error_msg);
+    if(rc != 0) {
+        return rc;
     }
 
-    ret = (*jenv)->CallStaticObjectMethodA(jenv, clazz, methodID, args);
+    ret = (*jenv)->CallStaticObjectMethodA(jenv, jcache->clazz, jcache->methodID, args);
 
     // Catch exception
     if( (*jenv)->ExceptionCheck(jenv) ) {
         return 1;
     }
 
+    if(ret == NULL) {
+        strcpy(error_msg,"Null pointer returned from java function call");
+        return -3;
+    }
+
     // Analyis return
     cls = (*jenv)->GetObjectClass(jenv, ret);
     
     // Iterator
-    hasNextF = (*jenv)->GetMethodID(jenv, cls, "hasNext", "()Z");
-    nextF = (*jenv)->GetMethodID(jenv, cls, "next", "()Ljava/lang/Object;");
+    it->hasNextF = (*jenv)->GetMethodID(jenv, cls, "hasNext", "()Z");
+    it->nextF = (*jenv)->GetMethodID(jenv, cls, "next", "()Ljava/lang/Object;");
+
+    (*jenv)->DeleteLocalRef(jenv, cls);
 
-    if(hasNextF == NULL || nextF == NULL) {
+    if(it->hasNextF == NULL || it->nextF == NULL) {
+        (*jenv)->ExceptionClear(jenv);
+        (*jenv)->DeleteLocalRef(jenv, ret);
         strcpy(error_msg,"Java object returned is not an iterator");
         return -6;
     }
+
+    it->iter = (*jenv)->NewGlobalRef(jenv, ret);
+    (*jenv)->DeleteLocalRef(jenv, ret);
+
+    return 0;
+}
+
+/*
+    Pull next row of an iterator into datums (done is set at the end).
+    tupdesc may be NULL in bg workers, fields are then taken in class order.
+*/
+int next_iter_java_function(Datum* values, bool* primitive, bool* nulls, int nvalues, bool* done, java_iterator* it, TupleDesc tupdesc, java_function_cache* jcache, char* error_msg) {
+    field_plan* plan;
+    jobject row;
+    int res;
+    bool hasNext;
+
+    hasNext = (bool) (*jenv)->CallBooleanMethod(jenv, it->iter, it->hasNextF);
+
+    if( (*jenv)->ExceptionCheck(jenv) ) {
+        return 1;
+    }
+
+    if(!hasNext) {
+        *done = true;
+        return 0;
+    }
+
+    *done = false;
+
+    // Get row object        
+    row = (*jenv)->CallObjectMethod(jenv, it->iter, it->nextF);
     
-    hasNext = (bool) (*jenv)->CallBooleanMethod(jenv, ret, hasNextF);
+    if( (*jenv)->ExceptionCheck(jenv) ) {
+        return 1;
+    }
 
-    while(hasNext) {
-        // Get row object        
-        jobject row = (*jenv)->CallObjectMethod(jenv, ret, nextF);
-        jclass rcls = (*jenv)->GetObjectClass(jenv, row);
-        
-        // Prepare row
-        jmethodID getFields = (*jenv)->GetMethodID(jenv, (*jenv)->GetObjectClass(jenv, rcls), "getFields", "()[Ljava/lang/reflect/Field;");
+    // Row of NULLs
+    if(row == NULL) {
+        for(int i = 0; i < nvalues; i++)
+            nulls[i] = true;
+        return 0;
+    }
 
-        jobjectArray fieldsList = (jobjectArray)  (*jenv)->CallObjectMethod(jenv, rcls, getFields); 
-  
-        jsize len =  (*jenv)->GetArrayLength(jenv,fieldsList);
+    // Plan is only rebuilt if the row class changes
+    plan = lookup_return_field_plan(jcache, row, tupdesc, error_msg);
+    if(plan == NULL) {
+        (*jenv)->DeleteLocalRef(jenv, row);
+        return -4;
+    }
+
+    memset(nulls, 0, nvalues * sizeof(bool));
+    res = fill_datums_from_jobject(plan, row, values, primitive, nulls, nvalues, error_msg);
+    (*jenv)->DeleteLocalRef(jenv, row);
+
+    return res;
+}
+
+void close_iter_java_function(java_iterator* it) {
+    if(it->iter != NULL && jenv != NULL) {
+        (*jenv)->DeleteGlobalRef(jenv, it->iter);
+    }
+    it->iter = NULL;
+}
+
+/*
+    Call java function with iterator return and materialize all rows (ONLY FOR FG WORKER !)
+*/
+int call_iter_java_function(Tuplestorestate* tupstore, TupleDesc tupdesc, java_function_cache* jcache, char* class_name, char* method_name, char* signature, jvalue* args, char* error_msg) {
+    java_iterator it;
+    bool done = false;
+    int res;
+
+    int natts = tupdesc->natts;
+    Datum values[natts];
+    bool* nulls = palloc0( natts * sizeof( bool ) );
+    bool* primitive = palloc0( natts * sizeof( bool ) );
+
+    res = open_iter_java_function(&it, jcache, class_name, method_name, signature, args, error_msg);
+    
+    while(res == 0) {
+        res = next_iter_java_function(values, primitive, nulls, natts, &done, &it, tupdesc, jcache, error_msg);
         
-        if(len == 0) {
-            elog(ERROR,"Empty composite return for iterator");
-        } else {
-            // Composite return
-            
-            Datum values[len];
-            bool*  nulls = palloc0( len * sizeof( bool ) );
-            bool* primitive = palloc0( len * sizeof( bool ) );
-            
-            // Composite return
-            for(int i = 0; i < len; i++) {
-                
-                // Detect field
-                jobject field = (*jenv)->GetObjectArrayElement(jenv, fieldsList, i);
-                jclass fieldClass = (*jenv)->GetObjectClass(jenv, field);
-              
-                // Obtain signature
-                jmethodID m =  (*jenv)->GetMethodID(jenv, fieldClass, "getName", "()Ljava/lang/String;");   
-                jstring jstr = (jstring)(*jenv)->CallObjectMethod(jenv, field, m);
-            
-                const char* fieldname =  (*jenv)->GetStringUTFChars(jenv, jstr, false);
-            
-                m =  (*jenv)->GetMethodID(jenv, fieldClass, "getType", "()Ljava/lang/Class;");   
-                jobject value = (*jenv)->CallObjectMethod(jenv, field, m);
-                jclass  valueClass = (*jenv)->GetObjectClass(jenv, value);
+        if(res != 0 || done)
+            break;
 
-                m =  (*jenv)->GetMethodID(jenv, valueClass, "getName", "()Ljava/lang/String;");   
-                jstring jstr2 = (jstring)(*jenv)->CallObjectMethod(jenv, value, m);
-                const char* typename =  (*jenv)->GetStringUTFChars(jenv, jstr2, false);
-            
-                const char* sig = convert_name_to_JNI_signature(typename, error_msg);
-                if(sig == NULL) {
-                    // Cleanup
-                    (*jenv)->ReleaseStringUTFChars(jenv, jstr, fieldname);
-                    (*jenv)->ReleaseStringUTFChars(jenv, jstr2, typename);
-                
-                    return -4;
-                }
+        tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+    }
 
-                values[i] = build_datum_from_return_field(&primitive[i], row, rcls, fieldname, sig, error_msg);
-                if(values == NULL) {
-                    // Cleanup
-                    (*jenv)->ReleaseStringUTFChars(jenv, jstr, fieldname);
-                    (*jenv)->ReleaseStringUTFChars(jenv, jstr2, typename);
-                    return -5;
-                }
+    close_iter_java_function(&it);
 
-                // Cleanup
-                (*jenv)->ReleaseStringUTFChars(jenv, jstr, fieldname);
-                (*jenv)->ReleaseStringUTFChars(jenv, jstr2, typename);
-            }
-            tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+    pfree(nulls);
+    pfree(primitive);
+
+    return res;
+}
 
-            pfree(primitive);
+/*
+    Build a java array from one batch of a scalar column (V functions)
+*/
+jobject datums_to_java_batch(const char* elem_type, Datum* values, int n, char* error_msg) {
+    jobject arr = NULL;
+    // Large enough for any primitive element
+    void* tmp = palloc(n * sizeof(jlong));
+
+    switch(elem_type[0]) {
+        case 'Z': {
+            jboolean* buf = (jboolean*) tmp;
+            for(int i = 0; i < n; i++) buf[i] = DatumGetBool(values[i]);
+            arr = (*jenv)->NewBooleanArray(jenv, n);
+            if(arr != NULL) (*jenv)->SetBooleanArrayRegion(jenv, arr, 0, n, buf);
+            break;
+        }
+        case 'S': {
+            jshort* buf = (jshort*) tmp;
+            for(int i = 0; i < n; i++) buf[i] = DatumGetInt16(values[i]);
+            arr = (*jenv)->NewShortArray(jenv, n);
+            if(arr != NULL) (*jenv)->SetShortArrayRegion(jenv, arr, 0, n, buf);
+            break;
         }
+        case 'I': {
+            jint* buf = (jint*) tmp;
+            for(int i = 0; i < n; i++) buf[i] = DatumGetInt32(values[i]);
+            arr = (*jenv)->NewIntArray(jenv, n);
+            if(arr != NULL) (*jenv)->SetIntArrayRegion(jenv, arr, 0, n, buf);
+            break;
+        }
+        case 'J': {
+            jlong* buf = (jlong*) tmp;
+            for(int i = 0; i < n; i++) buf[i] = DatumGetInt64(values[i]);
+            arr = (*jenv)->NewLongArray(jenv, n);
+            if(arr != NULL) (*jenv)->SetLongArrayRegion(jenv, arr, 0, n, buf);
+            break;
+        }
+        case 'F': {
+            jfloat* buf = (jfloat*) tmp;
+            for(int i = 0; i < n; i++) buf[i] = DatumGetFloat4(values[i]);
+            arr = (*jenv)->NewFloatArray(jenv, n);
+            if(arr != NULL) (*jenv)->SetFloatArrayRegion(jenv, arr, 0, n, buf);
+            break;
+        }
+        case 'D': {
+            jdouble* buf = (jdouble*) tmp;
+            for(int i = 0; i < n; i++) buf[i] = DatumGetFloat8(values[i]);
+            arr = (*jenv)->NewDoubleArray(jenv, n);
+            if(arr != NULL) (*jenv)->SetDoubleArrayRegion(jenv, arr, 0, n, buf);
+            break;
+        }
+        default:
+            if(strcmp(elem_type, "Ljava/lang/String;") == 0) {
+                jclass cls = (*jenv)->FindClass(jenv, "java/lang/String");
+                arr = (*jenv)->NewObjectArray(jenv, n, cls, NULL);
+                for(int i = 0; arr != NULL && i < n; i++) {
+                    jstring str = (*jenv)->NewStringUTF(jenv, text_to_cstring(DatumGetTextPP(values[i])));
+                    (*jenv)->SetObjectArrayElement(jenv, arr, i, str);
+                    (*jenv)->DeleteLocalRef(jenv, str);
+                }
+                (*jenv)->DeleteLocalRef(jenv, cls);
+            } else {
+                snprintf(error_msg, 128, "Type %s not supported in batched functions", elem_type);
+                pfree(tmp);
+                return NULL;
+            }
+    }
+
+    pfree(tmp);
+
+    if(arr == NULL) {
+        (*jenv)->ExceptionClear(jenv);
+        snprintf(error_msg, 128, "Could not allocate java array of %d elements", n);
+    }
+
+    return arr;
+}
+
+/*
+    Convert the java array returned by a batched (V) function to datums
+*/
+int java_batch_to_datums(jobject arr, const char* elem_type, Datum* values, int n, char* error_msg) {
+    void* tmp;
 
-        // Next
-        hasNext = (bool) (*jenv)->CallBooleanMethod(jenv, ret, hasNextF);
+    if(arr == NULL) {
+        strcpy(error_msg,"Null pointer returned from java function call");
+        return -3;
+    }
+
+    if((*jenv)->GetArrayLength(jenv, arr) != n) {
+        snprintf(error_msg, 128, "Batched function returned %d values for %d rows", (int) (*jenv)->GetArrayLength(jenv, arr), n);
+        return -4;
+    }
+
+    tmp = palloc(n * sizeof(jlong));
+
+    switch(elem_type[0]) {
+        case 'Z': {
+            jboolean* buf = (jboolean*) tmp;
+            (*jenv)->GetBooleanArrayRegion(jenv, arr, 0, n, buf);
+            for(int i = 0; i < n; i++) values[i] = BoolGetDatum(buf[i]);
+            break;
+        }
+        case 'S': {
+            jshort* buf = (jshort*) tmp;
+            (*jenv)->GetShortArrayRegion(jenv, arr, 0, n, buf);
+            for(int i = 0; i < n; i++) values[i] = Int16GetDatum(buf[i]);
+            break;
+        }
+        case 'I': {
+            jint* buf = (jint*) tmp;
+            (*jenv)->GetIntArrayRegion(jenv, arr, 0, n, buf);
+            for(int i = 0; i < n; i++) values[i] = Int32GetDatum(buf[i]);
+            break;
+        }
+        case 'J': {
+            jlong* buf = (jlong*) tmp;
+            (*jenv)->GetLongArrayRegion(jenv, arr, 0, n, buf);
+            for(int i = 0; i < n; i++) values[i] = Int64GetDatum(buf[i]);
+            break;
+        }
+        case 'F': {
+            jfloat* buf = (jfloat*) tmp;
+            (*jenv)->GetFloatArrayRegion(jenv, arr, 0, n, buf);
+            for(int i = 0; i < n; i++) values[i] = Float4GetDatum(buf[i]);
+            break;
+        }
+        case 'D': {
+            jdouble* buf = (jdouble*) tmp;
+            (*jenv)->GetDoubleArrayRegion(jenv, arr, 0, n, buf);
+            for(int i = 0; i < n; i++) values[i] = Float8GetDatum(buf[i]);
+            break;
+        }
+        default:
+            if(strcmp(elem_type, "Ljava/lang/String;") == 0) {
+                for(int i = 0; i < n; i++) {
+                    jstring str = (*jenv)->GetObjectArrayElement(jenv, arr, i);
+                    const char* chars;
+
+                    if(str == NULL) {
+                        strcpy(error_msg,"Null element returned from batched java function");
+                        pfree(tmp);
+                        return -3;
+                    }
+                    chars = (*jenv)->GetStringUTFChars(jenv, str, false);
+                    values[i] = PointerGetDatum(cstring_to_text(chars));
+                    (*jenv)->ReleaseStringUTFChars(jenv, str, chars);
+                    (*jenv)->DeleteLocalRef(jenv, str);
+                }
+            } else {
+                snprintf(error_msg, 128, "Type %s not supported in batched functions", elem_type);
+                pfree(tmp);
+                return -4;
+            }
     }
 
+    pfree(tmp);
     return 0;
 }
 
@@ -961,7 +2354,8 @@ int startJVM(char* error_msg) {
     JNI_CreateJavaVM_func JNI_CreateJavaVM;
     jint result;
 
-    elog(NOTICE,"Starting JVM");
+    // Parallel workers start their own JVM, do not repeat the notice per worker
+    elog(IsParallelWorker() ? DEBUG1 : NOTICE,"Starting JVM");
      
     options = setJVMoptions(&numOptions);
 
@@ -988,7 +2382,7 @@ int startJVM(char* error_msg) {
         snprintf(error_msg, 14, "JVM error %d",result);
     }
 
-    elog(NOTICE,"JVM startup complete");
+    elog(IsParallelWorker() ? DEBUG1 : NOTICE,"JVM startup complete");
 
     // Free
     for(int i = 0; i < numOptions; i++) {
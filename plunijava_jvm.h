@@ -3,15 +3,107 @@
 
 #include <jni.h>
 #include "utils/tuplestore.h"
+#include "utils/array.h"
 
 extern JNIEnv *jenv;
 extern JavaVM *jvm;
- 
+
+// Zero-copy view on array arguments
+#define JAVA_BUFFER_SIG "Ljava/nio/ByteBuffer;"
+// Array of any rank as flat data plus dims
+#define NDARRAY_SIG "Lai/sedn/plunijava/NDArray;"
+// Value classes of converted PG types (uuid, numeric)
+#define UUID_SIG "Ljava/util/UUID;"
+#define BIGDECIMAL_SIG "Ljava/math/BigDecimal;"
+
 typedef jint(JNICALL *JNI_CreateJavaVM_func)(JavaVM **pvm, void **penv, void *args);
 
+struct field_plan_entry;
+
+typedef void (*field_setter)(jobject obj, jfieldID fid, Datum dat);
+typedef Datum (*field_getter)(jobject obj, struct field_plan_entry* field, bool* primitive, bool* isnull, char* error_msg);
+
+/*
+    Mapping of one public field of a Java class to a PG attribute
+*/
+typedef struct field_plan_entry {
+    jfieldID fid;
+    char sig[128];
+    char name[NAMEDATALEN];
+    int attnum;
+    bool byval;
+    field_setter set;
+    field_getter get;
+} field_plan_entry;
+
+/*
+    Marshaling plan between a Java class and a composite type
+*/
+typedef struct {
+    jclass cls;
+    jmethodID constructor;
+    Oid typid;
+    int natts;
+    int nfields;
+    field_plan_entry fields[FLEXIBLE_ARRAY_MEMBER];
+} field_plan;
+
+/*
+    JNI state of a java function kept across calls
+*/
+typedef struct {
+    jclass clazz;
+    jmethodID methodID;
+    field_plan* ret_plan;
+    int n_arg_plans;
+    field_plan** arg_plans;
+} java_function_cache;
+
+/*
+    Java iterator of a SETOF function
+*/
+typedef struct {
+    jobject iter;
+    jmethodID hasNextF;
+    jmethodID nextF;
+} java_iterator;
+
 extern int startJVM(char* error_msg);
-extern int call_java_function(Datum* values, bool* primitive, char* class_name, char* method_name, char* signature, char* return_type, jvalue* args, char* error_msg);
-extern int call_iter_java_function(Tuplestorestate* tupstore, TupleDesc tupdesc, char* class_name, char* method_name, char* signature, jvalue* args, char* error_msg);
+extern int resolve_java_method(jclass* clazz, jmethodID* methodID, char* class_name, char* method_name, char* signature, char* error_msg);
+extern void release_java_method(jclass* clazz, jmethodID* methodID);
+extern void release_java_function_cache(java_function_cache* jcache);
+extern field_plan* build_field_plan(jclass cls, TupleDesc tupdesc, bool by_name, char* error_msg);
+extern void free_field_plan(field_plan* plan);
+extern field_plan* lookup_return_field_plan(java_function_cache* jcache, jobject obj, TupleDesc tupdesc, char* error_msg);
+extern field_plan* lookup_arg_field_plan(java_function_cache* jcache, int nargs, int arg, const char* class_sig, TupleDesc tupdesc, char* error_msg);
+extern int fill_datums_from_jobject(field_plan* plan, jobject obj, Datum* values, bool* primitive, bool* nulls, int nvalues, char* error_msg);
+extern void fill_jobject_from_datums(field_plan* plan, jobject obj, Datum* values, bool* nulls, int nvalues);
+extern bool java_return_is_object(const char* return_type);
+extern int invoke_java_method(JNIEnv* env, jclass clazz, jmethodID methodID, const char* return_type, jvalue* args, jvalue* ret);
+extern int convert_java_result(Datum* values, bool* primitive, bool* nulls, bool* ret_null, int nvalues, TupleDesc tupdesc, java_function_cache* jcache, const char* return_type, jvalue* ret, char* error_msg);
+extern int call_java_function(Datum* values, bool* primitive, bool* nulls, bool* ret_null, int nvalues, TupleDesc tupdesc, java_function_cache* jcache, char* class_name, char* method_name, char* signature, char* return_type, jvalue* args, char* error_msg);
+extern int open_iter_java_function(java_iterator* it, java_function_cache* jcache, char* class_name, char* method_name, char* signature, jvalue* args, char* error_msg);
+extern int next_iter_java_function(Datum* values, bool* primitive, bool* nulls, int nvalues, bool* done, java_iterator* it, TupleDesc tupdesc, java_function_cache* jcache, char* error_msg);
+extern void close_iter_java_function(java_iterator* it);
+extern int call_iter_java_function(Tuplestorestate* tupstore, TupleDesc tupdesc, java_function_cache* jcache, char* class_name, char* method_name, char* signature, jvalue* args, char* error_msg);
+extern jobject datums_to_java_batch(const char* elem_type, Datum* values, int n, char* error_msg);
+extern int java_batch_to_datums(jobject arr, const char* elem_type, Datum* values, int n, char* error_msg);
+extern jobject wrap_direct_buffer(void* data, jlong size);
+extern jobject wrap_array_buffer(ArrayType* v);
+extern char boxed_primitive(const char* sig);
+extern const char* boxed_signature(const char* sig);
+extern jobject box_datum(const char* sig, Datum dat);
+extern Datum unbox_jobject(const char* sig, jobject obj);
+extern bool is_value_class(const char* sig);
+extern jobject value_to_jobject(const char* sig, Datum dat, char* error_msg);
+extern Datum jobject_to_value(const char* sig, jobject obj, char* error_msg);
+extern ArrayType* createArray(jsize nElems, size_t elemSize, Oid elemType, bool withNulls);
+extern ArrayType* createNdArray(int ndim, int* dims, size_t elemSize, Oid elemType, int nNulls);
+extern void compact_array_nulls(const char* src, int n, Size elem_size, ArrayType* v, const uint64* nullmap);
+extern void* dense_array_values(ArrayType* v, char type, char* error_msg);
+extern jarray array_to_java(ArrayType* v, char type, char* error_msg);
+extern jobject datum_to_ndarray(Datum dat, char* error_msg);
+extern Datum ndarray_to_datum(jobject obj, char* error_msg);
 extern const char* convert_name_to_JNI_signature(const char* name, char* error_msg);
 extern int set_jobject_field_from_datum(jobject* obj, jfieldID* fid, Datum* dat, const char* sig);
 extern void freejvalues(jvalue* jvals, short* argprim, int N);
@@ -2,22 +2,50 @@
 #include "postgres.h"
 #include "executor/spi.h" 
 #include "utils/array.h"
+#include "catalog/pg_type.h"
+#include "access/detoast.h"
+#include "access/htup_details.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+#include "access/xact.h"
+#include "utils/plancache.h"
+#include "lib/stringinfo.h"
+#include "plunijava_jvm.h"
 #include "math.h"
 
 bool SPI_connected = false;
 bool activeSPI = false;
 
-Portal prtl;
+// Cursor 0 is the one of execute, fetch_next and the getters without cursor argument
+spi_cursor CURSORS[MAX_CURSORS];
 
-double_array_data* A;
+int pluj_fetch_size = 10000;
+int pluj_fetch_memory = 65536;
 
-Datum* prefetch;
-int proc = 0;
+prepared_plan* PREPARED = NULL;
+static int n_prepared = 0;
+static int max_prepared = 0;
+// Parameter datums of the last execute_prepared call
+static MemoryContext PARAM_CONTEXT = NULL;
 
-row_cache RCACHE;
-double_array_data* DOUBLE_ARRAY_CACHE;
-float_array_data* FLOAT_ARRAY_CACHE;
-char_array_data* CHAR_ARRAY_CACHE;
+static void release_batch(spi_cursor* cur) {
+    column_batch* batch = &cur->batch;
+
+    if(batch->cols != NULL) {
+        for(int c = 0; c < cur->batch_alloc_cols; c++) {
+            pfree(batch->cols[c].values);
+            pfree(batch->cols[c].nulls);
+        }
+        pfree(batch->cols);
+        batch->cols = NULL;
+    }
+    batch->nrows = 0;
+    batch->ncols = 0;
+    cur->batch_capacity = 0;
+    cur->batch_alloc_cols = 0;
+}
 
 int connect_SPI() {
     if(!activeSPI) {
@@ -29,13 +57,9 @@ int connect_SPI() {
         SPI_connect();
         
         // Init
-        A = palloc(1*sizeof(double_array_data));
-        
-        DOUBLE_ARRAY_CACHE = palloc(1*sizeof(double_array_data));
-        FLOAT_ARRAY_CACHE = palloc(1*sizeof(float_array_data));
-        CHAR_ARRAY_CACHE = palloc(1*sizeof(char_array_data));
-        
-        proc = 0;
+        memset(CURSORS, 0, sizeof(CURSORS));
+        CURSORS[0].used = true;
+        PARAM_CONTEXT = AllocSetContextCreate(CurrentMemoryContext, "plunijava parameters", ALLOCSET_SMALL_SIZES);
         
         SPI_connected = true;
     }
@@ -45,83 +69,493 @@ int connect_SPI() {
 
 void disconnect_SPI() {
     if(SPI_connected) {
-        if(prtl!=NULL) {
-            SPI_cursor_close(prtl);
-            prtl = NULL;
-        }
-        if(RCACHE.data != NULL) {
-            pfree(RCACHE.data);
-            RCACHE.data = NULL;
-            RCACHE.pos = -1;
-        }     
-        if(DOUBLE_ARRAY_CACHE!=NULL) {
-            pfree(DOUBLE_ARRAY_CACHE);
-            DOUBLE_ARRAY_CACHE = NULL;
-        }
-        if(FLOAT_ARRAY_CACHE!=NULL) {
-            pfree(FLOAT_ARRAY_CACHE);
-            FLOAT_ARRAY_CACHE = NULL;
-        }
-        if(CHAR_ARRAY_CACHE!=NULL) {
-            pfree(CHAR_ARRAY_CACHE);
-            CHAR_ARRAY_CACHE = NULL;
+        for(int i = 0; i < MAX_CURSORS; i++) {
+            if(CURSORS[i].prtl != NULL) {
+                SPI_cursor_close(CURSORS[i].prtl);
+            }
         }
+        // Row caches, batches and parameters are deleted with the SPI procedure context
+        memset(CURSORS, 0, sizeof(CURSORS));
+        PARAM_CONTEXT = NULL;
         
         SPI_finish();
         SPI_connected = false;
     }
 }
 
+static spi_cursor* get_cursor(int cursor) {
+    if(!SPI_connected || cursor < 0 || cursor >= MAX_CURSORS || !CURSORS[cursor].used)
+        return NULL;
+    return &CURSORS[cursor];
+}
+
+
+/*
+    Memory of a fetched tuple: the tuple itself plus the expanded size of 
+    its toasted or compressed attributes, which are detoasted on access
+*/
+static Size tuple_memory(HeapTuple tuple, TupleDesc tupdesc) {
+    Size size = tuple->t_len;
+
+    for(int c = 0; c < tupdesc->natts; c++) {
+        Form_pg_attribute att = TupleDescAttr(tupdesc, c);
+        bool isnull;
+        Datum value;
+
+        if(att->attlen != -1)
+            continue;
+
+        value = heap_getattr(tuple, c + 1, tupdesc, &isnull);
+        if(!isnull && VARATT_IS_EXTENDED(DatumGetPointer(value)))
+            size += toast_raw_datum_size(value) - VARSIZE_ANY(DatumGetPointer(value));
+    }
+
+    return size;
+}
+
+static void release_fetched(spi_cursor* cur) {
+    if(cur->fetched != NULL) {
+        SPI_freetuptable(cur->fetched);
+        cur->fetched = NULL;
+    }
+}
+
+/*
+    Fetch the next rows of the cursor. The tuples of the previous fetch are 
+    released, so only one fetch is held at a time. In adaptive mode, fetches 
+    start with FETCH_PROBE_ROWS rows and double until the measured row size 
+    puts the next one at about pluj.fetch_memory of tuples, which is kept 
+    for all further fetches, so a first fetch of wide rows stays small.
+*/
+static void cursor_fetch(spi_cursor* cur) {
+    Size bytes = 0;
+    int rows;
+
+    release_fetched(cur);
+    SPI_cursor_fetch(cur->prtl, true, cur->fetch_rows > 0 ? cur->fetch_rows : cur->probe_rows);
+    cur->fetched = SPI_tuptable;
+
+    if(cur->fetch_rows > 0 || SPI_processed == 0)
+        return;
+
+    for(uint64 i = 0; i < SPI_processed; i++)
+        bytes += tuple_memory(SPI_tuptable->vals[i], SPI_tuptable->tupdesc);
+
+    rows = (int) Max(Min(((Size) pluj_fetch_memory * 1024) / Max(bytes / SPI_processed, 1), FETCH_MAX_ROWS), 1);
+    if(cur->probe_rows * 2 < rows)
+        cur->probe_rows *= 2;
+    else
+        cur->fetch_rows = rows;
+}
+
+/*
+    Drop the row cache, its by-reference datums point into the fetched 
+    tuples and must not outlive them
+*/
+static void reset_row_cache(spi_cursor* cur) {
+    if(cur->rcache.data != NULL) {
+        pfree(cur->rcache.data);
+        cur->rcache.data = NULL;
+    }
+    cur->rcache.pos = -1;
+}
+
+/*
+    Close the portal and drop the rows of the previous query of the cursor 
+    before the next one is run
+*/
+static void reset_result(spi_cursor* cur, int fetch_size) {
+    // Close cursor if open
+    if(cur->prtl!=NULL) {
+        SPI_cursor_close(cur->prtl);
+        cur->prtl = NULL;
 
-int execute(char* query, bool use_cursor) {
+        if(cur->prefetch!=NULL) {
+            pfree(cur->prefetch);
+            cur->prefetch = NULL;
+        }   
+    }
+
+    // Cleanup
+    reset_row_cache(cur);
+    cur->rcache.proc = 0;
+    release_fetched(cur);
+    cur->batch_offset = 0;
+
+    if(fetch_size < 0)
+        fetch_size = pluj_fetch_size;
+    cur->fetch_rows = fetch_size;
+    cur->probe_rows = FETCH_PROBE_ROWS;
+}
+
+/*
+    Run plan with the given parameters, through a portal if use_cursor is 
+    set and the plan returns rows
+*/
+static void run_plan(spi_cursor* cur, SPIPlanPtr plan, Datum* values, const char* nulls, bool use_cursor) {
+    if(use_cursor && SPI_is_cursor_plan(plan)) {
+        cur->prtl = SPI_cursor_open(NULL, plan, values, nulls, false);  
+        //elog(WARNING,"Cursor plan (%s) -> prtl",query);      
+    } else {
+        SPI_execute_plan(plan, values, nulls, false, 0);  
+        cur->rcache.proc = SPI_processed; 
+        cur->fetched = SPI_tuptable;
+    }
+}
+
+/*
+    Statements that may modify data run in an internal subtransaction, so a 
+    failed statement is rolled back as a whole and its executor state is 
+    cleaned up before the error is discarded (as PL/Python's SPI calls do).
+    Plain SELECTs skip the subtransaction.
+*/
+static bool plan_is_select(SPIPlanPtr plan) {
+    ListCell* lc;
+
+    foreach(lc, SPI_plan_get_plan_sources(plan)) {
+        CachedPlanSource* source = (CachedPlanSource*) lfirst(lc);
+
+        if(source->commandTag != CMDTAG_SELECT)
+            return false;
+    }
+    return true;
+}
+
+static void subxact_begin(MemoryContext oldcontext) {
+    BeginInternalSubTransaction(NULL);
+    MemoryContextSwitchTo(oldcontext);
+}
+
+static void subxact_commit(MemoryContext oldcontext, ResourceOwner oldowner) {
+    ReleaseCurrentSubTransaction();
+    MemoryContextSwitchTo(oldcontext);
+    CurrentResourceOwner = oldowner;
+}
+
+static void subxact_abort(MemoryContext oldcontext, ResourceOwner oldowner) {
+    MemoryContextSwitchTo(oldcontext);
+    FlushErrorState();
+    RollbackAndReleaseCurrentSubTransaction();
+    MemoryContextSwitchTo(oldcontext);
+    CurrentResourceOwner = oldowner;
+}
+
+/*
+    Run query on cur. With use_cursor, rows are fetched fetch_size rows at 
+    a time (pluj.fetch_size for fetch_size < 0, adaptive for 0).
+*/
+static int run_query(spi_cursor* cur, char* query, bool use_cursor, int fetch_size) {
     
+    MemoryContext oldcontext = CurrentMemoryContext;
+    ResourceOwner oldowner = CurrentResourceOwner;
+    volatile bool subxact = false;
     bool error = false;
 
-    if(SPI_connected) {
-        // Close cursor if open
-        if(prtl!=NULL) {
-            SPI_cursor_close(prtl);
-            prtl = NULL;
-
-            //pfree(A);
-            if(prefetch!=NULL) {
-                pfree(prefetch);
-                prefetch = NULL;
-            }   
+    reset_result(cur, fetch_size);
+    
+    PG_TRY(); 
+    {
+        SPIPlanPtr plan = SPI_prepare(query, 0, NULL);
+
+        if(plan == NULL)
+            elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+
+        if(!plan_is_select(plan)) {
+            subxact_begin(oldcontext);
+            subxact = true;
         }
 
-        // Cleanup
-        if(RCACHE.data != NULL) {
-            pfree(RCACHE.data);
-            RCACHE.data = NULL;
-            RCACHE.pos = -1;
+        // Portals keep their own copy of the plan
+        run_plan(cur, plan, NULL, NULL, use_cursor);
+        SPI_freeplan(plan);
+
+        if(subxact) {
+            subxact = false;
+            subxact_commit(oldcontext, oldowner);
         }
-        
-        PG_TRY(); 
-        {
-            if(use_cursor) {
-                SPIPlanPtr plan = SPI_prepare(query, 0, NULL);
-                if(SPI_is_cursor_plan(plan)) {
-                    prtl = SPI_cursor_open(NULL, plan, NULL, NULL, false);  
-                    //elog(WARNING,"Cursor plan (%s) -> prtl",query);      
-                } else {
-                    SPI_execute_plan(plan, NULL, NULL, false, 0);  
-                    RCACHE.proc = SPI_processed; 
-                }
+    }
+    PG_CATCH();
+    {
+        if(subxact) {
+            subxact_abort(oldcontext, oldowner);
+        } else {
+            MemoryContextSwitchTo(oldcontext);
+            FlushErrorState();
+        }
+        cur->prtl = NULL;
+        cur->fetched = NULL;
+        error = true;    
+    }
+    PG_END_TRY();
+
+    if(error) 
+        return -1;
+    else 
+        return 0 ;
+}
+
+int execute(char* query, bool use_cursor, int fetch_size) {
+    if(!SPI_connected)
+        return 0;
+    return run_query(&CURSORS[0], query, use_cursor, fetch_size);
+}
+
+/*
+    Prepared statements: plans are kept with SPI_keepplan for the session 
+    and identified by their index in PREPARED. Preparing the same query 
+    with the same argument types again returns the existing handle, so 
+    Java code preparing its statements on every call plans them once.
+*/
+static int find_prepared(const char* query, int nargs, const Oid* argtypes) {
+    for(int i = 0; i < n_prepared; i++) {
+        if(PREPARED[i].plan != NULL && PREPARED[i].nargs == nargs && strcmp(PREPARED[i].query, query) == 0 
+           && (nargs == 0 || memcmp(PREPARED[i].argtypes, argtypes, nargs * sizeof(Oid)) == 0))
+            return i;
+    }
+    return -1;
+}
+
+/*
+    Handle of the kept plan of query, prepared on first use. Throws PG 
+    errors, call under PG_TRY.
+*/
+static int keep_plan(const char* query, int nargs, Oid* types) {
+    int handle = find_prepared(query, nargs, types);
+    SPIPlanPtr plan;
+
+    if(handle >= 0)
+        return handle;
+
+    plan = SPI_prepare(query, nargs, types);
+    if(plan == NULL)
+        elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+    SPI_keepplan(plan);
+
+    for(handle = 0; handle < n_prepared && PREPARED[handle].plan != NULL; handle++)
+        ;
+    if(handle == n_prepared) {
+        if(n_prepared == max_prepared) {
+            max_prepared = max_prepared > 0 ? 2 * max_prepared : 16;
+            PREPARED = PREPARED == NULL 
+                ? MemoryContextAllocZero(TopMemoryContext, max_prepared * sizeof(prepared_plan))
+                : repalloc(PREPARED, max_prepared * sizeof(prepared_plan));
+        }
+        n_prepared++;
+    }
+
+    PREPARED[handle].query = MemoryContextStrdup(TopMemoryContext, query);
+    PREPARED[handle].nargs = nargs;
+    PREPARED[handle].argtypes = MemoryContextAlloc(TopMemoryContext, (nargs > 0 ? nargs : 1) * sizeof(Oid));
+    memcpy(PREPARED[handle].argtypes, types, nargs * sizeof(Oid));
+    PREPARED[handle].plan = plan;
+
+    return handle;
+}
+
+/*
+    Prepare query with nargs parameters ($1..$n) of the given type names. 
+    Returns the handle of the kept plan or -1 on error.
+*/
+int prepare(char* query, int nargs, char** argtypes) {
+    MemoryContext oldcontext = CurrentMemoryContext;
+    int handle = -1;
+    Oid* types;
+
+    if(!SPI_connected || nargs < 0)
+        return -1;
+
+    types = palloc((nargs > 0 ? nargs : 1) * sizeof(Oid));
+
+    PG_TRY();
+    {
+        for(int i = 0; i < nargs; i++)
+            types[i] = DatumGetObjectId(DirectFunctionCall1(regtypein, CStringGetDatum(argtypes[i])));
+
+        handle = keep_plan(query, nargs, types);
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(oldcontext);
+        handle = -1;
+        FlushErrorState();
+    }
+    PG_END_TRY();
+
+    pfree(types);
+
+    return handle;
+}
+
+void free_prepared(int handle) {
+    if(handle >= 0 && handle < n_prepared && PREPARED[handle].plan != NULL) {
+        SPI_freeplan(PREPARED[handle].plan);
+        pfree(PREPARED[handle].query);
+        pfree(PREPARED[handle].argtypes);
+        PREPARED[handle].plan = NULL;
+    }
+}
+
+/*
+    Binary parameter value from Java: integer and floating point values are 
+    read with their size and converted to the parameter type, raw data of 
+    fixed width elements becomes a 1D array, bytes a bytea and strings are 
+    passed to the input function of the parameter type.
+*/
+static Datum param_to_datum(param_value* param, Oid type) {
+    Oid elemtype;
+
+    switch(param->kind) {
+        case PARAM_INTEGER: {
+            int64 v;
+
+            if(param->size == sizeof(int64))
+                v = *(int64*) param->data;
+            else if(param->size == sizeof(int32))
+                v = *(int32*) param->data;
+            else if(param->size == sizeof(int16))
+                v = *(int16*) param->data;
+            else
+                break;
+
+            switch(type) {
+                case INT2OID:
+                    if(v < PG_INT16_MIN || v > PG_INT16_MAX)
+                        elog(ERROR, "Value %lld out of range for smallint", (long long) v);
+                    return Int16GetDatum((int16) v);
+                case INT4OID:
+                    if(v < PG_INT32_MIN || v > PG_INT32_MAX)
+                        elog(ERROR, "Value %lld out of range for integer", (long long) v);
+                    return Int32GetDatum((int32) v);
+                case INT8OID:
+                    return Int64GetDatum(v);
+                case FLOAT4OID:
+                    return Float4GetDatum((float4) v);
+                case FLOAT8OID:
+                    return Float8GetDatum((float8) v);
+            }
+            break;
+        }
+        case PARAM_FLOAT: {
+            float8 v;
+
+            if(param->size == sizeof(float8))
+                v = *(float8*) param->data;
+            else if(param->size == sizeof(float4))
+                v = *(float4*) param->data;
+            else
+                break;
+
+            if(type == FLOAT8OID)
+                return Float8GetDatum(v);
+            if(type == FLOAT4OID)
+                return Float4GetDatum((float4) v);
+            break;
+        }
+        case PARAM_BOOL:
+            if(type == BOOLOID && param->size == sizeof(bool))
+                return BoolGetDatum(*(bool*) param->data);
+            break;
+        case PARAM_BYTES:
+            if(type == BYTEAOID) {
+                bytea* b = palloc(param->size + VARHDRSZ);
+
+                SET_VARSIZE(b, param->size + VARHDRSZ);
+                memcpy(VARDATA(b), param->data, param->size);
+                return PointerGetDatum(b);
+            }
+
+            elemtype = get_element_type(type);
+            if(elemtype == INT2OID || elemtype == INT4OID || elemtype == INT8OID 
+               || elemtype == FLOAT4OID || elemtype == FLOAT8OID || elemtype == BOOLOID) {
+                int16 typlen = get_typlen(elemtype);
+                ArrayType* v;
+
+                if(param->size % typlen != 0)
+                    break;
+                v = createArray(param->size / typlen, typlen, elemtype, false);
+                memcpy(ARR_DATA_PTR(v), param->data, param->size);
+                return PointerGetDatum(v);
+            }
+            break;
+        case PARAM_STRING: {
+            Oid typinput;
+            Oid typioparam;
+            char* str = pnstrdup(param->data, param->size);
+
+            getTypeInputInfo(type, &typinput, &typioparam);
+            return OidInputFunctionCall(typinput, str, typioparam, -1);
+        }
+    }
+
+    elog(ERROR, "Parameter of kind '%c' (%lld bytes) can not be passed as %s", 
+         param->kind, (long long) param->size, format_type_be(type));
+    return (Datum) 0;
+}
+
+/*
+    Run the prepared statement handle on cur with the nparams parameters 
+    params (one per argument type, kind PARAM_NULL for NULL); a count that 
+    does not match the prepared argument types is an error. Parameter datums are 
+    built in PARAM_CONTEXT, which is reset by the next call; portals keep 
+    their own copy.
+*/
+static int run_prepared(spi_cursor* cur, int handle, param_value* params, int nparams, bool use_cursor, int fetch_size) {
+    MemoryContext oldcontext = CurrentMemoryContext;
+    ResourceOwner oldowner = CurrentResourceOwner;
+    bool subxact;
+    bool error = false;
+
+    if(handle < 0 || handle >= n_prepared || PREPARED[handle].plan == NULL)
+        return -1;
+
+    if(nparams != PREPARED[handle].nargs)
+        return -1;
+
+    reset_result(cur, fetch_size);
+
+    MemoryContextReset(PARAM_CONTEXT);
+
+    subxact = !plan_is_select(PREPARED[handle].plan);
+    if(subxact)
+        subxact_begin(oldcontext);
+
+    PG_TRY();
+    {
+        prepared_plan* prep = &PREPARED[handle];
+        MemoryContext old = MemoryContextSwitchTo(PARAM_CONTEXT);
+        Datum* values = palloc((prep->nargs > 0 ? prep->nargs : 1) * sizeof(Datum));
+        char* nulls = palloc(prep->nargs + 1);
+
+        for(int i = 0; i < prep->nargs; i++) {
+            if(params[i].kind == PARAM_NULL) {
+                values[i] = (Datum) 0;
+                nulls[i] = 'n';
             } else {
-                SPI_execute(query, false, 0);
-                RCACHE.proc = SPI_processed;   
-                //elog(WARNING,"Non-cursor plan (%s) -> %d -> %d",query,exec,RCACHE.proc);
-            }  
+                values[i] = param_to_datum(&params[i], prep->argtypes[i]);
+                nulls[i] = ' ';
+            }
         }
-        PG_CATCH();
-        {
-            prtl = NULL;
-            error = true;    
+        nulls[prep->nargs] = '\0';
+        MemoryContextSwitchTo(old);
+
+        run_plan(cur, prep->plan, values, nulls, use_cursor);
+
+        if(subxact)
+            subxact_commit(oldcontext, oldowner);
+    }
+    PG_CATCH();
+    {
+        if(subxact) {
+            subxact_abort(oldcontext, oldowner);
+        } else {
+            MemoryContextSwitchTo(oldcontext);
             FlushErrorState();
         }
-        PG_END_TRY();
+        cur->prtl = NULL;
+        cur->fetched = NULL;
+        error = true;    
     }
+    PG_END_TRY();
 
     if(error) 
         return -1;
@@ -129,85 +563,314 @@ int execute(char* query, bool use_cursor) {
         return 0 ;
 }
 
-bool fetch_next() {
-    if(SPI_connected) {
-        if(RCACHE.data==NULL || RCACHE.pos == RCACHE.proc-1 || RCACHE.pos==-1) {  
-            if(prtl != NULL) {
-                /*
-                struct timespec start, finish, delta;
-                clock_gettime(CLOCK_REALTIME, &start);
-                */
-                SPI_cursor_fetch(prtl, true, 10000);
-                RCACHE.proc = SPI_processed; 
-                /*
-                clock_gettime(CLOCK_REALTIME, &finish);
-                sub_timespec(start, finish, &delta);
-                elog(WARNING,"[DEBUG](RT fetch_next): %d.%.9ld (%d)",(int)delta.tv_sec, delta.tv_nsec, SPI_processed);
-                */ 
-            } else {
-                if(RCACHE.pos == RCACHE.proc-1) return false;                
+int execute_prepared(int handle, param_value* params, int nparams, bool use_cursor, int fetch_size) {
+    if(!SPI_connected)
+        return -1;
+    return run_prepared(&CURSORS[0], handle, params, nparams, use_cursor, fetch_size);
+}
+
+/*
+    Cursors: each open cursor has its own portal, row cache and batch 
+    buffers, so Java can iterate several results at once (e.g. to merge 
+    two sorted inputs). Returns the cursor handle or -1 on error.
+*/
+static int alloc_cursor(void) {
+    for(int i = 1; i < MAX_CURSORS; i++) {
+        if(!CURSORS[i].used) {
+            memset(&CURSORS[i], 0, sizeof(spi_cursor));
+            CURSORS[i].used = true;
+            CURSORS[i].rcache.pos = -1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+int open_cursor(char* query, int fetch_size) {
+    int cursor;
+
+    if(!SPI_connected || (cursor = alloc_cursor()) < 0)
+        return -1;
+
+    if(run_query(&CURSORS[cursor], query, true, fetch_size) != 0) {
+        close_cursor(cursor);
+        return -1;
+    }
+    return cursor;
+}
+
+int open_prepared_cursor(int handle, param_value* params, int nparams, int fetch_size) {
+    int cursor;
+
+    if(!SPI_connected || (cursor = alloc_cursor()) < 0)
+        return -1;
+
+    if(run_prepared(&CURSORS[cursor], handle, params, nparams, true, fetch_size) != 0) {
+        close_cursor(cursor);
+        return -1;
+    }
+    return cursor;
+}
+
+/*
+    Close the portal of cursor and free its rows. Cursor 0 stays usable 
+    by execute.
+*/
+void close_cursor(int cursor) {
+    spi_cursor* cur = get_cursor(cursor);
+
+    if(cur == NULL)
+        return;
+
+    reset_result(cur, -1);
+    release_batch(cur);
+    if(cursor > 0)
+        cur->used = false;
+}
+
+static bool next_row(spi_cursor* cur) {
+    row_cache* rc = &cur->rcache;
+
+    if(rc->data==NULL || rc->pos == rc->proc-1 || rc->pos==-1) {  
+        if(cur->prtl != NULL) {
+            /*
+            struct timespec start, finish, delta;
+            clock_gettime(CLOCK_REALTIME, &start);
+            */
+            cursor_fetch(cur);
+            rc->proc = SPI_processed; 
+            /*
+            clock_gettime(CLOCK_REALTIME, &finish);
+            sub_timespec(start, finish, &delta);
+            elog(WARNING,"[DEBUG](RT fetch_next): %d.%.9ld (%d)",(int)delta.tv_sec, delta.tv_nsec, SPI_processed);
+            */ 
+        } else {
+            if(rc->data != NULL || rc->pos == rc->proc-1) {
+                rc->pos = -1;
+                return false;
             }
+        }
+        
+        if(rc->proc > 0 && cur->fetched != NULL) {
             
-            if(RCACHE.proc > 0) {
+            TupleDesc tupdesc = cur->fetched->tupdesc;
+            SPITupleTable *tuptable = cur->fetched;
                 
-                TupleDesc tupdesc = SPI_tuptable->tupdesc;
-                SPITupleTable *tuptable = SPI_tuptable;
+            rc->ncols = tupdesc->natts;
+            if(rc->data != NULL) {
+                pfree(rc->data);
+            }
+            rc->data = (Datum*) palloc(rc->proc * rc->ncols * sizeof(Datum));
+            
+            for(int i = 0; i < rc->proc; i++) {
+                HeapTuple row = tuptable->vals[i];
+                for(int c = 0; c < rc->ncols; c++) {
+                    bool isnull;
+                    Datum col = SPI_getbinval(row, tupdesc, c+1, &isnull);
                     
-                RCACHE.ncols = tupdesc->natts;
-                if(RCACHE.data != NULL) {
-                    pfree(RCACHE.data);
-                }
-                RCACHE.data = (Datum*) palloc(RCACHE.proc * RCACHE.ncols * sizeof(Datum));
-                
-                for(int i = 0; i < RCACHE.proc; i++) {
-                    HeapTuple row = tuptable->vals[i];
-                    for(int c = 0; c < RCACHE.ncols; c++) {
-                        bool isnull;
-                        Datum col = SPI_getbinval(row, tupdesc, c+1, &isnull);
-                        
-                        if(!isnull) {
-                            RCACHE.data[i*RCACHE.ncols + c] = col;
-                        } else {
-                            // ToDo: Setting for null treatment !
-                            RCACHE.data[i*RCACHE.ncols + c] = (Datum) 0;
-                            //elog(WARNING,"NULL DETECTED !");
-                        }  
-                    }      
-                }
+                    if(!isnull) {
+                        rc->data[i*rc->ncols + c] = col;
+                    } else {
+                        // ToDo: Setting for null treatment !
+                        rc->data[i*rc->ncols + c] = (Datum) 0;
+                        //elog(WARNING,"NULL DETECTED !");
+                    }  
+                }      
+            }
 
-                RCACHE.pos = 0;
-                return true;
-            }    
-            
-        } else {
-            RCACHE.pos++;
-            if(RCACHE.pos <= RCACHE.proc-1) {
-                return true;
-            } 
-        }
+            rc->pos = 0;
+            return true;
+        }    
+        
+    } else {
+        rc->pos++;
+        if(rc->pos <= rc->proc-1) {
+            return true;
+        } 
     }
-    RCACHE.pos = -1;
+    rc->pos = -1;
     return false;
 }
 
-double getdouble(int column) {
-    if(RCACHE.data != NULL && RCACHE.pos > -1 && column > 0 && column <= RCACHE.ncols) {
-        return DatumGetFloat8( RCACHE.data[RCACHE.pos*RCACHE.ncols+column-1] );
+bool fetch_next() {
+    return cursor_next(0);
+}
+
+bool cursor_next(int cursor) {
+    spi_cursor* cur = get_cursor(cursor);
+
+    if(cur == NULL)
+        return false;
+    return next_row(cur);
+}
+
+static int batch_width(Oid type) {
+    switch(type) {
+        case BOOLOID: return sizeof(bool);
+        case INT2OID: return sizeof(int16);
+        case INT4OID: return sizeof(int32);
+        case INT8OID: return sizeof(int64);
+        case FLOAT4OID: return sizeof(float4);
+        case FLOAT8OID: return sizeof(float8);
+        default: return -1;
+    }
+}
+
+static void batch_store(char* dst, Oid type, Datum value) {
+    switch(type) {
+        case BOOLOID: *(bool*) dst = DatumGetBool(value); break;
+        case INT2OID: *(int16*) dst = DatumGetInt16(value); break;
+        case INT4OID: *(int32*) dst = DatumGetInt32(value); break;
+        case INT8OID: *(int64*) dst = DatumGetInt64(value); break;
+        case FLOAT4OID: *(float4*) dst = DatumGetFloat4(value); break;
+        case FLOAT8OID: *(float8*) dst = DatumGetFloat8(value); break;
+    }
+}
+
+/*
+    Fetch up to max_rows rows of cursor and copy the given columns 
+    (1-based) into its batch, so Java reads a whole batch with one downcall 
+    instead of one getter call per value. Only fixed width numeric and bool 
+    columns are supported. Returns NULL for unsupported or invalid columns, 
+    nrows == 0 when the result is exhausted.
+*/
+column_batch* cursor_fetch_batch(int cursor, int* columns, int ncols, int max_rows) {
+    spi_cursor* cur = get_cursor(cursor);
+    column_batch* batch;
+    SPITupleTable* tuptable;
+    TupleDesc tupdesc;
+    uint64 first = 0;
+    uint64 nrows;
+    Oid* types;
+
+    if(cur == NULL || ncols <= 0 || max_rows <= 0)
+        return NULL;
+    batch = &cur->batch;
+
+    if(cur->prtl != NULL) {
+        reset_row_cache(cur);
+        release_fetched(cur);
+        SPI_cursor_fetch(cur->prtl, true, max_rows);
+        cur->fetched = SPI_tuptable;
+        nrows = SPI_processed;
+    } else {
+        if(cur->fetched == NULL || cur->batch_offset >= cur->fetched->numvals) {
+            batch->nrows = 0;
+            return batch;
+        }
+        first = cur->batch_offset;
+        nrows = Min(cur->fetched->numvals - cur->batch_offset, (uint64) max_rows);
+        cur->batch_offset += nrows;
+    }
+
+    tuptable = cur->fetched;
+    if(tuptable == NULL) {
+        batch->nrows = 0;
+        return batch;
+    }
+    tupdesc = tuptable->tupdesc;
+
+    types = palloc(ncols * sizeof(Oid));
+    for(int c = 0; c < ncols; c++) {
+        if(columns[c] < 1 || columns[c] > tupdesc->natts || batch_width(SPI_gettypeid(tupdesc, columns[c])) < 0) {
+            pfree(types);
+            return NULL;
+        }
+        types[c] = SPI_gettypeid(tupdesc, columns[c]);
+    }
+
+    if(ncols > cur->batch_alloc_cols || max_rows > cur->batch_capacity) {
+        int capacity = Max(max_rows, cur->batch_capacity);
+        int alloc_cols = Max(ncols, cur->batch_alloc_cols);
+
+        release_batch(cur);
+        batch->cols = palloc0(alloc_cols * sizeof(column_buffer));
+        for(int c = 0; c < alloc_cols; c++) {
+            batch->cols[c].values = palloc(capacity * sizeof(int64));
+            batch->cols[c].nulls = palloc(((capacity + 63) / 64) * sizeof(uint64));
+            batch->cols[c].size = capacity * sizeof(int64);
+        }
+        cur->batch_capacity = capacity;
+        cur->batch_alloc_cols = alloc_cols;
+    }
+
+    batch->ncols = ncols;
+    batch->nrows = (int) nrows;
+
+    for(int c = 0; c < ncols; c++) {
+        batch->cols[c].width = batch_width(types[c]);
+        batch->cols[c].nnulls = 0;
+        memset(batch->cols[c].nulls, 0, ((nrows + 63) / 64) * sizeof(uint64));
+    }
+
+    for(uint64 i = 0; i < nrows; i++) {
+        HeapTuple row = tuptable->vals[first + i];
+
+        for(int c = 0; c < ncols; c++) {
+            column_buffer* col = &batch->cols[c];
+            char* dst = (char*) col->values + i * col->width;
+            bool isnull;
+            Datum value = SPI_getbinval(row, tupdesc, columns[c], &isnull);
+
+            if(!isnull) {
+                batch_store(dst, types[c], value);
+            } else {
+                memset(dst, 0, col->width);
+                col->nulls[i >> 6] |= UINT64CONST(1) << (i & 63);
+                col->nnulls++;
+            }
+        }
+    }
+
+    pfree(types);
+
+    // Values are copied, cursor batches do not have to stay around
+    if(cur->prtl != NULL) {
+        reset_row_cache(cur);
+        release_fetched(cur);
+    }
+
+    return batch;
+}
+
+column_batch* fetch_batch(int* columns, int ncols, int max_rows) {
+    return cursor_fetch_batch(0, columns, ncols, max_rows);
+}
+
+// Datum of column in the current row of cursor, NULL if there is none
+static Datum* current_value(int cursor, int column) {
+    spi_cursor* cur = get_cursor(cursor);
+
+    if(cur != NULL && cur->rcache.data != NULL && cur->rcache.pos > -1 && column > 0 && column <= cur->rcache.ncols) {
+        return &cur->rcache.data[cur->rcache.pos*cur->rcache.ncols+column-1];
+    }
+    return NULL;
+}
+
+double cursor_getdouble(int cursor, int column) {
+    Datum* value = current_value(cursor, column);
+
+    if(value != NULL) {
+        return DatumGetFloat8( *value );
     }
     return NAN;
 }
 
-float getfloat(int column) {
-    if(RCACHE.data != NULL && RCACHE.pos > -1 && column > 0 && column <= RCACHE.ncols) {
-        return DatumGetFloat4( RCACHE.data[RCACHE.pos*RCACHE.ncols+column-1] );
+float cursor_getfloat(int cursor, int column) {
+    Datum* value = current_value(cursor, column);
+
+    if(value != NULL) {
+        return DatumGetFloat4( *value );
     }
     return NAN;
 }
 
-int getint(int column) {
-    if(RCACHE.data != NULL && RCACHE.pos > -1 && column > 0 && column <= RCACHE.ncols) {
-        if(RCACHE.data[RCACHE.pos*RCACHE.ncols+column-1] != (Datum) 0) {
-            return DatumGetInt32( RCACHE.data[RCACHE.pos*RCACHE.ncols+column-1] );
+int cursor_getint(int cursor, int column) {
+    Datum* value = current_value(cursor, column);
+
+    if(value != NULL) {
+        if(*value != (Datum) 0) {
+            return DatumGetInt32( *value );
         } else {
             // Return 0 for NULL
             return 0;
@@ -216,9 +879,11 @@ int getint(int column) {
     return 0;
 }
 
-long getlong(int column) {
-    if(RCACHE.data != NULL && RCACHE.pos > -1 && column > 0 && column <= RCACHE.ncols) {
-        return DatumGetInt64( RCACHE.data[RCACHE.pos*RCACHE.ncols+column-1] );
+long cursor_getlong(int cursor, int column) {
+    Datum* value = current_value(cursor, column);
+
+    if(value != NULL) {
+        return DatumGetInt64( *value );
     }
     return 0;
 }
@@ -239,90 +904,213 @@ char_array_data* getstring(int column) {
 }
 */
 
-double_array_data* getdoublearray(int column) { 
-    if(RCACHE.data != NULL && RCACHE.pos > -1 && column > 0 && column <= RCACHE.ncols) {
-        int pos = RCACHE.pos*RCACHE.ncols+column-1;
-        ArrayType* arr = DatumGetArrayTypeP( RCACHE.data[pos] );  
-        DOUBLE_ARRAY_CACHE[0].size = (int) ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
-        DOUBLE_ARRAY_CACHE[0].arr = (double*) ARR_DATA_PTR(arr);
-        return DOUBLE_ARRAY_CACHE;
+// Returned by the array getters if there is no current value
+static double_array_data EMPTY_DOUBLE_ARRAY;
+static float_array_data EMPTY_FLOAT_ARRAY;
+
+double_array_data* cursor_getdoublearray(int cursor, int column) { 
+    Datum* value = current_value(cursor, column);
+
+    if(value != NULL) {
+        spi_cursor* cur = &CURSORS[cursor];
+        ArrayType* arr = DatumGetArrayTypeP( *value );  
+
+        cur->double_array.size = (int) ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+        cur->double_array.arr = (double*) ARR_DATA_PTR(arr);
+        return &cur->double_array;
     } 
-    DOUBLE_ARRAY_CACHE[0].arr = NULL;
-    DOUBLE_ARRAY_CACHE[0].size = 0;
 
-    return DOUBLE_ARRAY_CACHE;          
+    return &EMPTY_DOUBLE_ARRAY;          
 }
 
-float_array_data* getvector(int column) { 
-    if(RCACHE.data != NULL && RCACHE.pos > -1 && column > 0 && column <= RCACHE.ncols) {
-        int pos = RCACHE.pos*RCACHE.ncols+column-1;
-        
-        Vector* V = (Vector *) PG_DETOAST_DATUM(  RCACHE.data[pos] );
+float_array_data* cursor_getvector(int cursor, int column) { 
+    Datum* value = current_value(cursor, column);
 
-        FLOAT_ARRAY_CACHE[0].size = (int) V->dim;
-        FLOAT_ARRAY_CACHE[0].arr = (float*) V->x;
-        
-        return FLOAT_ARRAY_CACHE;
+    if(value != NULL) {
+        spi_cursor* cur = &CURSORS[cursor];
+        Vector* V = (Vector *) PG_DETOAST_DATUM( *value );
+
+        cur->float_array.size = (int) V->dim;
+        cur->float_array.arr = (float*) V->x;
+        return &cur->float_array;
     } 
-    FLOAT_ARRAY_CACHE[0].arr = NULL;
-    FLOAT_ARRAY_CACHE[0].size = 0;
 
-    return FLOAT_ARRAY_CACHE;          
+    return &EMPTY_FLOAT_ARRAY;          
 }
 
+double getdouble(int column) {
+    return cursor_getdouble(0, column);
+}
 
+float getfloat(int column) {
+    return cursor_getfloat(0, column);
+}
+
+int getint(int column) {
+    return cursor_getint(0, column);
+}
+
+long getlong(int column) {
+    return cursor_getlong(0, column);
+}
+
+double_array_data* getdoublearray(int column) { 
+    return cursor_getdoublearray(0, column);
+}
+
+float_array_data* getvector(int column) { 
+    return cursor_getvector(0, column);
+}
 
 
 double_array_data* fetch_next_double_array(int column) { 
-    if(SPI_connected) {
-        if(prefetch==NULL) {
+    spi_cursor* cur = &CURSORS[0];
+    double_array_data* A = &cur->double_array;
+
+    if(SPI_connected && cur->prtl != NULL) {
+        if(cur->prefetch==NULL) {
             TupleDesc tupdesc;
             SPITupleTable* tuptable;
 
-            SPI_cursor_fetch(prtl, true, 10000);
-            proc = SPI_processed; 
-            if(proc > 0) {
-                prefetch = palloc(proc*sizeof(Datum));
+            cursor_fetch(cur);
+            cur->proc = SPI_processed; 
+            if(cur->proc > 0) {
+                cur->prefetch = palloc(cur->proc*sizeof(Datum));
                 
                 tupdesc = SPI_tuptable->tupdesc;
                 tuptable = SPI_tuptable;
         
-                for(int i = 0; i < proc; i++) {
-                    HeapTuple row = tuptable->vals[proc-i-1];
+                for(int i = 0; i < cur->proc; i++) {
+                    HeapTuple row = tuptable->vals[cur->proc-i-1];
                     bool isnull;
                     Datum col = SPI_getbinval(row, tupdesc, column, &isnull);
                     
-                    if(!isnull) {
-                        prefetch[i] = col;
-                    }
+                    cur->prefetch[i] = !isnull ? col : (Datum) 0;
                 }
             }
         }
 
-        proc--;
+        cur->proc--;
 
-        if(proc >= 0) {
-            Datum col = prefetch[proc];
+        if(cur->proc >= 0) {
+            Datum col = cur->prefetch[cur->proc];
 
-            if(proc==0) {
-                if(prefetch != NULL) {
-                    pfree(prefetch);
-                    prefetch = NULL;
+            if(cur->proc==0) {
+                if(cur->prefetch != NULL) {
+                    pfree(cur->prefetch);
+                    cur->prefetch = NULL;
                 }
             }
 
             if(col != (Datum) 0) {
                 ArrayType* arr = DatumGetArrayTypeP(col);  
                 
-                A[0].size = (int) ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
-                A[0].arr = (double*) ARR_DATA_PTR(arr);     
+                A->size = (int) ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+                A->arr = (double*) ARR_DATA_PTR(arr);     
             
                 return A;
             }    
         } 
     }
-    A[0].arr = NULL;
-    A[0].size = 0;
+    A->arr = NULL;
+    A->size = 0;
     
     return A;
 }
+
+
+/*
+    Write path: insert nrows rows given as columnar buffers (as filled by 
+    fetch_batch: dense values of the column type's width, uint64 words with 
+    a set bit per NULL row or nulls == NULL) into columns of table. The rows 
+    are passed as one array parameter per column to a kept 
+    INSERT ... SELECT * FROM unnest($1, ..., $n) plan, so a batch is 
+    inserted with one executor run, including triggers, constraints and 
+    indexes. A failed batch is rolled back as a whole. Returns the number 
+    of inserted rows or -1 on error.
+*/
+int64 insert_batch(char* table, int ncols, char** columns, column_buffer* data, int nrows) {
+    MemoryContext oldcontext = CurrentMemoryContext;
+    ResourceOwner oldowner = CurrentResourceOwner;
+    int64 inserted = -1;
+
+    if(!SPI_connected || ncols <= 0 || nrows < 0)
+        return -1;
+    if(nrows == 0)
+        return 0;
+
+    MemoryContextReset(PARAM_CONTEXT);
+
+    subxact_begin(oldcontext);
+
+    PG_TRY();
+    {
+        MemoryContext old = MemoryContextSwitchTo(PARAM_CONTEXT);
+        Oid relid = DatumGetObjectId(DirectFunctionCall1(regclassin, CStringGetDatum(table)));
+        Oid* types = palloc(ncols * sizeof(Oid));
+        Datum* values = palloc(ncols * sizeof(Datum));
+        StringInfoData query;
+        int handle;
+
+        initStringInfo(&query);
+        appendStringInfo(&query, "INSERT INTO %s (", 
+                         quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)), get_rel_name(relid)));
+
+        for(int c = 0; c < ncols; c++) {
+            AttrNumber attnum = get_attnum(relid, columns[c]);
+            Oid elemtype;
+            int nnulls = 0;
+            ArrayType* v;
+
+            if(attnum == InvalidAttrNumber)
+                elog(ERROR, "Column %s of %s does not exist", columns[c], table);
+
+            elemtype = get_atttype(relid, attnum);
+            data[c].width = batch_width(elemtype);
+            if(data[c].width < 0)
+                elog(ERROR, "Column %s of type %s can not be written from a batch", 
+                     columns[c], format_type_be(elemtype));
+            if(data[c].size < (int64) nrows * data[c].width)
+                elog(ERROR, "Values of column %s hold %lld bytes, %d rows of %s need %lld", 
+                     columns[c], (long long) data[c].size, nrows, format_type_be(elemtype), 
+                     (long long) nrows * data[c].width);
+
+            types[c] = get_array_type(elemtype);
+            appendStringInfo(&query, "%s%s", c > 0 ? ", " : "", quote_identifier(columns[c]));
+
+            if(data[c].nulls != NULL) {
+                for(int i = 0; i < nrows; i++)
+                    nnulls += (data[c].nulls[i >> 6] & (UINT64CONST(1) << (i & 63))) != 0;
+            }
+
+            v = createNdArray(1, &nrows, data[c].width, elemtype, nnulls);
+            if(nnulls > 0)
+                compact_array_nulls(data[c].values, nrows, data[c].width, v, data[c].nulls);
+            else if(nrows > 0)
+                memcpy(ARR_DATA_PTR(v), data[c].values, (Size) nrows * data[c].width);
+            values[c] = PointerGetDatum(v);
+        }
+
+        appendStringInfoString(&query, ") SELECT * FROM unnest(");
+        for(int c = 0; c < ncols; c++)
+            appendStringInfo(&query, "%s$%d", c > 0 ? ", " : "", c + 1);
+        appendStringInfoString(&query, ")");
+
+        MemoryContextSwitchTo(old);
+
+        handle = keep_plan(query.data, ncols, types);
+        if(SPI_execute_plan(PREPARED[handle].plan, values, NULL, false, 0) != SPI_OK_INSERT)
+            elog(ERROR, "Insert into %s failed", table);
+        inserted = (int64) SPI_processed;
+
+        subxact_commit(oldcontext, oldowner);
+    }
+    PG_CATCH();
+    {
+        subxact_abort(oldcontext, oldowner);
+        inserted = -1;
+    }
+    PG_END_TRY();
+
+    return inserted;
+}
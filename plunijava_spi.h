@@ -2,6 +2,7 @@
 #define PLUNIJAVA_SPI_H
 
 #include "postgres.h"
+#include "executor/spi.h"
 
 typedef struct {
     double* arr;
@@ -26,6 +27,85 @@ typedef struct {
     Datum* data;
 } row_cache;
 
+/*
+    Columnar batch of fetch_batch. Per requested column the dense values 
+    (width bytes per row, 0 for NULL rows) and a bitmap with a set bit per 
+    NULL row (uint64 words, layout of java.util.BitSet.valueOf). The buffers 
+    are reused by the next fetch_batch call. For insert_batch the width is
+    taken from the column type and size gives the bytes of values.
+*/
+typedef struct {
+    void* values;
+    uint64* nulls;
+    int width;
+    int nnulls;
+    int64 size;
+} column_buffer;
+
+typedef struct {
+    int nrows;
+    int ncols;
+    column_buffer* cols;
+} column_batch;
+
+/*
+    Prepared statement kept for the session (SPI_keepplan), referenced from 
+    Java by its index
+*/
+typedef struct {
+    char* query;
+    int nargs;
+    Oid* argtypes;
+    SPIPlanPtr plan;
+} prepared_plan;
+
+// Kinds of a binary parameter of execute_prepared
+#define PARAM_NULL 'n'
+#define PARAM_INTEGER 'i'
+#define PARAM_FLOAT 'f'
+#define PARAM_BOOL 'b'
+#define PARAM_BYTES 'y'
+#define PARAM_STRING 's'
+
+/*
+    Parameter of execute_prepared: size bytes at data (native byte order 
+    for numbers, dense elements for arrays, UTF-8 for strings)
+*/
+typedef struct {
+    void* data;
+    int64 size;
+    char kind;
+} param_value;
+
+// Open cursors per SPI connection, cursor 0 is the one of execute and fetch_next
+#define MAX_CURSORS 32
+
+/*
+    Result state of a cursor: its portal (NULL for results without cursor), 
+    the tuples of the last fetch, the row cache of fetch_next and the 
+    buffers of fetch_batch
+*/
+typedef struct {
+    bool used;
+    Portal prtl;
+    SPITupleTable* fetched;
+    // Rows per fetch, 0 while an adaptive fetch has not been measured yet
+    int fetch_rows;
+    // Rows of the next measuring fetch in adaptive mode
+    int probe_rows;
+    row_cache rcache;
+    // Next row of a result without cursor for fetch_batch
+    uint64 batch_offset;
+    column_batch batch;
+    int batch_capacity;
+    int batch_alloc_cols;
+    // Column of fetch_next_double_array, in reverse order
+    Datum* prefetch;
+    int proc;
+    double_array_data double_array;
+    float_array_data float_array;
+} spi_cursor;
+
 typedef struct Vector
 {
 	int32		vl_len_;		
@@ -34,13 +114,38 @@ typedef struct Vector
 	float		x[FLEXIBLE_ARRAY_MEMBER];
 } Vector;
 
+// Rows per cursor fetch (pluj.fetch_size, 0 = adaptive) and byte budget of an adaptive fetch (pluj.fetch_memory, kB)
+extern int pluj_fetch_size;
+extern int pluj_fetch_memory;
+
+// Rows of the first (measuring) fetch in adaptive mode and upper bound of an adaptive fetch
+#define FETCH_PROBE_ROWS 16
+#define FETCH_MAX_ROWS 1000000
+
 extern bool activeSPI;
 
 extern int connect_SPI(void);
 extern void disconnect_SPI(void);
-extern int execute(char* query, bool use_cursor);
+extern int execute(char* query, bool use_cursor, int fetch_size);
+extern int prepare(char* query, int nargs, char** argtypes);
+extern int execute_prepared(int handle, param_value* params, int nparams, bool use_cursor, int fetch_size);
+extern void free_prepared(int handle);
+extern int64 insert_batch(char* table, int ncols, char** columns, column_buffer* data, int nrows);
+
+extern int open_cursor(char* query, int fetch_size);
+extern int open_prepared_cursor(int handle, param_value* params, int nparams, int fetch_size);
+extern void close_cursor(int cursor);
+extern bool cursor_next(int cursor);
+extern column_batch* cursor_fetch_batch(int cursor, int* columns, int ncols, int max_rows);
+extern double cursor_getdouble(int cursor, int column);
+extern float cursor_getfloat(int cursor, int column);
+extern int cursor_getint(int cursor, int column);
+extern long cursor_getlong(int cursor, int column);
+extern double_array_data* cursor_getdoublearray(int cursor, int column);
+extern float_array_data* cursor_getvector(int cursor, int column);
 
 extern bool fetch_next(void);
+extern column_batch* fetch_batch(int* columns, int ncols, int max_rows);
 
 extern double getdouble(int column);
 extern float getfloat(int column);
@@ -14,7 +14,11 @@
 #include "pgstat.h"
 #include "storage/spin.h"
 #include "lib/ilist.h"
+#include "port/pg_bitutils.h"
 #include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <jni.h>
 #include "plunijava_worker.h"
@@ -27,524 +31,1888 @@
 #include "utils/datum.h"
 #include "access/xact.h"
 #include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
 
 bool got_signal = false;
 int worker_id;
 
 static worker_data_head *worker_head = NULL;
+static dsa_area *worker_area = NULL;
+
+/*
+	JNI cache of a worker function. Pool tasks hold a reference, as the
+	function can be redefined while a call is still in flight.
+*/
+typedef struct
+{
+	java_function_cache jcache;
+	int refs;
+} worker_function_cache;
+
+/*
+	Java functions resolved by this worker, keyed by function oid
+*/
+typedef struct
+{
+	Oid fn_oid;
+	char class_name[128];
+	char method_name[128];
+	char signature[256];
+	worker_function_cache* cache;
+	// Payload schema, parsed on first use
+	arg_schema* schema;
+	int n_schema;
+} worker_function_entry;
+
+static HTAB *worker_function_hash = NULL;
 
 void sigTermHandler(SIGNAL_ARGS);
 void plunijava_worker_main(Datum main_arg);
-int argDeSerializer(jvalue* args, short* argprim, worker_exec_entry* entry);
+int argDeSerializer(jvalue* args, short* argprim, worker_exec_entry* entry, worker_function_entry* fentry, char* error_msg);
+static worker_function_entry* lookup_worker_function(worker_exec_entry* entry);
+static bool flush_setof_chunk(worker_exec_entry* entry, int chunk, int rows, bool last, bool error);
+static void stream_setof_result(worker_exec_entry* entry, java_function_cache* jcache, jvalue* args, int jfr, char* error_msg);
+static void prepare_task_return(worker_exec_entry* entry, int jfr, Datum* values, bool* primitive, bool* nulls, bool ret_null, char* task_error);
+static void return_task(worker_exec_entry* entry);
+static void worker_loop_threaded(char* task_error);
+
+int pluj_max_workers = 1;
+int pluj_queue_length = 16;
+int pluj_max_payload = 1048575;
+int pluj_max_user_pools = 1;
+int pluj_worker_threads = 0;
+int pluj_batch_size = 1024;
+bool pluj_parallel_delegate = false;
+
+void		_PG_init(void);
+
+#ifndef PGXC
+/* hook */
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static void pluj_shmem_request(void);
+#endif
+
+/*
+ * Module load callback
+ */
+void
+_PG_init(void)
+{
+	DefineCustomIntVariable("pluj.max_workers",
+							"Number of JVM background workers per worker pool.",
+							NULL,
+							&pluj_max_workers,
+							1, 1, MAX_WORKERS,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pluj.queue_length",
+							"Maximum number of queued tasks per worker pool.",
+							NULL,
+							&pluj_queue_length,
+							16, 1, 65536,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pluj.max_payload",
+							"Maximum size of the arguments or result of a background task.",
+							NULL,
+							&pluj_max_payload,
+							1048575, 64, 1048575,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pluj.worker_threads",
+							"Number of JVM threads running the calls of a global (G) worker, 0 runs them on the worker process itself.",
+							NULL,
+							&pluj_worker_threads,
+							0, 0, 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pluj.max_user_pools",
+							"Maximum number of per user (B) worker pools, in addition to the global pool.",
+							NULL,
+							&pluj_max_user_pools,
+							1, 0, 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pluj.batch_size",
+							"Number of rows passed to a batched (V) function per Java call.",
+							NULL,
+							&pluj_batch_size,
+							1024, 1, 1048576,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pluj.fetch_size",
+							"Number of rows fetched per cursor fetch of the Java SPI API, 0 sizes fetches by pluj.fetch_memory.",
+							NULL,
+							&pluj_fetch_size,
+							10000, 0, FETCH_MAX_ROWS,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pluj.fetch_memory",
+							"Memory of the rows of an adaptive cursor fetch of the Java SPI API.",
+							NULL,
+							&pluj_fetch_memory,
+							65536, 64, MAX_KILOBYTES,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pluj.parallel_delegate",
+							"Run foreground (F) calls of parallel query workers on the global (G) pool instead of a JVM per worker.",
+							NULL,
+							&pluj_parallel_delegate,
+							false,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+#ifndef PGXC
+	if (!process_shared_preload_libraries_in_progress)
+			return;
+
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = pluj_shmem_request;
+#endif
+}
+
+/*
+	Ring capacity for the task queue (power of two)
+*/
+static uint32
+task_ring_capacity(void)
+{
+	return pg_nextpower2_32((uint32) pluj_queue_length);
+}
+
+static Size
+task_ring_size(void)
+{
+	return add_size(offsetof(task_ring, cells), mul_size(task_ring_capacity(), sizeof(task_ring_cell)));
+}
+
+static Size
+task_slots_size(void)
+{
+	return MAXALIGN(add_size(offsetof(worker_data_head, list_data), mul_size(pluj_queue_length, sizeof(worker_exec_entry))));
+}
+
+/*
+	Size of a worker pool header including its task slots and rings
+*/
+Size
+worker_head_size(void)
+{
+	return add_size(task_slots_size(), mul_size(2, MAXALIGN(task_ring_size())));
+}
+
+/*
+	Registry of the user (B) pools. The headers of pluj.max_user_pools pools 
+	live in one shared memory block behind the slots. A slot is taken by the 
+	first pool of a role/database and given back when the last worker of the 
+	pool exits, so a pool of one more role/database only fails while all 
+	slots are in use.
+*/
+typedef struct
+{
+	Oid roleid;
+	Oid dbid;
+	bool used;
+	// Workers attached to the pool header
+	int n_running;
+} user_pool_slot;
+
+typedef struct
+{
+	user_pool_slot slots[FLEXIBLE_ARRAY_MEMBER];
+} user_pool_registry;
+
+static Size
+user_pool_heads_offset(void)
+{
+	return MAXALIGN(mul_size(pluj_max_user_pools, sizeof(user_pool_slot)));
+}
+
+static Size
+user_pool_registry_size(void)
+{
+	return add_size(user_pool_heads_offset(), mul_size(pluj_max_user_pools, MAXALIGN(worker_head_size())));
+}
+
+static worker_data_head*
+user_pool_head(user_pool_registry* registry, int slot)
+{
+	return (worker_data_head*) ((char*) registry + user_pool_heads_offset() + slot * MAXALIGN(worker_head_size()));
+}
+
+/*
+	Shared registry, caller holds AddinShmemInitLock
+*/
+static user_pool_registry*
+attach_user_pool_registry(void)
+{
+	bool found;
+	user_pool_registry* registry = (user_pool_registry*) ShmemInitStruct("UJ_user_pools",
+								   user_pool_registry_size(),
+								   &found);
+
+	if(!found) {
+		memset(registry, 0, user_pool_registry_size());
+		for(int i = 0; i < pluj_max_user_pools; i++) {
+			worker_data_head* head = user_pool_head(registry, i);
+
+			SpinLockInit(&head->lock);
+			head->area_handle = DSA_HANDLE_INVALID;
+		}
+	}
+
+	return registry;
+}
+
+/*
+	Slot of the pool of roleid/dbid, taken if there is none yet. Caller holds 
+	AddinShmemInitLock. Returns -1 if pluj.max_user_pools pools of others are 
+	registered.
+*/
+static int
+reserve_user_pool(Oid roleid, Oid dbid)
+{
+	user_pool_registry* registry = attach_user_pool_registry();
+	int free_slot = -1;
+
+	for(int i = 0; i < pluj_max_user_pools; i++) {
+		user_pool_slot* s = &registry->slots[i];
+
+		if(s->used && s->roleid == roleid && s->dbid == dbid)
+			return i;
+		if(!s->used && free_slot < 0)
+			free_slot = i;
+	}
+
+	if(free_slot >= 0) {
+		registry->slots[free_slot].roleid = roleid;
+		registry->slots[free_slot].dbid = dbid;
+		registry->slots[free_slot].used = true;
+		registry->slots[free_slot].n_running = 0;
+	}
+	return free_slot;
+}
+
+/*
+	Header of the pool of roleid/dbid (NULL if it has no slot)
+*/
+worker_data_head*
+find_user_pool(Oid roleid, Oid dbid)
+{
+	user_pool_registry* registry;
+	worker_data_head* head = NULL;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	registry = attach_user_pool_registry();
+	for(int i = 0; i < pluj_max_user_pools; i++) {
+		user_pool_slot* s = &registry->slots[i];
+
+		if(s->used && s->roleid == roleid && s->dbid == dbid) {
+			head = user_pool_head(registry, i);
+			break;
+		}
+	}
+	LWLockRelease(AddinShmemInitLock);
+
+	return head;
+}
+
+/*
+	Exit of a user pool worker. The last one fails the queued tasks, whose 
+	backends are waiting for them, and gives the slot back.
+*/
+static void
+user_pool_worker_exit(int code, Datum arg)
+{
+	int slot = DatumGetInt32(arg);
+	user_pool_registry* registry;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	registry = attach_user_pool_registry();
+	if(--registry->slots[slot].n_running == 0) {
+		worker_data_head* head = user_pool_head(registry, slot);
+		int task;
+
+		SpinLockAcquire(&head->lock);
+		head->n_workers = 0;
+		SpinLockRelease(&head->lock);
+
+		if(worker_area != NULL) {
+			while((task = task_ring_pop(EXEC_RING(head))) >= 0)
+				fail_exec_entry(head, worker_area, &head->list_data[task], "bg worker pool was stopped before the task ran");
+		}
+
+		registry->slots[slot].used = false;
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+	Attach a worker to the header of its user pool slot
+*/
+static worker_data_head*
+attach_user_pool_worker(int slot)
+{
+	user_pool_registry* registry;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	registry = attach_user_pool_registry();
+	registry->slots[slot].n_running++;
+	LWLockRelease(AddinShmemInitLock);
+
+	before_shmem_exit(user_pool_worker_exit, Int32GetDatum(slot));
+
+	return user_pool_head(registry, slot);
+}
+
+void
+task_ring_init(task_ring* ring, uint32 capacity)
+{
+	ring->mask = capacity - 1;
+	pg_atomic_init_u32(&ring->head, 0);
+	pg_atomic_init_u32(&ring->tail, 0);
+	for(uint32 i = 0; i < capacity; i++) {
+		pg_atomic_init_u32(&ring->cells[i].sequence, i);
+		ring->cells[i].slot = -1;
+	}
+}
+
+/*
+	Enqueue a slot index (bounded MPMC queue after D. Vyukov). Each cell
+	carries a sequence number telling producers and consumers whether it 
+	is free for the current lap, so no lock is needed. Returns false if 
+	the ring is full.
+*/
+bool
+task_ring_push(task_ring* ring, int slot)
+{
+	task_ring_cell* cell;
+	uint32 pos = pg_atomic_read_u32(&ring->tail);
+
+	for(;;) {
+		uint32 seq;
+		int32 diff;
+
+		cell = &ring->cells[pos & ring->mask];
+		seq = pg_atomic_read_u32(&cell->sequence);
+		diff = (int32) (seq - pos);
+
+		if(diff == 0) {
+			// Claim cell (pos is updated on failure)
+			if(pg_atomic_compare_exchange_u32(&ring->tail, &pos, pos + 1))
+				break;
+		} else if(diff < 0) {
+			return false;
+		} else {
+			pos = pg_atomic_read_u32(&ring->tail);
+		}
+	}
+
+	cell->slot = slot;
+	// Publish slot (and task written before) to the consumer
+	pg_write_barrier();
+	pg_atomic_write_u32(&cell->sequence, pos + 1);
+
+	return true;
+}
+
+/*
+	Dequeue a slot index, -1 if the ring is empty
+*/
+int
+task_ring_pop(task_ring* ring)
+{
+	task_ring_cell* cell;
+	uint32 pos = pg_atomic_read_u32(&ring->head);
+	int slot;
+
+	for(;;) {
+		uint32 seq;
+		int32 diff;
+
+		cell = &ring->cells[pos & ring->mask];
+		seq = pg_atomic_read_u32(&cell->sequence);
+		diff = (int32) (seq - (pos + 1));
+
+		if(diff == 0) {
+			if(pg_atomic_compare_exchange_u32(&ring->head, &pos, pos + 1))
+				break;
+		} else if(diff < 0) {
+			return -1;
+		} else {
+			pos = pg_atomic_read_u32(&ring->head);
+		}
+	}
+
+	pg_read_barrier();
+	slot = cell->slot;
+	// Release cell for the next lap
+	pg_memory_barrier();
+	pg_atomic_write_u32(&cell->sequence, pos + ring->mask + 1);
+
+	return slot;
+}
+
+/*
+	Number of queued slots (a snapshot only)
+*/
+uint32
+task_ring_count(task_ring* ring)
+{
+	uint32 tail = pg_atomic_read_u32(&ring->tail);
+	uint32 head = pg_atomic_read_u32(&ring->head);
+
+	return tail - head;
+}
+
+/*
+	Wake the most recently idled worker of a pool after a task was pushed
+	(instead of all of them). Busy workers pick the task up by themselves.
+*/
+void
+wake_idle_worker(worker_data_head* head)
+{
+	Latch* latch = NULL;
+
+	// Pairs with the barrier in worker_go_idle
+	pg_memory_barrier();
+	if(pg_atomic_read_u32(&head->n_idle) == 0)
+		return;
+
+	SpinLockAcquire(&head->lock);
+	if(pg_atomic_read_u32(&head->n_idle) > 0) {
+		uint32 n = pg_atomic_read_u32(&head->n_idle) - 1;
+		int w = head->idle[n];
+
+		pg_atomic_write_u32(&head->n_idle, n);
+		head->is_idle[w] = false;
+		latch = head->latch[w];
+	}
+	SpinLockRelease(&head->lock);
+
+	if(latch != NULL)
+		SetLatch(latch);
+}
+
+/*
+	List this worker as idle before it sleeps. Returns true if tasks 
+	arrived meanwhile, the worker must not sleep then.
+*/
+static bool
+worker_go_idle(void)
+{
+	SpinLockAcquire(&worker_head->lock);
+	if(!worker_head->is_idle[worker_id]) {
+		uint32 n = pg_atomic_read_u32(&worker_head->n_idle);
+
+		worker_head->idle[n] = worker_id;
+		worker_head->is_idle[worker_id] = true;
+		pg_atomic_write_u32(&worker_head->n_idle, n + 1);
+	}
+	SpinLockRelease(&worker_head->lock);
+
+	// Pairs with the barrier in wake_idle_worker
+	pg_memory_barrier();
+	return task_ring_count(EXEC_RING(worker_head)) > 0;
+}
+
+/*
+	Unlist this worker if it got a task without being woken for it
+*/
+static void
+worker_leave_idle(void)
+{
+	SpinLockAcquire(&worker_head->lock);
+	if(worker_head->is_idle[worker_id]) {
+		uint32 n = pg_atomic_read_u32(&worker_head->n_idle);
+
+		for(uint32 i = 0; i < n; i++) {
+			if(worker_head->idle[i] == worker_id) {
+				memmove(&worker_head->idle[i], &worker_head->idle[i+1], (n - i - 1) * sizeof(int));
+				break;
+			}
+		}
+		worker_head->is_idle[worker_id] = false;
+		pg_atomic_write_u32(&worker_head->n_idle, n - 1);
+	}
+	SpinLockRelease(&worker_head->lock);
+}
+
+#ifndef PGXC
+/* Reserve shared memory */
+static void
+pluj_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	// Global pool, user pools with their registry
+	RequestAddinShmemSpace(worker_head_size());
+	RequestAddinShmemSpace(user_pool_registry_size());
+	RequestNamedLWLockTranche("pluj_background_workers", 1);
+}
+#endif
+
+
+/*
+	Map the DSA area holding the task payloads of a worker pool. The area 
+	is kept for the session, so its control data lives in TopMemoryContext 
+	and the mapping is pinned beyond the resource owner of the query.
+*/
+dsa_area*
+attach_worker_area(worker_data_head* head)
+{
+	MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	dsa_area* area;
+
+	LWLockRegisterTranche(head->dsa_tranche, "plunijava_dsa");
+	area = dsa_attach(head->area_handle);
+	dsa_pin_mapping(area);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return area;
+}
+
+worker_data_head*
+launch_dynamic_workers(int32 n_workers, bool needSPI, bool globalWorker, dsa_area** area)
+{
+	const char* WORKER_LIB = "$libdir/plunijava.so";
+
+	Oid			roleid = GetUserId();
+	Oid			dbid = MyDatabaseId;
+	
+	bool found = false;
+	int slot = -1;
+	int tranche;
+	dsa_handle area_handle;
+    
+    char buf[BGW_MAXLEN];
+	if(!globalWorker) {
+		snprintf(buf, BGW_MAXLEN, "UJ_%d_%d", roleid, dbid); 
+	} else {
+		snprintf(buf, BGW_MAXLEN, "UJ_global");
+	}
+
+	/* initialize worker data header */
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	if(globalWorker) {
+		worker_head = (worker_data_head*) ShmemInitStruct(buf,
+									   worker_head_size(),
+									   &found);
+	} else {
+		slot = reserve_user_pool(roleid, dbid);
+		if(slot < 0) {
+			LWLockRelease(AddinShmemInitLock);
+			ereport(ERROR,
+				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+				errmsg("too many plUniJava user worker pools"),
+				errhint("Increase pluj.max_user_pools (currently %d).", pluj_max_user_pools)));
+		}
+		// Slot headers are initialized with the registry
+		worker_head = user_pool_head(attach_user_pool_registry(), slot);
+		found = true;
+	}
+	LWLockRelease(AddinShmemInitLock);
+	
+	if (found && worker_head->n_workers > 0) {
+		if(*area == NULL)
+			*area = attach_worker_area(worker_head);
+    	return worker_head;
+    }
+
+	// Payloads live in a DSA area that outlives this backend
+	if(found && worker_head->area_handle != DSA_HANDLE_INVALID) {
+		tranche = worker_head->dsa_tranche;
+		area_handle = worker_head->area_handle;
+		if(*area == NULL)
+			*area = attach_worker_area(worker_head);
+	} else {
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		tranche = LWLockNewTrancheId();
+		LWLockRegisterTranche(tranche, "plunijava_dsa");
+		*area = dsa_create(tranche);
+		dsa_pin(*area);
+		dsa_pin_mapping(*area);
+		area_handle = dsa_get_handle(*area);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	SpinLockAcquire(&worker_head->lock);
+
+	/* initialize worker data header */
+	memset(worker_head, 0, worker_head_size());
+	worker_head->queue_length = pluj_queue_length;
+	worker_head->roleid = roleid;
+	worker_head->dbid = dbid;
+	worker_head->dsa_tranche = tranche;
+	worker_head->area_handle = area_handle;
+	worker_head->exec_ring_off = task_slots_size();
+	worker_head->free_ring_off = worker_head->exec_ring_off + MAXALIGN(task_ring_size());
+	task_ring_init(EXEC_RING(worker_head), task_ring_capacity());
+	task_ring_init(FREE_RING(worker_head), task_ring_capacity());
+	pg_atomic_init_u32(&worker_head->n_idle, 0);
+	// Init free ring
+	for(int i = 0; i < worker_head->queue_length; i++) {
+		worker_head->list_data[i].taskid = i;
+		pg_atomic_init_u32(&worker_head->list_data[i].state, TASK_DONE);
+		task_ring_push(FREE_RING(worker_head), i);
+	}
+
+	n_workers = Min(n_workers, pluj_max_workers);
+
+	for(int n = 0; n < n_workers; n++) {
+		BackgroundWorker worker;
+		BackgroundWorkerHandle *handle;
+		BgwHandleStatus status;
+		pid_t		pid;
+		
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = BGW_NEVER_RESTART; // Time in s to restart if crash. Use BGW_NEVER_RESTART for no restart;
+		
+		strcpy(worker.bgw_library_name, WORKER_LIB);
+		sprintf(worker.bgw_function_name, "plunijava_worker_main");
+		
+		snprintf(worker.bgw_name, BGW_MAXLEN, "%s",buf);
+		//snprintf(worker.bgw_name, BGW_MAXLEN, "UJ_%s_%d",buf,(n+1));
+			
+		worker.bgw_main_arg = Int32GetDatum(n);
+		worker.bgw_notify_pid = MyProcPid;
+
+		memcpy(&worker.bgw_extra[0],&roleid,4);
+		memcpy(&worker.bgw_extra[4],&dbid,4);
+		memcpy(&worker.bgw_extra[12],&slot,4);
+		if(!needSPI || globalWorker) {
+			worker.bgw_extra[9] = 0;
+		} else {
+			worker.bgw_extra[9] = 1;
+		}
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+			continue;
+
+		status = WaitForBackgroundWorkerStartup(handle, &pid);
+
+		if (status == BGWH_STOPPED)
+			ereport(ERROR,
+					(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+					errmsg("could not start background process"),
+					errhint("More details may be available in the server log.")));
+		if (status == BGWH_POSTMASTER_DIED)
+			ereport(ERROR,
+					(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+					errmsg("cannot start background processes without postmaster"),
+					errhint("Kill all remaining database processes and restart the database.")));
+		
+		Assert(status == BGWH_STARTED);
+		
+		elog(WARNING,"plUniJava worker %d of %d initialized with pid %d (from %d)",(n+1),n_workers,pid,MyProcPid);
+	}
+
+	worker_head->n_workers = n_workers;
+
+    SpinLockRelease(&worker_head->lock);
+	
+	return worker_head;
+}
+
+
+/*
+	Grow a DSA buffer to at least size bytes (content is not kept)
+*/
+static char*
+ensure_dsa_buffer(dsa_area* area, dsa_pointer* ptr, Size* cur, Size size)
+{
+	if(*cur < size) {
+		if(DsaPointerIsValid(*ptr))
+			dsa_free(area, *ptr);
+
+		*ptr = InvalidDsaPointer;
+		*cur = 0;
+
+		if(size > MAX_DATA)
+			return NULL;
+
+		*ptr = dsa_allocate_extended(area, size, DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM);
+		if(!DsaPointerIsValid(*ptr))
+			return NULL;
+
+		*cur = size;
+	}
+
+	return (char*) dsa_get_address(area, *ptr);
+}
+
+/*
+	Payload of a task, sized to the serialized arguments or results. 
+	Returns NULL if the payload is too large or the area is exhausted.
+*/
+char*
+alloc_entry_data(dsa_area* area, worker_exec_entry* entry, Size size)
+{
+	return ensure_dsa_buffer(area, &entry->data, &entry->data_size, size);
+}
+
+/*
+	Buffer of a SETOF chunk, never smaller than CHUNK_SIZE
+*/
+char*
+alloc_entry_chunk(dsa_area* area, worker_exec_entry* entry, int chunk, Size size)
+{
+	return ensure_dsa_buffer(area, &entry->chunk_data[chunk], &entry->chunk_size[chunk], Max(size, CHUNK_SIZE));
+}
+
+/*
+	Free the payloads of a task and put it back to the free ring
+*/
+void
+release_exec_entry(worker_data_head* head, dsa_area* area, worker_exec_entry* entry)
+{
+	if(DsaPointerIsValid(entry->data))
+		dsa_free(area, entry->data);
+	entry->data = InvalidDsaPointer;
+	entry->data_size = 0;
+
+	for(int c = 0; c < 2; c++) {
+		if(DsaPointerIsValid(entry->chunk_data[c]))
+			dsa_free(area, entry->chunk_data[c]);
+		entry->chunk_data[c] = InvalidDsaPointer;
+		entry->chunk_size[c] = 0;
+	}
+
+	task_ring_push(FREE_RING(head), entry->taskid);
+}
+
+/*
+	Complete a task that will not run with the error msg. The argument 
+	payload is freed and the submitting backend is woken up, or the entry 
+	is released if the backend already gave up on the task.
+*/
+void
+fail_exec_entry(worker_data_head* head, dsa_area* area, worker_exec_entry* entry, const char* msg)
+{
+	Latch* notify_latch = entry->notify_latch;
+	Size len = strlen(msg) + 1;
+	char* data;
+
+	if(DsaPointerIsValid(entry->data))
+		dsa_free(area, entry->data);
+	entry->data = InvalidDsaPointer;
+	entry->data_size = 0;
+
+	if(entry->setof) {
+		bool cancelled;
+
+		// Backend waits for a chunk, hand over a last chunk with the error
+		data = ensure_dsa_buffer(area, &entry->chunk_data[0], &entry->chunk_size[0], len);
+		if(data != NULL)
+			strcpy(data, msg);
+
+		SpinLockAcquire(&head->lock);
+		cancelled = entry->cancelled;
+		if(!cancelled) {
+			entry->chunk_rows[0] = 0;
+			entry->chunk_last[0] = true;
+			entry->chunk_error[0] = true;
+			entry->chunk_state[0] = CHUNK_FULL;
+			entry->worker_done = true;
+		}
+		SpinLockRelease(&head->lock);
+
+		if(cancelled)
+			release_exec_entry(head, area, entry);
+		else
+			SetLatch(notify_latch);
+		return;
+	}
+
+	data = alloc_entry_data(area, entry, len);
+	if(data != NULL)
+		strcpy(data, msg);
+	entry->error = true;
+
+	// Full barrier, as in return_task
+	if(pg_atomic_exchange_u32(&entry->state, TASK_DONE) == TASK_ABANDONED) {
+		release_exec_entry(head, area, entry);
+		return;
+	}
+
+	SetLatch(notify_latch);
+}
+
+/*
+	Kind of one signature token (dims leading '[' already skipped)
+*/
+static bool
+arg_schema_entry(arg_schema* a, int dims, const char* p, int len, char* error_msg) {
+	a->type = p[0];
+	a->sig[0] = '\0';
+
+	if(p[0] == 'L') {
+		if(len >= sizeof(a->sig)) {
+			snprintf(error_msg, 128, "Java class signature too long for bg worker: %.*s", len, p);
+			return false;
+		}
+		memcpy(a->sig, p, len);
+		a->sig[len] = '\0';
+	}
+
+	if(dims == 0) {
+		if(p[0] != 'L') {
+			a->kind = ARG_PRIMITIVE;
+			if(strchr("IJSFDZ", p[0]) != NULL)
+				return true;
+		} else {
+			if(strcmp(a->sig, "Ljava/lang/String;") == 0)
+				a->kind = ARG_STRING;
+			else if(strcmp(a->sig, JAVA_BUFFER_SIG) == 0)
+				a->kind = ARG_BUFFER;
+			else if(strcmp(a->sig, NDARRAY_SIG) == 0)
+				a->kind = ARG_NDARRAY;
+			else if(boxed_primitive(a->sig) != 0)
+				a->kind = ARG_BOXED;
+			else if(is_value_class(a->sig))
+				a->kind = ARG_VALUE;
+			else
+				a->kind = ARG_COMPOSITE;
+			return true;
+		}
+	} else if(dims == 1) {
+		if(p[0] == 'B') {
+			a->kind = ARG_BYTES;
+			return true;
+		}
+		if(strchr("IJFD", p[0]) != NULL) {
+			a->kind = ARG_ARRAY;
+			return true;
+		}
+		if(p[0] == 'L' && strcmp(a->sig, "Ljava/lang/String;") == 0) {
+			snprintf(error_msg, 128, "Array of strings as input to bg worker not supported yet");
+			return false;
+		}
+		if(p[0] == 'L') {
+			a->kind = ARG_COMPOSITE_ARRAY;
+			return true;
+		}
+	} else if(dims == 2) {
+		if(strchr("IJFD", p[0]) != NULL) {
+			a->kind = ARG_ARRAY2D;
+			return true;
+		}
+	}
+
+	snprintf(error_msg, 128, "Java argument type %.*s%.*s not supported by bg workers", dims, "[[[[[[[[", len, p);
+	return false;
+}
+
+/*
+	Payload schema of the arguments of a signature (malloc'd, as it is kept 
+	in function caches). Returns the number of arguments or -1.
+*/
+int
+build_arg_schema(const char* signature, arg_schema** schema, char* error_msg) {
+	const char* start = strchr(signature, '(');
+	arg_schema* s = NULL;
+	int n = 0;
+
+	if(start == NULL) {
+		snprintf(error_msg, 128, "Inconsistent Java function signature");
+		return -1;
+	}
+
+	// Count, then fill
+	for(int pass = 0; pass < 2; pass++) {
+		const char* p = start + 1;
+
+		n = 0;
+		while(*p != ')') {
+			const char* end;
+			int dims = 0;
+
+			while(*p == '[') {
+				dims++;
+				p++;
+			}
+
+			end = (*p == 'L') ? strchr(p, ';') : p;
+			if(*p == '\0' || end == NULL) {
+				snprintf(error_msg, 128, "Inconsistent Java function signature");
+				free(s);
+				return -1;
+			}
+			end++;
+
+			if(s != NULL && !arg_schema_entry(&s[n], dims, p, end - p, error_msg)) {
+				free(s);
+				return -1;
+			}
+
+			p = end;
+			n++;
+		}
+
+		if(pass == 0)
+			s = (arg_schema*) malloc(Max(n, 1) * sizeof(arg_schema));
+	}
+
+	*schema = s;
+	return n;
+}
+
+/*
+	2D Java array of a dense PG array (NULLs of float arrays as NaN)
+*/
+static jobjectArray
+array2d_to_java(ArrayType* v, char type, char* error_msg) {
+	char cls_sig[3] = {'[', type, '\0'};
+	char* values = dense_array_values(v, type, error_msg);
+	Size elem_size = (type == 'I' || type == 'F') ? 4 : 8;
+	jsize dim1, dim2;
+	jclass cls;
+	jobjectArray objectArray;
+
+	if(values == NULL)
+		return NULL;
+
+	dim1 = (ARR_NDIM(v) == 2) ? ARR_DIMS(v)[0] : 0;
+	dim2 = (ARR_NDIM(v) == 2) ? ARR_DIMS(v)[1] : 0;
+
+	cls = (*jenv)->FindClass(jenv, cls_sig);
+	objectArray = (*jenv)->NewObjectArray(jenv, dim1, cls, 0);
+	(*jenv)->DeleteLocalRef(jenv, cls);
+
+	for(int idx = 0; idx < dim1; idx++) {
+		jarray innerArray;
+		char* row = values + idx * dim2 * elem_size;
+
+		switch(type) {
+			case 'I':
+				innerArray = (*jenv)->NewIntArray(jenv, dim2);
+				(*jenv)->SetIntArrayRegion(jenv, innerArray, 0, dim2, (jint*) row);
+				break;
+			case 'J':
+				innerArray = (*jenv)->NewLongArray(jenv, dim2);
+				(*jenv)->SetLongArrayRegion(jenv, innerArray, 0, dim2, (jlong*) row);
+				break;
+			case 'F':
+				innerArray = (*jenv)->NewFloatArray(jenv, dim2);
+				(*jenv)->SetFloatArrayRegion(jenv, innerArray, 0, dim2, (jfloat*) row);
+				break;
+			default:
+				innerArray = (*jenv)->NewDoubleArray(jenv, dim2);
+				(*jenv)->SetDoubleArrayRegion(jenv, innerArray, 0, dim2, (jdouble*) row);
+				break;
+		}
+		(*jenv)->SetObjectArrayElement(jenv, objectArray, idx, innerArray);
+		(*jenv)->DeleteLocalRef(jenv, innerArray);
+	}
+
+	if(values != ARR_DATA_PTR(v))
+		pfree(values);
+
+	return objectArray;
+}
+
+/*
+	Java object of a composite type from its serialized attributes
+*/
+static jobject
+composite_to_java(char** pos, field_plan* plan, char* error_msg) {
+	jobject cobj = (*jenv)->NewObject(jenv, plan->cls, plan->constructor);
+
+	// Serialized in field order
+	for(int j = 0; j < plan->nfields; j++) {
+		field_plan_entry* f = &plan->fields[j];
+		bool isnull;
+		Datum attr = datumDeSerialize(pos, &isnull);
+
+		if(isnull) {
+			// Object fields stay null
+			if(f->sig[0] != 'L' && f->sig[0] != '[') {
+				snprintf(error_msg, MAX_ERROR_MSG, "Attribute %s of composite type is null, but the Java field is primitive", f->name);
+				(*jenv)->DeleteLocalRef(jenv, cobj);
+				return NULL;
+			}
+			continue;
+		}
+
+		if(f->set == NULL) {
+			strcpy(error_msg,"Could not deserialize java function argument (unknown error in composite type)");
+			(*jenv)->DeleteLocalRef(jenv, cobj);
+			return NULL;
+		}
+
+		f->set(cobj, f->fid, attr);
+	}
+
+	return cobj;
+}
+
+/*
+	Build Java args from the binary task payload
+*/
+int 
+argDeSerializer(jvalue* args, short* argprim, worker_exec_entry* entry, worker_function_entry* fentry, char* error_msg) {
+	char* pos = (char*) dsa_get_address(worker_area, entry->data);
+	bits8* nullmap = (bits8*) pos;
+	java_function_cache* jcache = &fentry->cache->jcache;
+
+	// Schema is parsed once per function
+	if(fentry->schema == NULL) {
+		fentry->n_schema = build_arg_schema(fentry->signature, &fentry->schema, error_msg);
+		if(fentry->n_schema < 0) {
+			fentry->schema = NULL;
+			return -1;
+		}
+	}
+
+	if(entry->n_args != fentry->n_schema) {
+		snprintf(error_msg, MAX_ERROR_MSG, "Task has %d arguments, the signature %d", entry->n_args, fentry->n_schema);
+		return -1;
+	}
+
+	pos += ARG_NULLMAP_SIZE(entry->n_args);
+
+	for(int i = 0; i < entry->n_args; i++) {
+		arg_schema* a = &fentry->schema[i];
+
+		argprim[i] = 0;
+
+		// NULL argument (objects only)
+		if(nullmap[i / 8] & (1 << (i % 8))) {
+			args[i].l = NULL;
+			continue;
+		}
+
+		switch(a->kind) {
+			case ARG_PRIMITIVE: {
+				Datum arg = *((Datum*) pos);
+
+				pos += sizeof(Datum);
+				switch(a->type) {
+					case 'S':
+						args[i].s = (jshort) DatumGetInt16(arg);
+						break;
+					case 'I':
+						args[i].i = (jint) DatumGetInt32(arg);
+						break;
+					case 'J':
+						args[i].j = (jlong) DatumGetInt64(arg);
+						break;
+					case 'Z':
+						args[i].z = (jboolean) DatumGetBool(arg);
+						break;
+					case 'F':
+						args[i].f = (jfloat) DatumGetFloat4(arg);
+						break;
+					case 'D':
+						args[i].d = (jdouble) DatumGetFloat8(arg);	
+						break;	
+				}
+				break;
+			}
+			case ARG_BOXED:
+				args[i].l = box_datum(a->sig, *((Datum*) pos));
+				pos += sizeof(Datum);
+				break;
+			case ARG_COMPOSITE: {
+				// Map composite type
+				field_plan* plan = lookup_arg_field_plan(jcache, entry->n_args, i, a->sig, NULL, error_msg);
+				if(plan == NULL) {
+					return -1;
+				}
+				if(plan->constructor == NULL) {
+					strcpy(error_msg,"Could not deserialize java function argument (no default constructor for composite type)");
+					return -1;
+				}
+
+				args[i].l = composite_to_java(&pos, plan, error_msg);
+				if(args[i].l == NULL)
+					return -1;
+				pos = (char*) MAXALIGN(pos);
+				break;
+			}
+			case ARG_COMPOSITE_ARRAY: {
+				int N;
+				jobjectArray objectArray;
+				field_plan* plan = lookup_arg_field_plan(jcache, entry->n_args, i, a->sig, NULL, error_msg);
+
+				if(plan == NULL) {
+					return -1;
+				}
+				if(plan->constructor == NULL) {
+					strcpy(error_msg,"Could not deserialize java function argument (no default constructor for composite type)");
+					return -1;
+				}
+
+				memcpy(&N, pos, sizeof(int));
+				pos += sizeof(int);
+
+				objectArray = (*jenv)->NewObjectArray(jenv, N, plan->cls, 0);
+				for(int n = 0; n < N; n++) {
+					jobject cobj = composite_to_java(&pos, plan, error_msg);
+
+					if(cobj == NULL) {
+						(*jenv)->DeleteLocalRef(jenv, objectArray);
+						return -1;
+					}
+					(*jenv)->SetObjectArrayElement(jenv, objectArray, n, cobj);
+					(*jenv)->DeleteLocalRef(jenv, cobj);
+				}
+
+				args[i].l = objectArray;
+				pos = (char*) MAXALIGN(pos);
+				break;
+			}
+			default: {
+				// Varlena in the payload (kept until the task returns)
+				struct varlena* v = (struct varlena*) pos;
+
+				pos += MAXALIGN(VARSIZE(v));
+				switch(a->kind) {
+					case ARG_STRING: {
+						int len = VARSIZE(v) - VARHDRSZ;
+
+						// Modified UTF-8 needs a terminated copy
+						char t[len + 1];
+						memcpy(t, VARDATA(v), len);
+						t[len] = '\0';
+						args[i].l = (*jenv)->NewStringUTF(jenv, t);
+						break;
+					}
+					case ARG_VALUE:
+						args[i].l = value_to_jobject(a->sig, PointerGetDatum(v), error_msg);
+						break;
+					case ARG_BYTES: {
+						jsize nElems = VARSIZE(v) - VARHDRSZ;
+						jbyteArray byteArray = (*jenv)->NewByteArray(jenv, nElems);
+
+						(*jenv)->SetByteArrayRegion(jenv, byteArray, 0, nElems, (jbyte*) VARDATA(v));
+						args[i].l = byteArray;
+						break;
+					}
+					case ARG_ARRAY:
+						args[i].l = array_to_java((ArrayType*) v, a->type, error_msg);
+						break;
+					case ARG_ARRAY2D:
+						args[i].l = array2d_to_java((ArrayType*) v, a->type, error_msg);
+						break;
+					case ARG_BUFFER:
+						args[i].l = wrap_array_buffer((ArrayType*) v);
+						if(args[i].l == NULL)
+							strcpy(error_msg,"Array with NULLs can not be passed as ByteBuffer");
+						break;
+					case ARG_NDARRAY:
+						args[i].l = datum_to_ndarray(PointerGetDatum(v), error_msg);
+						break;
+				}
+
+				if(args[i].l == NULL)
+					return -1;
+			}
+		}
+
+		// Local references (strings included) are deleted after the call
+		if(a->kind != ARG_PRIMITIVE)
+			argprim[i] = 1;
+	}		
+
+	return 0;
+}
+
+
+/*
+	Drop a reference to a worker function cache (main thread only)
+*/
+static void
+unref_worker_function_cache(worker_function_cache* cache) {
+	if(--cache->refs > 0)
+		return;
+
+	release_java_function_cache(&cache->jcache);
+	pfree(cache);
+}
+
+/*
+	Lookup cached class and method of a task. The names are compared as well, 
+	as the global worker serves several databases and functions can be replaced.
+*/
+static worker_function_entry*
+lookup_worker_function(worker_exec_entry* entry) {
+	bool found;
+	worker_function_entry* fentry;
+
+	if(worker_function_hash == NULL) {
+		HASHCTL ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(worker_function_entry);
+		ctl.hcxt = TopMemoryContext;
+
+		worker_function_hash = hash_create("worker function cache", 128, &ctl, HASH_ELEM | HASH_CONTEXT | HASH_BLOBS);
+	}
+
+	fentry = (worker_function_entry*) hash_search(worker_function_hash, (void *) &entry->fn_oid, HASH_ENTER, &found);
+
+	if(found && (strcmp(fentry->class_name, entry->class_name) != 0 ||
+				 strcmp(fentry->method_name, entry->method_name) != 0 ||
+				 strcmp(fentry->signature, entry->signature) != 0)) {
+		unref_worker_function_cache(fentry->cache);
+		free(fentry->schema);
+		found = false;
+	}
+
+	if(!found) {
+		strlcpy(fentry->class_name, entry->class_name, sizeof(fentry->class_name));
+		strlcpy(fentry->method_name, entry->method_name, sizeof(fentry->method_name));
+		strlcpy(fentry->signature, entry->signature, sizeof(fentry->signature));
+		fentry->cache = (worker_function_cache*) MemoryContextAllocZero(TopMemoryContext, sizeof(worker_function_cache));
+		fentry->cache->refs = 1;
+		fentry->schema = NULL;
+		fentry->n_schema = 0;
+	}
+
+	return fentry;
+}
+
+/*
+	Hand a filled half of the data buffer over to the backend and wait until 
+	the other half was consumed. Returns false if the backend gave up on the 
+	task, the entry is then released by the worker.
+*/
+static bool
+flush_setof_chunk(worker_exec_entry* entry, int chunk, int rows, bool last, bool error) {
+	bool cancelled;
+	Latch* notify_latch;
+
+	SpinLockAcquire(&worker_head->lock);
+	cancelled = entry->cancelled;
+	// Entry may be reused as soon as the backend has the last chunk
+	notify_latch = entry->notify_latch;
+	if(!cancelled) {
+		entry->chunk_rows[chunk] = rows;
+		entry->chunk_last[chunk] = last;
+		entry->chunk_error[chunk] = error;
+		entry->chunk_state[chunk] = CHUNK_FULL;
+		if(last)
+			entry->worker_done = true;
+	}
+	SpinLockRelease(&worker_head->lock);
+
+	if(cancelled) {
+		release_exec_entry(worker_head, worker_area, entry);
+		return false;
+	}
+
+	SetLatch( notify_latch );
+
+	if(last)
+		return true;
+
+	// Wait for the backend to release the other half
+	for(;;) {
+		int ev;
+
+		SpinLockAcquire(&worker_head->lock);
+		if(entry->cancelled) {
+			SpinLockRelease(&worker_head->lock);
+			release_exec_entry(worker_head, worker_area, entry);
+			return false;
+		}
+		if(entry->chunk_state[1-chunk] == CHUNK_EMPTY) {
+			SpinLockRelease(&worker_head->lock);
+			return true;
+		}
+		SpinLockRelease(&worker_head->lock);
 
-#ifndef PGXC
-void		_PG_init(void);
+		ev = WaitLatch(MyLatch,
+						WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+						1 * 1000L,
+						PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		if (ev & WL_POSTMASTER_DEATH)
+			elog(FATAL, "unexpected postmaster dead");
 
-/* hook */
-static shmem_request_hook_type prev_shmem_request_hook = NULL;
-static void pluj_shmem_request(void);
+		CHECK_FOR_INTERRUPTS();
+	}
+}
 
 /*
- * Module load callback
- */
-void
-_PG_init(void)
-{
-	if (!process_shared_preload_libraries_in_progress)
-			return;
+	Stream the rows of a SETOF function to the backend. Rows are serialized
+	into one chunk buffer while the backend reads the other one. A chunk 
+	buffer grows if a single row does not fit.
+*/
+static void
+stream_setof_result(worker_exec_entry* entry, java_function_cache* jcache, jvalue* args, int jfr, char* error_msg) {
+	java_iterator it;
+	Datum values[entry->n_return];
+	bool primitive[entry->n_return];
+	bool nulls[entry->n_return];
+	int chunk = 0;
+	int rows = 0;
+	bool done = false;
+	char* start = NULL;
+	char* data = NULL;
+	Size size = 0;
+	MemoryContext rowctx;
+	MemoryContext oldctx;
+
+	memset(primitive, 0, sizeof(primitive));
+	it.iter = NULL;
+
+	rowctx = AllocSetContextCreate(CurrentMemoryContext, "plunijava setof row", ALLOCSET_DEFAULT_SIZES);
+
+	if(jfr == 0)
+		jfr = open_iter_java_function(&it, jcache, entry->class_name, entry->method_name, entry->signature, args, error_msg);
+
+	while(jfr == 0) {
+		Size len = 0;
+
+		MemoryContextReset(rowctx);
+		oldctx = MemoryContextSwitchTo(rowctx);
+
+		jfr = next_iter_java_function(values, primitive, nulls, entry->n_return, &done, &it, NULL, jcache, error_msg);
+		if(jfr != 0 || done) {
+			MemoryContextSwitchTo(oldctx);
+			break;
+		}
 
-	prev_shmem_request_hook = shmem_request_hook;
-	shmem_request_hook = pluj_shmem_request;
+		for(int i = 0; i < entry->n_return; i++) {
+			if(!primitive[i] && !nulls[i])
+				values[i] = PointerGetDatum( PG_DETOAST_DATUM( values[i] ) );
+			len += datumEstimateSpace(values[i], nulls[i], primitive[i], -1);
+		}
+
+		// Current chunk full, hand it over and continue in the other one
+		if(start == NULL || data + len > start + size) {
+			if(rows > 0) {
+				if(!flush_setof_chunk(entry, chunk, rows, false, false)) {
+					MemoryContextSwitchTo(oldctx);
+					close_iter_java_function(&it);
+					MemoryContextDelete(rowctx);
+					return;
+				}
+				chunk = 1 - chunk;
+				rows = 0;
+			}
+
+			start = alloc_entry_chunk(worker_area, entry, chunk, len);
+			if(start == NULL) {
+				MemoryContextSwitchTo(oldctx);
+				snprintf(error_msg, MAX_ERROR_MSG, "Could not allocate %zu bytes for bg worker result", len);
+				jfr = -7;
+				break;
+			}
+			size = entry->chunk_size[chunk];
+			data = start;
+		}
+
+		for(int i = 0; i < entry->n_return; i++) {
+			datumSerialize( values[i], nulls[i], primitive[i], -1, &data);
+		}
+		rows++;
+
+		MemoryContextSwitchTo(oldctx);
+	}
+
+	close_iter_java_function(&it);
+	MemoryContextDelete(rowctx);
+
+	if(jfr > 0) {
+		jthrowable exh = (*jenv)->ExceptionOccurred(jenv);
+
+		if(exh != 0) {
+			prepareErrorMsg(exh, error_msg, MAX_ERROR_MSG);
+		} else {
+			strcpy(error_msg,"Unknown error occured during java function call");
+		}
+		(*jenv)->ExceptionClear(jenv);
+	}
+
+	// Last chunk carries the error message (if any)
+	if(jfr != 0) {
+		start = alloc_entry_chunk(worker_area, entry, chunk, strlen(error_msg)+1);
+		if(start != NULL)
+			strcpy(start, error_msg);
+		rows = 0;
+	}
+
+	flush_setof_chunk(entry, chunk, rows, true, jfr != 0);
 }
 
-/* Reserve shared memory */
+/*
+	Serialize the results of a task into its payload, or the error message
+	if the call failed (jfr != 0)
+*/
 static void
-pluj_shmem_request(void)
-{
-	if (prev_shmem_request_hook)
-		prev_shmem_request_hook();
+prepare_task_return(worker_exec_entry* entry, int jfr, Datum* values, bool* primitive, bool* nulls, bool ret_null, char* task_error) {
+	entry->ret_null = ret_null;
+	if(jfr == 0) {
+		// Payload sized to the results
+		Size len = 0;
+		char* data;
+
+		for(int i = 0; i < entry->n_return; i++) {
+			if(!primitive[i] && !nulls[i]) 
+				values[i] = PointerGetDatum( PG_DETOAST_DATUM( values[i] ) );
+			len += datumEstimateSpace(values[i], nulls[i], primitive[i], -1);
+		}
 
-	RequestAddinShmemSpace(mul_size(MAX_USERS,sizeof(worker_data_head)));
-	RequestNamedLWLockTranche("pluj_background_workers", 1);
+		data = alloc_entry_data(worker_area, entry, len);
+		if(data != NULL) {
+			for(int i = 0; i < entry->n_return; i++) {
+				datumSerialize( values[i], nulls[i], primitive[i],-1, &data);
+			}
+		} else {
+			snprintf(task_error, MAX_ERROR_MSG, "Could not allocate %zu bytes for bg worker result", len);
+			jfr = -7;
+		}
+	}
+
+	// Error message is supplied via data
+	entry->error = (jfr != 0);
+	if(entry->error) {
+		char* data = alloc_entry_data(worker_area, entry, strlen(task_error)+1);
+		if(data != NULL)
+			strcpy(data, task_error);
+	}
 }
-#endif
 
+/*
+	Hand a finished task back to the submitting backend
+*/
+static void
+return_task(worker_exec_entry* entry) {
+	// Entry may be reused as soon as it is marked done
+	Latch* notify_latch = entry->notify_latch;
+
+	// Full barrier, results are visible before the state flips
+	if(pg_atomic_exchange_u32(&entry->state, TASK_DONE) == TASK_ABANDONED) {
+		// Backend gave up on the task
+		release_exec_entry(worker_head, worker_area, entry);
+		return;
+	}
+
+	SetLatch( notify_latch );
+}
 
-worker_data_head*
-launch_dynamic_workers(int32 n_workers, bool needSPI, bool globalWorker)
+/*
+	Thread pool of a G worker. The Java calls of several tasks run in 
+	parallel on threads attached to the JVM. Arguments and results are 
+	marshaled on the main thread only, as PG memory management, elog,
+	latches and the DSA area are not thread safe. Finished calls are put
+	on the done list and the main thread is woken up through a pipe that
+	its wait event set watches.
+*/
+typedef struct pool_task
 {
-	const char* WORKER_LIB = "$libdir/plunijava.so";
+	struct pool_task* next;
+	worker_exec_entry* entry;
+	worker_function_cache* cache;
+	jclass clazz;
+	jmethodID methodID;
+	char return_type[32];
+	int n_args;
+	jvalue* args;
+	short* argprim;
+	// Set by the pool thread
+	int rc;
+	jvalue result;
+	jthrowable exh;
+} pool_task;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pool_task* pending_head;
+	pool_task* pending_tail;
+	pool_task* done;
+	bool shutdown;
+	int n_threads;
+	pthread_t* threads;
+	// Wakeup pipe of the main thread, written by the pool threads
+	int wakeup_fd[2];
+	WaitEventSet* wait_set;
+} worker_thread_pool;
+
+static worker_thread_pool pool;
 
-	Oid			roleid = GetUserId();
-	Oid			dbid = MyDatabaseId;
-	
-	bool found = false;
-    
-    char buf[BGW_MAXLEN];
-	if(!globalWorker) {
-		snprintf(buf, BGW_MAXLEN, "UJ_%d_%d", roleid, dbid); 
-	} else {
-		snprintf(buf, BGW_MAXLEN, "UJ_global");
+/*
+	Wake up the main thread. A full pipe already holds a pending wakeup.
+*/
+static void
+pool_wakeup(void) {
+	int rc;
+
+	do {
+		rc = write(pool.wakeup_fd[1], "", 1);
+	} while(rc < 0 && errno == EINTR);
+}
+
+static void
+pool_drain_wakeups(void) {
+	char buf[64];
+
+	while(read(pool.wakeup_fd[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+static void*
+pool_thread_main(void* arg) {
+	JNIEnv* env;
+
+	if((*jvm)->AttachCurrentThread(jvm, (void**) &env, NULL) != JNI_OK)
+		return NULL;
+
+	for(;;) {
+		pool_task* task;
+
+		pthread_mutex_lock(&pool.lock);
+		while(pool.pending_head == NULL && !pool.shutdown)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+
+		if(pool.shutdown) {
+			pthread_mutex_unlock(&pool.lock);
+			break;
+		}
+
+		task = pool.pending_head;
+		pool.pending_head = task->next;
+		if(pool.pending_head == NULL)
+			pool.pending_tail = NULL;
+		pthread_mutex_unlock(&pool.lock);
+
+		task->rc = invoke_java_method(env, task->clazz, task->methodID, task->return_type, task->args, &task->result);
+
+		// Local references of this thread are handed over as global ones
+		if(task->rc > 0) {
+			jthrowable exh = (*env)->ExceptionOccurred(env);
+			(*env)->ExceptionClear(env);
+			task->exh = (exh != NULL) ? (jthrowable) (*env)->NewGlobalRef(env, exh) : NULL;
+			(*env)->DeleteLocalRef(env, exh);
+		} else if(java_return_is_object(task->return_type) && task->result.l != NULL) {
+			jobject ret = task->result.l;
+			task->result.l = (*env)->NewGlobalRef(env, ret);
+			(*env)->DeleteLocalRef(env, ret);
+		}
+
+		pthread_mutex_lock(&pool.lock);
+		task->next = pool.done;
+		pool.done = task;
+		pthread_mutex_unlock(&pool.lock);
+
+		// Wake up main thread
+		pool_wakeup();
 	}
 
-	/* initialize worker data header */
-	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
-    
-	worker_head = (worker_data_head*) ShmemInitStruct(buf,
-								   sizeof(worker_data_head),
-								   &found);
-	LWLockRelease(AddinShmemInitLock);
-	
-	if (found && worker_head->n_workers > 0) {
-    	return worker_head;
-    }
+	(*jvm)->DetachCurrentThread(jvm);
+	return NULL;
+}
 
-	SpinLockAcquire(&worker_head->lock);
+static void
+start_thread_pool(int n_threads) {
+	sigset_t all;
+	sigset_t old;
+
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	pool.threads = (pthread_t*) MemoryContextAllocZero(TopMemoryContext, n_threads * sizeof(pthread_t));
+
+	if(pipe(pool.wakeup_fd) < 0 
+		|| fcntl(pool.wakeup_fd[0], F_SETFL, O_NONBLOCK) < 0 
+		|| fcntl(pool.wakeup_fd[1], F_SETFL, O_NONBLOCK) < 0)
+		elog(ERROR,"Could not create wakeup pipe of bg worker: %m");
+
+	pool.wait_set = CreateWaitEventSet(TopMemoryContext, 3);
+	AddWaitEventToSet(pool.wait_set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+	AddWaitEventToSet(pool.wait_set, WL_POSTMASTER_DEATH, PGINVALID_SOCKET, NULL, NULL);
+	AddWaitEventToSet(pool.wait_set, WL_SOCKET_READABLE, pool.wakeup_fd[0], NULL, NULL);
+
+	// Signals are handled by the main thread only (threads inherit the mask)
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for(int t = 0; t < n_threads; t++) {
+		if(pthread_create(&pool.threads[pool.n_threads], NULL, pool_thread_main, NULL) == 0)
+			pool.n_threads++;
+	}
 
-	/* initialize worker data header */
-	memset(worker_head, 0, sizeof(worker_data_head));
-    dlist_init(&worker_head->exec_list);
-    dlist_init(&worker_head->free_list);
-	dlist_init(&worker_head->return_list);
-		
-	// Init free list
-	for(int i = 0; i < MAX_QUEUE_LENGTH; i++) {
-		worker_head->list_data[i].taskid = i;
-		dlist_push_tail(&worker_head->free_list,&worker_head->list_data[i].node);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if(pool.n_threads == 0)
+		elog(ERROR,"Could not start JVM threads of bg worker");
+
+	elog(LOG,"plUniJava worker %d started %d JVM threads",worker_id,pool.n_threads);
+}
+
+/*
+	Global references a queued pool task holds
+*/
+static void
+release_pool_task_refs(pool_task* task) {
+	for(int i = 0; i < task->n_args; i++) {
+		if(task->argprim[i] != 0)
+			(*jenv)->DeleteGlobalRef(jenv, task->args[i].l);
 	}
+	(*jenv)->DeleteGlobalRef(jenv, task->clazz);
+}
 
-	for(int n = 0; n < fmin(n_workers,MAX_WORKERS); n++) {
-		BackgroundWorker worker;
-		BackgroundWorkerHandle *handle;
-		BgwHandleStatus status;
-		pid_t		pid;
-		
-		memset(&worker, 0, sizeof(worker));
-		worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
-		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
-		worker.bgw_restart_time = BGW_NEVER_RESTART; // Time in s to restart if crash. Use BGW_NEVER_RESTART for no restart;
-		
-		strcpy(worker.bgw_library_name, WORKER_LIB);
-		sprintf(worker.bgw_function_name, "plunijava_worker_main");
-		
-		snprintf(worker.bgw_name, BGW_MAXLEN, "%s",buf);
-		//snprintf(worker.bgw_name, BGW_MAXLEN, "UJ_%s_%d",buf,(n+1));
-			
-		worker.bgw_main_arg = Int32GetDatum(n);
-		worker.bgw_notify_pid = MyProcPid;
+/*
+	Prepare a task on the main thread and queue its Java call to the pool
+*/
+static void
+submit_pool_task(worker_exec_entry* entry, char* task_error) {
+	worker_function_entry* fentry = lookup_worker_function(entry);
+	pool_task* task;
+	int jfr;
+
+	task = (pool_task*) MemoryContextAllocZero(TopMemoryContext, sizeof(pool_task));
+	task->entry = entry;
+	task->cache = fentry->cache;
+	task->n_args = entry->n_args;
+	task->args = (jvalue*) MemoryContextAllocZero(TopMemoryContext, (task->n_args + 1) * sizeof(jvalue));
+	task->argprim = (short*) MemoryContextAllocZero(TopMemoryContext, (task->n_args + 1) * sizeof(short));
+	strlcpy(task->return_type, entry->return_type, sizeof(task->return_type));
+
+	jfr = argDeSerializer(task->args, task->argprim, entry, fentry, task_error);
+
+	// Rows are streamed from the main thread
+	if(entry->setof) {
+		stream_setof_result(entry, &task->cache->jcache, task->args, jfr, task_error);
+		freejvalues(task->args, task->argprim, task->n_args);
+		pfree(task->args);
+		pfree(task->argprim);
+		pfree(task);
+		return;
+	}
 
-		memcpy(&worker.bgw_extra[0],&roleid,4);
-		memcpy(&worker.bgw_extra[4],&dbid,4);
-		if(!needSPI || globalWorker) {
-			worker.bgw_extra[9] = 0;
+	if(jfr == 0)
+		jfr = resolve_java_method(&task->cache->jcache.clazz, &task->cache->jcache.methodID, entry->class_name, entry->method_name, entry->signature, task_error);
+
+	if(jfr != 0) {
+		freejvalues(task->args, task->argprim, task->n_args);
+		if(jfr > 0) {
+			jthrowable exh = (*jenv)->ExceptionOccurred(jenv);
+			if(exh != 0)
+				prepareErrorMsg(exh, task_error, MAX_ERROR_MSG);
+			else
+				strcpy(task_error,"Unknown error occured during java function call");
+			(*jenv)->ExceptionClear(jenv);
+		}
+		prepare_task_return(entry, jfr, NULL, NULL, NULL, false, task_error);
+		return_task(entry);
+		pfree(task->args);
+		pfree(task->argprim);
+		pfree(task);
+		return;
+	}
+
+	// Local references are bound to the main thread
+	for(int i = 0; i < task->n_args; i++) {
+		if(task->argprim[i] != 0) {
+			jobject obj = task->args[i].l;
+			task->args[i].l = (*jenv)->NewGlobalRef(jenv, obj);
+			(*jenv)->DeleteLocalRef(jenv, obj);
+		}
+	}
+	task->clazz = (jclass) (*jenv)->NewGlobalRef(jenv, task->cache->jcache.clazz);
+	task->methodID = task->cache->jcache.methodID;
+	task->cache->refs++;
+
+	pthread_mutex_lock(&pool.lock);
+	if(pool.pending_tail != NULL)
+		pool.pending_tail->next = task;
+	else
+		pool.pending_head = task;
+	pool.pending_tail = task;
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/*
+	Convert the result of a finished pool task and return it to the backend
+*/
+static void
+finish_pool_task(pool_task* task, char* task_error) {
+	worker_exec_entry* entry = task->entry;
+	Datum values[entry->n_return];
+	bool primitive[entry->n_return];
+	bool nulls[entry->n_return];
+	bool ret_null = false;
+	int jfr = task->rc;
+
+	memset(primitive, 0, sizeof(primitive));
+	memset(nulls, 0, sizeof(nulls));
+
+	if(jfr > 0) {
+		if(task->exh != NULL) {
+			prepareErrorMsg(task->exh, task_error, MAX_ERROR_MSG);
+			(*jenv)->DeleteGlobalRef(jenv, task->exh);
 		} else {
-			worker.bgw_extra[9] = 1;
+			strcpy(task_error,"Unknown error occured during java function call");
 		}
+	} else {
+		jfr = convert_java_result(values, primitive, nulls, &ret_null, entry->n_return, NULL, &task->cache->jcache, task->return_type, &task->result, task_error);
+		if(java_return_is_object(task->return_type) && task->result.l != NULL)
+			(*jenv)->DeleteGlobalRef(jenv, task->result.l);
+	}
 
-		if (!RegisterDynamicBackgroundWorker(&worker, &handle))
-			continue;
+	// Release args
+	release_pool_task_refs(task);
+	unref_worker_function_cache(task->cache);
 
-		status = WaitForBackgroundWorkerStartup(handle, &pid);
+	prepare_task_return(entry, jfr, values, primitive, nulls, ret_null, task_error);
+	return_task(entry);
 
-		if (status == BGWH_STOPPED)
-			ereport(ERROR,
-					(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
-					errmsg("could not start background process"),
-					errhint("More details may be available in the server log.")));
-		if (status == BGWH_POSTMASTER_DIED)
-			ereport(ERROR,
-					(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
-					errmsg("cannot start background processes without postmaster"),
-					errhint("Kill all remaining database processes and restart the database.")));
-		
-		Assert(status == BGWH_STARTED);
-		
-		elog(WARNING,"plUniJava worker %d of %d initialized with pid %d (from %d)",(n+1),(int) fmin(n_workers,MAX_WORKERS),pid,MyProcPid);
+	pfree(task->args);
+	pfree(task->argprim);
+	pfree(task);
+}
+
+/*
+	Stop the pool threads. Calls not started yet fail, calls in progress 
+	are waited for and returned, so no backend is left waiting on a task.
+*/
+static void
+stop_thread_pool(char* task_error) {
+	pool_task* pending;
+	pool_task* done;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.shutdown = true;
+	pending = pool.pending_head;
+	pool.pending_head = NULL;
+	pool.pending_tail = NULL;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	while(pending != NULL) {
+		pool_task* next = pending->next;
+
+		release_pool_task_refs(pending);
+		unref_worker_function_cache(pending->cache);
+		strlcpy(task_error, "bg worker was stopped before the task ran", MAX_ERROR_MSG);
+		prepare_task_return(pending->entry, -1, NULL, NULL, NULL, false, task_error);
+		return_task(pending->entry);
+		pfree(pending->args);
+		pfree(pending->argprim);
+		pfree(pending);
+		pending = next;
 	}
 
-	worker_head->n_workers = fmin(n_workers,MAX_WORKERS);
+	for(int t = 0; t < pool.n_threads; t++)
+		pthread_join(pool.threads[t], NULL);
 
-    SpinLockRelease(&worker_head->lock);
-	
-	return worker_head;
-}
+	// Threads are gone, no lock needed
+	done = pool.done;
+	pool.done = NULL;
+	while(done != NULL) {
+		pool_task* next = done->next;
+		finish_pool_task(done, task_error);
+		done = next;
+	}
 
+	FreeWaitEventSet(pool.wait_set);
+	close(pool.wakeup_fd[0]);
+	close(pool.wakeup_fd[1]);
+}
 
 /*
-	Build Java args from serialized datums
+	Main loop of a G worker with a JVM thread pool
 */
-int 
-argDeSerializer(jvalue* args, short* argprim, worker_exec_entry* entry) {
-	char* pos = entry->data;
-	for(int i = 0; i < entry->n_args; i++) {
-		bool isnull;
-		char* T = pos;
+static void
+worker_loop_threaded(char* task_error) {
+	bool listed = false;
 
-		pos += strlen(T)+1;
-		//elog(WARNING,"%d. T: %s, pos: %d",i,T,(int) pos);
+	start_thread_pool(pluj_worker_threads);
 
-		
-		if(T[0] == '[') {
-			ArrayType* v;
-			Datum arg;
-			argprim[i] = 1;
-			switch(T[1]) {
-				// 1D arrays
-				case 'B':
-					arg = datumDeSerialize(&pos, &isnull);
-					bytea* bytes  = DatumGetByteaP( arg );
-					jsize  nElems = VARSIZE(bytes) - sizeof(int32);
-					jbyteArray byteArray  =(*jenv)->NewByteArray(jenv,nElems);
-					(*jenv)->SetByteArrayRegion(jenv, byteArray, 0, nElems, (jbyte*)VARDATA(bytes));
-					args[i].l = byteArray;
-					break;
-				case 'I':
-					arg = datumDeSerialize(&pos, &isnull);
-					v = DatumGetArrayTypeP(arg);
-					if(!ARR_HASNULL(v)) {
-						jsize      nElems = (jsize)ArrayGetNItems(ARR_NDIM(v), ARR_DIMS(v));
-						jintArray intArray = (*jenv)->NewIntArray(jenv,nElems);
-						(*jenv)->SetIntArrayRegion(jenv,intArray, 0, nElems, (jint*)ARR_DATA_PTR(v));
-						args[i].l = intArray;
-					} else {
-						strcpy(entry->data,"Array with null not supported yet");
-						return -1;
-					}
-					break;
-				case 'J':
-					arg = datumDeSerialize(&pos, &isnull);
-					v = DatumGetArrayTypeP(arg);
-					if(!ARR_HASNULL(v)) {
-						jsize      nElems = (jsize)ArrayGetNItems(ARR_NDIM(v), ARR_DIMS(v));
-						jlongArray longArray = (*jenv)->NewLongArray(jenv,nElems);
-						(*jenv)->SetLongArrayRegion(jenv,longArray, 0, nElems, (jlong*)ARR_DATA_PTR(v));
-						args[i].l = longArray;
-					} else {
-						strcpy(entry->data,"Array with null not supported yet");
-						return -1;
-					}
-					break;
-				case 'D':
-					arg = datumDeSerialize(&pos, &isnull);
-					v = DatumGetArrayTypeP(arg);
-					if(!ARR_HASNULL(v)) {
-						jsize      nElems = (jsize)ArrayGetNItems(ARR_NDIM(v), ARR_DIMS(v));
-						jdoubleArray doubleArray = (*jenv)->NewDoubleArray(jenv,nElems);
-						(*jenv)->SetDoubleArrayRegion(jenv, doubleArray, 0, nElems, (jdouble *)ARR_DATA_PTR(v));
-						args[i].l = doubleArray;
-					} else {
-						strcpy(entry->data,"Array with null not supported yet");
-						return -1;
-					}
-					break;
-				case 'F':
-					arg = datumDeSerialize(&pos, &isnull);
-					v = DatumGetArrayTypeP(arg);
-					if(!ARR_HASNULL(v)) {
-						jsize      nElems = (jsize)ArrayGetNItems(ARR_NDIM(v), ARR_DIMS(v));
-						jfloatArray floatArray = (*jenv)->NewFloatArray(jenv,nElems);
-						(*jenv)->SetFloatArrayRegion(jenv, floatArray, 0, nElems, (jfloat *)ARR_DATA_PTR(v));
-						args[i].l = floatArray;
-					} else {
-						strcpy(entry->data,"Array with null not supported yet");
-						return -1;
-					}
-					break;
-				case '[':
-					arg = datumDeSerialize(&pos, &isnull);
-					int nc;
-					// 2D arrays;
-					switch(T[2]) {
-						case 'I':
-							v = DatumGetArrayTypeP(arg);
-							nc = 0;
-							if(!ARR_HASNULL(v)) {
-								jclass cls = (*jenv)->FindClass(jenv,"[I");
-								jobjectArray objectArray = (*jenv)->NewObjectArray(jenv, ARR_DIMS(v)[0],cls,0);
-								
-								for (int idx = 0; idx < ARR_DIMS(v)[0]; ++idx) {
-									// Create inner
-									jintArray innerArray = (*jenv)->NewIntArray(jenv,ARR_DIMS(v)[1]);
-									(*jenv)->SetIntArrayRegion(jenv, innerArray, 0, ARR_DIMS(v)[1], (jint *) (ARR_DATA_PTR(v) + nc*sizeof(int) ));
-									nc += ARR_DIMS(v)[1];
-									(*jenv)->SetObjectArrayElement(jenv, objectArray, idx, innerArray);
-									(*jenv)->DeleteLocalRef(jenv,innerArray);
-								}
-								
-								args[i].l = objectArray;
-							}	
-							break;
-						case 'D':
-							v = DatumGetArrayTypeP(arg);
-							nc = 0;
-							if(!ARR_HASNULL(v)) {
-								jclass cls = (*jenv)->FindClass(jenv,"[D");
-								jobjectArray objectArray = (*jenv)->NewObjectArray(jenv, ARR_DIMS(v)[0],cls,0);
-								
-								for (int idx = 0; idx < ARR_DIMS(v)[0]; ++idx) {
-									// Create inner
-									jdoubleArray innerArray = (*jenv)->NewDoubleArray(jenv,ARR_DIMS(v)[1]);
-									(*jenv)->SetDoubleArrayRegion(jenv, innerArray, 0, ARR_DIMS(v)[1], (jdouble *) (ARR_DATA_PTR(v) + nc*sizeof(double) ));
-									nc += ARR_DIMS(v)[1];
-									(*jenv)->SetObjectArrayElement(jenv, objectArray, idx, innerArray);
-									(*jenv)->DeleteLocalRef(jenv,innerArray);
-								}
-								
-								args[i].l = objectArray;
-							}	
-							break;
-						default:
-							strcpy(entry->data,"Could not deserialize java function argument (unknown 2d array type)");
-							return -1;
-					}
-					break;
-				case 'L':
-					// Object array
-					if(strcmp(T, "[Ljava/lang/String;") == 0) {
-						// String array
-						strcpy(entry->data,"Could not deserialize java function argument (string arrays not supported yet)");
-						return -1;
-					} else {
-						// Composite type
-					
-						// Read array length
-						int N = ((int*)(pos))[0];
-						pos += 4;
-
-						// Map composite type
-						jclass cls = (*jenv)->FindClass(jenv, T+1);
-						if(cls == NULL) {
-							strcpy(entry->data,"Could not deserialize java function argument (unknown class for composite type)");
-							return -1;
-						}
-						// Get field info
-						jmethodID getFields = (*jenv)->GetMethodID(jenv, (*jenv)->GetObjectClass(jenv,cls), "getFields", "()[Ljava/lang/reflect/Field;");
-						jobjectArray fieldsList = (jobjectArray)  (*jenv)->CallObjectMethod(jenv, cls, getFields);    
-						jsize len =  (*jenv)->GetArrayLength(jenv,fieldsList);
-						
-						if( len == 0 ) {
-							strcpy(entry->data,"Could not deserialize java function argument (composite type has zero elements)");
-							return -1;		
-						} else {
-							// Create object array
-							jobjectArray objectArray = (*jenv)->NewObjectArray(jenv, N, cls, 0);
-								
-							// Infer fields
-							char* sig[len];
-							char* fieldname[len];
-							char* typename[len];
-							jstring jstr[len];
-							jstring jstr2[len];
-							jfieldID fid[len];
-
-							// Loop over class fields to prepare                             
-							for(int j = 0; j < len; j++) {
-								char error_msg[128];
-								
-								// Detect field
-								jobject field = (*jenv)->GetObjectArrayElement(jenv, fieldsList, j);
-								jclass fieldClass = (*jenv)->GetObjectClass(jenv, field);
-									
-								// Obtain signature
-								jmethodID m =  (*jenv)->GetMethodID(jenv, fieldClass, "getName", "()Ljava/lang/String;");   
-								jstr[j] = (jstring)(*jenv)->CallObjectMethod(jenv, field, m);
-							
-								fieldname[j] =  (*jenv)->GetStringUTFChars(jenv, jstr[j], false);
-							
-								m =  (*jenv)->GetMethodID(jenv, fieldClass, "getType", "()Ljava/lang/Class;");   
-								jobject value = (*jenv)->CallObjectMethod(jenv, field, m);
-								jclass  valueClass = (*jenv)->GetObjectClass(jenv, value);
-
-								m =  (*jenv)->GetMethodID(jenv, valueClass, "getName", "()Ljava/lang/String;");   
-								jstr2[j] = (jstring)(*jenv)->CallObjectMethod(jenv, value, m);
-								typename[j] =  (*jenv)->GetStringUTFChars(jenv, jstr2[j], false);
-
-								sig[j] = convert_name_to_JNI_signature(typename[j], error_msg);
-								
-								if(sig[j] == NULL) {
-									sprintf(entry->data,"%s",error_msg);   
-									return -1;
-								}
-							
-								fid[j] = (*jenv)->GetFieldID(jenv, cls, fieldname[j], sig[j]);
-							}
-
-							// Loop over elements
-							for(int n = 0; n < N; n++) {
-						
-								// Construct new instance
-								jmethodID constructor = (*jenv)->GetMethodID(jenv, cls, "<init>", "()V");
-								jobject cobj = (*jenv)->NewObject(jenv, cls, constructor);
-
-								// Loop over class fields                            
-								for(int j = 0; j < len; j++) {
-									
-									// Read element
-									arg = datumDeSerialize(&pos, &isnull);
-									
-									if(isnull) {
-										strcpy(entry->data,"Could not deserialize java function argument (no corresponding attribute found)");
-										return -1;
-									}
-									
-									int res = set_jobject_field_from_datum(&cobj, &fid[j], &arg, sig[j]); 
-									
-									if(res != 0) {                                
-										strcpy(entry->data,"Could not deserialize java function argument (unknown error in composite type)");
-										return -1;
-									}
-								}
-								
-								// Set element
-								(*jenv)->SetObjectArrayElement(jenv, objectArray, n, cobj);
-							}
-							
-							// Cleanup
-							for(int j = 0; j < len; j++) {
-								(*jenv)->ReleaseStringUTFChars(jenv, jstr2[j], typename[j]);
-								(*jenv)->ReleaseStringUTFChars(jenv, jstr[j], fieldname[j]);
-							}
-
-							args[i].l = objectArray;
-						}			
-						break;
-					}
-					
-				default:
-					strcpy(entry->data,"Could not deserialize java function argument (unknown array type)");
-					return -1;
-			}
+	while(!got_signal)
+	{
+		bool busy = false;
+		pool_task* done;
+
+		// Finished Java calls
+		pthread_mutex_lock(&pool.lock);
+		done = pool.done;
+		pool.done = NULL;
+		pthread_mutex_unlock(&pool.lock);
+
+		while(done != NULL) {
+			pool_task* next = done->next;
+			finish_pool_task(done, task_error);
+			done = next;
+			busy = true;
 		}
-		else if(T[0] == 'L') {
-			Datum arg = datumDeSerialize(&pos, &isnull);
 
-			// Objects
-			if(strcmp(T, "Ljava/lang/String;") == 0) {
-				text* txt = DatumGetTextP(arg);
-				int len = VARSIZE_ANY_EXHDR(txt)+1;
-				char t[len];
-				text_to_cstring_buffer(txt, &t[0], len);
-				args[i].l = (*jenv)->NewStringUTF(jenv, t);
-				argprim[i] = 2;
+		// New tasks
+		for(;;) {
+			worker_exec_entry* entry;
+			int slot = task_ring_pop(EXEC_RING(worker_head));
 
-			} else {
-				argprim[i] = 1;
-	
-				// Map composite type
-				jclass cls = (*jenv)->FindClass(jenv, T);
-				if(cls == NULL) {
-                	strcpy(entry->data,"Could not deserialize java function argument (unknown class for composite type)");
-					return -1;
-                }
-				// Get field info
-				jmethodID getFields = (*jenv)->GetMethodID(jenv, (*jenv)->GetObjectClass(jenv,cls), "getFields", "()[Ljava/lang/reflect/Field;");
-				jobjectArray fieldsList = (jobjectArray)  (*jenv)->CallObjectMethod(jenv, cls, getFields);    
-				jsize len =  (*jenv)->GetArrayLength(jenv,fieldsList);
-				
-				if(len == 0) {
-					strcpy(entry->data,"Could not deserialize java function argument (empty class for composite type)");
-					return -1;
-				} else {
-					// Construct new instance
-					jmethodID constructor = (*jenv)->GetMethodID(jenv, cls, "<init>", "()V");
-					jobject cobj = (*jenv)->NewObject(jenv, cls, constructor);
-							
-					// Loop over class fields                            
-					for(int j = 0; j < len; j++) {
-						
-						// ToDo: Move to helper function ?
-						const char* sig;
-
-						// Detect field
-						jobject field = (*jenv)->GetObjectArrayElement(jenv, fieldsList, j);
-						jclass fieldClass = (*jenv)->GetObjectClass(jenv, field);
-							
-						// Obtain signature
-						jmethodID m =  (*jenv)->GetMethodID(jenv, fieldClass, "getName", "()Ljava/lang/String;");   
-						jstring jstr = (jstring)(*jenv)->CallObjectMethod(jenv, field, m);
-					
-						const char* fieldname =  (*jenv)->GetStringUTFChars(jenv, jstr, false);
-					
-						m =  (*jenv)->GetMethodID(jenv, fieldClass, "getType", "()Ljava/lang/Class;");   
-						jobject value = (*jenv)->CallObjectMethod(jenv, field, m);
-						jclass  valueClass = (*jenv)->GetObjectClass(jenv, value);
-
-						m =  (*jenv)->GetMethodID(jenv, valueClass, "getName", "()Ljava/lang/String;");   
-						jstring jstr2 = (jstring)(*jenv)->CallObjectMethod(jenv, value, m);
-						const char* typename =  (*jenv)->GetStringUTFChars(jenv, jstr2, false);
-
-						sig = convert_name_to_JNI_signature(typename, entry->data);
-						
-						if(sig == NULL) {
-							return -1;  
-						}
-						
-						jfieldID fid = (*jenv)->GetFieldID(jenv, cls, fieldname, sig);
-						
-						Datum attr;
-						if(j > 0) {
-							attr = datumDeSerialize(&pos, &isnull);
-						} else {
-							attr = arg;
-						}
-					
-						if(isnull) {
-							strcpy(entry->data,"Could not deserialize java function argument (no corresponding attribute found)");
-							return -1;
-						}
-						
-						int res = set_jobject_field_from_datum(&cobj, &fid, &attr, sig); 
-						
-						(*jenv)->ReleaseStringUTFChars(jenv, jstr2, typename);
-						(*jenv)->ReleaseStringUTFChars(jenv, jstr, fieldname);
-
-						if(res != 0) {                                
-							strcpy(entry->data,"Could not deserialize java function argument (unknown error in composite type)");
-							return -1;
-						}
-                        
-					}
-					args[i].l = cobj;
-				}
-				
-				//strcpy(entry->data,"HALDE");
-				//return -1;
-			}
-		} 
-		else {
-			Datum arg = datumDeSerialize(&pos, &isnull);
-
-			// Natives
-			switch(T[0]) {
-				case 'S':
-					args[i].s = (jshort) DatumGetInt16(arg);
-					break;
-				case 'I':
-					args[i].i = (jint) DatumGetInt32(arg);
-					break;
-				case 'J':
-					args[i].j = (jlong) DatumGetInt64(arg);
-					break;
-				case 'Z':
-					args[i].z = (jboolean) DatumGetBool(arg);
-					break;
-				case 'F':
-					args[i].f = (jfloat) DatumGetFloat4(arg);
-					break;
-				case 'D':
-					args[i].d = (jdouble) DatumGetFloat8(arg);	
-					break;	
-
-				default:
-					strcpy(entry->data,"Could not deserialize java function argument (unknown native type)");
-					return -1;	
+			if(slot < 0)
+				break;
+
+			if(listed) {
+				worker_leave_idle();
+				listed = false;
 			}
+
+			entry = &worker_head->list_data[slot];
+			entry->worker_latch = MyLatch;
+
+			submit_pool_task(entry, task_error);
+			busy = true;
 		}
-	}		
 
-	return 0;
-}
+		if(!busy) {
+			WaitEvent event;
+			int n;
+
+			// Threads may still run calls, more tasks are accepted meanwhile
+			listed = true;
+			if(worker_go_idle())
+				continue;
+
+			// Latch for new tasks, pipe for finished calls
+			n = WaitEventSetWait(pool.wait_set, 10 * 1000L, &event, 1, PG_WAIT_EXTENSION);
+			ResetLatch(MyLatch);
+			if (n > 0 && (event.events & WL_POSTMASTER_DEATH))
+				elog(FATAL, "unexpected postmaster dead");
+			if (n > 0 && (event.events & WL_SOCKET_READABLE))
+				pool_drain_wakeups();
 
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+
+	stop_thread_pool(task_error);
+}
 
 void
 sigTermHandler(SIGNAL_ARGS)
@@ -565,38 +1933,48 @@ plunijava_worker_main(Datum main_arg)
 	bits32		flags = 0;
 
 	char error_msg[128];
+	static char task_error[MAX_ERROR_MSG];
 	int jc;
 	char buf[BGW_MAXLEN];
 	bool found;
+	bool listed = false;
+	int slot;
 
  	memcpy(&roleoid,&MyBgworkerEntry->bgw_extra[0],4);
 	memcpy(&dboid,&MyBgworkerEntry->bgw_extra[4],4);
+	memcpy(&slot,&MyBgworkerEntry->bgw_extra[12],4);
 	memcpy(&flags,&MyBgworkerEntry->bgw_flags,4);
 
 	activeSPI = MyBgworkerEntry->bgw_extra[9];
+	worker_id = workerid;
 
 	snprintf(buf, BGW_MAXLEN, "%s_%d", MyBgworkerEntry->bgw_name, worker_id); 
 	//snprintf(buf, BGW_MAXLEN, "%s", MyBgworkerEntry->bgw_name); 
 
-	// Attach to shared memory
-
-	worker_head = (worker_data_head*) ShmemInitStruct(MyBgworkerEntry->bgw_name,
-								   sizeof(worker_data_head),
-								   &found);
+	// Attach to shared memory (user pools by their registry slot)
+	if(slot >= 0) {
+		worker_head = attach_user_pool_worker(slot);
+		found = true;
+	} else {
+		LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+		worker_head = (worker_data_head*) ShmemInitStruct(MyBgworkerEntry->bgw_name,
+									   worker_head_size(),
+									   &found);
+		LWLockRelease(AddinShmemInitLock);
+	}
 
 	if(!found) {
 		elog(ERROR,"Shared memory for background worker has not been initialized (%s)",buf);
 		/*
 		// initialize worker data header 
-		memset(worker_head, 0, sizeof(worker_data_head));
-		dlist_init(&worker_head->exec_list);
-		dlist_init(&worker_head->free_list);
-		dlist_init(&worker_head->return_list);
-
-		// Init free list
-		for(int i = 0; i < MAX_QUEUE_LENGTH; i++) {
+		memset(worker_head, 0, worker_head_size());
+		task_ring_init(EXEC_RING(worker_head), task_ring_capacity());
+		task_ring_init(FREE_RING(worker_head), task_ring_capacity());
+		// Init free ring
+		for(int i = 0; i < worker_head->queue_length; i++) {
 			worker_head->list_data[i].taskid = i;
-			dlist_push_tail(&worker_head->free_list,&worker_head->list_data[i].node);
+			pg_atomic_init_u32(&worker_head->list_data[i].state, TASK_DONE);
+			task_ring_push(FREE_RING(worker_head), i);
 		}
 		worker_head->n_workers = 0;
 		*/
@@ -610,6 +1988,9 @@ plunijava_worker_main(Datum main_arg)
 	elog(WARNING,"[DEBUG]: BG worker %s init shared memory found: %d | pid: %d, total: %d | SPI: %d",buf,(int) found,worker_head->pid[workerid],worker_head->n_workers,activeSPI);
 
 	SpinLockRelease(&worker_head->lock);
+
+	// Map task payloads
+	worker_area = attach_worker_area(worker_head);
 		
 	/* Establish signal handlers before unblocking signals. */
 	pqsignal(SIGTERM, sigTermHandler);
@@ -633,6 +2014,13 @@ plunijava_worker_main(Datum main_arg)
 	}
 
 	elog(LOG, "%s initialized",buf);
+
+	// Global worker (no SPI) runs Java calls on a thread pool
+	if(!activeSPI && pluj_worker_threads > 0) {
+		worker_loop_threaded(task_error);
+		elog(DEBUG1, "%s stopped", buf);
+		return;
+	}
 		
 	/*
 	 * Main loop: do this until SIGTERM is received and processed by
@@ -641,14 +2029,17 @@ plunijava_worker_main(Datum main_arg)
 	while(!got_signal)
 	{
 		int ev;
-		dlist_node* dnode;
+		int slot;
 		worker_exec_entry* entry;
 
-        SpinLockAcquire(&worker_head->lock);
+        slot = task_ring_pop(EXEC_RING(worker_head));
        
-        if (dlist_is_empty(&worker_head->exec_list))
+        if (slot < 0)
         {
-            SpinLockRelease(&worker_head->lock);
+            listed = true;
+            if(worker_go_idle())
+                continue;
+
 		    ev = WaitLatch(MyLatch,
                             WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
                             10 * 1000L,
@@ -664,13 +2055,16 @@ plunijava_worker_main(Datum main_arg)
         /*
             Exec task
         */       
-        dnode = dlist_pop_head_node(&worker_head->exec_list);
-        entry = dlist_container(worker_exec_entry, node, dnode);
+        if(listed) {
+            worker_leave_idle();
+            listed = false;
+        }
+
+        entry = &worker_head->list_data[slot];
+        entry->worker_latch = MyLatch;
 
         // Run function and return data
         //elog(WARNING,"BG worker taskid: %d",entry->taskid);
-		
-		SpinLockRelease(&worker_head->lock);
 
 		if(activeSPI) {
 			/* 
@@ -688,19 +2082,38 @@ plunijava_worker_main(Datum main_arg)
 		
 		Datum values[entry->n_return];
 		bool primitive[entry->n_return];
+		bool nulls[entry->n_return];
+		bool ret_null = false;
 		memset(primitive, 0, sizeof(primitive));
+		memset(nulls, 0, sizeof(nulls));
 		
 		// Prepare args
 		jvalue args[entry->n_args];
 		short argprim[entry->n_args];
 		memset(argprim, 0, sizeof(argprim));
 		
-		int jfr = argDeSerializer(args, argprim, entry);
+		worker_function_entry* fentry = lookup_worker_function(entry);
+		int jfr = argDeSerializer(args, argprim, entry, fentry, task_error);
 
 		
 		//elog(WARNING,"[DEBUG]: Calling java function %s->%s",entry->class_name,entry->method_name);
+		if(entry->setof) {
+			int n_args = entry->n_args;
+
+			// Rows are handed over chunk by chunk, no return list
+			stream_setof_result(entry, &fentry->cache->jcache, &args[0], jfr, task_error);
+			freejvalues(args, argprim, n_args);
+
+			if(activeSPI) {
+				disconnect_SPI();
+				PopActiveSnapshot();
+				CommitTransactionCommand();
+			}
+			continue;
+		}
+
 		if(jfr == 0) {			
-			jfr = call_java_function(values, primitive, entry->class_name, entry->method_name, entry->signature, entry->return_type, &args[0], entry->data);
+			jfr = call_java_function(values, primitive, nulls, &ret_null, entry->n_return, NULL, &fentry->cache->jcache, entry->class_name, entry->method_name, entry->signature, entry->return_type, &args[0], task_error);
 		} 
 
 		// Release args
@@ -709,38 +2122,19 @@ plunijava_worker_main(Datum main_arg)
 		// Check for exception
 		if( jfr > 0 ) {
 			elog(WARNING,"Java exception occured. Code: %d",jfr);
-			// Set error msg to true;
-			entry->error = true;
 			jthrowable exh = (*jenv)->ExceptionOccurred(jenv);
 			
 			if(exh !=0) {
-				prepareErrorMsg(exh, &entry->data[0], MAX_DATA); 
+				prepareErrorMsg(exh, task_error, MAX_ERROR_MSG); 
 			} else {
-				strcpy(entry->data,"Unknown error occured during java function call");
+				strcpy(task_error,"Unknown error occured during java function call");
 			}	
 
 			// Clear exception
 			(*jenv)->ExceptionClear(jenv);	
-		} else if(jfr < 0) {
-			// Activate error messaging (supplied via data)
-			entry->error = true;
-		} else {
-			// Set error msg to false;
-			entry->error = false;
-		
-			// Prepare return
-			char* data = entry->data;
-			for(int i = 0; i < entry->n_return; i++) {
-				if(!primitive[i]) 
-					datumSerialize( PointerGetDatum( PG_DETOAST_DATUM( values[i] ) ) , false, primitive[i],-1, &data);
-				else
-					datumSerialize( values[i], false, primitive[i],-1, &data);
-			}		
 		}
 
-	    SpinLockAcquire(&worker_head->lock);
-		dlist_push_tail(&worker_head->return_list,&entry->node);
-		SpinLockRelease(&worker_head->lock);
+		prepare_task_return(entry, jfr, values, primitive, nulls, ret_null, task_error);
 		
 		/*
 			Cleanup
@@ -753,7 +2147,8 @@ plunijava_worker_main(Datum main_arg)
 			PopActiveSnapshot();
 			CommitTransactionCommand();
 		}
-		SetLatch( entry->notify_latch );
+
+		return_task(entry);
 
 		//elog(WARNING,"BG worker: DONE");	
 	}
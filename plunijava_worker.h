@@ -1,40 +1,159 @@
 #include "postgres.h"
 #include "storage/latch.h"
 #include "postmaster/bgworker.h"
+#include "utils/dsa.h"
+#include "port/atomics.h"
 
-#define MAX_USERS 1+1
-#define MAX_WORKERS 1
-#define MAX_QUEUE_LENGTH 16
-#define MAX_DATA 2097152*1
+// Capacity of the per pool worker arrays (pluj.max_workers is bounded by it)
+#define MAX_WORKERS 1024
+
+// Pool sizes, set via pluj.* GUCs at server start
+extern int pluj_max_workers;
+extern int pluj_queue_length;
+extern int pluj_max_payload;
+extern int pluj_max_user_pools;
+extern int pluj_worker_threads;
+extern int pluj_batch_size;
+extern bool pluj_parallel_delegate;
+
+// Upper bound of a single task payload in bytes (pluj.max_payload is in kB)
+#define MAX_DATA ((Size) pluj_max_payload * 1024)
+#define MAX_ERROR_MSG 8192
+
+// SETOF results are streamed through two chunk buffers of at least CHUNK_SIZE
+#define CHUNK_SIZE 1048576
+#define CHUNK_EMPTY 0
+#define CHUNK_FULL 1
+
+// Completion state of a task, owned by the backend until TASK_DONE
+#define TASK_PENDING 0
+#define TASK_DONE 1
+#define TASK_ABANDONED 2
 
 typedef struct 
 {
-    dlist_node node;
     int taskid;
+    pg_atomic_uint32 state;
+    Oid fn_oid;
     char class_name[128];
     char method_name[128];
     char signature[256];
-    char return_type[1];
+    char return_type[32];
     Latch *notify_latch;
     int n_args;
     int n_return;
     bool error;
-    char data[MAX_DATA];
+    // Java returned null, the result is SQL NULL
+    bool ret_null;
+    // Arguments on submission, results or error message on return
+    dsa_pointer data;
+    Size data_size;
+    // SETOF streaming state (protected by worker_head->lock)
+    bool setof;
+    bool cancelled;
+    bool worker_done;
+    Latch *worker_latch;
+    int chunk_state[2];
+    int chunk_rows[2];
+    bool chunk_last[2];
+    bool chunk_error[2];
+    dsa_pointer chunk_data[2];
+    Size chunk_size[2];
 } worker_exec_entry;
 
+/*
+    Kind of a Java argument in the binary task payload. The schema is 
+    derived from the signature once per function (backend and worker 
+    function caches), so the payload carries no type tags:
+
+    null bitmap of all arguments (MAXALIGN'd), then per non-null argument
+      ARG_PRIMITIVE, ARG_BOXED   Datum
+      ARG_COMPOSITE              datumSerialize of each attribute
+      ARG_COMPOSITE_ARRAY        int count, then the attributes of each element
+      other kinds                detoasted varlena, read in place
+    each MAXALIGN'd.
+*/
+#define ARG_PRIMITIVE 'p'
+#define ARG_BOXED 'b'
+#define ARG_STRING 's'
+#define ARG_VALUE 'v'
+#define ARG_BYTES 'y'
+#define ARG_ARRAY 'a'
+#define ARG_ARRAY2D 'm'
+#define ARG_BUFFER 'u'
+#define ARG_NDARRAY 'n'
+#define ARG_COMPOSITE 'c'
+#define ARG_COMPOSITE_ARRAY 'r'
+
+#define ARG_NULLMAP_SIZE(nargs) MAXALIGN(((nargs) + 7) / 8)
+
+typedef struct
+{
+    char kind;
+    // JNI type of primitives and array elements
+    char type;
+    // Class signature of objects and composite array elements
+    char sig[128];
+} arg_schema;
+
+/*
+    Bounded lock-free MPMC ring of task slot indices
+*/
+typedef struct
+{
+    pg_atomic_uint32 sequence;
+    int slot;
+} task_ring_cell;
+
+typedef struct
+{
+    uint32 mask;
+    pg_atomic_uint32 head;
+    char pad1[PG_CACHE_LINE_SIZE - sizeof(pg_atomic_uint32)];
+    pg_atomic_uint32 tail;
+    char pad2[PG_CACHE_LINE_SIZE - sizeof(pg_atomic_uint32)];
+    task_ring_cell cells[FLEXIBLE_ARRAY_MEMBER];
+} task_ring;
+
 typedef struct
 {
 	volatile slock_t lock;
-    dlist_head exec_list;
-    dlist_head free_list;
-    dlist_head return_list;
+    // Rings are placed behind the task slots
+    Size exec_ring_off;
+    Size free_ring_off;
     int n_workers;
+    int queue_length;
+    // Owner of a user pool (the slot can be reused by another pool)
+    Oid roleid;
+    Oid dbid;
+    int dsa_tranche;
+    dsa_handle area_handle;
     pid_t pid[MAX_WORKERS];
     Latch *latch[MAX_WORKERS];
-    worker_exec_entry list_data[MAX_QUEUE_LENGTH];
+    // Idle worker stack (protected by lock, n_idle is read without)
+    pg_atomic_uint32 n_idle;
+    int idle[MAX_WORKERS];
+    bool is_idle[MAX_WORKERS];
+    worker_exec_entry list_data[FLEXIBLE_ARRAY_MEMBER];
 } worker_data_head;
 
 
-worker_data_head* launch_dynamic_workers(int32 n_workers, bool needSPI, bool globalWorker);
+#define EXEC_RING(head) ((task_ring*) ((char*) (head) + (head)->exec_ring_off))
+#define FREE_RING(head) ((task_ring*) ((char*) (head) + (head)->free_ring_off))
+
+Size worker_head_size(void);
+void task_ring_init(task_ring* ring, uint32 capacity);
+bool task_ring_push(task_ring* ring, int slot);
+int task_ring_pop(task_ring* ring);
+uint32 task_ring_count(task_ring* ring);
+void wake_idle_worker(worker_data_head* head);
+dsa_area* attach_worker_area(worker_data_head* head);
+worker_data_head* launch_dynamic_workers(int32 n_workers, bool needSPI, bool globalWorker, dsa_area** area);
+worker_data_head* find_user_pool(Oid roleid, Oid dbid);
+char* alloc_entry_data(dsa_area* area, worker_exec_entry* entry, Size size);
+char* alloc_entry_chunk(dsa_area* area, worker_exec_entry* entry, int chunk, Size size);
+void release_exec_entry(worker_data_head* head, dsa_area* area, worker_exec_entry* entry);
+void fail_exec_entry(worker_data_head* head, dsa_area* area, worker_exec_entry* entry, const char* msg);
 Datum datumDeSerialize(char **address, bool *isnull);
+int build_arg_schema(const char* signature, arg_schema** schema, char* error_msg);
 void prepareErrorMsg(jthrowable exh, char* target, int cutoff);